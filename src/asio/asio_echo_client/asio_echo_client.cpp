@@ -3,14 +3,30 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 
 #include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "send_schedule.hpp"
+#include "tsc_clock.hpp"
+#include "workload_scenario.hpp"
+#include "test_scenario_client.hpp"
+#include "packet_sweep.hpp"
+#include "asio/asio_echo_serv/io_service_pool.hpp"
 #include "test_pingpong_client.hpp"
 #include "test_latency_client.hpp"
 #include "test_qps_client.hpp"
 #include "test_http_client.hpp"
+#include "test_http_load_client.hpp"
+#include "test_connect_client.hpp"
+#include "test_http2_client.hpp"
+#include "test_websocket_client.hpp"
 #include "common/cmd_utils.hpp"
 
 using namespace boost::asio;
@@ -18,12 +34,301 @@ using namespace asio_test;
 
 uint32_t g_test_mode      = asio_test::test_mode_echo;
 uint32_t g_test_method    = asio_test::test_method_pingpong;
+uint32_t g_http_method    = asio_test::http_method_get;
+uint32_t g_body_size      = 4096;
+uint32_t g_body_chunked   = 0;
+uint32_t g_h2_streams     = 100;
+uint32_t g_packet_size    = 64;
+uint32_t g_pipeline       = 1;
+uint32_t g_verify         = 0;
+uint32_t g_linger_reset   = 0;
+uint32_t g_use_tsc        = 1;
+uint32_t g_connections    = 1;
+uint32_t g_thread_num     = 1;
+double   g_rate           = 0.0;
+uint32_t g_warmup_time    = 0;
+uint32_t g_test_time      = 30;
+uint32_t g_stats_output   = asio_test::stats_output_text;
+
+// The longest wait for the requests in flight after the measurement window.
+static const double kDrainTimeout = 2.0;
+// The longest wait for the connections to switch to the packet size of a sweep step.
+static const double kSweepSwitchTimeout = 5.0;
+// The open files besides the sockets of the connections.
+static const uint32_t kReservedFiles = 64;
 
 std::string g_test_mode_str     = "echo";
 std::string g_test_method_str   = "pingpong";
 
 std::string g_server_ip;
 std::string g_server_port;
+std::string g_stats_output_file;
+std::string g_scenario_file;
+std::string g_sweep_sizes;
+std::string g_bind_addresses;
+
+// The server endpoints of --endpoints (empty: --host and --port).
+std::vector<std::pair<std::string, std::string>> g_endpoints;
+
+//
+// The groups of the stats of a run (e.g. the groups of a scenario): the connection i
+// counts to the group group_of[i], the summary has a line for every group.
+//
+struct client_groups
+{
+    std::vector<std::string> names;
+    std::vector<uint32_t>    group_of;
+};
+
+//
+// Wait until done() (or timeout seconds), printing the intervals, returns false
+// if the clients are finished (all the connections are closed).
+//
+template <typename Predicate>
+bool wait_and_report(client_stats_reporter & reporter, const std::atomic<bool> & finished,
+                     double timeout, Predicate done)
+{
+    time_point<steady_clock> start_time = steady_clock::now();
+    while (!finished.load()) {
+        if (done() || duration_cast< duration<double> >(steady_clock::now() - start_time).count() >= timeout)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (reporter.seconds_since_last() >= 1.0)
+            reporter.print_interval();
+    }
+    return false;
+}
+
+struct sweep_result
+{
+    uint32_t packet_size;
+    double   seconds;
+    client_counters total;
+    latency_histogram latency;
+};
+
+//
+// --sweep: every step switches the connections to its packet size, warms up for
+// g_warmup_time seconds and measures for g_test_time seconds.
+//
+void run_sweep_steps(client_stats_reporter & reporter, const client_stats & stats, packet_sweep & sweep,
+                     const std::atomic<bool> & finished, std::vector<sweep_result> & results)
+{
+    for (uint32_t step = 0; step < sweep.step_count(); ++step) {
+        if (step != 0)
+            sweep.next_step();
+        uint32_t packet_size = sweep.packet_size(step);
+        std::cout << "sweep step " << (step + 1) << "/" << sweep.step_count()
+                  << ": packet_size = " << packet_size << std::endl;
+
+        bool alive = wait_and_report(reporter, finished, kSweepSwitchTimeout, [&]() -> bool
+            {
+                client_counters counters = stats.snapshot();
+                return (sweep.switched() + counters.connect_errors >= g_connections);
+            });
+        client_counters counters = stats.snapshot();
+        if (alive && sweep.switched() + counters.connect_errors < g_connections) {
+            std::cout << "sweep: " << (g_connections - counters.connect_errors - sweep.switched())
+                      << " connection(s) didn't switch in time." << std::endl;
+        }
+        if (alive)
+            alive = wait_and_report(reporter, finished, (double)g_warmup_time, []() -> bool { return false; });
+
+        reporter.begin_measure();
+        if (alive)
+            alive = wait_and_report(reporter, finished, (double)g_test_time, []() -> bool { return false; });
+        reporter.end_measure();
+
+        sweep_result result;
+        result.packet_size = packet_size;
+        result.seconds = reporter.measure_seconds();
+        result.total = reporter.measure_total();
+        result.latency = reporter.measure_latency();
+        results.push_back(result);
+        reporter.write_measure_record("sweep", std::to_string(packet_size).c_str());
+        if (!alive)
+            break;
+    }
+}
+
+void print_sweep_table(const std::vector<sweep_result> & results)
+{
+    std::cout << std::endl
+              << "Packet size sweep (" << g_connections << " connections, pipeline " << g_pipeline << "):" << std::endl
+              << std::endl
+              << "  packet_size         qps   send MB/s   recv MB/s    avg (us)    p50 (us)    p99 (us)"
+              << "  p99.9 (us)    max (us)   errors" << std::endl;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const sweep_result & result = results[i];
+        double rate = (result.seconds > 0.0) ? (1.0 / result.seconds) : 0.0;
+        std::cout << std::setiosflags(std::ios::fixed) << std::right
+                  << "  " << std::setw(11) << result.packet_size
+                  << std::setprecision(1) << std::setw(12) << ((double)result.total.queries * rate)
+                  << std::setprecision(3)
+                  << std::setw(12) << ((double)result.total.send_bytes / (1024.0 * 1024.0) * rate)
+                  << std::setw(12) << ((double)result.total.recv_bytes / (1024.0 * 1024.0) * rate)
+                  << std::setprecision(1)
+                  << std::setw(12) << (result.total.avg_latency_ms() * 1000.0)
+                  << std::setw(12) << ((double)result.latency.value_at_percentile(50.0) / 1000.0)
+                  << std::setw(12) << ((double)result.latency.value_at_percentile(99.0) / 1000.0)
+                  << std::setw(12) << ((double)result.latency.value_at_percentile(99.9) / 1000.0)
+                  << std::setw(12) << ((double)result.latency.max_value() / 1000.0)
+                  << std::setw(9) << result.total.errors << std::endl;
+    }
+}
+
+//
+// Spread g_connections clients over g_thread_num io_services (the connection i runs on
+// the io_service i % threads), the main thread prints the aggregated counters. After
+// g_warmup_time seconds the measurement window begins, after g_test_time seconds more
+// (or when all the connections are closed) it ends, then the connections finish the
+// requests in flight and the summary of the window is printed. With a sweep, the
+// window is a series of steps and a table of the steps is printed instead.
+//
+template <typename ClientT, typename Factory>
+void run_test_clients(const std::string & ip, const std::string & port, Factory factory,
+                      const client_groups & groups = client_groups(), packet_sweep * sweep = nullptr)
+{
+    uint32_t thread_num = std::max(std::min(g_thread_num, g_connections), 1U);
+
+    // A socket per connection, plus the files of the process.
+    uint64_t open_files = raise_open_files_limit((uint64_t)g_connections + kReservedFiles);
+    if (open_files < (uint64_t)g_connections + kReservedFiles) {
+        std::cerr << "Warnning: the open files limit is " << open_files << ", "
+                  << g_connections << " connections may fail (see ulimit -n)." << std::endl;
+    }
+
+    // The connection i goes to the endpoint i % count (--endpoints, or ip:port).
+    std::vector<std::pair<std::string, std::string>> endpoints = g_endpoints;
+    if (endpoints.empty())
+        endpoints.push_back(std::make_pair(ip, port));
+    std::string server_list;
+    for (std::size_t e = 0; e < endpoints.size(); ++e)
+        server_list += ((e != 0) ? "," : "") + endpoints[e].first + ":" + endpoints[e].second;
+
+    // With several endpoints, the groups are split by endpoint too.
+    client_groups run_groups;
+    std::size_t endpoint_count = endpoints.size();
+    if (endpoint_count > 1) {
+        std::size_t group_count = groups.names.empty() ? 1 : groups.names.size();
+        for (std::size_t g = 0; g < group_count; ++g) {
+            for (std::size_t e = 0; e < endpoint_count; ++e) {
+                std::string endpoint_name = endpoints[e].first + ":" + endpoints[e].second;
+                run_groups.names.push_back(groups.names.empty() ? endpoint_name
+                                                                : (groups.names[g] + "@" + endpoint_name));
+            }
+        }
+        run_groups.group_of.resize(g_connections);
+        for (uint32_t i = 0; i < g_connections; ++i) {
+            uint32_t group = groups.names.empty() ? 0 : groups.group_of[i];
+            run_groups.group_of[i] = (uint32_t)(group * endpoint_count + i % endpoint_count);
+        }
+    }
+    else {
+        run_groups = groups;
+    }
+
+    stats_writer writer(g_stats_output, g_stats_output_file);
+    stats_record config;
+    config.add("mode", g_test_mode_str)
+          .add("test", g_test_method_str)
+          .add("server", server_list)
+          .add("bind", g_bind_addresses)
+          .add("connections", g_connections)
+          .add("threads", thread_num)
+          .add("packet_size", g_packet_size)
+          .add("pipeline", g_pipeline)
+          .add("rate", g_rate)
+          .add("verify", g_verify)
+          .add("linger_reset", g_linger_reset)
+          .add("scenario", g_scenario_file)
+          .add("sweep", g_sweep_sizes)
+          .add("clock", tsc_clock::source_name())
+          .add("clock_read_ns", tsc_clock::read_ns())
+          .add("warmup_s", g_warmup_time)
+          .add("test_time_s", g_test_time);
+    writer.set_config(config);
+
+    io_service_pool pool(thread_num, false);
+    client_stats stats(thread_num, run_groups.names.size());
+
+    ip::tcp::resolver resolver(pool.get_first_io_service());
+    std::vector<ip::tcp::resolver::iterator> endpoint_iterators;
+    local_binding::instance().set_endpoint_count((uint32_t)endpoint_count);
+    for (std::size_t e = 0; e < endpoint_count; ++e)
+        endpoint_iterators.push_back(resolver.resolve( { endpoints[e].first, endpoints[e].second } ));
+
+    // Destroyed before the pool.
+    std::vector<std::unique_ptr<ClientT>> clients;
+    clients.reserve(g_connections);
+    for (uint32_t i = 0; i < g_connections; ++i) {
+        std::size_t index = i % thread_num;
+        client_stats_shard & shard = run_groups.names.empty() ? stats.shard(index)
+                                                              : stats.shard(run_groups.group_of[i], index);
+        clients.emplace_back(factory(pool.get_io_service(index), endpoint_iterators[i % endpoint_count],
+                                     i, &shard));
+    }
+
+    std::cout << "connectting " << server_list.c_str()
+              << ", connections: " << g_connections << ", threads: " << thread_num << std::endl;
+    if (!g_bind_addresses.empty())
+        std::cout << "local addresses: " << g_bind_addresses.c_str() << std::endl;
+
+    std::atomic<bool> finished(false);
+    std::thread runner([&pool, &finished]()
+    {
+        pool.run();
+        finished.store(true);
+    });
+
+    client_stats_reporter reporter(stats, writer, g_connections);
+    if (!run_groups.names.empty())
+        reporter.set_group_names(run_groups.names);
+    time_point<steady_clock> start_time = steady_clock::now();
+    time_point<steady_clock> measure_start = start_time + seconds(g_warmup_time);
+    time_point<steady_clock> measure_end = measure_start + seconds(g_test_time);
+    std::vector<sweep_result> sweep_results;
+    if (sweep != nullptr)
+        run_sweep_steps(reporter, stats, *sweep, finished, sweep_results);
+    else if (g_warmup_time == 0)
+        reporter.begin_measure();
+    while (sweep == nullptr && !finished.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        time_point<steady_clock> now_time = steady_clock::now();
+        if (reporter.seconds_since_last() >= 1.0)
+            reporter.print_interval();
+        if (!reporter.is_measuring() && now_time >= measure_start) {
+            reporter.begin_measure();
+        }
+        else if (g_test_time != 0 && now_time >= measure_end) {
+            break;
+        }
+    }
+    if (sweep == nullptr)
+        reporter.end_measure();
+
+    // Drain: no new request, wait for the responses in flight.
+    stats.start_draining();
+    time_point<steady_clock> drain_start = steady_clock::now();
+    while (!finished.load()) {
+        client_counters counters = stats.snapshot();
+        if (counters.drained >= counters.connects)
+            break;
+        if (duration_cast< duration<double> >(steady_clock::now() - drain_start).count() >= kDrainTimeout) {
+            std::cout << "drain timeout, " << (counters.connects - counters.drained)
+                      << " connection(s) still have requests in flight." << std::endl;
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    pool.stop();
+    runner.join();
+
+    if (sweep == nullptr)
+        reporter.print_summary();
+    else if (writer.print_text())
+        print_sweep_table(sweep_results);
+}
 
 void run_pingpong_client(const std::string & app_name, const std::string & ip,
     const std::string & port, uint32_t packet_size, uint32_t test_time)
@@ -32,17 +337,30 @@ void run_pingpong_client(const std::string & app_name, const std::string & ip,
     std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
     std::cout << std::endl;
     try {
-        boost::asio::io_service io_service;
-
-        ip::tcp::resolver resolver(io_service);
-        auto endpoint_iterator = resolver.resolve( { ip, port } );
-        test_pingpong_client client(io_service, endpoint_iterator, packet_size);
-
-        std::cout << "connectting " << ip.c_str() << ":" << port.c_str() << std::endl;
-        std::cout << "packet_size: " << packet_size << std::endl;
+        std::unique_ptr<packet_sweep> sweep;
+        if (!g_sweep_sizes.empty()) {
+            std::vector<uint32_t> sizes;
+            std::string error;
+            packet_sweep::parse_sizes(g_sweep_sizes, sizes, error);
+            sweep.reset(new packet_sweep(sizes));
+            packet_size = sweep->max_packet_size();
+            std::cout << "packet_size sweep: " << g_sweep_sizes.c_str() << ", pipeline: " << g_pipeline << std::endl;
+        }
+        else {
+            std::cout << "packet_size: " << packet_size << ", pipeline: " << g_pipeline << std::endl;
+        }
+        if (g_rate > 0.0)
+            std::cout << "open-loop rate: " << g_rate << " requests/s" << std::endl;
         std::cout << std::endl;
 
-        io_service.run();
+        run_test_clients<test_pingpong_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_pingpong_client *
+            {
+                return new test_pingpong_client(io_service, endpoint_iterator, index, packet_size, g_pipeline,
+                    send_schedule(g_rate, g_connections, index),
+                    (g_verify ? new packet_verifier(index, packet_size) : nullptr), sweep.get(), stats);
+            }, client_groups(), sweep.get());
     }
     catch (const std::exception & ex) {
         std::cerr << "Exception: " << ex.what() << std::endl;
@@ -57,17 +375,38 @@ void run_qps_client(const std::string & app_name, const std::string & ip,
     std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
     std::cout << std::endl;
     try {
-        boost::asio::io_service io_service;
+        std::cout << "packet_size: " << packet_size << std::endl;
+        std::cout << std::endl;
 
-        ip::tcp::resolver resolver(io_service);
-        auto endpoint_iterator = resolver.resolve( { ip, port } );
-        test_qps_client client(io_service, endpoint_iterator, g_test_method, 32768, packet_size);
+        run_test_clients<test_qps_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_qps_client *
+            {
+                return new test_qps_client(io_service, endpoint_iterator, index, g_test_method, 32768, packet_size, stats);
+            });
+    }
+    catch (const std::exception & ex) {
+        std::cerr << "Exception: " << ex.what() << std::endl;
+    }
+    std::cout << app_name.c_str() << " done." << std::endl;
+}
 
-        std::cout << "connectting " << ip.c_str() << ":" << port.c_str() << std::endl;
+void run_throughput_client(const std::string & app_name, const std::string & ip,
+    const std::string & port, uint32_t packet_size, uint32_t test_time)
+{
+    std::cout << std::endl;
+    std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
+    std::cout << std::endl;
+    try {
         std::cout << "packet_size: " << packet_size << std::endl;
         std::cout << std::endl;
 
-        io_service.run();
+        run_test_clients<test_qps_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_qps_client *
+            {
+                return new test_qps_client(io_service, endpoint_iterator, index, g_test_mode, 32768, packet_size, stats);
+            });
     }
     catch (const std::exception & ex) {
         std::cerr << "Exception: " << ex.what() << std::endl;
@@ -75,24 +414,53 @@ void run_qps_client(const std::string & app_name, const std::string & ip,
     std::cout << app_name.c_str() << " done." << std::endl;
 }
 
-void run_throughput_client(const std::string & app_name, const std::string & ip,
+void run_latency_client(const std::string & app_name, const std::string & ip,
     const std::string & port, uint32_t packet_size, uint32_t test_time)
 {
     std::cout << std::endl;
     std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
     std::cout << std::endl;
     try {
-        boost::asio::io_service io_service;
+        std::cout << "packet_size: " << packet_size << ", pipeline: " << g_pipeline << std::endl;
+        if (g_rate > 0.0)
+            std::cout << "open-loop rate: " << g_rate << " requests/s" << std::endl;
+        std::cout << std::endl;
 
-        ip::tcp::resolver resolver(io_service);
-        auto endpoint_iterator = resolver.resolve( { ip, port } );
-        test_qps_client client(io_service, endpoint_iterator, g_test_mode, 32768, packet_size);
+        run_test_clients<test_latency_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_latency_client *
+            {
+                return new test_latency_client(io_service, endpoint_iterator, index, packet_size, g_pipeline,
+                    send_schedule(g_rate, g_connections, index),
+                    (g_verify ? new packet_verifier(index, packet_size) : nullptr), stats);
+            });
+    }
+    catch (const std::exception & ex) {
+        std::cerr << "Exception: " << ex.what() << std::endl;
+    }
+    std::cout << app_name.c_str() << " done." << std::endl;
+}
 
-        std::cout << "connectting " << ip.c_str() << ":" << port.c_str() << std::endl;
+void run_http_client(const std::string & app_name, const std::string & ip,
+    const std::string & port, uint32_t packet_size, uint32_t test_time)
+{
+    std::cout << std::endl;
+    std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
+    std::cout << std::endl;
+    try {
         std::cout << "packet_size: " << packet_size << std::endl;
+        if (g_http_method == http_method_post) {
+            std::cout << "method: POST, body_size: " << g_body_size
+                      << ", chunked: " << g_body_chunked << std::endl;
+        }
         std::cout << std::endl;
 
-        io_service.run();
+        run_test_clients<test_http_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_http_client *
+            {
+                return new test_http_client(io_service, endpoint_iterator, index, g_test_method, 32768, packet_size, stats);
+            });
     }
     catch (const std::exception & ex) {
         std::cerr << "Exception: " << ex.what() << std::endl;
@@ -100,24 +468,65 @@ void run_throughput_client(const std::string & app_name, const std::string & ip,
     std::cout << app_name.c_str() << " done." << std::endl;
 }
 
-void run_latency_client(const std::string & app_name, const std::string & ip,
+void run_http_load_client(const std::string & app_name, const std::string & ip,
     const std::string & port, uint32_t packet_size, uint32_t test_time)
 {
     std::cout << std::endl;
     std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
     std::cout << std::endl;
     try {
-        boost::asio::io_service io_service;
+        // All the connections send the same request.
+        std::string request = g_request_html_header;
+        if (g_http_method == http_method_post) {
+            request = make_http_post_request(g_body_size, (g_body_chunked != 0));
+            std::cout << "method: POST, body_size: " << g_body_size
+                      << ", chunked: " << g_body_chunked << ", ";
+        }
+        else {
+            std::cout << "method: GET, ";
+        }
+        std::cout << "pipeline: " << g_pipeline << std::endl;
+        std::cout << std::endl;
 
-        ip::tcp::resolver resolver(io_service);
-        auto endpoint_iterator = resolver.resolve( { ip, port } );
-        test_latency_client client(io_service, endpoint_iterator, packet_size);
+        run_test_clients<test_http_load_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_http_load_client *
+            {
+                return new test_http_load_client(io_service, endpoint_iterator, index, request, g_pipeline, stats);
+            });
+    }
+    catch (const std::exception & ex) {
+        std::cerr << "Exception: " << ex.what() << std::endl;
+    }
+    std::cout << app_name.c_str() << " done." << std::endl;
+}
 
-        std::cout << "connectting " << ip.c_str() << ":" << port.c_str() << std::endl;
-        std::cout << "packet_size: " << packet_size << std::endl;
+void run_connect_client(const std::string & app_name, const std::string & ip,
+    const std::string & port, uint32_t packet_size, uint32_t test_time)
+{
+    std::cout << std::endl;
+    std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
+    std::cout << std::endl;
+    try {
+        // An echo packet, or an http request which asks the server to close.
+        std::string request(packet_size, 'h');
+        if (g_test_mode == test_mode_http) {
+            request = g_request_html_header;
+            std::string::size_type pos = request.find("Connection: keep-alive");
+            if (pos != std::string::npos)
+                request.replace(pos, sizeof("Connection: keep-alive") - 1, "Connection: close");
+        }
+        std::cout << "connection storm: one request per connection, request size: " << request.size() << std::endl;
+        std::cout << "qps = connections per second, latency = the connect time" << std::endl;
         std::cout << std::endl;
 
-        io_service.run();
+        run_test_clients<test_connect_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_connect_client *
+            {
+                return new test_connect_client(io_service, endpoint_iterator, index, g_test_mode,
+                                               (g_linger_reset != 0), request, stats);
+            });
     }
     catch (const std::exception & ex) {
         std::cerr << "Exception: " << ex.what() << std::endl;
@@ -125,24 +534,88 @@ void run_latency_client(const std::string & app_name, const std::string & ip,
     std::cout << app_name.c_str() << " done." << std::endl;
 }
 
-void run_http_client(const std::string & app_name, const std::string & ip,
+void run_http2_client(const std::string & app_name, const std::string & ip,
     const std::string & port, uint32_t packet_size, uint32_t test_time)
 {
     std::cout << std::endl;
     std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
     std::cout << std::endl;
     try {
-        boost::asio::io_service io_service;
+        std::cout << "streams: " << g_h2_streams << std::endl;
+        std::cout << std::endl;
+
+        run_test_clients<test_http2_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_http2_client *
+            {
+                return new test_http2_client(io_service, endpoint_iterator, index, ip + ":" + port, g_h2_streams, stats);
+            });
+    }
+    catch (const std::exception & ex) {
+        std::cerr << "Exception: " << ex.what() << std::endl;
+    }
+    std::cout << app_name.c_str() << " done." << std::endl;
+}
 
-        ip::tcp::resolver resolver(io_service);
-        auto endpoint_iterator = resolver.resolve( { ip, port } );
-        test_http_client client(io_service, endpoint_iterator, g_test_method, 32768, packet_size);
+void run_websocket_client(const std::string & app_name, const std::string & ip,
+    const std::string & port, uint32_t packet_size, uint32_t pipeline)
+{
+    std::cout << std::endl;
+    std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str() << "]" << std::endl;
+    std::cout << std::endl;
+    try {
+        std::cout << "frame size: " << packet_size << ", pipeline: " << pipeline << std::endl;
+        std::cout << std::endl;
 
-        std::cout << "connectting " << ip.c_str() << ":" << port.c_str() << std::endl;
-        std::cout << "packet_size: " << packet_size << std::endl;
+        run_test_clients<test_websocket_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_websocket_client *
+            {
+                return new test_websocket_client(io_service, endpoint_iterator, index, ip + ":" + port, packet_size, pipeline, stats);
+            });
+    }
+    catch (const std::exception & ex) {
+        std::cerr << "Exception: " << ex.what() << std::endl;
+    }
+    std::cout << app_name.c_str() << " done." << std::endl;
+}
+
+void run_scenario_client(const std::string & app_name, const std::string & ip,
+    const std::string & port, const std::vector<scenario_group> & scenario)
+{
+    std::cout << std::endl;
+    std::cout << app_name.c_str() << " [mode = " << g_test_mode_str.c_str()
+              << ", scenario = " << g_scenario_file.c_str() << "]" << std::endl;
+    std::cout << std::endl;
+    try {
+        // The connections of the groups one after another, and their index in the group.
+        client_groups groups;
+        std::vector<uint32_t> group_index;
+        for (std::size_t i = 0; i < scenario.size(); ++i) {
+            const scenario_group & group = scenario[i];
+            groups.names.push_back(group.name);
+            for (uint32_t n = 0; n < group.connections; ++n) {
+                groups.group_of.push_back((uint32_t)i);
+                group_index.push_back(n);
+            }
+            std::cout << "[" << group.name << "] connections: " << group.connections << ", ";
+            if (group.open_loop)
+                std::cout << "open-loop rate: " << group.rate << " requests/s, ";
+            else
+                std::cout << "pipeline: " << group.pipeline << ", think time: " << group.think_time_us << " us, ";
+            std::cout << "packet_size: " << group.packet_size_spec.c_str()
+                      << " (avg " << (uint32_t)group.avg_packet_size() << ")" << std::endl;
+        }
+        g_connections = (uint32_t)groups.group_of.size();
         std::cout << std::endl;
 
-        io_service.run();
+        run_test_clients<test_scenario_client>(ip, port,
+            [&](boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                uint32_t index, client_stats_shard * stats) -> test_scenario_client *
+            {
+                return new test_scenario_client(io_service, endpoint_iterator, index,
+                    scenario[groups.group_of[index]], group_index[index], stats);
+            }, groups);
     }
     catch (const std::exception & ex) {
         std::cerr << "Exception: " << ex.what() << std::endl;
@@ -167,23 +640,27 @@ void print_usage(const std::string & app_name, const boost::program_options::opt
 
     std::cerr << "Usage: " << std::endl << std::endl
               << "  " << app_name.c_str()      << " --host=<host> --port=<port> --mode=<mode> --test=<test>" << std::endl
-              << "  " << leader_spaces.c_str() << " --pipeline=<pipeline> [--packet_size=64] [--thread-num=0]" << std::endl
+              << "  " << leader_spaces.c_str() << " --pipeline=<pipeline> [--packet_size=64] [--thread-num=0] [--connections=1]" << std::endl
               << std::endl
               << "For example: " << std::endl << std::endl
               << "  " << app_name.c_str()      << " --host=127.0.0.1 --port=9000 --mode=echo --test=pingpong" << std::endl
-              << "  " << leader_spaces.c_str() << " --pipeline=10 --packet-size=64 --thread-num=8" << std::endl
+              << "  " << leader_spaces.c_str() << " --pipeline=10 --packet-size=64 --thread-num=8 --connections=1000" << std::endl
               << std::endl
-              << "  " << app_name.c_str() << " -s 127.0.0.1 -p 9000 -m echo -t pingpong -l 10 -k 64 -n 8" << std::endl;
+              << "  " << app_name.c_str() << " -s 127.0.0.1 -p 9000 -m echo -t pingpong -l 10 -k 64 -n 8 -C 1000" << std::endl;
     std::cerr << std::endl;
 }
 
 int main(int argc, char * argv[])
 {
     std::string app_name;
-    std::string test_mode, test_method, rpc_topic;
+    std::string test_mode, test_method, rpc_topic, http_method;
     std::string server_ip, server_port;
     std::string mode, test, cmd, cmd_value;
-    int32_t pipeline = 1, packet_size = 0, thread_num = 0, test_time = 30, need_echo = 1;
+    std::string output, output_file, clock, scenario_file, sweep_sizes, endpoints, bind_addresses;
+    int32_t pipeline = 1, packet_size = 0, thread_num = 0, test_time = 30, warmup_time = 0, need_echo = 1;
+    int32_t verify = 0, linger_reset = 0;
+    int32_t body_size = 4096, chunked = 0, streams = 100, connections = 1;
+    double rate = 0.0;
 
     namespace options = boost::program_options;
     options::options_description desc("Command list");
@@ -191,13 +668,29 @@ int main(int argc, char * argv[])
         ("help,h",                                                                                      "usage info")
         ("host,s",          options::value<std::string>(&server_ip)->default_value("127.0.0.1"),        "server host or ip address")
         ("port,p",          options::value<std::string>(&server_port)->default_value("9000"),           "server port")
-        ("mode,m",          options::value<std::string>(&test_mode)->default_value("echo"),             "test mode = [echo]")
-        ("test,t",          options::value<std::string>(&test_method)->default_value("pingpong"),       "test method = [pingpong, qps, latency, throughput]")
+        ("endpoints,E",     options::value<std::string>(&endpoints)->default_value(""),               "the server endpoints host:port,host:port,... instead of --host/--port (the connection i goes to the endpoint i % n)")
+        ("bind,B",          options::value<std::string>(&bind_addresses)->default_value(""),          "the local addresses the connections bind in turn (e.g. 127.0.0.2,127.0.0.3)")
+        ("mode,m",          options::value<std::string>(&test_mode)->default_value("echo"),             "test mode = [echo, http, h2, ws]")
+        ("test,t",          options::value<std::string>(&test_method)->default_value("pingpong"),       "test method = [pingpong, qps, latency, throughput, load (http), connect (echo, http)]")
         ("pipeline,l",      options::value<int32_t>(&pipeline)->default_value(1),                       "pipeline numbers")
         ("packet-size,k",   options::value<int32_t>(&packet_size)->default_value(64),                   "packet size")
         ("thread-num,n",    options::value<int32_t>(&thread_num)->default_value(1),                     "thread numbers")
-        ("test-time,i",     options::value<int32_t>(&test_time)->default_value(30),                     "total test time (seconds)")
+        ("connections,C",   options::value<int32_t>(&connections)->default_value(1),                    "the connections of the client (over all the threads)")
+        ("rate,r",          options::value<double>(&rate)->default_value(0.0),                          "echo pingpong/latency: open-loop requests per second of all the connections (0 = closed-loop)")
+        ("verify,V",        options::value<int32_t>(&verify)->default_value(0),                         "echo pingpong/latency: stamp the packets and check the echoes (sequence, crc32c)")
+        ("linger-reset,R",  options::value<int32_t>(&linger_reset)->default_value(0),                   "connect: close the connections with a RST (SO_LINGER 0), no TIME_WAIT holds the local ports")
+        ("clock,T",         options::value<std::string>(&clock)->default_value("tsc"),                  "the clock of the latencies = [tsc, steady] (tsc falls back to steady if it's not invariant)")
+        ("test-time,i",     options::value<int32_t>(&test_time)->default_value(30),                     "the measurement window (seconds, 0 = until the connections are closed)")
+        ("output,o",        options::value<std::string>(&output)->default_value("text"),               "the stats output = [text, json, csv]")
+        ("output-file,O",   options::value<std::string>(&output_file)->default_value(""),              "json/csv: the file of the stats records (default: stdout)")
+        ("sweep,W",         options::value<std::string>(&sweep_sizes)->default_value(""),             "echo pingpong: the packet sizes to step through on the same connections (e.g. 64,1k,64k)")
+        ("scenario,f",      options::value<std::string>(&scenario_file)->default_value(""),           "echo: run the connection groups of a scenario file (ini) instead of --test")
+        ("warmup,w",        options::value<int32_t>(&warmup_time)->default_value(0),                    "the warm-up time before the measurement window (seconds)")
         ("echo,e",          options::value<int32_t>(&need_echo)->default_value(1),                      "whether the server need echo")
+        ("method,M",        options::value<std::string>(&http_method)->default_value("get"),            "http request method = [get, post]")
+        ("body-size,b",     options::value<int32_t>(&body_size)->default_value(4096),                   "http request body size (post)")
+        ("chunked,c",       options::value<int32_t>(&chunked)->default_value(0),                        "whether send the http body chunked (post)")
+        ("streams,S",       options::value<int32_t>(&streams)->default_value(100),                      "h2: the concurrent streams of the connection")
         ;
 
     // parse command line
@@ -253,6 +746,12 @@ int main(int argc, char * argv[])
     else if (test_mode == "http") {
         g_test_mode = test_mode_http;
     }
+    else if (test_mode == "h2") {
+        g_test_mode = test_mode_http2;
+    }
+    else if (test_mode == "ws") {
+        g_test_mode = test_mode_websocket;
+    }
     else {
         // Write error log: Unknown test mode
         std::cerr << "Error: Unknown test mode: [" << mode.c_str() << "]." << std::endl;
@@ -280,6 +779,12 @@ int main(int argc, char * argv[])
     else if (test_method == "latency") {
         g_test_method = test_method_latency;
     }
+    else if (test_method == "load") {
+        g_test_method = test_method_load;
+    }
+    else if (test_method == "connect") {
+        g_test_method = test_method_connect;
+    }
     else {
         // Write error log: Unknown test method
         std::cerr << "Error: Unknown test method: [" << test.c_str() << "]." << std::endl;
@@ -293,6 +798,7 @@ int main(int argc, char * argv[])
     }
     if (pipeline <= 0)
         pipeline = 1;
+    g_pipeline = (uint32_t)pipeline;
 
     // packet-size
     if (args_map.count("packet-size") > 0) {
@@ -306,6 +812,7 @@ int main(int argc, char * argv[])
         std::cerr << "Warnning: packet_size = " << packet_size << " can not set to more than "
                   << MAX_PACKET_SIZE << " bytes [MAX_PACKET_SIZE]." << std::endl;
     }
+    g_packet_size = (uint32_t)packet_size;
 
     // thread-num
     if (args_map.count("thread-num") > 0) {
@@ -316,16 +823,102 @@ int main(int argc, char * argv[])
         thread_num = std::thread::hardware_concurrency();
         std::cout << ">>> thread-num: std::thread::hardware_concurrency() = " << thread_num << std::endl;
     }
+    g_thread_num = (uint32_t)thread_num;
+
+    // connections
+    if (args_map.count("connections") > 0) {
+        connections = args_map["connections"].as<int32_t>();
+    }
+    if (connections <= 0)
+        connections = 1;
+    g_connections = (uint32_t)connections;
+    std::cout << "connections: " << connections << std::endl;
+
+    // rate
+    if (args_map.count("rate") > 0) {
+        rate = args_map["rate"].as<double>();
+    }
+    g_rate = (rate > 0.0) ? rate : 0.0;
+    if (g_rate > 0.0) {
+        std::cout << "rate: " << g_rate << " requests/s" << std::endl;
+        if (g_test_mode != test_mode_echo
+            || (g_test_method != test_method_pingpong && g_test_method != test_method_latency)) {
+            std::cerr << "Warnning: --rate only applies to the echo pingpong and latency tests, it's ignored."
+                      << std::endl;
+        }
+    }
+
+    // verify
+    if (args_map.count("verify") > 0) {
+        verify = args_map["verify"].as<int32_t>();
+    }
+    g_verify = (verify != 0) ? 1 : 0;
+    if (g_verify) {
+        std::cout << "verify: the echoes are checked" << std::endl;
+        if (g_test_mode != test_mode_echo
+            || (g_test_method != test_method_pingpong && g_test_method != test_method_latency)) {
+            std::cerr << "Warnning: --verify only applies to the echo pingpong and latency tests, it's ignored."
+                      << std::endl;
+        }
+        if (packet_size < packet_verifier::kHeaderSize) {
+            packet_size = packet_verifier::kHeaderSize;
+            g_packet_size = (uint32_t)packet_size;
+            std::cerr << "Warnning: --verify needs packet_size >= " << packet_size << " bytes, it's raised." << std::endl;
+        }
+    }
+
+    // linger_reset
+    if (args_map.count("linger-reset") > 0) {
+        linger_reset = args_map["linger-reset"].as<int32_t>();
+    }
+    g_linger_reset = (linger_reset != 0) ? 1 : 0;
+    if (g_linger_reset) {
+        std::cout << "linger_reset: the connections are closed with a RST" << std::endl;
+        if (g_test_method != test_method_connect) {
+            std::cerr << "Warnning: --linger-reset only applies to the connect test, it's ignored."
+                      << std::endl;
+        }
+    }
+
+    // clock
+    if (args_map.count("clock") > 0) {
+        clock = args_map["clock"].as<std::string>();
+    }
+    if (clock == "tsc" || clock == "TSC") {
+        g_use_tsc = 1;
+    }
+    else if (clock == "steady") {
+        g_use_tsc = 0;
+    }
+    else {
+        std::cerr << "Error: Unknown clock: [" << clock.c_str() << "]." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    tsc_clock::init(g_use_tsc != 0);
+    std::cout << "clock: " << tsc_clock::source_name();
+    if (tsc_clock::is_tsc())
+        std::cout << " (" << tsc_clock::tsc_ghz() << " GHz)";
+    else if (g_use_tsc)
+        std::cout << " (" << tsc_clock::fallback_reason() << ")";
+    std::cout << ", " << tsc_clock::read_ns() << " ns/read" << std::endl;
 
     // test-time
     if (args_map.count("test-time") > 0) {
         test_time = args_map["test-time"].as<int32_t>();
     }
     std::cout << "test-time: " << test_time << std::endl;
-    if (test_time <= 0) {
-        test_time = 30;
-        std::cout << ">>> test-time: " << test_time << std::endl;
+    if (test_time < 0)
+        test_time = 0;
+    g_test_time = (uint32_t)test_time;
+
+    // warmup
+    if (args_map.count("warmup") > 0) {
+        warmup_time = args_map["warmup"].as<int32_t>();
     }
+    if (warmup_time < 0)
+        warmup_time = 0;
+    g_warmup_time = (uint32_t)warmup_time;
+    std::cout << "warmup: " << warmup_time << std::endl;
 
     // need_echo
     if (args_map.count("echo") > 0) {
@@ -333,9 +926,152 @@ int main(int argc, char * argv[])
     }
     std::cout << "need_echo: " << need_echo << std::endl;
 
+    // method
+    if (args_map.count("method") > 0) {
+        http_method = args_map["method"].as<std::string>();
+    }
+    if (http_method == "post" || http_method == "POST") {
+        g_http_method = http_method_post;
+    }
+    else if (http_method == "get" || http_method == "GET") {
+        g_http_method = http_method_get;
+    }
+    else {
+        // Write error log: Unknown http method
+        std::cerr << "Error: Unknown http method: [" << http_method.c_str() << "]." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "http method: " << http_method.c_str() << std::endl;
+
+    // body-size
+    if (args_map.count("body-size") > 0) {
+        body_size = args_map["body-size"].as<int32_t>();
+    }
+    if (body_size < 0)
+        body_size = 0;
+    g_body_size = (uint32_t)body_size;
+
+    // chunked
+    if (args_map.count("chunked") > 0) {
+        chunked = args_map["chunked"].as<int32_t>();
+    }
+    g_body_chunked = (chunked != 0) ? 1 : 0;
+    if (g_http_method == http_method_post) {
+        std::cout << "body-size: " << g_body_size << ", chunked: " << g_body_chunked << std::endl;
+    }
+
+    // streams
+    if (args_map.count("streams") > 0) {
+        streams = args_map["streams"].as<int32_t>();
+    }
+    g_h2_streams = (streams > 0) ? (uint32_t)streams : 1;
+
+    // output
+    if (args_map.count("output") > 0) {
+        output = args_map["output"].as<std::string>();
+    }
+    if (!parse_stats_output_format(output, g_stats_output)) {
+        std::cerr << "Error: Unknown stats output: [" << output.c_str() << "]." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (args_map.count("output-file") > 0) {
+        output_file = args_map["output-file"].as<std::string>();
+    }
+    g_stats_output_file = output_file;
+    std::cout << "output: " << output.c_str()
+              << (output_file.empty() ? std::string() : (", file: " + output_file)) << std::endl;
+
+    // sweep
+    if (args_map.count("sweep") > 0) {
+        sweep_sizes = args_map["sweep"].as<std::string>();
+    }
+    if (!sweep_sizes.empty()) {
+        std::vector<uint32_t> sizes;
+        std::string error;
+        if (g_test_mode != test_mode_echo || g_test_method != test_method_pingpong) {
+            std::cerr << "Error: --sweep needs --mode=echo --test=pingpong." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!packet_sweep::parse_sizes(sweep_sizes, sizes, error)) {
+            std::cerr << "Error: Bad sweep: [" << sweep_sizes.c_str() << "], " << error.c_str() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (g_rate > 0.0) {
+            g_rate = 0.0;
+            std::cerr << "Warnning: --sweep runs closed-loop, --rate is ignored." << std::endl;
+        }
+        if (g_verify) {
+            g_verify = 0;
+            std::cerr << "Warnning: --sweep changes the packet size, --verify is ignored." << std::endl;
+        }
+        if (g_test_time == 0) {
+            g_test_time = 5;
+            std::cerr << "Warnning: --sweep needs a measurement window, test-time = 5 seconds per step." << std::endl;
+        }
+        g_sweep_sizes = sweep_sizes;
+        std::cout << "sweep: " << sweep_sizes.c_str() << " (" << sizes.size() << " steps)" << std::endl;
+    }
+
+    // scenario
+    if (args_map.count("scenario") > 0) {
+        scenario_file = args_map["scenario"].as<std::string>();
+    }
+    std::vector<scenario_group> scenario;
+    if (!scenario_file.empty()) {
+        std::string error;
+        if (g_test_mode != test_mode_echo) {
+            std::cerr << "Error: --scenario needs --mode=echo." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!load_scenario_file(scenario_file, scenario, error)) {
+            std::cerr << "Error: Bad scenario file: [" << scenario_file.c_str() << "], " << error.c_str() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        g_scenario_file = scenario_file;
+        g_test_method_str = "scenario";
+        std::cout << "scenario: " << scenario_file.c_str() << ", groups: " << scenario.size() << std::endl;
+    }
+
+    // endpoints
+    if (args_map.count("endpoints") > 0) {
+        endpoints = args_map["endpoints"].as<std::string>();
+    }
+    if (!endpoints.empty()) {
+        std::string error;
+        if (!parse_endpoint_list(endpoints, g_endpoints, error)) {
+            std::cerr << "Error: Bad endpoints: [" << endpoints.c_str() << "], " << error.c_str() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "endpoints: " << endpoints.c_str() << " (" << g_endpoints.size() << ")" << std::endl;
+    }
+
+    // bind
+    if (args_map.count("bind") > 0) {
+        bind_addresses = args_map["bind"].as<std::string>();
+    }
+    if (!bind_addresses.empty()) {
+        std::string error;
+        if (!local_binding::instance().set_addresses(bind_addresses, error)) {
+            std::cerr << "Error: Bad bind: [" << bind_addresses.c_str() << "], " << error.c_str() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        g_bind_addresses = bind_addresses;
+        std::cout << "bind: " << bind_addresses.c_str() << std::endl;
+    }
+
     // Run a test method
-    if (g_test_mode == test_mode_http)
+    if (!scenario.empty())
+        run_scenario_client(app_name, server_ip, server_port, scenario);
+    else if ((g_test_mode == test_mode_echo || g_test_mode == test_mode_http) && g_test_method == test_method_connect)
+        run_connect_client(app_name, server_ip, server_port, packet_size, test_time);
+    else if (g_test_mode == test_mode_http && g_test_method == test_method_load)
+        run_http_load_client(app_name, server_ip, server_port, packet_size, test_time);
+    else if (g_test_mode == test_mode_http)
         run_http_client(app_name, server_ip, server_port, packet_size, test_time);
+    else if (g_test_mode == test_mode_http2)
+        run_http2_client(app_name, server_ip, server_port, packet_size, test_time);
+    else if (g_test_mode == test_mode_websocket)
+        run_websocket_client(app_name, server_ip, server_port, packet_size, pipeline);
     else if (g_test_method == test_method_pingpong)
         run_pingpong_client(app_name, server_ip, server_port, packet_size, test_time);
     else if (g_test_method == test_method_qps)
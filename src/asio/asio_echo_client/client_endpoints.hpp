@@ -0,0 +1,189 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <boost/asio.hpp>
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#endif
+
+using namespace boost::asio;
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                    < The server endpoints and the local addresses >
+
+  --endpoints=host:port,host:port,...  the connection i goes to the endpoint i % n,
+                                       e.g. the processes of a server, or ports.
+  --bind=addr,addr,...                 the connections bind these local addresses
+                                       in turn (e.g. 127.0.0.2, 127.0.0.3, ...)
+
+  A (local address, server endpoint) pair has its own ephemeral ports, so more
+  local addresses get past the ~28K ports of one pair. On Linux the bind uses
+  IP_BIND_ADDRESS_NO_PORT, the port is picked by connect() for the pair instead
+  of being reserved by bind() for the address.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+/// "host:port,[v6 host]:port,..." into (host, port) pairs.
+static inline
+bool parse_endpoint_list(const std::string & list, std::vector<std::pair<std::string, std::string>> & endpoints,
+                         std::string & error)
+{
+    endpoints.clear();
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+        std::size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, (comma == std::string::npos) ? std::string::npos : comma - pos);
+        std::size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == item.size()) {
+            error = "bad endpoint: [" + item + "], host:port expected";
+            return false;
+        }
+        std::string host = item.substr(0, colon);
+        if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']')
+            host = host.substr(1, host.size() - 2);
+        endpoints.push_back(std::make_pair(host, item.substr(colon + 1)));
+        pos = (comma == std::string::npos) ? list.size() : comma + 1;
+    }
+    if (endpoints.empty()) {
+        error = "no endpoint";
+        return false;
+    }
+    return true;
+}
+
+//
+// The local addresses of --bind, the address of a connection is chosen by its index.
+//
+class local_binding
+{
+private:
+    std::vector<ip::address> addresses_;
+    uint32_t endpoint_count_;
+
+    local_binding() : endpoint_count_(1) {}
+
+public:
+    static local_binding & instance()
+    {
+        static local_binding s_binding;
+        return s_binding;
+    }
+
+    bool empty() const { return addresses_.empty(); }
+    const std::vector<ip::address> & addresses() const { return addresses_; }
+
+    /// "addr,addr,...", call before the connections start.
+    bool set_addresses(const std::string & list, std::string & error)
+    {
+        addresses_.clear();
+        std::size_t pos = 0;
+        while (pos < list.size()) {
+            std::size_t comma = list.find(',', pos);
+            std::string item = list.substr(pos, (comma == std::string::npos) ? std::string::npos : comma - pos);
+            boost::system::error_code ec;
+            ip::address address = ip::address::from_string(item, ec);
+            if (ec) {
+                error = "bad local address: [" + item + "]";
+                return false;
+            }
+            addresses_.push_back(address);
+            pos = (comma == std::string::npos) ? list.size() : comma + 1;
+        }
+        return true;
+    }
+
+    /// The connects go to the count endpoints in turn, call before the connections start.
+    void set_endpoint_count(uint32_t count) { endpoint_count_ = (count != 0) ? count : 1; }
+
+    /// The connection i goes to the endpoint i % count, the address changes after
+    /// every round of the endpoints, so the connections cover all the (local address,
+    /// endpoint) pairs, and a reconnect keeps the pair of its connection.
+    const ip::address & address_of(uint32_t connection_index) const
+    {
+        return addresses_[(connection_index / endpoint_count_) % addresses_.size()];
+    }
+};
+
+//
+// boost::asio::async_connect(), from the local address of --bind of the connection
+// if any. The connect composed by asio reopens the socket (the bind would be lost),
+// so a bound socket connects to the first endpoint only. A bind error is posted to
+// io_service (the io_service of socket), the handler never runs inside the call.
+//
+template <typename ConnectHandler>
+void async_connect_bound(boost::asio::io_service & io_service, ip::tcp::socket & socket,
+                         ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+                         ConnectHandler handler)
+{
+    local_binding & binding = local_binding::instance();
+    if (binding.empty()) {
+        boost::asio::async_connect(socket, endpoint_iterator, handler);
+        return;
+    }
+
+    ip::tcp::endpoint remote = *endpoint_iterator;
+    boost::system::error_code ec;
+    if (socket.is_open())
+        socket.close(ec);
+    socket.open(remote.protocol(), ec);
+    if (!ec) {
+#if defined(__linux__)
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT     24
+#endif
+        if (remote.address().is_v4()) {
+            int enable = 1;
+            ::setsockopt(socket.native_handle(), IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+                         (const char *)&enable, sizeof(enable));
+        }
+#endif
+        socket.bind(ip::tcp::endpoint(binding.address_of(connection_index), 0), ec);
+    }
+    if (ec) {
+        io_service.post([handler, ec, endpoint_iterator]() mutable
+            {
+                handler(ec, endpoint_iterator);
+            });
+        return;
+    }
+    socket.async_connect(remote, [handler, endpoint_iterator](const boost::system::error_code & ec) mutable
+        {
+            handler(ec, endpoint_iterator);
+        });
+}
+
+/// Raise the open files limit (soft) up to the hard limit for count sockets, returns the limit.
+static inline
+uint64_t raise_open_files_limit(uint64_t count)
+{
+#if !defined(_WIN32)
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return 0;
+    if ((uint64_t)limit.rlim_cur < count) {
+        rlim_t wanted = (limit.rlim_max == RLIM_INFINITY || (uint64_t)limit.rlim_max > count)
+                        ? (rlim_t)count : limit.rlim_max;
+        if (wanted > limit.rlim_cur) {
+            limit.rlim_cur = wanted;
+            ::setrlimit(RLIMIT_NOFILE, &limit);
+            ::getrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+    return (uint64_t)limit.rlim_cur;
+#else
+    return count;
+#endif
+}
+
+} // namespace asio_test
@@ -0,0 +1,591 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>      // For std::setw()
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "common.h"
+#include "latency_histogram.hpp"
+#include "packet_verifier.hpp"
+#include "tsc_clock.hpp"
+#include "common/stats_output.hpp"
+
+using namespace std::chrono;
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                   < The aggregated counters of the load clients >
+
+  Every io_service of the client has its own shard, only the connections on its
+  thread write it (a plain load + store, no locked instruction), the reporter
+  thread sums the shards once a second, so thousands of connections make one
+  report and never contend on a counter. Every latency sample also goes to the
+  HDR histogram of the shard, the percentiles of an interval are the difference
+  of two merged snapshots.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+struct client_counters {
+    // The http responses by status class, [0] is the status codes out of 100 - 599.
+    enum { kStatusClasses = 6 };
+
+    uint64_t connects;
+    uint64_t connect_errors;
+    // The connect errors of EADDRNOTAVAIL, no local port is free (e.g. held by TIME_WAIT),
+    // or a --bind address is not local.
+    uint64_t no_local_port;
+    uint64_t queries;
+    uint64_t latency_count;
+    uint64_t latency_ns;
+    uint64_t send_bytes;
+    uint64_t recv_bytes;
+    uint64_t errors;
+    uint64_t drained;
+    uint64_t status[kStatusClasses];
+    // --verify: the echo packets checked, and the bad ones.
+    uint64_t verified;
+    uint64_t corrupted;
+    uint64_t reordered;
+    uint64_t lost;
+
+    client_counters()
+        : connects(0), connect_errors(0), no_local_port(0), queries(0), latency_count(0), latency_ns(0),
+          send_bytes(0), recv_bytes(0), errors(0), drained(0),
+          verified(0), corrupted(0), reordered(0), lost(0)
+    {
+        for (std::size_t i = 0; i < kStatusClasses; ++i)
+            status[i] = 0;
+    }
+
+    client_counters operator - (const client_counters & rhs) const
+    {
+        client_counters delta;
+        delta.connects       = connects - rhs.connects;
+        delta.connect_errors = connect_errors - rhs.connect_errors;
+        delta.no_local_port  = no_local_port - rhs.no_local_port;
+        delta.queries        = queries - rhs.queries;
+        delta.latency_count  = latency_count - rhs.latency_count;
+        delta.latency_ns     = latency_ns - rhs.latency_ns;
+        delta.send_bytes     = send_bytes - rhs.send_bytes;
+        delta.recv_bytes     = recv_bytes - rhs.recv_bytes;
+        delta.errors         = errors - rhs.errors;
+        delta.drained        = drained - rhs.drained;
+        for (std::size_t i = 0; i < kStatusClasses; ++i)
+            delta.status[i] = status[i] - rhs.status[i];
+        delta.verified       = verified - rhs.verified;
+        delta.corrupted      = corrupted - rhs.corrupted;
+        delta.reordered      = reordered - rhs.reordered;
+        delta.lost           = lost - rhs.lost;
+        return delta;
+    }
+
+    uint64_t responses() const
+    {
+        uint64_t count = 0;
+        for (std::size_t i = 0; i < kStatusClasses; ++i)
+            count += status[i];
+        return count;
+    }
+
+    /// The http responses which are not 2xx.
+    uint64_t non_2xx() const
+    {
+        return responses() - status[2];
+    }
+
+    /// The average latency in milliseconds.
+    double avg_latency_ms() const
+    {
+        return (latency_count != 0) ? ((double)latency_ns / 1000000.0 / (double)latency_count) : 0.0;
+    }
+};
+
+//
+// The counters of one io_service, it has a single writer (the thread of its io_service).
+//
+class client_stats_shard : private boost::noncopyable
+{
+private:
+    enum { kCacheLineSize = 64 };
+
+    std::atomic<uint64_t> connects_;
+    std::atomic<uint64_t> connect_errors_;
+    std::atomic<uint64_t> no_local_port_;
+    std::atomic<uint64_t> queries_;
+    std::atomic<uint64_t> latency_count_;
+    std::atomic<uint64_t> latency_ns_;
+    std::atomic<uint64_t> send_bytes_;
+    std::atomic<uint64_t> recv_bytes_;
+    std::atomic<uint64_t> errors_;
+    std::atomic<uint64_t> drained_;
+    std::atomic<uint64_t> status_[client_counters::kStatusClasses];
+    std::atomic<uint64_t> verified_;
+    std::atomic<uint64_t> corrupted_;
+    std::atomic<uint64_t> reordered_;
+    std::atomic<uint64_t> lost_;
+    // Set by the main thread when the measurement window is over.
+    std::atomic<bool>     draining_;
+    latency_recorder      latency_;
+    // The shards are allocated one by one, don't share the cache line with the next one.
+    char padding_[kCacheLineSize];
+
+    static void add(std::atomic<uint64_t> & counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+public:
+    client_stats_shard()
+        : connects_(0), connect_errors_(0), no_local_port_(0), queries_(0), latency_count_(0), latency_ns_(0),
+          send_bytes_(0), recv_bytes_(0), errors_(0), drained_(0),
+          verified_(0), corrupted_(0), reordered_(0), lost_(0), draining_(false)
+    {
+        for (std::size_t i = 0; i < client_counters::kStatusClasses; ++i)
+            status_[i].store(0, std::memory_order_relaxed);
+    }
+
+    void on_connect(const boost::system::error_code & ec)
+    {
+        add(ec ? connect_errors_ : connects_, 1);
+        if (ec == boost::system::errc::address_not_available)
+            add(no_local_port_, 1);
+    }
+
+    /// A query without its own latency (e.g. a batch of the qps test).
+    void on_query()
+    {
+        add(queries_, 1);
+    }
+
+    void on_query(uint64_t latency_ns)
+    {
+        add(queries_, 1);
+        add(latency_count_, 1);
+        add(latency_ns_, latency_ns);
+        latency_.record(latency_ns);
+    }
+
+    void on_send(std::size_t bytes) { add(send_bytes_, bytes); }
+    void on_recv(std::size_t bytes) { add(recv_bytes_, bytes); }
+    void on_error() { add(errors_, 1); }
+
+    /// A complete http response.
+    void on_status(uint32_t status_code)
+    {
+        add(status_[(status_code >= 100 && status_code < 600) ? (status_code / 100) : 0], 1);
+    }
+
+    void on_verify(const verify_counters & counters)
+    {
+        add(verified_, counters.verified);
+        if (counters.corrupted != 0 || counters.reordered != 0 || counters.lost != 0) {
+            add(corrupted_, counters.corrupted);
+            add(reordered_, counters.reordered);
+            add(lost_, counters.lost);
+        }
+    }
+
+    /// No new request may be sent, the connections finish the ones in flight.
+    bool is_draining() const { return draining_.load(std::memory_order_relaxed); }
+    void start_draining() { draining_.store(true, std::memory_order_relaxed); }
+
+    /// A connection has nothing in flight any more, after is_draining().
+    void on_drained() { add(drained_, 1); }
+
+    void sum_to(client_counters & counters) const
+    {
+        counters.connects       += connects_.load(std::memory_order_relaxed);
+        counters.connect_errors += connect_errors_.load(std::memory_order_relaxed);
+        counters.no_local_port  += no_local_port_.load(std::memory_order_relaxed);
+        counters.queries        += queries_.load(std::memory_order_relaxed);
+        counters.latency_count  += latency_count_.load(std::memory_order_relaxed);
+        counters.latency_ns     += latency_ns_.load(std::memory_order_relaxed);
+        counters.send_bytes     += send_bytes_.load(std::memory_order_relaxed);
+        counters.recv_bytes     += recv_bytes_.load(std::memory_order_relaxed);
+        counters.errors         += errors_.load(std::memory_order_relaxed);
+        counters.drained        += drained_.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < client_counters::kStatusClasses; ++i)
+            counters.status[i]  += status_[i].load(std::memory_order_relaxed);
+        counters.verified       += verified_.load(std::memory_order_relaxed);
+        counters.corrupted      += corrupted_.load(std::memory_order_relaxed);
+        counters.reordered      += reordered_.load(std::memory_order_relaxed);
+        counters.lost           += lost_.load(std::memory_order_relaxed);
+    }
+
+    void sum_latency_to(latency_histogram & histogram) const
+    {
+        latency_.add_to(histogram);
+    }
+};
+
+//
+// The shards of all the threads, and optionally of several groups of connections
+// (e.g. the groups of a scenario): the shard of (group, thread) is
+// shards_[group * threads + thread], so a group can be summed on its own.
+//
+class client_stats : private boost::noncopyable
+{
+private:
+    std::vector<std::unique_ptr<client_stats_shard>> shards_;
+    std::size_t thread_count_;
+    std::size_t group_count_;
+
+public:
+    explicit client_stats(std::size_t thread_count, std::size_t group_count = 1)
+        : thread_count_(thread_count), group_count_(std::max(group_count, (std::size_t)1))
+    {
+        std::size_t shard_count = thread_count_ * group_count_;
+        shards_.reserve(shard_count);
+        for (std::size_t i = 0; i < shard_count; ++i) {
+            shards_.push_back(std::unique_ptr<client_stats_shard>(new client_stats_shard()));
+        }
+    }
+
+    ~client_stats() {}
+
+    std::size_t size() const { return shards_.size(); }
+    std::size_t group_count() const { return group_count_; }
+
+    client_stats_shard & shard(std::size_t index)
+    {
+        return *shards_[index];
+    }
+
+    client_stats_shard & shard(std::size_t group, std::size_t thread)
+    {
+        return *shards_[group * thread_count_ + thread];
+    }
+
+    /// A relaxed sum of all the shards.
+    client_counters snapshot() const
+    {
+        client_counters counters;
+        for (std::size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->sum_to(counters);
+        }
+        return counters;
+    }
+
+    /// A relaxed sum of the shards of one group.
+    client_counters group_snapshot(std::size_t group) const
+    {
+        client_counters counters;
+        for (std::size_t i = 0; i < thread_count_; ++i) {
+            shards_[group * thread_count_ + i]->sum_to(counters);
+        }
+        return counters;
+    }
+
+    void group_snapshot_latency(std::size_t group, latency_histogram & histogram) const
+    {
+        histogram.reset();
+        for (std::size_t i = 0; i < thread_count_; ++i) {
+            shards_[group * thread_count_ + i]->sum_latency_to(histogram);
+        }
+    }
+
+    void start_draining()
+    {
+        for (std::size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->start_draining();
+        }
+    }
+
+    /// Merge the latency histograms of all the shards into histogram (reset first).
+    void snapshot_latency(latency_histogram & histogram) const
+    {
+        histogram.reset();
+        for (std::size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->sum_latency_to(histogram);
+        }
+    }
+};
+
+//
+// "p50 = 0.091, p90 = ..., max = ..." in microseconds.
+//
+static const double kLatencyPercentiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+
+static inline
+void print_latency_percentiles(std::ostream & os, const latency_histogram & histogram)
+{
+    static const char * kNames[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+
+    os << std::setiosflags(std::ios::fixed) << std::setprecision(1);
+    for (std::size_t i = 0; i < sizeof(kNames) / sizeof(kNames[0]); ++i) {
+        os << kNames[i] << " = " << ((double)histogram.value_at_percentile(kLatencyPercentiles[i]) / 1000.0) << ", ";
+    }
+    os << "max = " << ((double)histogram.max_value() / 1000.0) << " us";
+}
+
+//
+// Prints the aggregated counters of an interval (once a second), and the summary
+// of the measurement window: the counters between begin_measure() and end_measure(),
+// so the warm-up and the drain are not in it.
+//
+class client_stats_reporter : private boost::noncopyable
+{
+private:
+    const client_stats & stats_;
+    stats_writer & writer_;
+    uint32_t connections_;
+    bool     measuring_;
+
+    time_point<steady_clock> start_time_;
+    time_point<steady_clock> last_time_;
+    time_point<steady_clock> measure_start_;
+    time_point<steady_clock> measure_end_;
+    client_counters last_;
+    client_counters measure_base_;
+    client_counters measure_total_;
+
+    latency_histogram latency_;
+    latency_histogram last_latency_;
+    latency_histogram interval_latency_;
+    latency_histogram measure_base_latency_;
+
+    // The names of the groups of the stats (set_group_names()), and their windows.
+    std::vector<std::string> group_names_;
+    std::vector<client_counters> group_base_;
+    std::vector<client_counters> group_total_;
+    std::vector<latency_histogram> group_latency_;
+
+public:
+    client_stats_reporter(const client_stats & stats, stats_writer & writer, uint32_t connections)
+        : stats_(stats), writer_(writer), connections_(connections), measuring_(false),
+          start_time_(steady_clock::now()), last_time_(start_time_)
+    {
+        measure_start_ = measure_end_ = last_time_;
+    }
+
+    ~client_stats_reporter() {}
+
+    /// With names, the summary also has a line for every group of the stats.
+    void set_group_names(const std::vector<std::string> & names)
+    {
+        group_names_ = names;
+        group_names_.resize(stats_.group_count());
+        group_base_.resize(group_names_.size());
+        group_total_.resize(group_names_.size());
+        group_latency_.resize(group_names_.size());
+    }
+
+    bool is_measuring() const { return measuring_; }
+
+    double seconds_since_last() const
+    {
+        return duration_cast< duration<double> >(steady_clock::now() - last_time_).count();
+    }
+
+    void print_interval()
+    {
+        time_point<steady_clock> now_time = steady_clock::now();
+        double elapsed_time = duration_cast< duration<double> >(now_time - last_time_).count();
+        if (elapsed_time <= 0.0)
+            return;
+
+        client_counters current = stats_.snapshot();
+        client_counters delta = current - last_;
+
+        // The samples of this interval.
+        stats_.snapshot_latency(latency_);
+        interval_latency_ = latency_;
+        interval_latency_.subtract(last_latency_);
+        std::swap(latency_, last_latency_);
+
+        write_record("interval", (measuring_ ? "measure" : "warm-up"), now_time, elapsed_time,
+                     current.connects, delta, interval_latency_);
+        last_ = current;
+        last_time_ = now_time;
+        if (!writer_.print_text())
+            return;
+
+        std::cout << (measuring_ ? "" : "(warm-up) ")
+                  << "[" << std::right << std::setw(5) << current.connects << "/" << connections_ << " conns] "
+                  << "qps = " << std::setw(8) << (uint64_t)(delta.queries / elapsed_time) << ", "
+                  << "send BW = " << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                  << ((double)delta.send_bytes / (1024.0 * 1024.0) / elapsed_time) << " MB/s, "
+                  << "recv BW = " << ((double)delta.recv_bytes / (1024.0 * 1024.0) / elapsed_time) << " MB/s, "
+                  << "average latency = " << std::setprecision(6) << delta.avg_latency_ms() << " ms, "
+                  << "errors = " << delta.errors << ", "
+                  << "total = " << current.queries << std::endl;
+        if (delta.non_2xx() != 0)
+            std::cout << "    non-2xx responses = " << delta.non_2xx() << std::endl;
+        if (delta.no_local_port != 0)
+            std::cout << "    no local port (EADDRNOTAVAIL) = " << delta.no_local_port << std::endl;
+        if (delta.corrupted != 0 || delta.reordered != 0 || delta.lost != 0) {
+            std::cout << "    verify: corrupted = " << delta.corrupted << ", reordered = " << delta.reordered
+                      << ", lost = " << delta.lost << std::endl;
+        }
+        if (interval_latency_.total_count() != 0) {
+            std::cout << "    latency: ";
+            print_latency_percentiles(std::cout, interval_latency_);
+            std::cout << std::endl;
+        }
+    }
+
+    void begin_measure()
+    {
+        measuring_ = true;
+        measure_start_ = steady_clock::now();
+        measure_base_ = stats_.snapshot();
+        stats_.snapshot_latency(measure_base_latency_);
+        for (std::size_t i = 0; i < group_names_.size(); ++i) {
+            group_base_[i] = stats_.group_snapshot(i);
+            stats_.group_snapshot_latency(i, group_latency_[i]);
+        }
+    }
+
+    void end_measure()
+    {
+        if (!measuring_)
+            begin_measure();
+        measuring_ = false;
+        measure_end_ = steady_clock::now();
+        measure_total_ = stats_.snapshot() - measure_base_;
+        // latency_ is the samples of the window from now on.
+        stats_.snapshot_latency(latency_);
+        latency_.subtract(measure_base_latency_);
+        for (std::size_t i = 0; i < group_names_.size(); ++i) {
+            group_total_[i] = stats_.group_snapshot(i) - group_base_[i];
+            latency_histogram base_latency(group_latency_[i]);
+            stats_.group_snapshot_latency(i, group_latency_[i]);
+            group_latency_[i].subtract(base_latency);
+        }
+    }
+
+    /// The last measurement window, after end_measure().
+    double measure_seconds() const
+    {
+        return duration_cast< duration<double> >(measure_end_ - measure_start_).count();
+    }
+
+    const client_counters & measure_total() const { return measure_total_; }
+    const latency_histogram & measure_latency() const { return latency_; }
+
+    /// A record of the last measurement window (e.g. a step of --sweep), labeled by group.
+    void write_measure_record(const char * type, const char * group)
+    {
+        write_record(type, "measure", measure_end_, measure_seconds(), stats_.snapshot().connects,
+                     measure_total_, latency_, group);
+    }
+
+    void print_summary()
+    {
+        const client_counters & total = measure_total_;
+        double total_time = duration_cast< duration<double> >(measure_end_ - measure_start_).count();
+        client_counters all = stats_.snapshot();
+        write_record("summary", "measure", measure_end_, total_time, all.connects, total, latency_);
+        for (std::size_t i = 0; i < group_names_.size(); ++i) {
+            write_record("group_summary", "measure", measure_end_, total_time,
+                         stats_.group_snapshot(i).connects, group_total_[i], group_latency_[i],
+                         group_names_[i].c_str());
+        }
+        if (!writer_.print_text())
+            return;
+
+        double qps = (total_time > 0.0) ? ((double)total.queries / total_time) : 0.0;
+        double send_bw = (total_time > 0.0) ? ((double)total.send_bytes / (1024.0 * 1024.0) / total_time) : 0.0;
+        double recv_bw = (total_time > 0.0) ? ((double)total.recv_bytes / (1024.0 * 1024.0) / total_time) : 0.0;
+
+        std::cout << std::endl
+                  << "Summary (" << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                  << total_time << " seconds measured):" << std::endl
+                  << "  connections = " << all.connects << "/" << connections_
+                  << " (connect errors = " << all.connect_errors << ")" << std::endl;
+        if (total.no_local_port != 0) {
+            std::cout << "  no local port (EADDRNOTAVAIL) = " << total.no_local_port
+                      << ", the local ports are held by TIME_WAIT (see --linger-reset or --bind)"
+                      << " or a --bind address isn't local" << std::endl;
+        }
+        std::cout << "  queries = " << total.queries << ", "
+                  << "qps = " << std::setprecision(1) << qps << std::endl
+                  << "  send BW = " << std::setprecision(3) << send_bw << " MB/s, "
+                  << "recv BW = " << recv_bw << " MB/s" << std::endl
+                  << "  average latency = " << std::setprecision(6) << total.avg_latency_ms() << " ms" << std::endl;
+        if (latency_.total_count() != 0) {
+            std::cout << "  latency: ";
+            print_latency_percentiles(std::cout, latency_);
+            std::cout << std::endl;
+        }
+        if (total.responses() != 0) {
+            std::cout << "  status: ";
+            for (std::size_t i = 1; i < client_counters::kStatusClasses; ++i)
+                std::cout << i << "xx = " << total.status[i] << ", ";
+            std::cout << "other = " << total.status[0] << std::endl;
+        }
+        if (total.verified != 0) {
+            std::cout << "  verify: packets = " << total.verified << ", corrupted = " << total.corrupted
+                      << ", reordered = " << total.reordered << ", lost = " << total.lost << std::endl;
+        }
+        std::cout << "  errors = " << total.errors << std::endl;
+        for (std::size_t i = 0; i < group_names_.size(); ++i) {
+            const client_counters & group = group_total_[i];
+            double group_qps = (total_time > 0.0) ? ((double)group.queries / total_time) : 0.0;
+            double group_bw = (total_time > 0.0) ? ((double)group.recv_bytes / (1024.0 * 1024.0) / total_time) : 0.0;
+            std::cout << "  [" << group_names_[i] << "] conns = " << stats_.group_snapshot(i).connects << ", "
+                      << "qps = " << std::setprecision(1) << group_qps << ", "
+                      << "recv BW = " << std::setprecision(3) << group_bw << " MB/s, "
+                      << "errors = " << group.errors << std::endl;
+            if (group_latency_[i].total_count() != 0) {
+                std::cout << "      latency: ";
+                print_latency_percentiles(std::cout, group_latency_[i]);
+                std::cout << std::endl;
+            }
+        }
+        std::cout << "  clock: " << tsc_clock::source_name();
+        if (tsc_clock::is_tsc())
+            std::cout << " (" << std::setprecision(3) << tsc_clock::tsc_ghz() << " GHz)";
+        std::cout << ", " << std::setprecision(1) << tsc_clock::read_ns() << " ns/read"
+                  << " (steady_clock " << tsc_clock::steady_read_ns() << " ns/read)" << std::endl;
+    }
+
+private:
+    void write_record(const char * type, const char * phase, const time_point<steady_clock> & now_time,
+                      double interval_time, uint64_t connects, const client_counters & delta,
+                      const latency_histogram & latency, const char * group = "all")
+    {
+        if (writer_.is_text())
+            return;
+
+        static const char * kNames[] = { "p50_us", "p90_us", "p99_us", "p99.9_us", "p99.99_us" };
+        double rate = (interval_time > 0.0) ? (1.0 / interval_time) : 0.0;
+        stats_record record;
+        record.add("type", type)
+              .add("phase", phase)
+              .add("group", group)
+              .add("elapsed_s", duration_cast< duration<double> >(now_time - start_time_).count())
+              .add("interval_s", interval_time)
+              .add("conns", connects)
+              .add("queries", delta.queries)
+              .add("qps", (double)delta.queries * rate)
+              .add("send_MBps", (double)delta.send_bytes / (1024.0 * 1024.0) * rate)
+              .add("recv_MBps", (double)delta.recv_bytes / (1024.0 * 1024.0) * rate)
+              .add("avg_latency_us", delta.avg_latency_ms() * 1000.0);
+        for (std::size_t i = 0; i < sizeof(kNames) / sizeof(kNames[0]); ++i)
+            record.add(kNames[i], (double)latency.value_at_percentile(kLatencyPercentiles[i]) / 1000.0);
+        record.add("max_us", (double)latency.max_value() / 1000.0)
+              .add("non_2xx", delta.non_2xx())
+              .add("no_local_port", delta.no_local_port)
+              .add("corrupted", delta.corrupted)
+              .add("reordered", delta.reordered)
+              .add("lost", delta.lost)
+              .add("errors", delta.errors);
+        writer_.write(record);
+    }
+};
+
+} // namespace asio_test
@@ -9,6 +9,10 @@
 
 extern uint32_t g_test_mode;
 extern uint32_t g_test_method;
+extern uint32_t g_http_method;
+extern uint32_t g_body_size;
+extern uint32_t g_body_chunked;
+extern uint32_t g_h2_streams;
 
 extern std::string g_test_mode_str;
 extern std::string g_test_method_str;
@@ -23,15 +27,25 @@ enum test_mode_t {
     test_mode_unknown,
     test_mode_echo,
     test_mode_http,
+    test_mode_http2,
+    test_mode_websocket,
     test_mode_last
 };
 
+enum http_method_t {
+    http_method_get,
+    http_method_post,
+    http_method_last
+};
+
 enum test_method_t {
     test_method_unknown,
     test_method_pingpong,
     test_method_qps,
     test_method_throughput,
     test_method_latency,
+    test_method_load,
+    test_method_connect,
     test_method_last
 };
 
@@ -0,0 +1,195 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <boost/noncopyable.hpp>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                  < High dynamic range latency histogram >
+
+  The values (nanoseconds) are kept in log-linear buckets like HdrHistogram:
+  bucket b holds the values in [2^(b + 10), 2^(b + 11)) split in 1024 equal
+  sub-buckets, the bucket 0 holds [0, 2048) one by one. So every value keeps
+  3 significant digits (an error under 0.1%) from 1 ns to 68 seconds, the
+  larger values are clamped to the highest one.
+
+      counts_index = ((bucket + 1) << 10) + (value >> bucket) - 1024
+
+  Recording is a bit scan, two shifts and an add. The layout is the same for
+  every histogram, so merging (and the interval = now - last) is exact, it's a
+  sum of the counts.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+namespace hdr {
+
+static const uint32_t kSubBucketBits        = 11;
+static const uint32_t kSubBucketCount       = 1U << kSubBucketBits;
+static const uint32_t kSubBucketHalfBits    = kSubBucketBits - 1;
+static const uint32_t kSubBucketHalfCount   = 1U << kSubBucketHalfBits;
+static const uint32_t kMaxValueBits         = 36;
+static const uint64_t kMaxTrackableValue    = (1ULL << kMaxValueBits) - 1;
+static const uint32_t kBucketCount          = kMaxValueBits - kSubBucketBits + 1;
+static const std::size_t kCountsLength      = (std::size_t)(kBucketCount + 1) << kSubBucketHalfBits;
+
+// The index of the highest set bit, value must not be 0.
+static inline uint32_t highest_bit(uint64_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (uint32_t)index;
+#else
+    return (uint32_t)(63 - __builtin_clzll(value));
+#endif
+}
+
+static inline std::size_t counts_index(uint64_t value)
+{
+    if (value > kMaxTrackableValue)
+        value = kMaxTrackableValue;
+    uint32_t bucket = highest_bit(value | (kSubBucketCount - 1)) + 1 - kSubBucketBits;
+    uint32_t sub_bucket = (uint32_t)(value >> bucket);
+    return ((std::size_t)(bucket + 1) << kSubBucketHalfBits) + sub_bucket - kSubBucketHalfCount;
+}
+
+// The highest value which is recorded to the index.
+static inline uint64_t highest_value(std::size_t index)
+{
+    int32_t bucket = (int32_t)(index >> kSubBucketHalfBits) - 1;
+    uint32_t sub_bucket = (uint32_t)(index & (kSubBucketHalfCount - 1)) + kSubBucketHalfCount;
+    if (bucket < 0) {
+        sub_bucket -= kSubBucketHalfCount;
+        bucket = 0;
+    }
+    return ((uint64_t)sub_bucket << bucket) + ((1ULL << bucket) - 1);
+}
+
+} // namespace hdr
+
+//
+// A plain histogram, to merge and to read the percentiles from.
+//
+class latency_histogram
+{
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_count_;
+
+public:
+    latency_histogram() : counts_(hdr::kCountsLength, 0), total_count_(0) {}
+
+    ~latency_histogram() {}
+
+    uint64_t total_count() const { return total_count_; }
+
+    void reset()
+    {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        total_count_ = 0;
+    }
+
+    void record(uint64_t value)
+    {
+        counts_[hdr::counts_index(value)]++;
+        total_count_++;
+    }
+
+    void add_count(std::size_t index, uint64_t count)
+    {
+        counts_[index] += count;
+        total_count_ += count;
+    }
+
+    void merge(const latency_histogram & other)
+    {
+        for (std::size_t i = 0; i < hdr::kCountsLength; ++i)
+            counts_[i] += other.counts_[i];
+        total_count_ += other.total_count_;
+    }
+
+    /// this = this - older, older is an earlier snapshot of the same counters.
+    void subtract(const latency_histogram & older)
+    {
+        for (std::size_t i = 0; i < hdr::kCountsLength; ++i)
+            counts_[i] -= older.counts_[i];
+        total_count_ -= older.total_count_;
+    }
+
+    /// The value which percentile (0.0 - 100.0) of the samples are less than or equal to.
+    uint64_t value_at_percentile(double percentile) const
+    {
+        if (total_count_ == 0)
+            return 0;
+        if (percentile > 100.0)
+            percentile = 100.0;
+        uint64_t target = (uint64_t)((percentile / 100.0) * (double)total_count_ + 0.5);
+        if (target == 0)
+            target = 1;
+        uint64_t count = 0;
+        for (std::size_t i = 0; i < hdr::kCountsLength; ++i) {
+            count += counts_[i];
+            if (count >= target)
+                return hdr::highest_value(i);
+        }
+        return hdr::kMaxTrackableValue;
+    }
+
+    uint64_t max_value() const
+    {
+        for (std::size_t i = hdr::kCountsLength; i > 0; --i) {
+            if (counts_[i - 1] != 0)
+                return hdr::highest_value(i - 1);
+        }
+        return 0;
+    }
+};
+
+//
+// The histogram of one thread: a single writer, the reporter thread reads it.
+// The counts are never reset, an interval is the difference of two snapshots.
+//
+class latency_recorder : private boost::noncopyable
+{
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+
+public:
+    latency_recorder() : counts_(new std::atomic<uint64_t>[hdr::kCountsLength])
+    {
+        for (std::size_t i = 0; i < hdr::kCountsLength; ++i)
+            counts_[i].store(0, std::memory_order_relaxed);
+    }
+
+    ~latency_recorder() {}
+
+    void record(uint64_t value)
+    {
+        std::atomic<uint64_t> & count = counts_[hdr::counts_index(value)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void add_to(latency_histogram & histogram) const
+    {
+        for (std::size_t i = 0; i < hdr::kCountsLength; ++i) {
+            uint64_t count = counts_[i].load(std::memory_order_relaxed);
+            if (count != 0)
+                histogram.add_count(i, count);
+        }
+    }
+};
+
+} // namespace asio_test
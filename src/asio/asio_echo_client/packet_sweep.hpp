@@ -0,0 +1,90 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+#include "common.h"
+
+namespace asio_test {
+
+//
+// The steps of a packet-size sweep (--sweep). The main thread moves to the next
+// step, every connection then waits for its echoes in flight, tells the server
+// the new size (see echo_control), and counts itself as switched when it's acked.
+//
+class packet_sweep : private boost::noncopyable
+{
+private:
+    std::vector<uint32_t> sizes_;
+    std::atomic<uint32_t> step_;
+    std::atomic<uint32_t> switched_;
+
+public:
+    explicit packet_sweep(const std::vector<uint32_t> & sizes)
+        : sizes_(sizes), step_(0), switched_(0)
+    {
+    }
+
+    ~packet_sweep() {}
+
+    std::size_t step_count() const { return sizes_.size(); }
+
+    uint32_t step() const { return step_.load(std::memory_order_acquire); }
+
+    uint32_t packet_size(uint32_t step) const { return sizes_[step]; }
+
+    uint32_t max_packet_size() const
+    {
+        uint32_t max_size = 0;
+        for (std::size_t i = 0; i < sizes_.size(); ++i)
+            max_size = (sizes_[i] > max_size) ? sizes_[i] : max_size;
+        return max_size;
+    }
+
+    /// The main thread: the connections switch to the next size.
+    void next_step()
+    {
+        switched_.store(0, std::memory_order_relaxed);
+        step_.fetch_add(1, std::memory_order_release);
+    }
+
+    /// A connection runs the current step now.
+    void on_switched() { switched_.fetch_add(1, std::memory_order_relaxed); }
+
+    uint32_t switched() const { return switched_.load(std::memory_order_relaxed); }
+
+    /// "64,256,1k,64k" (k = 1024), the sizes are 1 to MAX_PACKET_SIZE bytes.
+    static bool parse_sizes(const std::string & list, std::vector<uint32_t> & sizes, std::string & error)
+    {
+        sizes.clear();
+        std::size_t pos = 0;
+        while (pos < list.size()) {
+            std::size_t comma = list.find(',', pos);
+            std::string item = list.substr(pos, (comma == std::string::npos) ? std::string::npos : comma - pos);
+            char * end = nullptr;
+            unsigned long size = ::strtoul(item.c_str(), &end, 10);
+            if (end != nullptr && (*end == 'k' || *end == 'K')) {
+                size *= 1024;
+                end++;
+            }
+            if (item.empty() || end == nullptr || *end != '\0' || size < 1 || size > MAX_PACKET_SIZE) {
+                error = "bad packet size: [" + item + "]";
+                return false;
+            }
+            sizes.push_back((uint32_t)size);
+            pos = (comma == std::string::npos) ? list.size() : comma + 1;
+        }
+        if (sizes.empty()) {
+            error = "no packet size";
+            return false;
+        }
+        return true;
+    }
+};
+
+} // namespace asio_test
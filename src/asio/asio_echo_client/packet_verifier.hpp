@@ -0,0 +1,162 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "common/crc32c.hpp"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                        < The echo packets of --verify >
+
+  Every packet starts with a header, the payload is a pattern of the connection:
+
+      [ conn id : 4 ][ checksum : 4 ][ sequence : 8 ][ payload ... ]
+
+      checksum = crc32c(payload) extended by (conn id, sequence)
+
+  The payload is the same in all the packets of a connection, so the sender
+  only stamps 16 bytes (the crc of the payload is computed once), the receiver
+  checks the whole packet. A wrong checksum or conn id is a corruption (e.g. a
+  buffer reused by the server before its write is done), a sequence ahead of
+  the expected one is a loss, a sequence behind it is a reorder (or duplicate).
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+struct verify_counters
+{
+    uint64_t verified;
+    uint64_t corrupted;
+    uint64_t reordered;
+    uint64_t lost;
+
+    verify_counters() : verified(0), corrupted(0), reordered(0), lost(0) {}
+};
+
+class packet_verifier
+{
+public:
+    enum { kHeaderSize = 16 };
+
+private:
+    uint32_t conn_id_;
+    uint32_t packet_size_;
+    uint32_t payload_crc_;
+    uint64_t send_seq_;
+    uint64_t expected_seq_;
+
+    // The first part of a packet which is split by two reads.
+    std::vector<char> partial_;
+    std::size_t partial_size_;
+
+    static uint32_t header_crc(uint32_t payload_crc, uint32_t conn_id, uint64_t seq)
+    {
+        char fields[12];
+        std::memcpy(fields, &conn_id, sizeof(conn_id));
+        std::memcpy(fields + 4, &seq, sizeof(seq));
+        return crc32c_extend(payload_crc, fields, sizeof(fields));
+    }
+
+    void verify_packet(const char * packet, verify_counters & counters)
+    {
+        uint32_t conn_id, checksum;
+        uint64_t seq;
+        std::memcpy(&conn_id, packet, sizeof(conn_id));
+        std::memcpy(&checksum, packet + 4, sizeof(checksum));
+        std::memcpy(&seq, packet + 8, sizeof(seq));
+
+        counters.verified++;
+        uint32_t payload_crc = crc32c(packet + kHeaderSize, packet_size_ - kHeaderSize);
+        if (conn_id != conn_id_ || checksum != header_crc(payload_crc, conn_id, seq)) {
+            // It takes the place of the expected packet.
+            counters.corrupted++;
+            expected_seq_++;
+        }
+        else if (seq == expected_seq_) {
+            expected_seq_++;
+        }
+        else if (seq > expected_seq_) {
+            counters.lost += (seq - expected_seq_);
+            expected_seq_ = seq + 1;
+        }
+        else {
+            counters.reordered++;
+        }
+    }
+
+public:
+    /// packet_size must be kHeaderSize at least.
+    packet_verifier(uint32_t conn_id, uint32_t packet_size)
+        : conn_id_(conn_id), packet_size_(std::max(packet_size, (uint32_t)kHeaderSize)),
+          payload_crc_(0), send_seq_(0), expected_seq_(0),
+          partial_(packet_size_), partial_size_(0)
+    {
+    }
+
+    ~packet_verifier() {}
+
+    /// Fill the payloads of the packets of buffer with the pattern of the connection.
+    void init_packets(char * buffer, std::size_t count)
+    {
+        uint32_t state = conn_id_ * 2654435761U + 1;
+        std::vector<char> payload(packet_size_ - kHeaderSize);
+        for (std::size_t i = 0; i < payload.size(); ++i) {
+            state = state * 1664525U + 1013904223U;
+            payload[i] = (char)(state >> 24);
+        }
+        payload_crc_ = crc32c(payload.data(), payload.size());
+        for (std::size_t n = 0; n < count; ++n) {
+            char * packet = buffer + n * packet_size_;
+            std::memset(packet, 0, kHeaderSize);
+            if (!payload.empty())
+                std::memcpy(packet + kHeaderSize, payload.data(), payload.size());
+        }
+    }
+
+    /// Stamp the next sequence numbers on count packets of buffer (initialized by init_packets()).
+    void stamp(char * buffer, std::size_t count)
+    {
+        for (std::size_t n = 0; n < count; ++n) {
+            char * packet = buffer + n * packet_size_;
+            uint64_t seq = send_seq_++;
+            uint32_t checksum = header_crc(payload_crc_, conn_id_, seq);
+            std::memcpy(packet, &conn_id_, sizeof(conn_id_));
+            std::memcpy(packet + 4, &checksum, sizeof(checksum));
+            std::memcpy(packet + 8, &seq, sizeof(seq));
+        }
+    }
+
+    /// Check the echo bytes as they are received.
+    void verify(const char * data, std::size_t size, verify_counters & counters)
+    {
+        if (partial_size_ != 0) {
+            std::size_t copy_size = std::min(size, (std::size_t)packet_size_ - partial_size_);
+            std::memcpy(partial_.data() + partial_size_, data, copy_size);
+            partial_size_ += copy_size;
+            data += copy_size;
+            size -= copy_size;
+            if (partial_size_ < packet_size_)
+                return;
+            verify_packet(partial_.data(), counters);
+            partial_size_ = 0;
+        }
+        while (size >= packet_size_) {
+            verify_packet(data, counters);
+            data += packet_size_;
+            size -= packet_size_;
+        }
+        if (size != 0) {
+            std::memcpy(partial_.data(), data, size);
+            partial_size_ = size;
+        }
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,77 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+
+#include "tsc_clock.hpp"
+
+using namespace std::chrono;
+
+namespace asio_test {
+
+//
+// The open-loop (--rate) timeline of one connection: the request k is due at
+//
+//     start + offset + k * interval,   interval = connections / rate
+//
+// whatever the responses do, so a stall of the server shows up as latency (it's
+// measured from the due time) instead of as fewer requests. The connection i is
+// offset by i / rate, so all the connections together send at the even rate.
+// The due time is computed from k, not accumulated, so it never drifts. The
+// timeline is on steady_clock (the timers), the due times are handed out as
+// tsc_clock stamps, back-dated from the stamp of now.
+//
+class send_schedule
+{
+private:
+    time_point<steady_clock> start_time_;
+    double   interval_ns_;
+    double   offset_ns_;
+    uint64_t next_seq_;
+
+public:
+    /// A closed-loop schedule, nothing is ever due.
+    send_schedule() : interval_ns_(0.0), offset_ns_(0.0), next_seq_(0) {}
+
+    /// rate is the requests per second of all the connections.
+    send_schedule(double rate, uint32_t connections, uint32_t index)
+        : interval_ns_(0.0), offset_ns_(0.0), next_seq_(0)
+    {
+        if (rate > 0.0 && connections != 0) {
+            interval_ns_ = 1000000000.0 * (double)connections / rate;
+            offset_ns_ = 1000000000.0 * (double)(index % connections) / rate;
+        }
+    }
+
+    bool is_open_loop() const { return (interval_ns_ != 0.0); }
+
+    void start(const time_point<steady_clock> & now)
+    {
+        start_time_ = now;
+        next_seq_ = 0;
+    }
+
+    time_point<steady_clock> next_send_time() const
+    {
+        return start_time_ + nanoseconds((int64_t)(offset_ns_ + (double)next_seq_ * interval_ns_));
+    }
+
+    /// Append the due stamps of all the requests due by now (now_stamp on tsc_clock), returns the count.
+    template <typename Container>
+    uint32_t take_due(const time_point<steady_clock> & now, uint64_t now_stamp, Container & send_times)
+    {
+        uint32_t count = 0;
+        time_point<steady_clock> send_time = next_send_time();
+        while (send_time <= now) {
+            send_times.push_back(tsc_clock::stamp_before(now_stamp,
+                (uint64_t)duration_cast<nanoseconds>(now - send_time).count()));
+            next_seq_++;
+            count++;
+            send_time = next_send_time();
+        }
+        return count;
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,222 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+
+#include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "tsc_clock.hpp"
+#include "test_http_load_client.hpp"
+
+using namespace boost::asio;
+using namespace std::chrono;
+
+namespace asio_test {
+
+//
+// The connection storm: every client is a slot which connects, exchanges one
+// request (an echo packet, or an http request and its whole response), closes
+// and connects again at once, so the accept path and the teardown of the server
+// are the load. A query is one connection, the latency is its connect time.
+// The connects counter is the slots which ever connected, so the drain works.
+// The client closes first, so every connect leaves a TIME_WAIT on a local port:
+// about 28k connects per TIME_WAIT period exhaust the ephemeral ports of one
+// local address (EADDRNOTAVAIL), unless --linger-reset closes with a RST or
+// --bind spreads the connections over more local addresses.
+//
+class test_connect_client
+{
+private:
+    enum { kRecvBufferSize = 64 * 1024 };
+    // The delay (ms) before connecting again after a connect error.
+    enum { kConnectRetryDelay = 10 };
+
+    boost::asio::io_service & io_service_;
+    ip::tcp::socket socket_;
+    ip::tcp::resolver::iterator endpoint_iterator_;
+    // The index of the connection, every reconnect binds the same local address.
+    uint32_t connection_index_;
+    boost::asio::steady_timer timer_;
+    uint32_t mode_;
+    bool linger_reset_;
+    client_stats_shard * stats_;
+
+    const std::string & request_;
+    std::size_t response_size_;
+    std::size_t recv_size_;
+    bool connected_once_;
+    bool drained_;
+    uint64_t connect_ns_;
+    uint64_t connect_time_;
+
+    http_response_parser parser_;
+    std::vector<char> recv_buffer_;
+
+public:
+    /// In the echo mode, request is the packet and the response is its echo.
+    test_connect_client(boost::asio::io_service & io_service,
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        uint32_t mode, bool linger_reset, const std::string & request, client_stats_shard * stats)
+        : io_service_(io_service),
+          socket_(io_service), endpoint_iterator_(endpoint_iterator), connection_index_(connection_index),
+          timer_(io_service),
+          mode_(mode), linger_reset_(linger_reset), stats_(stats), request_(request), response_size_(request.size()), recv_size_(0),
+          connected_once_(false), drained_(false), connect_ns_(0), connect_time_(0),
+          recv_buffer_(kRecvBufferSize)
+    {
+        do_connect();
+    }
+
+    ~test_connect_client()
+    {
+    }
+
+private:
+    /// After the measurement window no new connection is made, returns true if draining.
+    bool drain_now()
+    {
+        if (!stats_->is_draining())
+            return false;
+        if (connected_once_ && !drained_) {
+            drained_ = true;
+            stats_->on_drained();
+        }
+        return true;
+    }
+
+    void close()
+    {
+        boost::system::error_code ignored_ec;
+        if (socket_.is_open()) {
+            // An abortive close (a RST) leaves no TIME_WAIT behind.
+            if (linger_reset_)
+                socket_.set_option(socket_base::linger(true, 0), ignored_ec);
+            socket_.close(ignored_ec);
+        }
+    }
+
+    void do_connect()
+    {
+        if (drain_now())
+            return;
+
+        connect_time_ = tsc_clock::now();
+        recv_size_ = 0;
+        response_size_ = request_.size();
+        parser_ = http_response_parser();
+        async_connect_bound(io_service_, socket_, endpoint_iterator_, connection_index_,
+            [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
+            {
+                if (!ec)
+                {
+                    connect_ns_ = tsc_clock::elapsed_ns(connect_time_, tsc_clock::now());
+                    if (!connected_once_) {
+                        connected_once_ = true;
+                        stats_->on_connect(ec);
+                    }
+                    boost::system::error_code ignored_ec;
+                    socket_.set_option(ip::tcp::no_delay(true), ignored_ec);
+                    do_write();
+                }
+                else {
+                    stats_->on_connect(ec);
+                    close();
+                    do_connect_later();
+                }
+            });
+    }
+
+    void do_connect_later()
+    {
+        timer_.expires_from_now(milliseconds(kConnectRetryDelay));
+        timer_.async_wait([this](const boost::system::error_code & ec)
+            {
+                if (!ec)
+                    do_connect();
+            });
+    }
+
+    // The errors are counted, not logged, a storm would flood the log.
+    void on_error()
+    {
+        stats_->on_error();
+        close();
+        do_connect_later();
+    }
+
+    void on_response()
+    {
+        stats_->on_query(connect_ns_);
+        if (mode_ == test_mode_http)
+            stats_->on_status(parser_.status_code());
+        close();
+        do_connect();
+    }
+
+    void do_write()
+    {
+        boost::asio::async_write(socket_, boost::asio::buffer(request_.data(), request_.size()),
+            [this](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                {
+                    stats_->on_send(bytes_transferred);
+                    do_read();
+                }
+                else {
+                    on_error();
+                }
+            });
+    }
+
+    void do_read()
+    {
+        socket_.async_read_some(boost::asio::buffer(recv_buffer_.data() + recv_size_, recv_buffer_.size() - recv_size_),
+            [this](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                {
+                    stats_->on_recv(bytes_transferred);
+                    if (mode_ == test_mode_http) {
+                        std::size_t consumed = 0;
+                        const char * first = recv_buffer_.data();
+                        http_response_parser::parse_result_t result =
+                            parser_.parse(first, first + recv_size_ + bytes_transferred, consumed);
+                        if (result == http_response_parser::parse_complete) {
+                            on_response();
+                            return;
+                        }
+                        // Keep the unparsed bytes (a part of the headers) at the front.
+                        recv_size_ = recv_size_ + bytes_transferred - consumed;
+                        if (recv_size_ != 0 && consumed != 0)
+                            ::memmove(recv_buffer_.data(), first + consumed, recv_size_);
+                        if (result == http_response_parser::parse_error || recv_size_ >= recv_buffer_.size()) {
+                            on_error();
+                            return;
+                        }
+                    }
+                    else {
+                        // The echo is only counted, it's not kept.
+                        response_size_ -= std::min(response_size_, bytes_transferred);
+                        if (response_size_ == 0) {
+                            on_response();
+                            return;
+                        }
+                    }
+                    do_read();
+                }
+                else {
+                    on_error();
+                }
+            });
+    }
+};
+
+} // namespace asio_test
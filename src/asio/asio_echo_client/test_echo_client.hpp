@@ -0,0 +1,326 @@
+
+#pragma once
+
+#include <iostream>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <boost/asio.hpp>
+
+#include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "send_schedule.hpp"
+#include "packet_verifier.hpp"
+#include "packet_sweep.hpp"
+#include "common/echo_control.hpp"
+
+using namespace boost::asio;
+using namespace std::chrono;
+
+namespace asio_test {
+
+//
+// An echo connection, the base of the pingpong and the latency clients. Keeps
+// pipeline_ packets in flight (or sends them on the timeline of --rate), a new
+// packet is sent as soon as one echo is complete. The echoes come back in order,
+// so the oldest send time belongs to the packet being completed.
+//
+class test_echo_client
+{
+protected:
+    enum { PACKET_SIZE = MAX_PACKET_SIZE };
+    // The most packets of one write in the open-loop mode.
+    enum { kOpenLoopBatch = 64 };
+    static const uint32_t kNoSweepStep = 0xFFFFFFFFU;
+
+    boost::asio::io_service & io_service_;
+    ip::tcp::socket socket_;
+    // The class name in the logs.
+    const char * name_;
+    uint32_t packet_size_;
+    uint32_t pipeline_;
+    uint32_t batch_size_;
+    client_stats_shard * stats_;
+
+    // The packets to send by the next write, and the bytes of the echo being received.
+    uint32_t unsent_count_;
+    uint32_t recv_offset_;
+    bool     write_pending_;
+    bool     drained_;
+    std::deque<uint64_t> send_times_;
+
+    // With --rate, the packets are sent on a fixed timeline instead of after the echoes.
+    send_schedule schedule_;
+    boost::asio::steady_timer timer_;
+
+    // With --verify, the packets are stamped and the echoes are checked.
+    std::unique_ptr<packet_verifier> verifier_;
+
+    // With --sweep, the step of the packet size this connection runs, and the
+    // control message in flight (sent when nothing else is) which switches it.
+    // The first step is switched before any packet, so the server counts the
+    // packets in the size of the client from the start.
+    packet_sweep * sweep_;
+    uint32_t sweep_step_;
+    uint32_t control_step_;
+    uint32_t control_acked_;
+    bool     control_pending_;
+    char     control_message_[echo_control::kMessageSize];
+    char     control_ack_[echo_control::kMessageSize];
+
+    std::vector<char> send_buffer_;
+    char data_[PACKET_SIZE];
+
+public:
+    test_echo_client(boost::asio::io_service & io_service, const char * name,
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        uint32_t packet_size, uint32_t pipeline,
+        const send_schedule & schedule, packet_verifier * verifier, packet_sweep * sweep,
+        client_stats_shard * stats)
+        : io_service_(io_service),
+          socket_(io_service), name_(name), packet_size_(packet_size), pipeline_(pipeline), batch_size_(0), stats_(stats),
+          unsent_count_(0), recv_offset_(0), write_pending_(false), drained_(false),
+          schedule_(schedule), timer_(io_service), verifier_(verifier),
+          sweep_(sweep), sweep_step_(kNoSweepStep), control_step_(0), control_acked_(0), control_pending_(false)
+    {
+        if (pipeline_ == 0)
+            pipeline_ = 1;
+        if (!schedule_.is_open_loop())
+            unsent_count_ = pipeline_;
+        batch_size_ = schedule_.is_open_loop() ? std::max(pipeline_, (uint32_t)kOpenLoopBatch) : pipeline_;
+        send_buffer_.resize((std::size_t)packet_size_ * batch_size_, 'h');
+        if (verifier_)
+            verifier_->init_packets(send_buffer_.data(), batch_size_);
+        ::memset(data_, 'h', sizeof(data_));
+        do_connect(endpoint_iterator, connection_index);
+    }
+
+    virtual ~test_echo_client()
+    {
+    }
+
+protected:
+    /// An error of the socket, it's counted already and the connection stops after it.
+    virtual void on_socket_error(const char * func, const boost::system::error_code & ec) {}
+
+    /// More echo bytes have come back than have been sent.
+    virtual void on_unexpected_echo() {}
+
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        timer_.cancel(ignored_ec);
+        if (socket_.is_open())
+            socket_.close(ignored_ec);
+        // A stopped connection has nothing in flight any more.
+        if (!drained_) {
+            drained_ = true;
+            stats_->on_drained();
+        }
+    }
+
+private:
+    void do_connect(ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index)
+    {
+        async_connect_bound(io_service_, socket_, endpoint_iterator, connection_index,
+            [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
+            {
+                stats_->on_connect(ec);
+                if (!ec)
+                {
+                    if (schedule_.is_open_loop()) {
+                        schedule_.start(steady_clock::now());
+                        do_wait_send_time();
+                    }
+                    do_write();
+                    do_read();
+                }
+                else {
+                    std::cout << name_ << "::do_connect() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                }
+            });
+    }
+
+    void on_recieved(std::size_t bytes_transferred)
+    {
+        uint64_t recieve_time = tsc_clock::now();
+        recv_offset_ += (uint32_t)bytes_transferred;
+        while (recv_offset_ >= packet_size_) {
+            recv_offset_ -= packet_size_;
+            if (!send_times_.empty()) {
+                stats_->on_query(tsc_clock::elapsed_ns(send_times_.front(), recieve_time));
+                send_times_.pop_front();
+            }
+            else {
+                on_unexpected_echo();
+            }
+            if (!schedule_.is_open_loop())
+                unsent_count_++;
+        }
+    }
+
+    void do_wait_send_time()
+    {
+        timer_.expires_at(schedule_.next_send_time());
+        timer_.async_wait([this](const boost::system::error_code & ec)
+            {
+                if (!ec && socket_.is_open()) {
+                    if (stats_->is_draining()) {
+                        do_write();
+                        return;
+                    }
+                    unsent_count_ += schedule_.take_due(steady_clock::now(), tsc_clock::now(), send_times_);
+                    do_write();
+                    do_wait_send_time();
+                }
+            });
+    }
+
+    void do_read()
+    {
+        socket_.async_read_some(boost::asio::buffer(data_, sizeof(data_)),
+            [this](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                {
+                    if (control_pending_) {
+                        if (!on_control_acked(bytes_transferred)) {
+                            stats_->on_error();
+                            stop();
+                            return;
+                        }
+                        do_write();
+                        do_read();
+                        return;
+                    }
+                    stats_->on_recv(bytes_transferred);
+                    if (verifier_) {
+                        verify_counters counters;
+                        verifier_->verify(data_, bytes_transferred, counters);
+                        stats_->on_verify(counters);
+                    }
+                    on_recieved(bytes_transferred);
+                    do_write();
+                    do_read();
+                }
+                else {
+                    stats_->on_error();
+                    on_socket_error("do_read", ec);
+                    stop();
+                }
+            });
+    }
+
+    void do_write()
+    {
+        // After the measurement window, drop the unsent packets and wait for the echoes in flight.
+        if (stats_->is_draining()) {
+            if (schedule_.is_open_loop())
+                send_times_.resize(send_times_.size() - unsent_count_);
+            unsent_count_ = 0;
+            if (!write_pending_ && send_times_.empty() && !drained_) {
+                drained_ = true;
+                stats_->on_drained();
+            }
+            return;
+        }
+        if (sweep_ != nullptr && sweep_step_ != sweep_->step()) {
+            do_switch_packet_size();
+            return;
+        }
+        if (write_pending_ || unsent_count_ == 0)
+            return;
+
+        uint64_t send_time = tsc_clock::now();
+        // The send buffer holds batch_size_ packets, the rest of a burst goes by the next write.
+        uint32_t send_count = std::min(unsent_count_, batch_size_);
+        if (!schedule_.is_open_loop()) {
+            for (uint32_t i = 0; i < send_count; ++i)
+                send_times_.push_back(send_time);
+        }
+
+        if (verifier_)
+            verifier_->stamp(send_buffer_.data(), send_count);
+
+        std::size_t send_size = (std::size_t)packet_size_ * send_count;
+        unsent_count_ -= send_count;
+        write_pending_ = true;
+        boost::asio::async_write(socket_,
+            boost::asio::buffer(send_buffer_.data(), send_size),
+            [this](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                {
+                    stats_->on_send(bytes_transferred);
+                    write_pending_ = false;
+                    do_write();
+                }
+                else {
+                    stats_->on_error();
+                    on_socket_error("do_write", ec);
+                    stop();
+                }
+            });
+    }
+
+    /// Once the echoes in flight are back, ask the server for the packet size of the sweep step.
+    void do_switch_packet_size()
+    {
+        if (write_pending_ || control_pending_ || !send_times_.empty())
+            return;
+
+        control_step_ = sweep_->step();
+        control_acked_ = 0;
+        control_pending_ = true;
+        echo_control::make(control_message_, echo_control::cmd_packet_size, sweep_->packet_size(control_step_));
+        write_pending_ = true;
+        boost::asio::async_write(socket_,
+            boost::asio::buffer(control_message_, sizeof(control_message_)),
+            [this](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                {
+                    write_pending_ = false;
+                    do_write();
+                }
+                else {
+                    stats_->on_error();
+                    on_socket_error("do_switch_packet_size", ec);
+                    stop();
+                }
+            });
+    }
+
+    /// Returns false if the answer is not the ack of the control message (e.g. a plain echo).
+    bool on_control_acked(std::size_t bytes_transferred)
+    {
+        std::size_t size = std::min(bytes_transferred, (std::size_t)(echo_control::kMessageSize - control_acked_));
+        ::memcpy(control_ack_ + control_acked_, data_, size);
+        control_acked_ += (uint32_t)size;
+        if (control_acked_ < echo_control::kMessageSize)
+            return true;
+
+        uint32_t command, value;
+        if (bytes_transferred != size
+            || !echo_control::parse_ack(control_ack_, sizeof(control_ack_), command, value)
+            || command != echo_control::cmd_packet_size || value != sweep_->packet_size(control_step_)) {
+            std::cout << name_ << "::on_control_acked() - Error: the server doesn't apply the packet size "
+                      << sweep_->packet_size(control_step_) << " (an old server echoes it)." << std::endl;
+            return false;
+        }
+
+        control_pending_ = false;
+        packet_size_ = sweep_->packet_size(control_step_);
+        recv_offset_ = 0;
+        send_buffer_.resize((std::size_t)packet_size_ * batch_size_, 'h');
+        sweep_step_ = control_step_;
+        sweep_->on_switched();
+        return true;
+    }
+};
+
+} // namespace asio_test
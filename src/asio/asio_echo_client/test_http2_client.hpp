@@ -0,0 +1,326 @@
+
+#pragma once
+
+#include <stdio.h>
+#include <iostream>
+#include <iomanip>      // For std::setw()
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <boost/asio.hpp>
+
+#include "common.h"
+#include "tsc_clock.hpp"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "asio/asio_echo_serv/http2_server/http2_frame.hpp"
+#include "asio/asio_echo_serv/http2_server/hpack.hpp"
+
+using namespace boost::asio;
+using namespace std::chrono;
+
+namespace asio_test {
+
+//
+// The h2c load client: one connection (prior knowledge), keeps streams_ requests
+// in flight (no more than the server's SETTINGS_MAX_CONCURRENT_STREAMS), a new
+// stream is opened as soon as one completes. The response headers are not decoded,
+// only END_STREAM of the HEADERS or DATA frames matters. The latency of a stream
+// is from the queueing of its HEADERS to its END_STREAM.
+//
+class test_http2_client
+{
+private:
+    enum { kRecvBufferSize = 256 * 1024 };
+    // The receive windows advertised to the server, the DATA is dropped at once.
+    enum { kRecvWindowSize = 16 * 1024 * 1024 };
+
+    ip::tcp::socket socket_;
+    uint32_t max_streams_;
+    uint32_t server_max_streams_;
+    uint32_t inflight_;
+    uint32_t next_stream_id_;
+    bool     started_;
+    bool     write_pending_;
+    uint32_t conn_recv_unacked_;
+
+    bool     drained_;
+    client_stats_shard * stats_;
+
+    // The send time of every stream in flight, the streams complete in any order.
+    std::unordered_map<uint32_t, uint64_t> send_times_;
+
+    // The HPACK block of every request, it only uses the static table.
+    std::string request_headers_;
+    std::string output_;
+    std::string writing_;
+    std::vector<char> recv_buffer_;
+    std::size_t recv_size_;
+
+public:
+    test_http2_client(boost::asio::io_service & io_service,
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        const std::string & authority, uint32_t streams, client_stats_shard * stats)
+        : socket_(io_service), max_streams_(streams), server_max_streams_(0xFFFFFFFFU), inflight_(0),
+          next_stream_id_(1), started_(false), write_pending_(false), conn_recv_unacked_(0),
+          drained_(false), stats_(stats),
+          recv_buffer_(kRecvBufferSize), recv_size_(0)
+    {
+        if (max_streams_ == 0)
+            max_streams_ = 1;
+
+        // GET / http://<authority>
+        hpack_encode_indexed(request_headers_, hpack_index_method_get);
+        hpack_encode_indexed(request_headers_, hpack_index_scheme_http);
+        hpack_encode_indexed(request_headers_, hpack_index_path_root);
+        hpack_encode_literal(request_headers_, hpack_index_authority, authority.c_str(), authority.size());
+
+        do_connect(io_service, endpoint_iterator, connection_index);
+    }
+
+    ~test_http2_client()
+    {
+    }
+
+private:
+    void set_socket_send_bufsize(int buffer_size)
+    {
+        boost::asio::socket_base::send_buffer_size send_bufsize_option(buffer_size);
+        socket_.set_option(send_bufsize_option);
+    }
+
+    void set_socket_recv_bufsize(int buffer_size)
+    {
+        boost::asio::socket_base::receive_buffer_size recv_bufsize_option(buffer_size);
+        socket_.set_option(recv_bufsize_option);
+    }
+
+    void start()
+    {
+        set_socket_send_bufsize(MAX_PACKET_SIZE);
+        set_socket_recv_bufsize(MAX_PACKET_SIZE);
+        socket_.set_option(ip::tcp::no_delay(true));
+
+        output_.append(kHttp2Preface, kHttp2PrefaceSize);
+        const uint32_t settings[][2] = {
+            { http2_settings_enable_push,         0 },
+            { http2_settings_initial_window_size, kRecvWindowSize }
+        };
+        http2_append_settings(output_, settings, sizeof(settings) / sizeof(settings[0]));
+        http2_append_window_update(output_, 0, kRecvWindowSize - kHttp2DefaultWindowSize);
+        do_flush();
+
+        do_read_some();
+    }
+
+    void stop()
+    {
+        if (socket_.is_open()) {
+            boost::system::error_code ignored_ec;
+            socket_.close(ignored_ec);
+        }
+        // A stopped connection has nothing in flight any more.
+        if (!drained_) {
+            drained_ = true;
+            stats_->on_drained();
+        }
+    }
+
+    void do_connect(boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                    uint32_t connection_index)
+    {
+        async_connect_bound(io_service, socket_, endpoint_iterator, connection_index,
+            [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
+            {
+                stats_->on_connect(ec);
+                if (!ec) {
+                    start();
+                }
+                else {
+                    std::cout << "test_http2_client::do_connect() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                }
+            });
+    }
+
+    void open_streams()
+    {
+        // After the measurement window, only the streams in flight are finished.
+        if (stats_->is_draining()) {
+            if (inflight_ == 0 && !drained_) {
+                drained_ = true;
+                stats_->on_drained();
+            }
+            return;
+        }
+        uint32_t max_inflight = std::min(max_streams_, server_max_streams_);
+        uint64_t send_time = tsc_clock::now();
+        while (inflight_ < max_inflight) {
+            if (next_stream_id_ > kHttp2MaxWindowSize) {
+                // The stream ids are used up, no new stream on this connection.
+                return;
+            }
+            http2_append_frame_header(output_, (uint32_t)request_headers_.size(), http2_frame_headers,
+                                      http2_flag_end_headers | http2_flag_end_stream, next_stream_id_);
+            output_.append(request_headers_);
+            send_times_[next_stream_id_] = send_time;
+            next_stream_id_ += 2;
+            inflight_++;
+        }
+    }
+
+    void on_stream_complete(uint32_t stream_id)
+    {
+        if (inflight_ != 0)
+            inflight_--;
+        std::unordered_map<uint32_t, uint64_t>::iterator iter = send_times_.find(stream_id);
+        if (iter != send_times_.end()) {
+            stats_->on_query(tsc_clock::elapsed_ns(iter->second, tsc_clock::now()));
+            send_times_.erase(iter);
+        }
+        else {
+            stats_->on_query();
+        }
+    }
+
+    /// Returns false if the connection must be closed.
+    bool handle_frame(const http2_frame_header & header, const char * payload)
+    {
+        switch (header.type) {
+        case http2_frame_settings:
+            if ((header.flags & http2_flag_ack) == 0) {
+                for (uint32_t offset = 0; offset + 6 <= header.length; offset += 6) {
+                    uint32_t id = ((uint32_t)(uint8_t)payload[offset] << 8) | (uint32_t)(uint8_t)payload[offset + 1];
+                    if (id == http2_settings_max_concurrent_streams)
+                        server_max_streams_ = http2_read_u32(payload + offset + 2);
+                }
+                http2_append_settings_ack(output_);
+                if (!started_) {
+                    started_ = true;
+                    std::cout << "server max concurrent streams: " << server_max_streams_
+                              << ", streams: " << std::min(max_streams_, server_max_streams_) << std::endl;
+                }
+            }
+            break;
+
+        case http2_frame_headers:
+            if (header.flags & http2_flag_end_stream)
+                on_stream_complete(header.stream_id);
+            break;
+
+        case http2_frame_data:
+            stats_->on_recv(header.length);
+            conn_recv_unacked_ += header.length;
+            if (conn_recv_unacked_ >= kRecvWindowSize / 2) {
+                http2_append_window_update(output_, 0, conn_recv_unacked_);
+                conn_recv_unacked_ = 0;
+            }
+            if (header.flags & http2_flag_end_stream)
+                on_stream_complete(header.stream_id);
+            else if (header.length != 0)
+                http2_append_window_update(output_, header.stream_id, header.length);
+            break;
+
+        case http2_frame_rst_stream:
+            // A refused stream.
+            stats_->on_error();
+            if (inflight_ != 0)
+                inflight_--;
+            send_times_.erase(header.stream_id);
+            break;
+
+        case http2_frame_ping:
+            if ((header.flags & http2_flag_ack) == 0 && header.length == 8)
+                http2_append_ping_ack(output_, payload);
+            break;
+
+        case http2_frame_goaway:
+            std::cout << "test_http2_client::handle_frame() - Error: GOAWAY (code = "
+                      << ((header.length >= 8) ? http2_read_u32(payload + 4) : 0) << ")" << std::endl;
+            return false;
+
+        default:
+            break;
+        }
+        return true;
+    }
+
+    void do_read_some()
+    {
+        socket_.async_read_some(boost::asio::buffer(&recv_buffer_[recv_size_], recv_buffer_.size() - recv_size_),
+            [this](const boost::system::error_code & ec, std::size_t recieved_bytes)
+            {
+                if (!ec) {
+                    recv_size_ += recieved_bytes;
+
+                    std::size_t offset = 0;
+                    while (recv_size_ - offset >= kHttp2FrameHeaderSize) {
+                        http2_frame_header header;
+                        http2_parse_frame_header(&recv_buffer_[offset], header);
+                        if (header.length > kHttp2DefaultFrameSize) {
+                            std::cout << "test_http2_client::do_read_some() - Error: frame too large ("
+                                      << header.length << " bytes)." << std::endl;
+                            stop();
+                            return;
+                        }
+                        if (recv_size_ - offset < kHttp2FrameHeaderSize + header.length)
+                            break;
+                        if (!handle_frame(header, &recv_buffer_[offset + kHttp2FrameHeaderSize])) {
+                            stop();
+                            return;
+                        }
+                        offset += kHttp2FrameHeaderSize + header.length;
+                    }
+                    // Keep the partial frame at the front, it's less than one frame.
+                    if (offset != 0) {
+                        recv_size_ -= offset;
+                        ::memmove(&recv_buffer_[0], &recv_buffer_[offset], recv_size_);
+                    }
+
+                    if (started_)
+                        open_streams();
+
+                    do_flush();
+                    do_read_some();
+                }
+                else {
+                    stats_->on_error();
+                    // Write error log
+                    std::cout << "test_http2_client::do_read_some() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    stop();
+                }
+            });
+    }
+
+    void do_flush()
+    {
+        if (write_pending_ || output_.empty())
+            return;
+
+        writing_.swap(output_);
+        output_.clear();
+        write_pending_ = true;
+        boost::asio::async_write(socket_, boost::asio::buffer(writing_.data(), writing_.size()),
+            [this](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec) {
+                    stats_->on_send(send_bytes);
+                    writing_.clear();
+                    write_pending_ = false;
+                    do_flush();
+                }
+                else {
+                    stats_->on_error();
+                    // Write error log
+                    std::cout << "test_http2_client::do_flush() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    stop();
+                }
+            });
+    }
+};
+
+} // namespace asio_test
@@ -1,13 +1,19 @@
 
 #pragma once
 
+#include <stdio.h>
 #include <iostream>
 #include <iomanip>      // For std::setw()
 #include <thread>
 #include <chrono>
+#include <string>
+#include <algorithm>
 #include <boost/asio.hpp>
 
 #include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "tsc_clock.hpp"
 
 using namespace boost::asio;
 using namespace std::chrono;
@@ -36,45 +42,76 @@ const std::string g_response_html =
         "Connection: Keep-Alive\r\n\r\n"
         "Hello World!";
 
+//
+// The whole POST request (header and body), a chunked body is sent in 16 KB chunks.
+//
+static inline
+std::string make_http_post_request(uint32_t body_size, bool chunked)
+{
+    static const uint32_t kBodyChunkSize = 16384;
+
+    std::string body;
+    body.resize(body_size);
+    for (uint32_t i = 0; i < body_size; ++i) {
+        body[i] = (char)('a' + (i % 26));
+    }
+
+    std::string request = "POST /upload HTTP/1.1\r\n"
+                          "Host: 127.0.0.1:8090\r\n"
+                          "Connection: keep-alive\r\n"
+                          "Content-Type: application/octet-stream\r\n";
+    if (chunked) {
+        request += "Transfer-Encoding: chunked\r\n\r\n";
+        for (uint32_t offset = 0; offset < body_size; offset += kBodyChunkSize) {
+            uint32_t chunk_size = std::min(kBodyChunkSize, body_size - offset);
+            char chunk_header[32];
+            snprintf(chunk_header, sizeof(chunk_header), "%x\r\n", chunk_size);
+            request += chunk_header;
+            request.append(body, offset, chunk_size);
+            request += "\r\n";
+        }
+        request += "0\r\n\r\n";
+    }
+    else {
+        request += "Content-Length: " + std::to_string(body_size) + "\r\n\r\n";
+        request += body;
+    }
+    return request;
+}
+
 class test_http_client
 {
 private:
     enum { PACKET_SIZE = MAX_PACKET_SIZE };
     enum { kSendRepeatTimes = 20 };
-    
+
     boost::asio::io_service & io_service_;
     ip::tcp::socket socket_;
     uint32_t mode_;
     uint32_t buffer_size_;
     uint32_t packet_size_;
+    client_stats_shard * stats_;
+    bool drained_;
     size_t html_header_size_;
     size_t html_response_size_;
 
-    uint64_t last_query_count_;
-    uint64_t total_query_count_;
-    double last_total_latency_;
-    double total_latency_;
+    uint64_t send_time_;
+    uint64_t recieve_time_;
 
-    duration<double> elapsed_time_;
-    time_point<high_resolution_clock> send_time_;
-    time_point<high_resolution_clock> recieve_time_;
-    time_point<high_resolution_clock> last_time_;
-
-    uint32_t send_bytes_;
-    uint32_t recieved_bytes_;
-
-    uint32_t sent_cnt_;
+    // POST mode: the whole request (header and body) is built once.
+    std::string post_request_;
 
     char recv_data_[PACKET_SIZE];
     char send_data_[PACKET_SIZE];
 
 public:
     test_http_client(boost::asio::io_service & io_service,
-        ip::tcp::resolver::iterator endpoint_iterator, uint32_t mode, uint32_t buffer_size, uint32_t packet_size)
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        uint32_t mode, uint32_t buffer_size, uint32_t packet_size, client_stats_shard * stats)
         : io_service_(io_service),
-          socket_(io_service), mode_(mode), buffer_size_(buffer_size), packet_size_(packet_size), html_header_size_(0),
-          last_query_count_(0), total_query_count_(0), last_total_latency_(0.0), total_latency_(0.0),
-          send_bytes_(0), recieved_bytes_(0), sent_cnt_(0)
+          socket_(io_service), mode_(mode), buffer_size_(buffer_size), packet_size_(packet_size), stats_(stats),
+          drained_(false), html_header_size_(0),
+          send_time_(0), recieve_time_(0)
     {
         html_header_size_ = g_request_html_header.size();
         html_response_size_ = g_response_html.size();
@@ -83,9 +120,10 @@ public:
         ::memset(send_data_, 0, sizeof(send_data_));
         ::memcpy((void *)&send_data_[0], (void *)g_request_html_header.c_str(), html_header_size_);
 
-        last_time_ = high_resolution_clock::now();
+        if (g_http_method == http_method_post)
+            post_request_ = make_http_post_request(g_body_size, (g_body_chunked != 0));
 
-        do_connect(endpoint_iterator);
+        do_connect(endpoint_iterator, connection_index);
     }
 
     ~test_http_client()
@@ -131,51 +169,34 @@ private:
         //std::cout << "set_socket_recv_buffer_size(): " << buffer_size << " bytes" << std::endl;
     }
 
+    void display_post_counters()
+    {
+        stats_->on_query(tsc_clock::elapsed_ns(send_time_, recieve_time_));
+    }
+
     void display_counters()
     {
-        elapsed_time_ = duration_cast< duration<double> >(recieve_time_ - send_time_);
-        last_query_count_++;
-        total_query_count_++;
-        last_total_latency_ += elapsed_time_.count();
-        total_latency_ += elapsed_time_.count();
-        time_point<high_resolution_clock> now_time = high_resolution_clock::now();
-        duration<double> interval_time = duration_cast< duration<double> >(now_time - last_time_);
-        double elapsed_time = interval_time.count();
-        double avg_latency, avg_total_latency;
-        if (elapsed_time >= 1.0) {
-            std::cout << "packet_size           = " << std::left << std::setw(8)
-                      << packet_size_ << " B,  latency total     = "
-                      << last_total_latency_ << " sec." <<  std::endl;
-            // average latency (one second interval)
-            if (last_query_count_ != 0)
-                avg_latency = (last_total_latency_ * 1000.0) / (double)last_query_count_;
-            else
-                avg_latency = 0.0;
-            std::cout << "average latency       = " << std::left << std::setw(8)
-                      << std::setiosflags(std::ios::fixed) << std::setprecision(6)
-                      << avg_latency << " ms, query count       = " << last_query_count_ << std::endl;
-
-            // average latency total
-            if (total_query_count_ != 0)
-                avg_total_latency = (total_latency_ * 1000.0) / (double)total_query_count_;
-            else
-                avg_total_latency = 0.0;
-            std::cout << "average latency total = " << std::left << std::setw(8)
-                      << std::setiosflags(std::ios::fixed) << std::setprecision(6)
-                      << avg_total_latency << " ms, query count total = " << total_query_count_ << std::endl;
-
-            std::cout << "send bytes: " << send_bytes_ << ", recieved bytes: " << recieved_bytes_
-                      << ", send pkgs: " << (send_bytes_ / packet_size_) << ", recieved pkgs: " << (recieved_bytes_ / packet_size_)
-                      << std::endl;
-            std::cout << std::endl;
-
-            // Reset the counters
-            last_time_ = high_resolution_clock::now();
-            last_query_count_ = 0;
-            last_total_latency_ = 0.0;
+        stats_->on_query(tsc_clock::elapsed_ns(send_time_, recieve_time_));
+    }
+
+    /// A failed connection has nothing in flight any more.
+    void set_drained()
+    {
+        if (!drained_) {
+            drained_ = true;
+            stats_->on_drained();
         }
     }
 
+    /// After the measurement window no new request is sent, returns true if draining.
+    bool drain_now()
+    {
+        if (!stats_->is_draining())
+            return false;
+        set_drained();
+        return true;
+    }
+
     void start()
     {
         set_socket_send_bufsize(MAX_PACKET_SIZE);
@@ -191,7 +212,10 @@ private:
         sLinger.l_linger = 5;   // After shutdown(), socket send/recv 5 second data yet.
         ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_LINGER, (const char *)&sLinger, sizeof(sLinger));
 
-        if (mode_ == test_method_throughput) {
+        if (g_http_method == http_method_post) {
+            do_post_write();
+        }
+        else if (mode_ == test_method_throughput) {
             //do_sync_write_only();
             do_async_write_only();
         }
@@ -216,15 +240,20 @@ private:
             delete this;
     }
 
-    void do_connect(ip::tcp::resolver::iterator endpoint_iterator)
+    void do_connect(ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index)
     {
-        boost::asio::async_connect(socket_, endpoint_iterator,
+        async_connect_bound(io_service_, socket_, endpoint_iterator, connection_index,
             [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
             {
+                stats_->on_connect(ec);
                 if (!ec)
                 {
                     start();
                 }
+                else {
+                    std::cout << "test_http_client::do_connect() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                }
             });
     }
 
@@ -241,18 +270,19 @@ private:
                 if (!ec)
                 {
                     // Have recieved the response message
-                    recieve_time_ = high_resolution_clock::now();
-                    if (recieved_bytes > 0)
-                        recieved_bytes_ += (uint32_t)recieved_bytes;
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
 
                     display_counters();
 
                     do_write();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_http_client::do_read() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
@@ -269,18 +299,19 @@ private:
                 if (!ec)
                 {
                     // Have recieved the response message
-                    recieve_time_ = high_resolution_clock::now();
-                    if (recieved_bytes > 0)
-                        recieved_bytes_ += (uint32_t)recieved_bytes;
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
 
                     display_counters();
 
                     do_write_some();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_http_client::do_read_some() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
@@ -300,18 +331,19 @@ private:
                 if (!ec)
                 {
                     // Have recieved the response message
-                    recieve_time_ = high_resolution_clock::now();
-                    if (recieved_bytes > 0)
-                        recieved_bytes_ += (uint32_t)recieved_bytes;
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
 
                     display_counters();
 
                     do_sync_write(kSendRepeatTimes);
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_http_client::do_sync_read_some() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
@@ -329,26 +361,30 @@ private:
                 if (!ec)
                 {
                     // Have recieved the response message
-                    recieve_time_ = high_resolution_clock::now();
-                    if (recieved_bytes > 0)
-                        recieved_bytes_ += (uint32_t)recieved_bytes;
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
 
                     display_counters();
 
                     do_sync_write_only();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_http_client::do_sync_read_only() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
 
     void do_write()
     {
+        if (drain_now())
+            return;
+
         // Prepare to send the request message
-        send_time_ = high_resolution_clock::now();
+        send_time_ = tsc_clock::now();
 
         boost::asio::async_write(socket_,
             boost::asio::buffer(send_data_, html_header_size_),
@@ -361,13 +397,15 @@ private:
 
                 if (!ec)
                 {
-                    send_bytes_ += (uint32_t)send_bytes;
+                    stats_->on_send(send_bytes);
                     do_read();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_http_client::do_write() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
@@ -375,7 +413,7 @@ private:
     void do_write_some()
     {
         // Prepare to send the request message
-        send_time_ = high_resolution_clock::now();
+        send_time_ = tsc_clock::now();
 
         boost::asio::async_write(socket_,
             boost::asio::buffer(send_data_, html_header_size_),
@@ -388,29 +426,89 @@ private:
 
                 if (!ec)
                 {
-                    send_bytes_ += (uint32_t)send_bytes;
+                    stats_->on_send(send_bytes);
                     do_read_some();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_http_client::do_write() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
+                }
+            });
+    }
+
+    void do_post_write()
+    {
+        if (drain_now())
+            return;
+
+        // Prepare to send the request message
+        send_time_ = tsc_clock::now();
+
+        boost::asio::async_write(socket_,
+            boost::asio::buffer(post_request_.c_str(), post_request_.size()),
+            [this](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec)
+                {
+                    stats_->on_send(send_bytes);
+                    do_post_read();
+                }
+                else {
+                    stats_->on_error();
+                    // Write error log
+                    std::cout << "test_http_client::do_post_write() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    set_drained();
+                }
+            });
+    }
+
+    void do_post_read()
+    {
+        // The server responds one g_response_html for every POST.
+        boost::asio::async_read(socket_,
+            boost::asio::buffer(recv_data_, html_response_size_),
+            [this](const boost::system::error_code & ec, std::size_t recieved_bytes)
+            {
+                if (!ec)
+                {
+                    // Have recieved the response message
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
+
+                    display_post_counters();
+
+                    do_post_write();
+                }
+                else {
+                    stats_->on_error();
+                    // Write error log
+                    std::cout << "test_http_client::do_post_read() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
 
     void do_sync_write(int repeat)
     {
+        if (drain_now())
+            return;
+
         // Prepare to send the request message
-        send_time_ = high_resolution_clock::now();
+        send_time_ = tsc_clock::now();
 
         for (int i = 0; i < repeat; ++i) {
             boost::system::error_code ec;
             std::size_t send_bytes = socket_.send(boost::asio::buffer(send_data_, html_header_size_), 0, ec);
             if (!ec) {
-                send_bytes_ += (uint32_t)send_bytes;
+                stats_->on_send(send_bytes);
             }
             else {
+                stats_->on_error();
                 std::cout << "test_http_client::do_sync_write() - Error: (code = " << ec.value() << ") "
                           << ec.message().c_str() << std::endl;
             }
@@ -421,44 +519,44 @@ private:
 
     void do_async_write_only()
     {
-        // Prepare to send the request message
-        last_time_ = high_resolution_clock::now();
-
-        sent_cnt_ = 0;
-        send_bytes_ = 0;
-
         do_sync_write_only();
     }
 
     void do_sync_write_only()
     {
+        if (drain_now())
+            return;
+
 #if 0
         // Prepare to send the request message
         time_point<high_resolution_clock> last_time = high_resolution_clock::now();
 
         static unsigned int sent_cnt = 0;
+        uint64_t interval_bytes = 0;
         for (;;) {
             boost::system::error_code ec;
             std::size_t send_bytes = socket_.send(boost::asio::buffer(send_data_, html_header_size_), 0, ec);
             if (!ec) {
                 if (send_bytes > 0) {
                     sent_cnt++;
-                    send_bytes_ += (uint32_t)send_bytes;
+                    interval_bytes += send_bytes;
+                    stats_->on_send(send_bytes);
                     if ((sent_cnt & 0x7FFF) == 0x7FFF) {
                         time_point<high_resolution_clock> now_time = high_resolution_clock::now();
                         duration<double> interval_time = duration_cast< duration<double> >(now_time - last_time);
                         double elapsed_time = interval_time.count();
-                        std::cout << "sent_cnt = " << sent_cnt_ << ", send_bytes = " << send_bytes_ << ", BandWidth = "
+                        std::cout << "sent_cnt = " << sent_cnt << ", send_bytes = " << interval_bytes << ", BandWidth = "
                                   << std::left << std::setw(5)
                                   << std::setiosflags(std::ios::fixed) << std::setprecision(3)
-                                  << (send_bytes_ / (1000.0 * 1000.0) / (double)elapsed_time) << " MB/s"
+                                  << (interval_bytes / (1000.0 * 1000.0) / (double)elapsed_time) << " MB/s"
                                   << std::endl;
                         last_time = high_resolution_clock::now();
-                        send_bytes_ = 0;
+                        interval_bytes = 0;
                     }
                 }
             }
             else {
+                stats_->on_error();
                 std::cout << "test_http_client::do_sync_write_only() - Error: (code = " << ec.value() << ") "
                           << ec.message().c_str() << std::endl;
             }
@@ -468,29 +566,16 @@ private:
             [this](const boost::system::error_code & ec, std::size_t send_bytes)
             {
                 if (!ec) {
-                    if (send_bytes > 0) {
-                        sent_cnt_++;
-                        send_bytes_ += (uint32_t)send_bytes;
-                        time_point<high_resolution_clock> now_time = high_resolution_clock::now();
-                        duration<double> interval_time = duration_cast< duration<double> >(now_time - last_time_);
-                        double elapsed_time = interval_time.count();
-                        if (elapsed_time > 1.0 ) {                           
-                            std::cout << "sent_cnt = " << sent_cnt_ << ", send_bytes = " << send_bytes_ << ", BandWidth = "
-                                      << std::left << std::setw(5)
-                                      << std::setiosflags(std::ios::fixed) << std::setprecision(3)
-                                      << (send_bytes_ / (1000.0 * 1000.0) / (double)elapsed_time) << " MB/s"
-                                      << std::endl;
-                            last_time_ = high_resolution_clock::now();
-                            sent_cnt_ = 0;
-                            send_bytes_ = 0;
-                        }
-                    }
+                    if (send_bytes > 0)
+                        stats_->on_send(send_bytes);
 
                     do_sync_write_only();
                 }
                 else {
+                    stats_->on_error();
                     std::cout << "test_http_client::do_sync_write_only() - Error: (code = " << ec.value() << ") "
                                 << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
         });
 #endif
@@ -0,0 +1,497 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+
+#include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "tsc_clock.hpp"
+#include "test_http_client.hpp"
+
+using namespace boost::asio;
+using namespace std::chrono;
+
+namespace asio_test {
+
+//
+// An incremental HTTP/1.1 response parser: the status line and the headers are
+// parsed once they are complete, the body is only counted (Content-Length or
+// chunked), so it's never copied. A response without a length is only allowed
+// for 1xx, 204 and 304.
+//
+class http_response_parser
+{
+public:
+    enum parse_result_t {
+        parse_need_more,
+        parse_complete,
+        parse_error
+    };
+
+private:
+    enum parse_state_t {
+        state_header,
+        state_body,
+        state_chunk_size,
+        state_chunk_data,
+        state_trailer
+    };
+
+    uint32_t state_;
+    uint32_t status_code_;
+    uint64_t body_remain_;
+    bool     keep_alive_;
+    std::string error_;
+
+    static bool equals_nocase(const char * first, const char * last, const char * name)
+    {
+        std::size_t size = strlen(name);
+        if ((std::size_t)(last - first) != size)
+            return false;
+        for (std::size_t i = 0; i < size; ++i) {
+            char ch = first[i];
+            if (ch >= 'A' && ch <= 'Z')
+                ch = ch - 'A' + 'a';
+            if (ch != name[i])
+                return false;
+        }
+        return true;
+    }
+
+    static const char * find_crlf(const char * first, const char * last)
+    {
+        for (const char * p = first; p + 1 < last; ++p) {
+            p = (const char *)::memchr(p, '\r', last - p - 1);
+            if (p == nullptr)
+                return nullptr;
+            if (p[1] == '\n')
+                return p;
+        }
+        return nullptr;
+    }
+
+    static const char * find_header_end(const char * first, const char * last)
+    {
+        const char * p = first;
+        while ((p = find_crlf(p, last)) != nullptr) {
+            if (p + 3 < last && p[2] == '\r' && p[3] == '\n')
+                return p;
+            p += 2;
+        }
+        return nullptr;
+    }
+
+    static const char * skip_spaces(const char * first, const char * last)
+    {
+        while (first < last && (*first == ' ' || *first == '\t'))
+            ++first;
+        return first;
+    }
+
+    bool parse_header(const char * first, const char * last)
+    {
+        // "HTTP/1.x 200 OK"
+        const char * line_end = find_crlf(first, last + 2);
+        if ((line_end - first) < 12 || ::memcmp(first, "HTTP/1.", 7) != 0 || first[8] != ' ') {
+            error_ = "bad status line";
+            return false;
+        }
+        status_code_ = 0;
+        for (const char * p = first + 9; p < first + 12; ++p) {
+            if (*p < '0' || *p > '9') {
+                error_ = "bad status code";
+                return false;
+            }
+            status_code_ = status_code_ * 10 + (*p - '0');
+        }
+        keep_alive_ = (first[7] != '0');
+
+        bool has_length = false, chunked = false;
+        body_remain_ = 0;
+        const char * line = line_end + 2;
+        while (line < last) {
+            line_end = find_crlf(line, last + 2);
+            const char * colon = (const char *)::memchr(line, ':', line_end - line);
+            if (colon != nullptr) {
+                const char * value = skip_spaces(colon + 1, line_end);
+                const char * value_end = line_end;
+                while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                    --value_end;
+                if (equals_nocase(line, colon, "content-length")) {
+                    char * end = nullptr;
+                    body_remain_ = ::strtoull(value, &end, 10);
+                    if (end != value_end) {
+                        error_ = "bad Content-Length";
+                        return false;
+                    }
+                    has_length = true;
+                }
+                else if (equals_nocase(line, colon, "transfer-encoding")) {
+                    chunked = equals_nocase(value, value_end, "chunked");
+                }
+                else if (equals_nocase(line, colon, "connection")) {
+                    if (equals_nocase(value, value_end, "close"))
+                        keep_alive_ = false;
+                    else if (equals_nocase(value, value_end, "keep-alive"))
+                        keep_alive_ = true;
+                }
+            }
+            line = line_end + 2;
+        }
+
+        if (chunked) {
+            state_ = state_chunk_size;
+        }
+        else if (has_length) {
+            state_ = state_body;
+        }
+        else if (status_code_ < 200 || status_code_ == 204 || status_code_ == 304) {
+            state_ = state_body;
+            body_remain_ = 0;
+        }
+        else {
+            error_ = "no Content-Length";
+            return false;
+        }
+        return true;
+    }
+
+public:
+    http_response_parser()
+        : state_(state_header), status_code_(0), body_remain_(0), keep_alive_(true)
+    {
+    }
+
+    ~http_response_parser() {}
+
+    uint32_t status_code() const { return status_code_; }
+    bool keep_alive() const { return keep_alive_; }
+    const std::string & error() const { return error_; }
+
+    /// Parse from [first, last), consumed is the bytes used (the rest is kept by the caller).
+    parse_result_t parse(const char * first, const char * last, std::size_t & consumed)
+    {
+        const char * p = first;
+        while (p < last || state_ == state_body) {
+            if (state_ == state_header) {
+                const char * header_end = find_header_end(p, last);
+                if (header_end == nullptr)
+                    break;
+                if (!parse_header(p, header_end))
+                    return parse_error;
+                p = header_end + 4;
+            }
+            else if (state_ == state_body) {
+                std::size_t size = (std::size_t)std::min<uint64_t>(body_remain_, (uint64_t)(last - p));
+                p += size;
+                body_remain_ -= size;
+                if (body_remain_ != 0)
+                    break;
+                state_ = state_header;
+                consumed = p - first;
+                // An interim response (100 Continue) is not the response of the request.
+                if (status_code_ >= 200)
+                    return parse_complete;
+            }
+            else if (state_ == state_chunk_size || state_ == state_trailer) {
+                const char * line_end = find_crlf(p, last);
+                if (line_end == nullptr)
+                    break;
+                if (state_ == state_trailer) {
+                    // The empty line ends the trailers.
+                    bool is_end = (line_end == p);
+                    p = line_end + 2;
+                    if (is_end) {
+                        state_ = state_header;
+                        consumed = p - first;
+                        return parse_complete;
+                    }
+                    continue;
+                }
+                char * end = nullptr;
+                uint64_t chunk_size = ::strtoull(p, &end, 16);
+                if (end == p || (end != line_end && *end != ';' && *end != ' ')) {
+                    error_ = "bad chunk size";
+                    return parse_error;
+                }
+                p = line_end + 2;
+                if (chunk_size == 0) {
+                    state_ = state_trailer;
+                }
+                else {
+                    // The data and its CRLF.
+                    body_remain_ = chunk_size + 2;
+                    state_ = state_chunk_data;
+                }
+            }
+            else {
+                std::size_t size = (std::size_t)std::min<uint64_t>(body_remain_, (uint64_t)(last - p));
+                p += size;
+                body_remain_ -= size;
+                if (body_remain_ != 0)
+                    break;
+                state_ = state_chunk_size;
+            }
+        }
+        consumed = p - first;
+        return parse_need_more;
+    }
+};
+
+//
+// A wrk-like http load connection: keeps pipeline_ requests in flight on one
+// keep-alive connection, parses every response (status line, Content-Length or
+// chunked body), so a query is a complete response, and counts the responses by
+// status class. The latency of a response is from the write of its request.
+// After a "Connection: close" response it connects again, like wrk, the connects
+// counter is the slots which ever connected, so the drain works.
+//
+class test_http_load_client
+{
+private:
+    // The most bytes of the headers of one response.
+    enum { kRecvBufferSize = 64 * 1024 };
+
+    boost::asio::io_service & io_service_;
+    ip::tcp::socket socket_;
+    ip::tcp::resolver::iterator endpoint_iterator_;
+    // The index of the connection, a reconnect binds the same local address.
+    uint32_t connection_index_;
+    uint32_t pipeline_;
+    client_stats_shard * stats_;
+
+    std::size_t request_size_;
+    std::string send_buffer_;
+
+    uint32_t unsent_count_;
+    bool     write_pending_;
+    bool     drained_;
+    bool     connected_once_;
+    // The last response said "Connection: close", the server closes this socket.
+    bool     server_closing_;
+    // The socket generation, the handlers of a closed socket are ignored.
+    uint32_t generation_;
+    std::deque<uint64_t> send_times_;
+
+    http_response_parser parser_;
+    std::vector<char> recv_buffer_;
+    std::size_t recv_size_;
+
+public:
+    test_http_load_client(boost::asio::io_service & io_service,
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        const std::string & request, uint32_t pipeline, client_stats_shard * stats)
+        : io_service_(io_service),
+          socket_(io_service), endpoint_iterator_(endpoint_iterator), connection_index_(connection_index),
+          pipeline_(pipeline), stats_(stats),
+          request_size_(request.size()), unsent_count_(0), write_pending_(false), drained_(false),
+          connected_once_(false), server_closing_(false), generation_(0),
+          recv_buffer_(kRecvBufferSize), recv_size_(0)
+    {
+        if (pipeline_ == 0)
+            pipeline_ = 1;
+        unsent_count_ = pipeline_;
+        send_buffer_.reserve(request_size_ * pipeline_);
+        for (uint32_t i = 0; i < pipeline_; ++i)
+            send_buffer_ += request;
+        do_connect();
+    }
+
+    ~test_http_load_client()
+    {
+    }
+
+private:
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        if (socket_.is_open())
+            socket_.close(ignored_ec);
+        // A stopped connection has nothing in flight any more.
+        if (!drained_) {
+            drained_ = true;
+            stats_->on_drained();
+        }
+    }
+
+    void do_connect()
+    {
+        async_connect_bound(io_service_, socket_, endpoint_iterator_, connection_index_,
+            [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
+            {
+                if (ec || !connected_once_)
+                    stats_->on_connect(ec);
+                if (!ec)
+                {
+                    connected_once_ = true;
+                    boost::system::error_code ignored_ec;
+                    socket_.set_option(ip::tcp::no_delay(true), ignored_ec);
+                    do_write();
+                    do_read();
+                }
+                else {
+                    std::cout << "test_http_load_client::do_connect() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    if (connected_once_)
+                        stop();
+                }
+            });
+    }
+
+    /// The server has closed the connection as announced, connect again,
+    /// the requests which were in flight on the old connection are lost.
+    void do_reconnect()
+    {
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);
+        generation_++;
+        server_closing_ = false;
+        write_pending_ = false;
+        send_times_.clear();
+        unsent_count_ = pipeline_;
+        recv_size_ = 0;
+        parser_ = http_response_parser();
+        do_connect();
+    }
+
+    /// Parse all the complete responses in the buffer, returns false on a bad response.
+    bool on_recieved()
+    {
+        uint64_t recieve_time = tsc_clock::now();
+        const char * first = recv_buffer_.data();
+        const char * last = first + recv_size_;
+        while (first < last) {
+            std::size_t consumed = 0;
+            http_response_parser::parse_result_t result = parser_.parse(first, last, consumed);
+            first += consumed;
+            if (result == http_response_parser::parse_need_more)
+                break;
+            if (result == http_response_parser::parse_error) {
+                std::cout << "test_http_load_client::on_recieved() - Error: " << parser_.error().c_str() << std::endl;
+                return false;
+            }
+            if (send_times_.empty()) {
+                std::cout << "test_http_load_client::on_recieved() - Error: a response without request." << std::endl;
+                return false;
+            }
+            stats_->on_query(tsc_clock::elapsed_ns(send_times_.front(), recieve_time));
+            stats_->on_status(parser_.status_code());
+            send_times_.pop_front();
+            unsent_count_++;
+            if (!parser_.keep_alive()) {
+                // The server closes the connection, wait for it and connect again.
+                server_closing_ = true;
+                unsent_count_ = 0;
+                break;
+            }
+        }
+
+        // Keep the unparsed bytes (a part of the headers) at the front.
+        recv_size_ = last - first;
+        if (recv_size_ != 0 && first != recv_buffer_.data())
+            ::memmove(recv_buffer_.data(), first, recv_size_);
+        if (recv_size_ >= recv_buffer_.size()) {
+            std::cout << "test_http_load_client::on_recieved() - Error: the response headers are too large." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void do_read()
+    {
+        uint32_t generation = generation_;
+        socket_.async_read_some(boost::asio::buffer(recv_buffer_.data() + recv_size_, recv_buffer_.size() - recv_size_),
+            [this, generation](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (generation != generation_)
+                    return;
+                if (!ec)
+                {
+                    stats_->on_recv(bytes_transferred);
+                    recv_size_ += bytes_transferred;
+                    if (!on_recieved()) {
+                        stats_->on_error();
+                        stop();
+                        return;
+                    }
+                    do_write();
+                    do_read();
+                }
+                else if (server_closing_) {
+                    // The close announced by the last response.
+                    if (stats_->is_draining())
+                        stop();
+                    else
+                        do_reconnect();
+                }
+                else {
+                    // A close between two responses is not an error of the server.
+                    if (!send_times_.empty() || (ec != boost::asio::error::eof)) {
+                        stats_->on_error();
+                        std::cout << "test_http_load_client::do_read() - Error: (code = " << ec.value() << ") "
+                                  << ec.message().c_str() << std::endl;
+                    }
+                    stop();
+                }
+            });
+    }
+
+    void do_write()
+    {
+        // After the measurement window, wait for the responses in flight.
+        if (stats_->is_draining()) {
+            unsent_count_ = 0;
+            if (!write_pending_ && send_times_.empty() && !drained_) {
+                drained_ = true;
+                stats_->on_drained();
+            }
+            return;
+        }
+        if (write_pending_ || unsent_count_ == 0)
+            return;
+
+        uint64_t send_time = tsc_clock::now();
+        uint32_t send_count = unsent_count_;
+        for (uint32_t i = 0; i < send_count; ++i)
+            send_times_.push_back(send_time);
+
+        unsent_count_ = 0;
+        write_pending_ = true;
+        uint32_t generation = generation_;
+        boost::asio::async_write(socket_,
+            boost::asio::buffer(send_buffer_.data(), request_size_ * send_count),
+            [this, generation](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (generation != generation_)
+                    return;
+                if (!ec)
+                {
+                    stats_->on_send(bytes_transferred);
+                    write_pending_ = false;
+                    do_write();
+                }
+                else if (server_closing_) {
+                    // The read side connects again.
+                    write_pending_ = false;
+                }
+                else {
+                    stats_->on_error();
+                    stop();
+                    std::cout << "test_http_load_client::do_write() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                }
+            });
+    }
+};
+
+} // namespace asio_test
@@ -8,6 +8,9 @@
 #include <boost/asio.hpp>
 
 #include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "tsc_clock.hpp"
 
 using namespace boost::asio;
 using namespace std::chrono;
@@ -25,38 +28,28 @@ private:
     uint32_t mode_;
     uint32_t buffer_size_;
     uint32_t packet_size_;
+    client_stats_shard * stats_;
+    bool drained_;
 
-    uint64_t last_query_count_;
-    uint64_t total_query_count_;
-    double last_total_latency_;
-    double total_latency_;
-
-    duration<double> elapsed_time_;
-    time_point<high_resolution_clock> send_time_;
-    time_point<high_resolution_clock> recieve_time_;
-    time_point<high_resolution_clock> last_time_;
-
-    uint32_t send_bytes_;
-    uint32_t recieved_bytes_;
-
-    uint32_t sent_cnt_;
+    uint64_t send_time_;
+    uint64_t recieve_time_;
 
     char recv_data_[PACKET_SIZE];
     char send_data_[PACKET_SIZE];
 
 public:
     test_qps_client(boost::asio::io_service & io_service,
-        ip::tcp::resolver::iterator endpoint_iterator, uint32_t mode, uint32_t buffer_size, uint32_t packet_size)
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        uint32_t mode, uint32_t buffer_size, uint32_t packet_size, client_stats_shard * stats)
         : io_service_(io_service),
-          socket_(io_service), mode_(mode), buffer_size_(buffer_size), packet_size_(packet_size),
-          last_query_count_(0), total_query_count_(0), last_total_latency_(0.0), total_latency_(0.0),
-          send_bytes_(0), recieved_bytes_(0), sent_cnt_(0)
+          socket_(io_service), mode_(mode), buffer_size_(buffer_size), packet_size_(packet_size), stats_(stats),
+          drained_(false),
+          send_time_(0), recieve_time_(0)
     {
         ::memset(recv_data_, 'h', sizeof(recv_data_) - 1);
         ::memset(send_data_, 'k', sizeof(send_data_) - 1);
-        last_time_ = high_resolution_clock::now();
 
-        do_connect(endpoint_iterator);
+        do_connect(endpoint_iterator, connection_index);
     }
 
     ~test_qps_client()
@@ -104,49 +97,27 @@ private:
 
     void display_counters()
     {
-        elapsed_time_ = duration_cast< duration<double> >(recieve_time_ - send_time_);
-        last_query_count_++;
-        total_query_count_++;
-        last_total_latency_ += elapsed_time_.count();
-        total_latency_ += elapsed_time_.count();
-        time_point<high_resolution_clock> now_time = high_resolution_clock::now();
-        duration<double> interval_time = duration_cast< duration<double> >(now_time - last_time_);
-        double elapsed_time = interval_time.count();
-        double avg_latency, avg_total_latency;
-        if (elapsed_time >= 1.0) {
-            std::cout << "packet_size           = " << std::left << std::setw(8)
-                      << packet_size_ << " B,  latency total     = "
-                      << last_total_latency_ << " sec." <<  std::endl;
-            // average latency (one second interval)
-            if (last_query_count_ != 0)
-                avg_latency = (last_total_latency_ * 1000.0) / (double)last_query_count_;
-            else
-                avg_latency = 0.0;
-            std::cout << "average latency       = " << std::left << std::setw(8)
-                      << std::setiosflags(std::ios::fixed) << std::setprecision(6)
-                      << avg_latency << " ms, query count       = " << last_query_count_ << std::endl;
-
-            // average latency total
-            if (total_query_count_ != 0)
-                avg_total_latency = (total_latency_ * 1000.0) / (double)total_query_count_;
-            else
-                avg_total_latency = 0.0;
-            std::cout << "average latency total = " << std::left << std::setw(8)
-                      << std::setiosflags(std::ios::fixed) << std::setprecision(6)
-                      << avg_total_latency << " ms, query count total = " << total_query_count_ << std::endl;
-
-            std::cout << "send bytes: " << send_bytes_ << ", recieved bytes: " << recieved_bytes_
-                      << ", send pkgs: " << (send_bytes_ / packet_size_) << ", recieved pkgs: " << (recieved_bytes_ / packet_size_)
-                      << std::endl;
-            std::cout << std::endl;
-
-            // Reset the counters
-            last_time_ = high_resolution_clock::now();
-            last_query_count_ = 0;
-            last_total_latency_ = 0.0;
+        stats_->on_query(tsc_clock::elapsed_ns(send_time_, recieve_time_));
+    }
+
+    /// A failed connection has nothing in flight any more.
+    void set_drained()
+    {
+        if (!drained_) {
+            drained_ = true;
+            stats_->on_drained();
         }
     }
 
+    /// After the measurement window no new request is sent, returns true if draining.
+    bool drain_now()
+    {
+        if (!stats_->is_draining())
+            return false;
+        set_drained();
+        return true;
+    }
+
     void start()
     {
         set_socket_send_bufsize(MAX_PACKET_SIZE);
@@ -186,15 +157,20 @@ private:
             delete this;
     }
 
-    void do_connect(ip::tcp::resolver::iterator endpoint_iterator)
+    void do_connect(ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index)
     {
-        boost::asio::async_connect(socket_, endpoint_iterator,
+        async_connect_bound(io_service_, socket_, endpoint_iterator, connection_index,
             [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
             {
+                stats_->on_connect(ec);
                 if (!ec)
                 {
                     start();
                 }
+                else {
+                    std::cout << "test_qps_client::do_connect() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                }
             });
     }
 
@@ -211,18 +187,19 @@ private:
                 if (!ec)
                 {
                     // Have recieved the response message
-                    recieve_time_ = high_resolution_clock::now();
-                    if (recieved_bytes > 0)
-                        recieved_bytes_ += (uint32_t)recieved_bytes;
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
 
                     display_counters();
 
                     do_write();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_qps_client::do_read() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
@@ -240,18 +217,19 @@ private:
                 if (!ec)
                 {
                     // Have recieved the response message
-                    recieve_time_ = high_resolution_clock::now();
-                    if (recieved_bytes > 0)
-                        recieved_bytes_ += (uint32_t)recieved_bytes;
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
 
                     display_counters();
 
                     do_write();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_qps_client::do_read() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
@@ -269,26 +247,30 @@ private:
                 if (!ec)
                 {
                     // Have recieved the response message
-                    recieve_time_ = high_resolution_clock::now();
-                    if (recieved_bytes > 0)
-                        recieved_bytes_ += (uint32_t)recieved_bytes;
+                    recieve_time_ = tsc_clock::now();
+                    stats_->on_recv(recieved_bytes);
 
                     display_counters();
 
                     do_sync_write(kSendRepeatTimes);
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_qps_client::do_read() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
 
     void do_write()
     {
+        if (drain_now())
+            return;
+
         // Prepare to send the request message
-        send_time_ = high_resolution_clock::now();
+        send_time_ = tsc_clock::now();
 
         boost::asio::async_write(socket_,
             boost::asio::buffer(send_data_, packet_size_),
@@ -300,29 +282,35 @@ private:
                 }
                 if (!ec)
                 {
-                    send_bytes_ += (uint32_t)send_bytes;
+                    stats_->on_send(send_bytes);
                     do_read();
                 }
                 else {
+                    stats_->on_error();
                     // Write error log
                     std::cout << "test_qps_client::do_write() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
             });
     }
 
     void do_sync_write(int repeat)
     {
+        if (drain_now())
+            return;
+
         // Prepare to send the request message
-        send_time_ = high_resolution_clock::now();
+        send_time_ = tsc_clock::now();
 
         for (int i = 0; i < repeat; ++i) {
             boost::system::error_code ec;
             std::size_t send_bytes = socket_.send(boost::asio::buffer(send_data_, packet_size_), 0, ec);
             if (!ec) {
-                send_bytes_ += (uint32_t)send_bytes;
+                stats_->on_send(send_bytes);
             }
             else {
+                stats_->on_error();
                 std::cout << "test_qps_client::do_sync_write() - Error: (code = " << ec.value() << ") "
                           << ec.message().c_str() << std::endl;
             }
@@ -333,44 +321,44 @@ private:
 
     void do_async_write_only()
     {
-        // Prepare to send the request message
-        last_time_ = high_resolution_clock::now();
-
-        sent_cnt_ = 0;
-        send_bytes_ = 0;
-
         do_sync_write_only();
     }
 
     void do_sync_write_only()
     {
+        if (drain_now())
+            return;
+
 #if 0
         // Prepare to send the request message
         time_point<high_resolution_clock> last_time = high_resolution_clock::now();
 
         static unsigned int sent_cnt = 0;
+        uint64_t interval_bytes = 0;
         for (;;) {
             boost::system::error_code ec;
             std::size_t send_bytes = socket_.send(boost::asio::buffer(send_data_, packet_size_), 0, ec);
             if (!ec) {
                 if (send_bytes > 0) {
                     sent_cnt++;
-                    send_bytes_ += (uint32_t)send_bytes;
+                    interval_bytes += send_bytes;
+                    stats_->on_send(send_bytes);
                     if ((sent_cnt & 0x7FFF) == 0x7FFF) {
                         time_point<high_resolution_clock> now_time = high_resolution_clock::now();
                         duration<double> interval_time = duration_cast< duration<double> >(now_time - last_time);
                         double elapsed_time = interval_time.count();
-                        std::cout << "sent_cnt = " << sent_cnt_ << ", send_bytes = " << send_bytes_ << ", BandWidth = "
+                        std::cout << "sent_cnt = " << sent_cnt << ", send_bytes = " << interval_bytes << ", BandWidth = "
                                   << std::left << std::setw(5)
                                   << std::setiosflags(std::ios::fixed) << std::setprecision(3)
-                                  << (send_bytes_ / (1000.0 * 1000.0) / (double)elapsed_time) << " MB/s"
+                                  << (interval_bytes / (1000.0 * 1000.0) / (double)elapsed_time) << " MB/s"
                                   << std::endl;
                         last_time = high_resolution_clock::now();
-                        send_bytes_ = 0;
+                        interval_bytes = 0;
                     }
                 }
             }
             else {
+                stats_->on_error();
                 std::cout << "test_qps_client::do_sync_write_only() - Error: (code = " << ec.value() << ") "
                           << ec.message().c_str() << std::endl;
             }
@@ -380,29 +368,16 @@ private:
             [this](const boost::system::error_code & ec, std::size_t send_bytes)
             {
                 if (!ec) {
-                    if (send_bytes > 0) {
-                        sent_cnt_++;
-                        send_bytes_ += (uint32_t)send_bytes;
-                        time_point<high_resolution_clock> now_time = high_resolution_clock::now();
-                        duration<double> interval_time = duration_cast< duration<double> >(now_time - last_time_);
-                        double elapsed_time = interval_time.count();
-                        if (elapsed_time > 1.0 ) {                           
-                            std::cout << "sent_cnt = " << sent_cnt_ << ", send_bytes = " << send_bytes_ << ", BandWidth = "
-                                      << std::left << std::setw(5)
-                                      << std::setiosflags(std::ios::fixed) << std::setprecision(3)
-                                      << (send_bytes_ / (1000.0 * 1000.0) / (double)elapsed_time) << " MB/s"
-                                      << std::endl;
-                            last_time_ = high_resolution_clock::now();
-                            sent_cnt_ = 0;
-                            send_bytes_ = 0;
-                        }
-                    }
+                    if (send_bytes > 0)
+                        stats_->on_send(send_bytes);
 
                     do_sync_write_only();
                 }
                 else {
+                    stats_->on_error();
                     std::cout << "test_qps_client::do_sync_write_only() - Error: (code = " << ec.value() << ") "
                                 << ec.message().c_str() << std::endl;
+                    set_drained();
                 }
         });
 #endif
@@ -0,0 +1,254 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <iostream>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+
+#include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "send_schedule.hpp"
+#include "tsc_clock.hpp"
+#include "workload_scenario.hpp"
+
+using namespace boost::asio;
+using namespace std::chrono;
+
+namespace asio_test {
+
+//
+// An echo connection of a scenario group (--scenario): the packet sizes come
+// from the sample table of the group, the packets are sent closed-loop (pipeline,
+// with an optional think time after every echo) or open-loop (the rate of the
+// group). The echoes come back in order, so the oldest packet in flight is the
+// one being completed, its size says where the next one begins.
+//
+class test_scenario_client
+{
+private:
+    enum { kRecvBufferSize = MAX_PACKET_SIZE };
+    // The most packets of one write in the open-loop mode.
+    enum { kOpenLoopBatch = 64 };
+
+    boost::asio::io_service & io_service_;
+    ip::tcp::socket socket_;
+    const scenario_group & group_;
+    uint32_t sample_index_;
+    uint32_t batch_size_;
+    client_stats_shard * stats_;
+
+    uint32_t unsent_count_;
+    uint32_t recv_offset_;
+    bool     write_pending_;
+    bool     timer_pending_;
+    bool     drained_;
+    std::deque<uint64_t> send_times_;
+    std::deque<uint32_t> send_sizes_;
+    // The end of the think time of the packets to send again (closed-loop).
+    std::deque<time_point<steady_clock>> think_until_;
+
+    send_schedule schedule_;
+    boost::asio::steady_timer timer_;
+
+    std::vector<char> send_buffer_;
+    std::vector<char> recv_buffer_;
+
+public:
+    /// index is the index of the connection in its group.
+    test_scenario_client(boost::asio::io_service & io_service,
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        const scenario_group & group, uint32_t index, client_stats_shard * stats)
+        : io_service_(io_service),
+          socket_(io_service), group_(group), sample_index_(0), batch_size_(0), stats_(stats),
+          unsent_count_(0), recv_offset_(0), write_pending_(false), timer_pending_(false), drained_(false),
+          schedule_(group.open_loop ? send_schedule(group.rate, group.connections, index) : send_schedule()),
+          timer_(io_service), recv_buffer_(kRecvBufferSize)
+    {
+        // The connections of a group walk the table from different offsets.
+        sample_index_ = (uint32_t)(((uint64_t)index * 7919) % scenario_group::kSampleCount);
+        if (!schedule_.is_open_loop())
+            unsent_count_ = group_.pipeline;
+        batch_size_ = schedule_.is_open_loop() ? std::max(group_.pipeline, (uint32_t)kOpenLoopBatch) : group_.pipeline;
+        send_buffer_.resize((std::size_t)group_.packet_size.max_size() * batch_size_, 'h');
+        do_connect(endpoint_iterator, connection_index);
+    }
+
+    ~test_scenario_client()
+    {
+    }
+
+private:
+    void stop()
+    {
+        boost::system::error_code ignored_ec;
+        timer_.cancel(ignored_ec);
+        if (socket_.is_open())
+            socket_.close(ignored_ec);
+        // A stopped connection has nothing in flight any more.
+        if (!drained_) {
+            drained_ = true;
+            stats_->on_drained();
+        }
+    }
+
+    uint32_t next_packet_size()
+    {
+        uint32_t size = group_.size_samples[sample_index_];
+        sample_index_ = (sample_index_ + 1) % scenario_group::kSampleCount;
+        return size;
+    }
+
+    void do_connect(ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index)
+    {
+        async_connect_bound(io_service_, socket_, endpoint_iterator, connection_index,
+            [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
+            {
+                stats_->on_connect(ec);
+                if (!ec)
+                {
+                    boost::system::error_code ignored_ec;
+                    socket_.set_option(ip::tcp::no_delay(true), ignored_ec);
+                    if (schedule_.is_open_loop()) {
+                        schedule_.start(steady_clock::now());
+                        do_wait_send_time();
+                    }
+                    do_write();
+                    do_read();
+                }
+                else {
+                    std::cout << "test_scenario_client::do_connect() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                }
+            });
+    }
+
+    void on_recieved(std::size_t bytes_transferred)
+    {
+        uint64_t recieve_time = tsc_clock::now();
+        recv_offset_ += (uint32_t)bytes_transferred;
+        while (!send_sizes_.empty() && recv_offset_ >= send_sizes_.front()) {
+            recv_offset_ -= send_sizes_.front();
+            send_sizes_.pop_front();
+            stats_->on_query(tsc_clock::elapsed_ns(send_times_.front(), recieve_time));
+            send_times_.pop_front();
+            if (!schedule_.is_open_loop()) {
+                if (group_.think_time_us == 0)
+                    unsent_count_++;
+                else
+                    think_until_.push_back(steady_clock::now() + microseconds(group_.think_time_us));
+            }
+        }
+        if (!think_until_.empty() && !timer_pending_)
+            do_wait_think_time();
+    }
+
+    void do_wait_send_time()
+    {
+        timer_.expires_at(schedule_.next_send_time());
+        timer_.async_wait([this](const boost::system::error_code & ec)
+            {
+                if (!ec && socket_.is_open()) {
+                    if (stats_->is_draining()) {
+                        do_write();
+                        return;
+                    }
+                    unsent_count_ += schedule_.take_due(steady_clock::now(), tsc_clock::now(), send_times_);
+                    do_write();
+                    do_wait_send_time();
+                }
+            });
+    }
+
+    void do_wait_think_time()
+    {
+        timer_pending_ = true;
+        timer_.expires_at(think_until_.front());
+        timer_.async_wait([this](const boost::system::error_code & ec)
+            {
+                timer_pending_ = false;
+                if (!ec && socket_.is_open()) {
+                    time_point<steady_clock> now_time = steady_clock::now();
+                    while (!think_until_.empty() && think_until_.front() <= now_time) {
+                        think_until_.pop_front();
+                        unsent_count_++;
+                    }
+                    do_write();
+                    if (!think_until_.empty() && !stats_->is_draining())
+                        do_wait_think_time();
+                }
+            });
+    }
+
+    void do_read()
+    {
+        socket_.async_read_some(boost::asio::buffer(recv_buffer_.data(), recv_buffer_.size()),
+            [this](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                {
+                    stats_->on_recv(bytes_transferred);
+                    on_recieved(bytes_transferred);
+                    do_write();
+                    do_read();
+                }
+                else {
+                    stats_->on_error();
+                    stop();
+                }
+            });
+    }
+
+    void do_write()
+    {
+        // After the measurement window, drop the unsent packets and wait for the echoes in flight.
+        if (stats_->is_draining()) {
+            if (schedule_.is_open_loop())
+                send_times_.resize(send_times_.size() - unsent_count_);
+            unsent_count_ = 0;
+            think_until_.clear();
+            if (!write_pending_ && send_times_.empty() && !drained_) {
+                drained_ = true;
+                stats_->on_drained();
+            }
+            return;
+        }
+        if (write_pending_ || unsent_count_ == 0)
+            return;
+
+        uint64_t send_time = tsc_clock::now();
+        uint32_t send_count = std::min(unsent_count_, batch_size_);
+        std::size_t send_size = 0;
+        for (uint32_t i = 0; i < send_count; ++i) {
+            uint32_t packet_size = next_packet_size();
+            send_sizes_.push_back(packet_size);
+            send_size += packet_size;
+            if (!schedule_.is_open_loop())
+                send_times_.push_back(send_time);
+        }
+
+        unsent_count_ -= send_count;
+        write_pending_ = true;
+        boost::asio::async_write(socket_,
+            boost::asio::buffer(send_buffer_.data(), send_size),
+            [this](const boost::system::error_code & ec, std::size_t bytes_transferred)
+            {
+                if (!ec)
+                {
+                    stats_->on_send(bytes_transferred);
+                    write_pending_ = false;
+                    do_write();
+                }
+                else {
+                    stats_->on_error();
+                    stop();
+                }
+            });
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,323 @@
+
+#pragma once
+
+#include <stdio.h>
+#include <iostream>
+#include <iomanip>      // For std::setw()
+#include <chrono>
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include <boost/asio.hpp>
+
+#include "common.h"
+#include "client_stats.hpp"
+#include "client_endpoints.hpp"
+#include "tsc_clock.hpp"
+#include "asio/asio_echo_serv/http_server/websocket.hpp"
+
+using namespace boost::asio;
+using namespace std::chrono;
+
+namespace asio_test {
+
+//
+// The WebSocket echo client: upgrades one http connection, then keeps pipeline
+// binary messages (one frame each, packet_size bytes) in flight, every message is
+// masked with a new key. The echoed payload is compared with the one sent, the
+// latency is measured from the send to the end of its echo.
+//
+class test_websocket_client
+{
+private:
+    enum { kRecvBufferSize = 128 * 1024 };
+
+    ip::tcp::socket socket_;
+    uint32_t packet_size_;
+    uint32_t pipeline_;
+    bool     upgraded_;
+    bool     write_pending_;
+
+    // The echo frame being received.
+    bool     in_frame_;
+    uint64_t frame_remain_;
+    uint64_t frame_offset_;
+
+    bool     drained_;
+    client_stats_shard * stats_;
+    std::deque<uint64_t> send_times_;
+
+    std::mt19937 random_;
+    std::string accept_key_;
+    std::string payload_;
+    std::string output_;
+    std::string writing_;
+    std::vector<char> recv_buffer_;
+    std::size_t recv_size_;
+
+public:
+    test_websocket_client(boost::asio::io_service & io_service,
+        ip::tcp::resolver::iterator endpoint_iterator, uint32_t connection_index,
+        const std::string & host, uint32_t packet_size, uint32_t pipeline,
+        client_stats_shard * stats)
+        : socket_(io_service), packet_size_(packet_size), pipeline_(pipeline), upgraded_(false),
+          write_pending_(false), in_frame_(false), frame_remain_(0), frame_offset_(0),
+          drained_(false), stats_(stats), random_(std::random_device()()),
+          recv_buffer_(kRecvBufferSize), recv_size_(0)
+    {
+        if (pipeline_ == 0)
+            pipeline_ = 1;
+
+        payload_.resize(packet_size_);
+        for (uint32_t i = 0; i < packet_size_; ++i)
+            payload_[i] = (char)('a' + (i % 26));
+
+        uint8_t key[16];
+        for (std::size_t i = 0; i < sizeof(key); ++i)
+            key[i] = (uint8_t)random_();
+        std::string key_base64 = detail::base64_encode(key, sizeof(key));
+        accept_key_ = websocket_accept_key(key_base64.c_str(), key_base64.size());
+
+        output_ = "GET /ws HTTP/1.1\r\n"
+                  "Host: " + host + "\r\n"
+                  "Upgrade: websocket\r\n"
+                  "Connection: Upgrade\r\n"
+                  "Sec-WebSocket-Key: " + key_base64 + "\r\n"
+                  "Sec-WebSocket-Version: 13\r\n\r\n";
+
+        do_connect(io_service, endpoint_iterator, connection_index);
+    }
+
+    ~test_websocket_client()
+    {
+    }
+
+private:
+    void set_socket_send_bufsize(int buffer_size)
+    {
+        boost::asio::socket_base::receive_buffer_size send_bufsize_option(buffer_size);
+        socket_.set_option(send_bufsize_option);
+    }
+
+    void set_socket_recv_bufsize(int buffer_size)
+    {
+        boost::asio::socket_base::receive_buffer_size recv_bufsize_option(buffer_size);
+        socket_.set_option(recv_bufsize_option);
+    }
+
+    void start()
+    {
+        set_socket_send_bufsize(MAX_PACKET_SIZE);
+        set_socket_recv_bufsize(MAX_PACKET_SIZE);
+        socket_.set_option(ip::tcp::no_delay(true));
+
+        do_flush();
+        do_read_some();
+    }
+
+    void stop()
+    {
+        if (socket_.is_open()) {
+            boost::system::error_code ignored_ec;
+            socket_.close(ignored_ec);
+        }
+        // A stopped connection has nothing in flight any more.
+        if (!drained_) {
+            drained_ = true;
+            stats_->on_drained();
+        }
+    }
+
+    void do_connect(boost::asio::io_service & io_service, ip::tcp::resolver::iterator endpoint_iterator,
+                    uint32_t connection_index)
+    {
+        async_connect_bound(io_service, socket_, endpoint_iterator, connection_index,
+            [this](const boost::system::error_code & ec, ip::tcp::resolver::iterator)
+            {
+                stats_->on_connect(ec);
+                if (!ec) {
+                    start();
+                }
+                else {
+                    std::cout << "test_websocket_client::do_connect() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                }
+            });
+    }
+
+    void send_messages()
+    {
+        // After the measurement window, only the messages in flight are finished.
+        if (stats_->is_draining()) {
+            if (send_times_.empty() && !drained_) {
+                drained_ = true;
+                stats_->on_drained();
+            }
+            return;
+        }
+        while (send_times_.size() < pipeline_) {
+            uint8_t mask[4];
+            uint32_t key = (uint32_t)random_();
+            ::memcpy(mask, &key, sizeof(mask));
+            websocket_append_frame_header(output_, true, ws_opcode_binary, payload_.size(), mask);
+            std::size_t offset = output_.size();
+            output_.append(payload_);
+            websocket_unmask(&output_[offset], payload_.size(), mask, 0);
+            send_times_.push_back(tsc_clock::now());
+        }
+    }
+
+    void on_message_echoed()
+    {
+        if (!send_times_.empty()) {
+            stats_->on_query(tsc_clock::elapsed_ns(send_times_.front(), tsc_clock::now()));
+            send_times_.pop_front();
+        }
+        else {
+            stats_->on_query();
+        }
+    }
+
+    /// Returns the bytes consumed, or -1 if the connection must be closed.
+    long handle_handshake(const char * data, std::size_t size)
+    {
+        std::string response(data, size);
+        std::size_t header_end = response.find("\r\n\r\n");
+        if (header_end == std::string::npos)
+            return 0;
+        if (response.compare(0, 12, "HTTP/1.1 101") != 0
+            || response.find("Sec-WebSocket-Accept: " + accept_key_ + "\r\n") == std::string::npos) {
+            std::cout << "test_websocket_client::handle_handshake() - Error: the upgrade is rejected:" << std::endl
+                      << response.substr(0, header_end) << std::endl;
+            return -1;
+        }
+        upgraded_ = true;
+        std::cout << "websocket upgraded, frame = " << packet_size_ << " B, pipeline = " << pipeline_ << std::endl;
+        return (long)(header_end + 4);
+    }
+
+    /// Returns the bytes consumed, or -1 if the connection must be closed.
+    long handle_frames(const char * data, std::size_t size)
+    {
+        std::size_t offset = 0;
+        while (offset < size) {
+            if (!in_frame_) {
+                websocket_frame_header header;
+                int header_size = websocket_parse_frame_header(data + offset, size - offset, header);
+                if (header_size == 0)
+                    break;
+                if (header_size < 0 || header.masked) {
+                    std::cout << "test_websocket_client::handle_frames() - Error: bad frame." << std::endl;
+                    return -1;
+                }
+                if (header.opcode == ws_opcode_close) {
+                    std::cout << "test_websocket_client::handle_frames() - Error: closed by the server." << std::endl;
+                    return -1;
+                }
+                offset += header_size;
+                in_frame_ = true;
+                frame_remain_ = header.payload_len;
+                frame_offset_ = 0;
+                if (header.payload_len != payload_.size())
+                    stats_->on_error();
+            }
+
+            std::size_t chunk = std::min((std::size_t)frame_remain_, size - offset);
+            if (frame_offset_ + chunk <= payload_.size()
+                && ::memcmp(data + offset, payload_.data() + frame_offset_, chunk) != 0)
+                stats_->on_error();
+            offset += chunk;
+            frame_offset_ += chunk;
+            frame_remain_ -= chunk;
+            stats_->on_recv(chunk);
+            if (frame_remain_ != 0)
+                break;
+
+            in_frame_ = false;
+            on_message_echoed();
+        }
+        return (long)offset;
+    }
+
+    void do_read_some()
+    {
+        socket_.async_read_some(boost::asio::buffer(&recv_buffer_[recv_size_], recv_buffer_.size() - recv_size_),
+            [this](const boost::system::error_code & ec, std::size_t recieved_bytes)
+            {
+                if (!ec) {
+                    recv_size_ += recieved_bytes;
+
+                    long consumed = 0;
+                    if (!upgraded_) {
+                        consumed = handle_handshake(&recv_buffer_[0], recv_size_);
+                        if (consumed > 0) {
+                            long frames = handle_frames(&recv_buffer_[consumed], recv_size_ - consumed);
+                            consumed = (frames >= 0) ? (consumed + frames) : -1;
+                        }
+                    }
+                    else {
+                        consumed = handle_frames(&recv_buffer_[0], recv_size_);
+                    }
+                    if (consumed < 0) {
+                        stop();
+                        return;
+                    }
+                    // Only a partial frame header (or http header) is left.
+                    if (consumed != 0) {
+                        recv_size_ -= consumed;
+                        ::memmove(&recv_buffer_[0], &recv_buffer_[consumed], recv_size_);
+                    }
+                    if (recv_size_ == recv_buffer_.size()) {
+                        std::cout << "test_websocket_client::do_read_some() - Error: the response header is too large."
+                                  << std::endl;
+                        stop();
+                        return;
+                    }
+
+                    if (upgraded_)
+                        send_messages();
+
+                    do_flush();
+                    do_read_some();
+                }
+                else {
+                    stats_->on_error();
+                    // Write error log
+                    std::cout << "test_websocket_client::do_read_some() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    stop();
+                }
+            });
+    }
+
+    void do_flush()
+    {
+        if (write_pending_ || output_.empty())
+            return;
+
+        writing_.swap(output_);
+        output_.clear();
+        write_pending_ = true;
+        boost::asio::async_write(socket_, boost::asio::buffer(writing_.data(), writing_.size()),
+            [this](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec) {
+                    stats_->on_send(send_bytes);
+                    writing_.clear();
+                    write_pending_ = false;
+                    do_flush();
+                }
+                else {
+                    stats_->on_error();
+                    // Write error log
+                    std::cout << "test_websocket_client::do_flush() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    stop();
+                }
+            });
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,214 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+#include <chrono>
+#include <thread>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TSC_CLOCK_HAS_RDTSC     1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#include <cpuid.h>
+#define TSC_CLOCK_HAS_RDTSC     1
+#endif
+
+using namespace std::chrono;
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                        < The timestamps of the requests >
+
+  A stamp is a reading of the invariant TSC (rdtsc, no syscall, no vDSO), it's
+  calibrated against steady_clock at startup by init(). The clock falls back to
+  steady_clock (the stamps are nanoseconds then) if the CPU has no invariant TSC
+  or the two calibration windows disagree (e.g. a VM which migrates the vCPUs).
+
+  Only the differences of two stamps are meaningful: elapsed_ns(start, end).
+  The clients stamp the send and the receive times of the requests, the timers
+  and the reports stay on steady_clock.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+class tsc_clock
+{
+public:
+    enum clock_source_t {
+        source_steady,
+        source_tsc
+    };
+
+private:
+    // The calibration window, and how far the two windows may disagree.
+    enum { kCalibrateMillisecs = 20 };
+    static constexpr double kMaxRateDeviation = 0.0005;
+
+    struct clock_data {
+        int      source;
+        double   ns_per_tick;
+        double   ticks_per_ns;
+        double   read_ns;
+        double   steady_read_ns;
+        const char * fallback_reason;
+    };
+
+    static clock_data & data()
+    {
+        // Constant initialized, no guard in now().
+        static clock_data s_data = { source_steady, 1.0, 1.0, 0.0, 0.0, "" };
+        return s_data;
+    }
+
+    static uint64_t steady_now()
+    {
+        return (uint64_t)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+#if defined(TSC_CLOCK_HAS_RDTSC)
+    static uint64_t rdtsc()
+    {
+        return (uint64_t)__rdtsc();
+    }
+
+    /// CPUID.80000007H:EDX[8], the TSC runs at a constant rate in all the P/C-states.
+    static bool has_invariant_tsc()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0x80000000);
+        if ((unsigned int)info[0] < 0x80000007U)
+            return false;
+        __cpuid(info, 0x80000007);
+        return ((info[3] & (1 << 8)) != 0);
+#else
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(0x80000007U, &eax, &ebx, &ecx, &edx) == 0)
+            return false;
+        return ((edx & (1U << 8)) != 0);
+#endif
+    }
+
+    /// A pair of (steady ns, tsc) read as close together as it can.
+    static void read_pair(uint64_t & steady_ns, uint64_t & ticks)
+    {
+        uint64_t best_gap = (uint64_t)-1;
+        for (int i = 0; i < 8; ++i) {
+            uint64_t before = rdtsc();
+            uint64_t now_ns = steady_now();
+            uint64_t after = rdtsc();
+            if (after - before < best_gap) {
+                best_gap = after - before;
+                steady_ns = now_ns;
+                ticks = before + (after - before) / 2;
+            }
+        }
+    }
+
+    /// The ticks per ns over one calibration window, 0.0 if the tsc went backward.
+    static double measure_rate()
+    {
+        uint64_t start_ns = 0, start_ticks = 0, end_ns = 0, end_ticks = 0;
+        read_pair(start_ns, start_ticks);
+        std::this_thread::sleep_for(milliseconds(kCalibrateMillisecs));
+        read_pair(end_ns, end_ticks);
+        if (end_ticks <= start_ticks || end_ns <= start_ns)
+            return 0.0;
+        return (double)(end_ticks - start_ticks) / (double)(end_ns - start_ns);
+    }
+#endif // TSC_CLOCK_HAS_RDTSC
+
+    template <typename ReadFunc>
+    static double measure_read_ns(ReadFunc read)
+    {
+        static const int kReads = 200000;
+        uint64_t sink = 0;
+        uint64_t start_ns = steady_now();
+        for (int i = 0; i < kReads; ++i)
+            sink += read();
+        uint64_t end_ns = steady_now();
+        volatile uint64_t keep = sink;
+        (void)keep;
+        return (double)(end_ns - start_ns) / kReads;
+    }
+
+public:
+    /// Calibrate once at startup (before the io threads), prefer_tsc = false keeps steady_clock.
+    static void init(bool prefer_tsc)
+    {
+        clock_data & clock = data();
+        clock.source = source_steady;
+        clock.ns_per_tick = 1.0;
+        clock.ticks_per_ns = 1.0;
+        clock.fallback_reason = prefer_tsc ? "" : "--clock=steady";
+#if defined(TSC_CLOCK_HAS_RDTSC)
+        if (prefer_tsc) {
+            if (has_invariant_tsc()) {
+                double rate1 = measure_rate();
+                double rate2 = measure_rate();
+                if (rate1 > 0.0 && rate2 > 0.0
+                    && std::fabs(rate1 - rate2) <= rate1 * kMaxRateDeviation) {
+                    clock.source = source_tsc;
+                    clock.ticks_per_ns = (rate1 + rate2) / 2.0;
+                    clock.ns_per_tick = 1.0 / clock.ticks_per_ns;
+                }
+                else {
+                    clock.fallback_reason = "the tsc rate is unstable";
+                }
+            }
+            else {
+                clock.fallback_reason = "no invariant tsc";
+            }
+        }
+#else
+        if (prefer_tsc)
+            clock.fallback_reason = "no tsc on this cpu";
+#endif
+        clock.read_ns = measure_read_ns(&tsc_clock::now);
+        clock.steady_read_ns = measure_read_ns(&tsc_clock::steady_now);
+    }
+
+    static uint64_t now()
+    {
+#if defined(TSC_CLOCK_HAS_RDTSC)
+        if (data().source == source_tsc)
+            return rdtsc();
+#endif
+        return steady_now();
+    }
+
+    static uint64_t elapsed_ns(uint64_t start, uint64_t end)
+    {
+        if (end <= start)
+            return 0;
+        return (uint64_t)((double)(end - start) * data().ns_per_tick);
+    }
+
+    /// The stamp of ns nanoseconds before the stamp now_stamp.
+    static uint64_t stamp_before(uint64_t now_stamp, uint64_t ns)
+    {
+        uint64_t ticks = (uint64_t)((double)ns * data().ticks_per_ns);
+        return (ticks < now_stamp) ? (now_stamp - ticks) : 0;
+    }
+
+    static bool is_tsc() { return (data().source == source_tsc); }
+
+    static const char * source_name() { return is_tsc() ? "tsc" : "steady"; }
+
+    static const char * fallback_reason() { return data().fallback_reason; }
+
+    /// The tsc frequency (GHz), 0.0 on steady_clock.
+    static double tsc_ghz() { return is_tsc() ? data().ticks_per_ns : 0.0; }
+
+    /// The cost of one now(), and of one steady_clock::now() to compare with.
+    static double read_ns() { return data().read_ns; }
+    static double steady_read_ns() { return data().steady_read_ns; }
+};
+
+} // namespace asio_test
+
+#undef TSC_CLOCK_HAS_RDTSC
@@ -0,0 +1,394 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <exception>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+
+#include "common.h"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                         < The scenario files (--scenario) >
+
+  An ini file, every section but [global] is a group of echo connections, all
+  the groups run at the same time (see scenario_sample.ini at the top of the
+  repository), a value may end with a ; or # comment:
+
+      [global]
+      seed = 1                        ; the seed of the sample tables
+
+      [small]
+      connections   = 200
+      mode          = closed          ; closed: pipeline + think time, open: rate
+      pipeline      = 4               ; the requests in flight of a connection
+      think_time_us = 100             ; closed: the pause after an echo
+      packet_size   = zipf:64-1024:1.1
+
+      [bulk]
+      connections   = 8
+      mode          = open
+      rate          = 2000            ; open: the requests/s of the whole group
+      packet_size   = table:4096=70,16384=20,65536=10
+
+  The packet sizes (64 KB at most) are
+
+      64                      fixed
+      fixed:64                fixed
+      uniform:64-4096         uniform in [64, 4096]
+      zipf:64-4096:1.1        64 + (rank - 1), the rank is Zipf(s = 1.1)
+      table:64=50,512=50      an empirical table of size=weight
+
+  A value which isn't a number of its key (e.g. seed = abc) is an error, not
+  the default.
+
+  The sizes are drawn at load time into a table of kSampleCount samples, a
+  connection walks the table from its own offset, so a send never draws.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+class size_distribution
+{
+public:
+    enum distribution_t {
+        dist_fixed,
+        dist_uniform,
+        dist_zipf,
+        dist_table
+    };
+
+private:
+    uint32_t type_;
+    uint32_t min_size_;
+    uint32_t max_size_;
+    double   zipf_s_;
+    std::vector<std::pair<uint32_t, double>> table_;
+
+    static bool parse_size(const std::string & text, uint32_t & size)
+    {
+        char * end = nullptr;
+        unsigned long value = ::strtoul(text.c_str(), &end, 10);
+        if (text.empty() || end == nullptr || *end != '\0')
+            return false;
+        if (value < 1 || value > MAX_PACKET_SIZE)
+            return false;
+        size = (uint32_t)value;
+        return true;
+    }
+
+    static bool parse_range(const std::string & text, uint32_t & min_size, uint32_t & max_size)
+    {
+        std::size_t dash = text.find('-');
+        if (dash == std::string::npos)
+            return false;
+        if (!parse_size(text.substr(0, dash), min_size) || !parse_size(text.substr(dash + 1), max_size))
+            return false;
+        return (min_size <= max_size);
+    }
+
+public:
+    size_distribution() : type_(dist_fixed), min_size_(64), max_size_(64), zipf_s_(1.0) {}
+
+    uint32_t type() const { return type_; }
+    uint32_t max_size() const { return max_size_; }
+
+    bool parse(const std::string & spec, std::string & error)
+    {
+        std::size_t colon = spec.find(':');
+        std::string kind = (colon == std::string::npos) ? std::string("fixed") : spec.substr(0, colon);
+        std::string args = (colon == std::string::npos) ? spec : spec.substr(colon + 1);
+        table_.clear();
+        if (kind == "fixed") {
+            type_ = dist_fixed;
+            if (!parse_size(args, min_size_)) {
+                error = "bad fixed size: [" + args + "]";
+                return false;
+            }
+            max_size_ = min_size_;
+        }
+        else if (kind == "uniform") {
+            type_ = dist_uniform;
+            if (!parse_range(args, min_size_, max_size_)) {
+                error = "bad uniform range: [" + args + "]";
+                return false;
+            }
+        }
+        else if (kind == "zipf") {
+            type_ = dist_zipf;
+            std::size_t sep = args.find(':');
+            zipf_s_ = (sep == std::string::npos) ? 1.0 : ::atof(args.substr(sep + 1).c_str());
+            if (!parse_range(args.substr(0, sep), min_size_, max_size_) || zipf_s_ <= 0.0) {
+                error = "bad zipf parameters: [" + args + "]";
+                return false;
+            }
+        }
+        else if (kind == "table") {
+            type_ = dist_table;
+            min_size_ = MAX_PACKET_SIZE;
+            max_size_ = 0;
+            std::size_t pos = 0;
+            while (pos < args.size()) {
+                std::size_t comma = args.find(',', pos);
+                std::string entry = args.substr(pos, (comma == std::string::npos) ? std::string::npos : comma - pos);
+                std::size_t eq = entry.find('=');
+                uint32_t size = 0;
+                double weight = (eq == std::string::npos) ? 0.0 : ::atof(entry.substr(eq + 1).c_str());
+                if (eq == std::string::npos || !parse_size(entry.substr(0, eq), size) || weight <= 0.0) {
+                    error = "bad table entry: [" + entry + "]";
+                    return false;
+                }
+                table_.push_back(std::make_pair(size, weight));
+                min_size_ = std::min(min_size_, size);
+                max_size_ = std::max(max_size_, size);
+                pos = (comma == std::string::npos) ? args.size() : comma + 1;
+            }
+            if (table_.empty()) {
+                error = "empty table";
+                return false;
+            }
+        }
+        else {
+            error = "unknown distribution: [" + kind + "]";
+            return false;
+        }
+        return true;
+    }
+
+    /// Draw count sizes into samples.
+    void fill_samples(std::vector<uint32_t> & samples, std::size_t count, uint64_t seed) const
+    {
+        std::mt19937_64 random(seed);
+        samples.resize(count);
+        if (type_ == dist_fixed) {
+            std::fill(samples.begin(), samples.end(), min_size_);
+        }
+        else if (type_ == dist_uniform) {
+            std::uniform_int_distribution<uint32_t> uniform(min_size_, max_size_);
+            for (std::size_t i = 0; i < count; ++i)
+                samples[i] = uniform(random);
+        }
+        else {
+            // Zipf and the tables both draw from a discrete distribution of weights.
+            std::vector<double> weights;
+            std::vector<uint32_t> sizes;
+            if (type_ == dist_zipf) {
+                for (uint32_t size = min_size_; size <= max_size_; ++size) {
+                    sizes.push_back(size);
+                    weights.push_back(1.0 / std::pow((double)(size - min_size_ + 1), zipf_s_));
+                }
+            }
+            else {
+                for (std::size_t i = 0; i < table_.size(); ++i) {
+                    sizes.push_back(table_[i].first);
+                    weights.push_back(table_[i].second);
+                }
+            }
+            std::discrete_distribution<std::size_t> discrete(weights.begin(), weights.end());
+            for (std::size_t i = 0; i < count; ++i)
+                samples[i] = sizes[discrete(random)];
+        }
+    }
+};
+
+//
+// A group of the scenario, and its table of packet sizes.
+//
+struct scenario_group
+{
+    enum { kSampleCount = 64 * 1024 };
+
+    std::string name;
+    uint32_t connections;
+    uint32_t open_loop;
+    uint32_t pipeline;
+    uint32_t think_time_us;
+    double   rate;
+    std::string packet_size_spec;
+    size_distribution packet_size;
+    std::vector<uint32_t> size_samples;
+
+    scenario_group()
+        : connections(1), open_loop(0), pipeline(1), think_time_us(0), rate(0.0) {}
+
+    double avg_packet_size() const
+    {
+        double total = 0.0;
+        for (std::size_t i = 0; i < size_samples.size(); ++i)
+            total += (double)size_samples[i];
+        return size_samples.empty() ? 0.0 : (total / (double)size_samples.size());
+    }
+};
+
+/// ini_parser keeps the comment after a value, cut it (and the spaces before it).
+static inline
+void strip_scenario_comments(boost::property_tree::ptree & tree)
+{
+    for (boost::property_tree::ptree::iterator iter = tree.begin(); iter != tree.end(); ++iter) {
+        std::string & value = iter->second.data();
+        std::size_t pos = value.find_first_of(";#");
+        if (pos != std::string::npos) {
+            while (pos > 0 && (value[pos - 1] == ' ' || value[pos - 1] == '\t'))
+                pos--;
+            value.erase(pos);
+        }
+        strip_scenario_comments(iter->second);
+    }
+}
+
+/// Read the value of key if it's set, returns false with error if it's not a T.
+template <typename T>
+static inline
+bool get_scenario_value(const boost::property_tree::ptree & section, const std::string & name,
+                        const char * key, T & value, std::string & error)
+{
+    boost::optional<const boost::property_tree::ptree &> child = section.get_child_optional(key);
+    if (!child)
+        return true;
+    boost::optional<T> parsed = child->get_value_optional<T>();
+    if (!parsed) {
+        error = "[" + name + "] bad " + key + ": [" + child->data() + "]";
+        return false;
+    }
+    value = *parsed;
+    return true;
+}
+
+/// Read the unsigned value of key if it's set, get_value_optional<> would take "-5" and wrap it.
+static inline
+bool get_scenario_unsigned(const boost::property_tree::ptree & section, const std::string & name,
+                           const char * key, uint64_t max_value, uint64_t & value, std::string & error)
+{
+    boost::optional<const boost::property_tree::ptree &> child = section.get_child_optional(key);
+    if (!child)
+        return true;
+    const std::string & text = child->data();
+    char * end = nullptr;
+    errno = 0;
+    unsigned long long parsed = 0;
+    // strtoull() skips the spaces and takes a sign, so only the digits are accepted.
+    if (!text.empty() && text[0] >= '0' && text[0] <= '9')
+        parsed = ::strtoull(text.c_str(), &end, 10);
+    if (end == nullptr || *end != '\0' || errno == ERANGE || parsed > max_value) {
+        error = "[" + name + "] bad " + key + ": [" + text + "]";
+        return false;
+    }
+    value = (uint64_t)parsed;
+    return true;
+}
+
+static inline
+bool get_scenario_value(const boost::property_tree::ptree & section, const std::string & name,
+                        const char * key, uint32_t & value, std::string & error)
+{
+    uint64_t parsed = value;
+    if (!get_scenario_unsigned(section, name, key, UINT32_MAX, parsed, error))
+        return false;
+    value = (uint32_t)parsed;
+    return true;
+}
+
+static inline
+bool get_scenario_value(const boost::property_tree::ptree & section, const std::string & name,
+                        const char * key, uint64_t & value, std::string & error)
+{
+    return get_scenario_unsigned(section, name, key, UINT64_MAX, value, error);
+}
+
+/// Load the groups of the scenario file, returns false with error on a bad file.
+static inline
+bool load_scenario_file(const std::string & path, std::vector<scenario_group> & groups, std::string & error)
+{
+    namespace pt = boost::property_tree;
+    pt::ptree tree;
+    try {
+        pt::ini_parser::read_ini(path, tree);
+    }
+    catch (const std::exception & ex) {
+        error = ex.what();
+        return false;
+    }
+    strip_scenario_comments(tree);
+
+    uint64_t seed = 1;
+    groups.clear();
+    try {
+        for (pt::ptree::const_iterator iter = tree.begin(); iter != tree.end(); ++iter) {
+            const pt::ptree & section = iter->second;
+            if (iter->first == "global") {
+                if (!get_scenario_value(section, iter->first, "seed", seed, error))
+                    return false;
+                continue;
+            }
+            if (section.empty()) {
+                error = "[" + iter->first + "] is not a section";
+                return false;
+            }
+            scenario_group group;
+            group.name = iter->first;
+            group.packet_size_spec = "64";
+            if (!get_scenario_value(section, group.name, "connections", group.connections, error)
+                || !get_scenario_value(section, group.name, "pipeline", group.pipeline, error)
+                || !get_scenario_value(section, group.name, "think_time_us", group.think_time_us, error)
+                || !get_scenario_value(section, group.name, "rate", group.rate, error)
+                || !get_scenario_value(section, group.name, "packet_size", group.packet_size_spec, error))
+                return false;
+            group.pipeline = std::max(group.pipeline, 1U);
+            if (group.rate < 0.0) {
+                error = "[" + group.name + "] bad rate: the requests/s can't be negative";
+                return false;
+            }
+
+            std::string mode = (group.rate > 0.0) ? "open" : "closed";
+            if (!get_scenario_value(section, group.name, "mode", mode, error))
+                return false;
+            if (mode == "open") {
+                group.open_loop = 1;
+                if (group.rate <= 0.0) {
+                    error = "[" + group.name + "] mode = open needs a rate";
+                    return false;
+                }
+            }
+            else if (mode == "closed") {
+                group.open_loop = 0;
+            }
+            else {
+                error = "[" + group.name + "] unknown mode: " + mode;
+                return false;
+            }
+            if (group.connections == 0) {
+                error = "[" + group.name + "] has no connection";
+                return false;
+            }
+            std::string dist_error;
+            if (!group.packet_size.parse(group.packet_size_spec, dist_error)) {
+                error = "[" + group.name + "] packet_size: " + dist_error;
+                return false;
+            }
+            group.packet_size.fill_samples(group.size_samples, scenario_group::kSampleCount,
+                                           seed + groups.size());
+            groups.push_back(group);
+        }
+    }
+    catch (const std::exception & ex) {
+        error = ex.what();
+        return false;
+    }
+    if (groups.empty()) {
+        error = "no group in the scenario";
+        return false;
+    }
+    return true;
+}
+
+} // namespace asio_test
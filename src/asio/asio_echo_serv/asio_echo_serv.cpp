@@ -10,9 +10,11 @@
 
 #include "common.h"
 #include "common/cmd_utils.hpp"
+#include "common/stats_output.hpp"
 #include "async_asio_echo_serv.hpp"
 #include "async_aiso_echo_serv_ex.hpp"
 #include "http_server/async_asio_http_server.hpp"
+#include "http2_server/async_asio_http2_server.hpp"
 
 using namespace asio_test;
 using namespace std::chrono;
@@ -23,11 +25,33 @@ uint32_t g_nodelay      = 0;
 uint32_t g_need_echo    = 1;
 uint32_t g_packet_size  = 64;
 
+uint32_t g_idle_timeout      = 60;
+uint32_t g_keepalive_timeout = 15;
+uint32_t g_write_timeout     = 30;
+
+uint32_t g_http_compress      = 1;
+uint32_t g_response_body_size = 0;
+uint32_t g_mirror_buffer      = 1;
+uint32_t g_http2_max_streams  = 256;
+
+// The requests (or bytes) handled by one wakeup of a http session, 0 means no limit.
+uint32_t g_http_budget_requests = 64;
+uint32_t g_http_budget_bytes    = 0;
+
+// The body bytes a http connection takes before its body sink pauses, 0 means no limit.
+uint32_t g_http_body_window = 0;
+
+// The pre-warmed connections to every upstream, per io_service (proxy mode).
+uint32_t g_upstream_conns = 4;
+uint32_t g_stats_output   = asio_test::stats_output_text;
+
 std::string g_test_mode_str      = "echo";
 std::string g_test_method_str    = "pingpong";
 std::string g_test_mode_full_str = "echo server";
 std::string g_nodelay_str        = "false";
 std::string g_rpc_topic;
+std::string g_upstream_list;
+std::string g_stats_output_file;
 
 std::string g_server_ip;
 std::string g_server_port;
@@ -35,11 +59,27 @@ std::string g_server_port;
 asio_test::aligned_atomic<uint64_t> asio_test::g_query_count(0);
 asio_test::aligned_atomic<uint32_t> asio_test::g_client_count(0);
 
+asio_test::aligned_atomic<uint64_t> asio_test::g_accept_count(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_accept_errors(0);
+
 asio_test::aligned_atomic<uint64_t> asio_test::g_recv_bytes(0);
 asio_test::aligned_atomic<uint64_t> asio_test::g_send_bytes(0);
 
+asio_test::aligned_atomic<uint64_t> asio_test::g_compress_count(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_compress_saved_bytes(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_rollback_bytes(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_write_fallbacks(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_budget_yields(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_body_pauses(0);
+
+asio_test::aligned_atomic<uint64_t> asio_test::g_upstream_connects(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_upstream_errors(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_proxy_requests(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_proxy_total_ns(0);
+asio_test::aligned_atomic<uint64_t> asio_test::g_proxy_upstream_ns(0);
+
 bool                     g_first_time = true;
-time_point<steady_clock> g_start_time = high_resolution_clock::now();
+time_point<steady_clock> g_start_time = steady_clock::now();
 
 static const size_t kBytes = 8;
 
@@ -87,6 +127,109 @@ void run_asio_echo_serv(const std::string & ip, const std::string & port,
     }
 }
 
+//
+// The run configuration written with every stats record (--output=json|csv).
+//
+stats_record server_stats_config(const std::string & ip, const std::string & port,
+                                 uint32_t packet_size, uint32_t thread_num)
+{
+    stats_record config;
+    config.add("mode", g_test_mode_str)
+          .add("test", g_test_method_str)
+          .add("listen", ip + ":" + port)
+          .add("threads", thread_num)
+          .add("packet_size", packet_size)
+          .add("nodelay", g_nodelay);
+    if (g_test_mode == test_mode_http_proxy)
+        config.add("upstream", g_upstream_list);
+    return config;
+}
+
+//
+// The fields every server writes, the counters are the deltas over seconds.
+//
+void add_server_stats(stats_record & record, const char * type, double elapsed, double seconds,
+                      uint32_t conns, uint64_t queries, uint64_t recv_bytes, uint64_t send_bytes,
+                      uint64_t timeouts, uint64_t accepts, uint64_t accept_errors)
+{
+    double per_second = (seconds > 0.0) ? (1.0 / seconds) : 0.0;
+    record.add("type", type)
+          .add("elapsed_s", elapsed)
+          .add("interval_s", seconds)
+          .add("conns", conns)
+          .add("queries", queries)
+          .add("qps", queries * per_second)
+          .add("recv_MBps", recv_bytes * per_second / (1024.0 * 1024.0))
+          .add("send_MBps", send_bytes * per_second / (1024.0 * 1024.0))
+          .add("timeouts", timeouts)
+          .add("accepts_per_s", accepts * per_second)
+          .add("accept_errors", accept_errors);
+}
+
+//
+// The cumulative counters of the http server, an interval is the difference of two samples.
+//
+struct http_stats_sample
+{
+    uint64_t queries, timeouts, accepts, accept_errors;
+    uint64_t saved_bytes, rollback_bytes, write_fallbacks, budget_yields, body_pauses;
+    uint64_t upstream_connects, upstream_errors, proxy_requests, proxy_total_ns, proxy_upstream_ns;
+};
+
+http_stats_sample sample_http_stats(const async_asio_http_server & server)
+{
+    http_stats_sample sample;
+    sample.queries           = (uint64_t)g_query_count;
+    sample.timeouts          = server.timeout_count();
+    sample.accepts           = (uint64_t)g_accept_count;
+    sample.accept_errors     = (uint64_t)g_accept_errors;
+    sample.saved_bytes       = (uint64_t)g_compress_saved_bytes;
+    sample.rollback_bytes    = (uint64_t)g_rollback_bytes;
+    sample.write_fallbacks   = (uint64_t)g_write_fallbacks;
+    sample.budget_yields     = (uint64_t)g_budget_yields;
+    sample.body_pauses       = (uint64_t)g_body_pauses;
+    sample.upstream_connects = (uint64_t)g_upstream_connects;
+    sample.upstream_errors   = (uint64_t)g_upstream_errors;
+    sample.proxy_requests    = (uint64_t)g_proxy_requests;
+    sample.proxy_total_ns    = (uint64_t)g_proxy_total_ns;
+    sample.proxy_upstream_ns = (uint64_t)g_proxy_upstream_ns;
+    return sample;
+}
+
+void write_http_stats(stats_writer & writer, const async_asio_http_server & server,
+                      const char * type, double elapsed, double seconds, uint32_t conns,
+                      const http_stats_sample & cur, const http_stats_sample & last)
+{
+    uint64_t queries = cur.queries - last.queries;
+    uint64_t saved_bytes = cur.saved_bytes - last.saved_bytes;
+    uint64_t send_bytes = queries * server.response_size();
+    send_bytes = (send_bytes > saved_bytes) ? (send_bytes - saved_bytes) : 0;
+    double per_second = (seconds > 0.0) ? (1.0 / seconds) : 0.0;
+
+    stats_record record;
+    add_server_stats(record, type, elapsed, seconds, conns, queries,
+                     queries * g_request_html_header.size(), send_bytes, cur.timeouts - last.timeouts,
+                     cur.accepts - last.accepts, cur.accept_errors - last.accept_errors);
+    record.add("saved_MBps", saved_bytes * per_second / (1024.0 * 1024.0))
+          .add("rollback_KBps", (cur.rollback_bytes - last.rollback_bytes) * per_second / 1024.0)
+          .add("async_fallbacks", cur.write_fallbacks - last.write_fallbacks)
+          .add("budget_yields", cur.budget_yields - last.budget_yields)
+          .add("body_pauses", cur.body_pauses - last.body_pauses);
+    if (server.is_proxy()) {
+        uint64_t proxy_requests = cur.proxy_requests - last.proxy_requests;
+        double avg_total_us = (proxy_requests != 0) ?
+            ((cur.proxy_total_ns - last.proxy_total_ns) / 1000.0 / proxy_requests) : 0.0;
+        double avg_upstream_us = (proxy_requests != 0) ?
+            ((cur.proxy_upstream_ns - last.proxy_upstream_ns) / 1000.0 / proxy_requests) : 0.0;
+        record.add("proxy_requests", proxy_requests)
+              .add("upstream_connects", cur.upstream_connects - last.upstream_connects)
+              .add("upstream_errors", cur.upstream_errors - last.upstream_errors)
+              .add("proxy_avg_us", avg_total_us)
+              .add("proxy_upstream_us", avg_upstream_us);
+    }
+    writer.write(record);
+}
+
 void run_asio_echo_serv_ex(const std::string & ip, const std::string & port,
                            uint32_t packet_size, uint32_t thread_num,
                            bool confirm = false)
@@ -103,28 +246,78 @@ void run_asio_echo_serv_ex(const std::string & ip, const std::string & port,
         }
         std::cout << std::endl;
 
+        stats_writer writer(g_stats_output, g_stats_output_file);
+        writer.set_config(server_stats_config(ip, port, packet_size, thread_num));
+        time_point<steady_clock> start_time = steady_clock::now();
+        time_point<steady_clock> last_time = start_time;
+
         uint64_t last_query_count = 0;
-        while (true) {
+        uint64_t last_timeout_count = 0;
+        uint64_t last_accept_count = 0;
+        uint64_t last_accept_errors = 0;
+        uint64_t last_recv_bytes = 0;
+        uint64_t last_send_bytes = 0;
+        while (!server.is_stopped()) {
             auto cur_succeed_count = (uint64_t)g_query_count;
+            // The bytes are counted, the packet size of a session may change (--sweep of the client).
+            auto cur_recv_bytes = (uint64_t)g_recv_bytes;
+            auto cur_send_bytes = (uint64_t)g_send_bytes;
+            auto recv_bytes = (cur_recv_bytes - last_recv_bytes);
+            auto send_bytes = (cur_send_bytes - last_send_bytes);
             auto client_count = (uint32_t)g_client_count;
             auto qps = (cur_succeed_count - last_query_count);
-            std::cout << ip.c_str() << ":" << port.c_str() << " - " << packet_size << " bytes : "
-                      << thread_num << " threads : "
-                      << "[" << std::left << std::setw(4) << client_count << "] conns : "
-                      << "nodelay:" << g_nodelay << ", "
-                      << "mode=" << g_test_mode_str.c_str() << ", "
-                      << "test=" << g_test_method_str.c_str() << ", "
-                      << "qps=" << std::right << std::setw(7) << qps << ", "
-                      << "BW="
-                      << std::right << std::setw(6)
-                      << std::setiosflags(std::ios::fixed) << std::setprecision(3)
-                      << ((qps * packet_size) * kBytes / (1024.0 * 1024.0))
-                      << " Mb/s" << std::endl;
-            std::cout << std::right;
+            auto cur_timeout_count = server.timeout_count();
+            auto timeouts = (cur_timeout_count - last_timeout_count);
+            auto cur_accept_count = (uint64_t)g_accept_count;
+            auto cur_accept_errors = (uint64_t)g_accept_errors;
+            auto accepts = (cur_accept_count - last_accept_count);
+            auto accept_errors = (cur_accept_errors - last_accept_errors);
+            time_point<steady_clock> now = steady_clock::now();
+            if (writer.print_text()) {
+                std::cout << ip.c_str() << ":" << port.c_str() << " - " << packet_size << " bytes : "
+                          << thread_num << " threads : "
+                          << "[" << std::left << std::setw(4) << client_count << "] conns : "
+                          << "nodelay:" << g_nodelay << ", "
+                          << "mode=" << g_test_mode_str.c_str() << ", "
+                          << "test=" << g_test_method_str.c_str() << ", "
+                          << "qps=" << std::right << std::setw(7) << qps << ", "
+                          << "BW="
+                          << std::right << std::setw(6)
+                          << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                          << (recv_bytes * kBytes / (1024.0 * 1024.0))
+                          << " Mb/s, "
+                          << "timeouts=" << timeouts << "/s, "
+                          << "accepts=" << accepts << "/s, "
+                          << "accept errors=" << accept_errors << "/s" << std::endl;
+                std::cout << std::right;
+            }
+            // The first pass only starts the interval.
+            if (last_time != start_time) {
+                stats_record record;
+                add_server_stats(record, "interval", duration<double>(now - start_time).count(),
+                                 duration<double>(now - last_time).count(), client_count, qps,
+                                 recv_bytes, send_bytes, timeouts, accepts, accept_errors);
+                writer.write(record);
+            }
+            last_time = now;
             last_query_count = cur_succeed_count;
+            last_timeout_count = cur_timeout_count;
+            last_accept_count = cur_accept_count;
+            last_accept_errors = cur_accept_errors;
+            last_recv_bytes = cur_recv_bytes;
+            last_send_bytes = cur_send_bytes;
             std::this_thread::sleep_for(std::chrono::milliseconds(1000));
         }
 
+        // The server stops on a signal, the summary is the whole run.
+        time_point<steady_clock> end_time = steady_clock::now();
+        stats_record record;
+        add_server_stats(record, "summary", duration<double>(end_time - start_time).count(),
+                         duration<double>(end_time - start_time).count(), (uint32_t)g_client_count,
+                         (uint64_t)g_query_count, (uint64_t)g_recv_bytes, (uint64_t)g_send_bytes,
+                         server.timeout_count(), (uint64_t)g_accept_count, (uint64_t)g_accept_errors);
+        writer.write(record);
+
         server.join();
     }
     catch (const std::exception & e) {
@@ -148,7 +341,8 @@ void run_asio_http_server(const std::string & ip, const std::string & port,
         }
         std::cout << std::endl;
 
-        static const std::size_t response_html_size = g_response_html.size();
+        const std::size_t response_html_size = server.response_size();
+        const uint64_t compress_ns = server.compress_ns();
         static const std::size_t request_html_header_size = g_request_html_header.size();
 
         duration<double> elapsed_time_;
@@ -156,36 +350,191 @@ void run_asio_http_server(const std::string & ip, const std::string & port,
 
         last_time_ = high_resolution_clock::now();
 
-        uint64_t last_query_count = 0;
-        while (true) {
-            auto cur_succeed_count = (uint64_t)g_query_count;
-            auto client_count = (uint32_t)g_client_count;
-            auto qps = (cur_succeed_count - last_query_count);
+        stats_writer writer(g_stats_output, g_stats_output_file);
+        writer.set_config(server_stats_config(ip, port, packet_size, thread_num));
+        time_point<steady_clock> start_time = steady_clock::now();
+        time_point<steady_clock> last_time = start_time;
+        http_stats_sample last_sample = sample_http_stats(server);
+        while (!server.is_stopped()) {
+            http_stats_sample cur_sample = sample_http_stats(server);
+            auto client_count = (uint32_t)server.connection_count();
+            auto qps = (cur_sample.queries - last_sample.queries);
+            auto compress_count = (uint64_t)g_compress_count;
+            auto saved_bytes = (cur_sample.saved_bytes - last_sample.saved_bytes);
+            // The counters are batched separately, don't let the difference underflow.
+            auto send_bytes = qps * response_html_size;
+            send_bytes = (send_bytes > saved_bytes) ? (send_bytes - saved_bytes) : 0;
             packet_size = g_packet_size;
-            elapsed_time_ = duration_cast< duration<double> >(high_resolution_clock::now() - g_start_time);
+            elapsed_time_ = duration_cast< duration<double> >(steady_clock::now() - g_start_time);
             double total_time = elapsed_time_.count();
-            std::cout << ip.c_str() << ":" << port.c_str() << " - " << packet_size << " bytes : "
-                      << thread_num << " threads : "
-                      << "[" << std::left << std::setw(4) << client_count << "] conns : "
-                      << "nodelay:" << g_nodelay << ", "
-                      << "mode=" << g_test_mode_str.c_str() << ", "
-                      << "test=" << g_test_method_str.c_str() << ", "
-                      << "qps=" << std::right << std::setw(7) << qps << ", "
-                      << "Recv BW: "
-                      << std::right << std::setw(6)
-                      << std::setiosflags(std::ios::fixed) << std::setprecision(3)
-                      << ((qps * request_html_header_size) * kBytes / (1024.0 * 1024.0))
-                      << " Mb/s, "
-                      << "Send BW: "
-                      << std::right << std::setw(6)
-                      << std::setiosflags(std::ios::fixed) << std::setprecision(3)
-                      << ((qps * response_html_size) * kBytes / (1024.0 * 1024.0))
-                      << " Mb/s" << std::endl;
-            std::cout << std::right;
+            if (writer.print_text()) {
+                std::cout << ip.c_str() << ":" << port.c_str() << " - " << packet_size << " bytes : "
+                          << thread_num << " threads : "
+                          << "[" << std::left << std::setw(4) << client_count << "] conns : "
+                          << "nodelay:" << g_nodelay << ", "
+                          << "mode=" << g_test_mode_str.c_str() << ", "
+                          << "test=" << g_test_method_str.c_str() << ", "
+                          << "qps=" << std::right << std::setw(7) << qps << ", "
+                          << "Recv BW: "
+                          << std::right << std::setw(6)
+                          << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                          << ((qps * request_html_header_size) * kBytes / (1024.0 * 1024.0))
+                          << " Mb/s, "
+                          << "Send BW: "
+                          << std::right << std::setw(6)
+                          << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                          << (send_bytes * kBytes / (1024.0 * 1024.0))
+                          << " Mb/s, "
+                          << "Saved BW: "
+                          << std::right << std::setw(6)
+                          << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                          << (saved_bytes * kBytes / (1024.0 * 1024.0))
+                          << " Mb/s, "
+                          // The one-time compression cost, amortized over the compressed responses.
+                          << "compress=" << std::setprecision(1)
+                          << ((compress_count != 0) ? ((double)compress_ns / compress_count) : 0.0) << " ns/resp, "
+                          << "rollback=" << std::setprecision(1)
+                          << ((cur_sample.rollback_bytes - last_sample.rollback_bytes) / 1024.0) << " KB/s, "
+                          << "async fallbacks=" << (cur_sample.write_fallbacks - last_sample.write_fallbacks) << "/s, "
+                          << "budget yields=" << (cur_sample.budget_yields - last_sample.budget_yields) << "/s, "
+                          << "body pauses=" << (cur_sample.body_pauses - last_sample.body_pauses) << "/s, "
+                          << "timeouts=" << (cur_sample.timeouts - last_sample.timeouts) << "/s, "
+                          << "accepts=" << (cur_sample.accepts - last_sample.accepts) << "/s, "
+                          << "accept errors=" << (cur_sample.accept_errors - last_sample.accept_errors) << "/s"
+                          << std::endl;
+                std::cout << std::right;
+                if (server.is_proxy()) {
+                    auto proxy_requests = (cur_sample.proxy_requests - last_sample.proxy_requests);
+                    double avg_total_us = (proxy_requests != 0) ?
+                        ((cur_sample.proxy_total_ns - last_sample.proxy_total_ns) / 1000.0 / proxy_requests) : 0.0;
+                    double avg_upstream_us = (proxy_requests != 0) ?
+                        ((cur_sample.proxy_upstream_ns - last_sample.proxy_upstream_ns) / 1000.0 / proxy_requests) : 0.0;
+                    // The overhead is the time of a request not spent waiting for the upstream's response.
+                    std::cout << "    proxy: requests=" << proxy_requests << "/s, "
+                              << "upstream connects=" << (cur_sample.upstream_connects - last_sample.upstream_connects) << "/s, "
+                              << "errors=" << (cur_sample.upstream_errors - last_sample.upstream_errors) << "/s, "
+                              << "avg=" << std::setprecision(1) << avg_total_us << " us, "
+                              << "upstream=" << avg_upstream_us << " us, "
+                              << "overhead=" << (avg_total_us - avg_upstream_us) << " us/req" << std::endl;
+                }
+            }
+            time_point<steady_clock> now = steady_clock::now();
+            // The first pass only starts the interval.
+            if (last_time != start_time) {
+                write_http_stats(writer, server, "interval", duration<double>(now - start_time).count(),
+                                 duration<double>(now - last_time).count(), client_count, cur_sample, last_sample);
+            }
+            last_sample = cur_sample;
+            last_time = now;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        }
+
+        // The server stops on a signal, the summary is the whole run.
+        time_point<steady_clock> end_time = steady_clock::now();
+        write_http_stats(writer, server, "summary", duration<double>(end_time - start_time).count(),
+                         duration<double>(end_time - start_time).count(), (uint32_t)server.connection_count(),
+                         sample_http_stats(server), http_stats_sample());
+
+        server.join();
+    }
+    catch (const std::exception & e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+    }
+}
+
+void run_asio_http2_server(const std::string & ip, const std::string & port,
+                           uint32_t packet_size, uint32_t thread_num,
+                           bool confirm = false)
+{
+    static const uint32_t kSeesionBufferSize = 65536 * 2;
+    try {
+        async_asio_http2_server server(ip, port, kSeesionBufferSize, g_http2_max_streams, thread_num);
+        server.run();
+
+        std::cout << "H2c Server has bind and listening ..." << std::endl;
+        if (confirm) {
+            std::cout << "press [enter] key to continue ...";
+            getchar();
+        }
+        std::cout << std::endl;
+
+        stats_writer writer(g_stats_output, g_stats_output_file);
+        writer.set_config(server_stats_config(ip, port, packet_size, thread_num));
+        time_point<steady_clock> start_time = steady_clock::now();
+        time_point<steady_clock> last_time = start_time;
+
+        uint64_t last_query_count = 0;
+        uint64_t last_recv_bytes = 0;
+        uint64_t last_send_bytes = 0;
+        uint64_t last_timeout_count = 0;
+        uint64_t last_accept_count = 0;
+        uint64_t last_accept_errors = 0;
+        while (!server.is_stopped()) {
+            auto cur_succeed_count = (uint64_t)g_query_count;
+            auto client_count = (uint32_t)server.connection_count();
+            auto cur_timeout_count = server.timeout_count();
+            auto timeouts = (cur_timeout_count - last_timeout_count);
+            auto cur_accept_count = (uint64_t)g_accept_count;
+            auto cur_accept_errors = (uint64_t)g_accept_errors;
+            auto accepts = (cur_accept_count - last_accept_count);
+            auto accept_errors = (cur_accept_errors - last_accept_errors);
+            auto streams = (cur_succeed_count - last_query_count);
+            // The frames have no fixed size, so the real bytes are counted.
+            auto cur_recv_bytes = (uint64_t)g_recv_bytes;
+            auto cur_send_bytes = (uint64_t)g_send_bytes;
+            auto recv_bytes = (cur_recv_bytes - last_recv_bytes);
+            auto send_bytes = (cur_send_bytes - last_send_bytes);
+            time_point<steady_clock> now = steady_clock::now();
+            if (writer.print_text()) {
+                std::cout << ip.c_str() << ":" << port.c_str() << " - "
+                          << thread_num << " threads : "
+                          << "[" << std::left << std::setw(4) << client_count << "] conns : "
+                          << "nodelay:" << g_nodelay << ", "
+                          << "mode=" << g_test_mode_str.c_str() << ", "
+                          << "body=" << server.response_size() << " bytes, "
+                          << "streams=" << std::right << std::setw(7) << streams << "/s, "
+                          << "Recv BW: "
+                          << std::right << std::setw(6)
+                          << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                          << (recv_bytes * kBytes / (1024.0 * 1024.0))
+                          << " Mb/s, "
+                          << "Send BW: "
+                          << std::right << std::setw(6)
+                          << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+                          << (send_bytes * kBytes / (1024.0 * 1024.0))
+                          << " Mb/s, "
+                          << "timeouts=" << timeouts << "/s, "
+                          << "accepts=" << accepts << "/s, "
+                          << "accept errors=" << accept_errors << "/s" << std::endl;
+                std::cout << std::right;
+            }
+            // The first pass only starts the interval.
+            if (last_time != start_time) {
+                stats_record record;
+                add_server_stats(record, "interval", duration<double>(now - start_time).count(),
+                                 duration<double>(now - last_time).count(), client_count, streams,
+                                 recv_bytes, send_bytes, timeouts, accepts, accept_errors);
+                writer.write(record);
+            }
+            last_time = now;
             last_query_count = cur_succeed_count;
+            last_recv_bytes = cur_recv_bytes;
+            last_send_bytes = cur_send_bytes;
+            last_timeout_count = cur_timeout_count;
+            last_accept_count = cur_accept_count;
+            last_accept_errors = cur_accept_errors;
             std::this_thread::sleep_for(std::chrono::milliseconds(1000));
         }
 
+        // The server stops on a signal, the summary is the whole run.
+        time_point<steady_clock> end_time = steady_clock::now();
+        stats_record record;
+        add_server_stats(record, "summary", duration<double>(end_time - start_time).count(),
+                         duration<double>(end_time - start_time).count(), (uint32_t)server.connection_count(),
+                         (uint64_t)g_query_count, (uint64_t)g_recv_bytes, (uint64_t)g_send_bytes,
+                         server.timeout_count(), (uint64_t)g_accept_count, (uint64_t)g_accept_errors);
+        writer.write(record);
+
         server.join();
     }
     catch (const std::exception & e) {
@@ -223,10 +572,14 @@ void print_usage(const std::string & app_name, const boost::program_options::opt
 int main(int argc, char * argv[])
 {
     std::string app_name;
-    std::string test_mode, test_method, nodelay, rpc_topic;
+    std::string test_mode, test_method, nodelay, compress, mirror_buffer, rpc_topic, upstream;
     std::string server_ip, server_port;
     std::string mode, test, cmd, cmd_value;
+    std::string output, output_file;
     int32_t pipeline = 1, packet_size = 0, thread_num = 0, need_echo = 1;
+    int32_t idle_timeout = 60, keepalive_timeout = 15, write_timeout = 30;
+    int32_t response_size = 0, h2_streams = 256, budget_requests = 64, budget_bytes = 0, upstream_conns = 4;
+    int32_t body_window = 0;
 
     namespace options = boost::program_options;
     options::options_description desc("Command list");
@@ -234,13 +587,27 @@ int main(int argc, char * argv[])
         ("help,h",                                                                                  "usage info")
         ("host,s",          options::value<std::string>(&server_ip)->default_value("127.0.0.1"),    "server host or ip address")
         ("port,p",          options::value<std::string>(&server_port)->default_value("9000"),       "server port")
-        ("mode,m",          options::value<std::string>(&test_mode)->default_value("echo"),         "test mode = [echo]")
+        ("mode,m",          options::value<std::string>(&test_mode)->default_value("echo"),         "test mode = [echo, http, h2c, proxy]")
         ("test,t",          options::value<std::string>(&test_method)->default_value("pingpong"),   "test method = [pingpong, qps, latency, throughput]")
         ("pipeline,l",      options::value<int32_t>(&pipeline)->default_value(1),                   "pipeline numbers")
         ("packet-size,k",   options::value<int32_t>(&packet_size)->default_value(64),               "packet size")
         ("thread-num,n",    options::value<int32_t>(&thread_num)->default_value(0),                 "thread numbers")
         ("nodelay,y",       options::value<std::string>(&nodelay)->default_value("false"),          "TCP socket nodelay = [0 or 1, true or false]")
         ("echo,e",          options::value<int32_t>(&need_echo)->default_value(1),                  "whether the server need echo")
+        ("idle-timeout",    options::value<int32_t>(&idle_timeout)->default_value(60),              "idle timeout before the first request, in seconds (0 = disable)")
+        ("keepalive-timeout", options::value<int32_t>(&keepalive_timeout)->default_value(15),       "keep-alive timeout between two requests, in seconds (0 = disable)")
+        ("write-timeout",   options::value<int32_t>(&write_timeout)->default_value(30),             "write-stall timeout, in seconds (0 = disable)")
+        ("compress",        options::value<std::string>(&compress)->default_value("true"),          "http: serve the pre-compressed gzip/deflate responses = [0 or 1, true or false]")
+        ("mirror-buffer",   options::value<std::string>(&mirror_buffer)->default_value("true"),     "http: map the ring buffer twice (memfd), no rollback copy = [0 or 1, true or false]")
+        ("response-size",   options::value<int32_t>(&response_size)->default_value(0),              "http: the body size of the template html response (0 = \"Hello World!\")")
+        ("budget-requests", options::value<int32_t>(&budget_requests)->default_value(64),           "http: the requests handled per wakeup of a connection before it yields (0 = no limit)")
+        ("budget-bytes",    options::value<int32_t>(&budget_bytes)->default_value(0),               "http: the request bytes handled per wakeup of a connection before it yields (0 = no limit)")
+        ("body-window",     options::value<int32_t>(&body_window)->default_value(0),                "http: the request body bytes a connection takes before it pauses for the sink to drain (0 = no limit)")
+        ("h2-streams",      options::value<int32_t>(&h2_streams)->default_value(256),               "h2c: SETTINGS_MAX_CONCURRENT_STREAMS of a connection")
+        ("upstream",        options::value<std::string>(&upstream)->default_value(""),              "proxy: the upstream servers = host:port[,host:port...]")
+        ("upstream-conns",  options::value<int32_t>(&upstream_conns)->default_value(4),             "proxy: the pre-warmed connections to every upstream, per thread")
+        ("output,o",        options::value<std::string>(&output)->default_value("text"),            "the stats output = [text, json, csv]")
+        ("output-file,O",   options::value<std::string>(&output_file)->default_value(""),           "json/csv: the file of the stats records (default: stdout)")
         ;
 
     // Parse the command line.
@@ -290,6 +657,16 @@ int main(int argc, char * argv[])
         g_test_mode_str = test_mode;
         g_test_mode_full_str = "http server";
     }
+    else if (test_mode == "proxy") {
+        g_test_mode = test_mode_http_proxy;
+        g_test_mode_str = test_mode;
+        g_test_mode_full_str = "http reverse proxy";
+    }
+    else if (test_mode == "h2c") {
+        g_test_mode = test_mode_http2_server;
+        g_test_mode_str = test_mode;
+        g_test_mode_full_str = "h2c server";
+    }
     else if (test_mode == "no-echo") {
         g_test_mode = test_mode_echo_server;
         g_test_mode_str = test_mode;
@@ -355,6 +732,73 @@ int main(int argc, char * argv[])
     std::cout << "need_echo: " << need_echo << std::endl;
     g_need_echo =  need_echo;
 
+    // timeouts
+    g_idle_timeout      = (idle_timeout > 0) ? (uint32_t)idle_timeout : 0;
+    g_keepalive_timeout = (keepalive_timeout > 0) ? (uint32_t)keepalive_timeout : 0;
+    g_write_timeout     = (write_timeout > 0) ? (uint32_t)write_timeout : 0;
+    std::cout << "timeouts: idle = " << g_idle_timeout << " s, keep-alive = " << g_keepalive_timeout
+              << " s, write = " << g_write_timeout << " s" << std::endl;
+
+    // compress, response-size
+    g_http_compress = (compress == "1" || compress == "true") ? 1 : 0;
+    g_response_body_size = (response_size > 0) ? (uint32_t)response_size : 0;
+    std::cout << "http compress: " << (g_http_compress ? "true" : "false")
+              << ", response body size: " << g_response_body_size << std::endl;
+
+    // mirror-buffer
+    g_mirror_buffer = (mirror_buffer == "1" || mirror_buffer == "true") ? 1 : 0;
+    std::cout << "http mirror ring buffer: " << (g_mirror_buffer ? "true" : "false")
+              << (http_ring_buffer::is_mirror_supported() ? "" : " (not supported, use the copy mode)") << std::endl;
+
+    // budget-requests, budget-bytes
+    g_http_budget_requests = (budget_requests > 0) ? (uint32_t)budget_requests : 0;
+    g_http_budget_bytes = (budget_bytes > 0) ? (uint32_t)budget_bytes : 0;
+    if (g_test_mode == test_mode_http_server || g_test_mode == test_mode_http_proxy) {
+        std::cout << "http budget per wakeup: requests = " << g_http_budget_requests
+                  << ", bytes = " << g_http_budget_bytes << " (0 = no limit)" << std::endl;
+    }
+
+    // body-window
+    g_http_body_window = (body_window > 0) ? (uint32_t)body_window : 0;
+    if (g_http_body_window != 0 && g_test_mode == test_mode_http_server) {
+        std::cout << "http body window: " << g_http_body_window << " bytes" << std::endl;
+    }
+
+    // h2-streams
+    g_http2_max_streams = (h2_streams > 0) ? (uint32_t)h2_streams : 1;
+    if (g_test_mode == test_mode_http2_server) {
+        std::cout << "h2c max concurrent streams: " << g_http2_max_streams << std::endl;
+    }
+
+    // upstream, upstream-conns
+    if (g_test_mode == test_mode_http_proxy) {
+        std::vector<std::pair<std::string, std::string>> upstreams;
+        if (!parse_upstream_list(upstream, upstreams)) {
+            std::cerr << "Error: proxy mode needs --upstream=host:port[,host:port...], it is \""
+                      << upstream.c_str() << "\"." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        g_upstream_list = upstream;
+        g_upstream_conns = (upstream_conns > 0) ? (uint32_t)upstream_conns : 0;
+        std::cout << "proxy upstreams: " << g_upstream_list.c_str()
+                  << ", pre-warmed connections: " << g_upstream_conns << " per upstream per thread" << std::endl;
+    }
+
+    // output
+    if (args_map.count("output") > 0) {
+        output = args_map["output"].as<std::string>();
+    }
+    if (!parse_stats_output_format(output, g_stats_output)) {
+        std::cerr << "Error: Unknown stats output: [" << output.c_str() << "]." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (args_map.count("output-file") > 0) {
+        output_file = args_map["output-file"].as<std::string>();
+    }
+    g_stats_output_file = output_file;
+    std::cout << "output: " << output.c_str()
+              << (output_file.empty() ? std::string() : (", file: " + output_file)) << std::endl;
+
     // Run the server
     std::cout << std::endl;
     std::cout << app_name.c_str() << " begin ..." << std::endl;
@@ -365,9 +809,12 @@ int main(int argc, char * argv[])
     std::cout << "packet_size: " << packet_size << ", thread_num: " << thread_num << std::endl;
     std::cout << std::endl;
 
-    if (g_test_mode == test_mode_http_server) {
+    if (g_test_mode == test_mode_http_server || g_test_mode == test_mode_http_proxy) {
         run_asio_http_server(server_ip, server_port, packet_size, thread_num);
     }
+    else if (g_test_mode == test_mode_http2_server) {
+        run_asio_http2_server(server_ip, server_port, packet_size, thread_num);
+    }
     else if (g_test_mode == test_mode_no_echo_server) {
         // TODO:
         std::cout << "TODO: test_mode_no_echo_server." << std::endl;
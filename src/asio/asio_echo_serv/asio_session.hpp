@@ -10,6 +10,8 @@
 #include <boost/smart_ptr.hpp>
 
 #include "common.h"
+#include "timing_wheel.hpp"
+#include "common/echo_control.hpp"
 
 using namespace boost::system;
 
@@ -28,12 +30,15 @@ using namespace boost::asio;
 
 namespace asio_test {
 
-class asio_session : public boost::enable_shared_from_this<asio_session>,
+class asio_session : public std::enable_shared_from_this<asio_session>,
+                     public wheel_timer,
                      private boost::noncopyable {
 private:
     enum { PACKET_SIZE = MAX_PACKET_SIZE };
 
     ip::tcp::socket socket_;
+    /// The timing wheel of the io_service it runs on, nullptr means no timeouts.
+    timing_wheel *  timing_wheel_;
     uint32_t    need_echo_;
     uint32_t    buffer_size_;
     uint32_t    packet_size_;
@@ -48,14 +53,20 @@ private:
     uint32_t    send_bytes_remain_;
     uint32_t    recieved_bytes_remain_;
 
+    // The offset in the current packet, a control message begins at offset 0.
+    uint32_t    packet_offset_;
+    // The bytes of a control message which has arrived in pieces, at the front of data_.
+    uint32_t    control_bytes_;
+
     char data_[PACKET_SIZE];
 
 public:
-    asio_session(boost::asio::io_service & io_service, uint32_t buffer_size,
+    asio_session(boost::asio::io_service & io_service, timing_wheel * wheel, uint32_t buffer_size,
                  uint32_t packet_size, uint32_t need_echo = mode_need_echo)
-        : socket_(io_service), need_echo_(need_echo), buffer_size_(buffer_size), packet_size_(packet_size),
+        : socket_(io_service), timing_wheel_(wheel), need_echo_(need_echo),
+          buffer_size_(buffer_size), packet_size_(packet_size),
           query_count_(0), recieved_bytes_(0), send_bytes_(0), recieved_cnt_(0), sent_cnt_(0),
-          send_bytes_remain_(0), recieved_bytes_remain_(0)
+          send_bytes_remain_(0), recieved_bytes_remain_(0), packet_offset_(0), control_bytes_(0)
     {
         if (buffer_size_ > MAX_PACKET_SIZE)
             buffer_size_ = MAX_PACKET_SIZE;
@@ -66,7 +77,7 @@ public:
 
     ~asio_session()
     {
-        stop(false);
+        stop();
     }
 
     void start()
@@ -74,10 +85,8 @@ public:
         set_socket_send_bufsize(MAX_PACKET_SIZE);
         set_socket_recv_bufsize(MAX_PACKET_SIZE);
 
-        static const int kNetSendTimeout = 45 * 1000;    // Send timeout is 45 seconds.
-        static const int kNetRecvTimeout = 45 * 1000;    // Recieve timeout is 45 seconds.
-        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_SNDTIMEO, (const char *)&kNetSendTimeout, sizeof(kNetSendTimeout));
-        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_RCVTIMEO, (const char *)&kNetRecvTimeout, sizeof(kNetRecvTimeout));
+        // SO_SNDTIMEO and SO_RCVTIMEO don't work for the async operations,
+        // the idle and write-stall timeouts are handled by the timing wheel.
 
         linger sLinger;
         sLinger.l_onoff = 1;    // Enable linger
@@ -86,11 +95,13 @@ public:
 
         g_client_count++;
 
-        do_read_some();        
+        do_read_some();
     }
 
-    void stop(bool delete_self = false)
+    void stop()
     {
+        cancel_timer();
+
         if (socket_.is_open()) {
 #if !defined(_WIN32_WINNT) || (_WIN32_WINNT >= 0x0600)
             socket_.cancel();
@@ -104,9 +115,6 @@ public:
             if (g_client_count.load() != 0)
                 g_client_count--;
         }
-        
-        if (delete_self)
-            delete this;
     }
 
     ip::tcp::socket & socket()
@@ -114,12 +122,32 @@ public:
         return socket_;
     }
 
-    static boost::shared_ptr<asio_session> create_new(
-        boost::asio::io_service & io_service, uint32_t buffer_size, uint32_t packet_size) {
-        return boost::shared_ptr<asio_session>(new asio_session(io_service, buffer_size, packet_size, g_test_mode));
+    static std::shared_ptr<asio_session> create_new(
+        boost::asio::io_service & io_service, timing_wheel * wheel,
+        uint32_t buffer_size, uint32_t packet_size, uint32_t need_echo) {
+        return std::make_shared<asio_session>(io_service, wheel, buffer_size, packet_size, need_echo);
     }
 
 private:
+    void arm_timeout(uint32_t timeout_type)
+    {
+        if (timing_wheel_ != nullptr) {
+            uint32_t timeout_ms = get_session_timeout_ms(timeout_type);
+            if (timeout_ms != 0) {
+                timing_wheel_->schedule(this, timeout_ms);
+            }
+            else {
+                cancel_timer();
+            }
+        }
+    }
+
+    void on_timeout()
+    {
+        // Closing the socket aborts the pending operations, they release the session.
+        stop();
+    }
+
     int get_socket_send_bufsize() const
     {
         boost::asio::socket_base::send_buffer_size send_bufsize_option;
@@ -251,38 +279,61 @@ private:
 
     void do_read()
     {
-        //auto self(this->shared_from_this());
-        boost::asio::async_read(socket_, boost::asio::buffer(data_, packet_size_),
-            [this](const boost::system::error_code & ec, std::size_t received_bytes)
+        arm_timeout(timeout_idle);
+        auto self(shared_from_this());
+        // A control message may be shorter than a packet, the buffer has room for it.
+        std::size_t read_size = std::max((std::size_t)packet_size_, (std::size_t)echo_control::kMessageSize);
+        boost::asio::async_read(socket_, boost::asio::buffer(data_, read_size),
+            [this](const boost::system::error_code & ec, std::size_t received_bytes) -> std::size_t
+            {
+                // Stop at the end of a control message, or else at the end of the packet.
+                uint32_t command, value;
+                if (ec)
+                    return 0;
+                if (received_bytes != 0 && echo_control::is_partial(data_, received_bytes))
+                    return (echo_control::kMessageSize - received_bytes);
+                if (echo_control::parse(data_, received_bytes, command, value))
+                    return 0;
+                return (received_bytes < packet_size_) ? (packet_size_ - received_bytes) : 0;
+            },
+            [this, self](const boost::system::error_code & ec, std::size_t received_bytes)
             {
-                if ((uint32_t)received_bytes != packet_size_) {
-                    std::cout << "asio_session::do_read(): async_read(), received_bytes = "
-                              << received_bytes << " bytes." << std::endl;
-                }
                 if (!ec) {
                     // Count the recieved bytes
                     do_recieve_counter((uint32_t)received_bytes);
 
+                    if (on_control_message((uint32_t)received_bytes)) {
+                        do_write_control(true);
+                        return;
+                    }
+                    if ((uint32_t)received_bytes != packet_size_) {
+                        std::cout << "asio_session::do_read(): async_read(), received_bytes = "
+                                  << received_bytes << " bytes." << std::endl;
+                    }
+
                     // A successful request, can be used to statistic qps
-                    do_write();
+                    do_write((uint32_t)received_bytes);
                 }
                 else {
-                    // Write error log
-                    std::cout << "asio_session::do_read() - Error: (code = " << ec.value() << ") "
-                              << ec.message().c_str() << std::endl;
+                    // Write error log, a close by the client is not an error (short-lived connections).
+                    if (ec != boost::asio::error::eof) {
+                        std::cout << "asio_session::do_read() - Error: (code = " << ec.value() << ") "
+                                  << ec.message().c_str() << std::endl;
+                    }
 
                     if (ec != boost::asio::error::operation_aborted)
-                        stop(true);
+                        stop();
                 }
             }
         );
     }
 
-    void do_write()
+    void do_write(uint32_t data_bytes)
     {
-        //auto self(this->shared_from_this());
-        boost::asio::async_write(socket_, boost::asio::buffer(data_, packet_size_),
-            [this](const boost::system::error_code & ec, std::size_t send_bytes)
+        arm_timeout(timeout_write_stall);
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(data_, data_bytes),
+            [this, self, data_bytes](const boost::system::error_code & ec, std::size_t send_bytes)
             {
                 if (!ec) {
                     // Count the sent bytes
@@ -291,7 +342,7 @@ private:
                     // If get a circle of ping-pong, we count the query one time.
                     do_query_counter_write_some((uint32_t)send_bytes);
 
-                    if ((uint32_t)send_bytes != packet_size_) {
+                    if ((uint32_t)send_bytes != data_bytes) {
                         std::cout << "asio_session::do_write(): async_write(), send_bytes = "
                                   << send_bytes << " bytes." << std::endl;
                     }
@@ -304,7 +355,7 @@ private:
                               << ec.message().c_str() << std::endl;
 
                     if (ec != boost::asio::error::operation_aborted)
-                        stop(true);
+                        stop();
                 }
             }
         );
@@ -312,8 +363,10 @@ private:
 
     void do_read_some()
     {
-        socket_.async_read_some(boost::asio::buffer(data_, buffer_size_),
-            [this](const boost::system::error_code & ec, std::size_t received_bytes)
+        arm_timeout(timeout_idle);
+        auto self(shared_from_this());
+        socket_.async_read_some(boost::asio::buffer(data_ + control_bytes_, buffer_size_ - control_bytes_),
+            [this, self](const boost::system::error_code & ec, std::size_t received_bytes)
             {
 #if 0
                 static int cnt = 0, cnt_sm = 0, cnt_big = 0;
@@ -363,17 +416,77 @@ private:
                         do_read_some();
                     }
                     else {
-                        // A successful request, can be used to statistic qps.
-                        do_write_some((int32_t)received_bytes);
+                        // With the first pieces of a control message.
+                        uint32_t data_bytes = control_bytes_ + (uint32_t)received_bytes;
+                        control_bytes_ = 0;
+                        if (packet_offset_ == 0 && echo_control::is_partial(data_, data_bytes)) {
+                            // Wait for the rest of it.
+                            control_bytes_ = data_bytes;
+                            do_read_some();
+                        }
+                        else if (packet_offset_ == 0 && on_control_message(data_bytes)) {
+                            do_write_control();
+                        }
+                        else {
+                            packet_offset_ = (uint32_t)((packet_offset_ + data_bytes) % packet_size_);
+                            // A successful request, can be used to statistic qps.
+                            do_write_some((int32_t)data_bytes);
+                        }
                     }
                 }
                 else {
-                    // Write error log
-                    std::cout << "asio_session::do_read_some() - Error: (code = " << ec.value() << ") "
+                    // Write error log, a close by the client is not an error (short-lived connections).
+                    if (ec != boost::asio::error::eof) {
+                        std::cout << "asio_session::do_read_some() - Error: (code = " << ec.value() << ") "
+                                  << ec.message().c_str() << std::endl;
+                    }
+
+                    if (ec != boost::asio::error::operation_aborted)
+                        stop();
+                }
+            }
+        );
+    }
+
+    /// Apply the control message in data_ if it's one (see echo_control), its ack replaces it.
+    bool on_control_message(uint32_t received_bytes)
+    {
+        uint32_t command, value;
+        if (!echo_control::parse(data_, received_bytes, command, value))
+            return false;
+        uint32_t applied = 0;
+        if (command == echo_control::cmd_packet_size && value != 0) {
+            packet_size_ = (value <= MAX_PACKET_SIZE) ? value : MAX_PACKET_SIZE;
+            recieved_bytes_remain_ = 0;
+            send_bytes_remain_ = 0;
+            applied = packet_size_;
+        }
+        echo_control::make_ack(data_, command, applied);
+        return true;
+    }
+
+    /// Write the ack, then go on reading whole packets (do_read()) or pieces (do_read_some()).
+    void do_write_control(bool read_packet = false)
+    {
+        arm_timeout(timeout_write_stall);
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(data_, echo_control::kMessageSize),
+            [this, self, read_packet](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec) {
+                    // The ack is not a query.
+                    do_send_counter((uint32_t)send_bytes);
+                    if (read_packet)
+                        do_read();
+                    else
+                        do_read_some();
+                }
+                else {
+                    std::cout << "asio_session::do_write_control() - Error: (code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
 
                     if (ec != boost::asio::error::operation_aborted)
-                        stop(true);
+                        stop();
                 }
             }
         );
@@ -381,7 +494,7 @@ private:
 
     void do_write_some(int32_t total_send_bytes)
     {
-        //auto self(this->shared_from_this());
+        arm_timeout(timeout_write_stall);
         while (total_send_bytes > 0) {
             std::size_t buffer_size;
             if (total_send_bytes < PACKET_SIZE)
@@ -390,8 +503,9 @@ private:
                 buffer_size = PACKET_SIZE;
 #if 1
             // async write one time <= PACKET_SIZE
+            auto self(shared_from_this());
             boost::asio::async_write(socket_, boost::asio::buffer(data_, buffer_size),
-                [this, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
+                [this, self, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
                 {
                     if (!ec) {
                         // Count the sent bytes
@@ -413,14 +527,15 @@ private:
                                   << ec.message().c_str() << std::endl;
 
                         if (ec != boost::asio::error::operation_aborted)
-                            stop(true);
+                            stop();
                     }
                 }
             );
 #else
             // async write some one time <= PACKET_SIZE
+            auto self(shared_from_this());
             socket_.async_write_some(boost::asio::buffer(data_, buffer_size),
-                [this, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
+                [this, self, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
                 {
                     if (!ec) {
                         // Count the sent bytes
@@ -442,7 +557,7 @@ private:
                                   << ec.message().c_str() << std::endl;
 
                         if (ec != boost::asio::error::operation_aborted)
-                            stop(true);
+                            stop();
                     }
                 }
             );
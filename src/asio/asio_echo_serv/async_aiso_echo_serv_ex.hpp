@@ -2,7 +2,9 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
 #include <thread>
+#include <chrono>
 #include <functional>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
@@ -10,9 +12,11 @@
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/error.hpp>
+#include <boost/asio/signal_set.hpp>
 
 #include "common.h"
 #include "io_service_pool.hpp"
+#include "timing_wheel.hpp"
 #include "asio_session.hpp"
 
 using namespace boost::asio;
@@ -26,30 +30,50 @@ class async_asio_echo_serv_ex : public boost::enable_shared_from_this<async_asio
                                 private boost::noncopyable
 {
 private:
+    // The delay (ms) before accepting again after an accept error.
+    enum { kAcceptRetryDelay = 10 };
+
     io_service_pool					io_service_pool_;
+    timing_wheel_pool               timing_wheels_;
     boost::asio::ip::tcp::acceptor	acceptor_;
+    boost::asio::steady_timer       accept_timer_;
+    boost::asio::signal_set         signals_;
     std::shared_ptr<asio_session>	session_;
     std::shared_ptr<std::thread>	thread_;
     uint32_t                        buffer_size_;
     uint32_t					    packet_size_;
+    std::atomic<bool>               stopped_;
 
 public:
     async_asio_echo_serv_ex(const std::string & ip_addr, const std::string & port,
         uint32_t buffer_size = 32768,
         uint32_t packet_size = 64,
         uint32_t pool_size = std::thread::hardware_concurrency())
-        : io_service_pool_(pool_size), acceptor_(io_service_pool_.get_first_io_service()),
-          buffer_size_(buffer_size), packet_size_(packet_size)
+        : io_service_pool_(pool_size), timing_wheels_(io_service_pool_),
+          acceptor_(io_service_pool_.get_first_io_service()),
+          accept_timer_(io_service_pool_.get_first_io_service()),
+          signals_(io_service_pool_.get_first_io_service()),
+          buffer_size_(buffer_size), packet_size_(packet_size), stopped_(false)
     {
+#if defined(__linux__)
+        signals_.add(SIGINT);
+        signals_.add(SIGTERM);
+        signals_.async_wait([this](const boost::system::error_code & ec, int signal_no)
+                            {
+                                shutdown();
+                            });
+#endif
         start(ip_addr, port);
     }
 
     async_asio_echo_serv_ex(short port, uint32_t buffer_size = 32768,
         uint32_t packet_size = 64,
         uint32_t pool_size = std::thread::hardware_concurrency())
-        : io_service_pool_(pool_size), acceptor_(io_service_pool_.get_first_io_service(),
-          ip::tcp::endpoint(ip::tcp::v4(), port)),
-          buffer_size_(buffer_size), packet_size_(packet_size)
+        : io_service_pool_(pool_size), timing_wheels_(io_service_pool_),
+          acceptor_(io_service_pool_.get_first_io_service(), ip::tcp::endpoint(ip::tcp::v4(), port)),
+          accept_timer_(io_service_pool_.get_first_io_service()),
+          signals_(io_service_pool_.get_first_io_service()),
+          buffer_size_(buffer_size), packet_size_(packet_size), stopped_(false)
     {
         do_accept();
     }
@@ -88,6 +112,24 @@ public:
         if (acceptor_.is_open()) {
             acceptor_.cancel();
         }
+        boost::system::error_code ignored_ec;
+        accept_timer_.cancel(ignored_ec);
+    }
+
+    /// Stop accepting, then stop the io_services, the pending sessions are released with them.
+    void shutdown()
+    {
+        if (stopped_.exchange(true))
+            return;
+        io_service_pool_.get_first_io_service().post([this]() {
+            this->stop();
+            io_service_pool_.stop();
+        });
+    }
+
+    bool is_stopped() const
+    {
+        return stopped_.load();
     }
 
     void run()
@@ -101,12 +143,34 @@ public:
             thread_->join();
     }
 
+    /// The total expired timeouts of all the sessions.
+    uint64_t timeout_count() const
+    {
+        return timing_wheels_.expired_count();
+    }
+
 private:
-    void handle_accept(const boost::system::error_code & ec, asio_session * session)
+    std::shared_ptr<asio_session> new_session(std::size_t io_index)
+    {
+        return asio_session::create_new(io_service_pool_.get_io_service(io_index),
+                                        &timing_wheels_.get_wheel(io_index),
+                                        buffer_size_, packet_size_, g_need_echo);
+    }
+
+    void start_session(std::shared_ptr<asio_session> session, std::size_t io_index)
+    {
+        // Start the session on the thread of its own io_service, the timing wheel
+        // of the io_service can only be touched by that thread.
+        io_service_pool_.get_io_service(io_index).post(boost::bind(&asio_session::start, session));
+    }
+
+    void handle_accept(const boost::system::error_code & ec, std::shared_ptr<asio_session> session,
+                       std::size_t io_index)
     {
         if (!ec) {
+            g_accept_count.fetch_add(1);
             if (session) {
-                session->start();
+                start_session(session, io_index);
             }
             do_accept();
         }
@@ -116,26 +180,42 @@ private:
                       << ec.message().c_str() << std::endl;
             if (session) {
                 session->stop();
-                delete session;
+            }
+            // Canceled by stop(), otherwise (e.g. out of fds) keep accepting after a while.
+            if (ec != boost::asio::error::operation_aborted) {
+                g_accept_errors.fetch_add(1);
+                do_accept_later();
             }
         }
     }
 
+    void do_accept_later()
+    {
+        accept_timer_.expires_from_now(std::chrono::milliseconds(kAcceptRetryDelay));
+        accept_timer_.async_wait([this](const boost::system::error_code & ec)
+            {
+                if (!ec && acceptor_.is_open())
+                    do_accept();
+            });
+    }
+
     void do_accept()
     {
-        asio_session * new_session = new asio_session(io_service_pool_.get_io_service(), buffer_size_, packet_size_, g_need_echo);
-        acceptor_.async_accept(new_session->socket(), boost::bind(&async_asio_echo_serv_ex::handle_accept,
-                               this, boost::asio::placeholders::error, new_session));
+        std::size_t io_index = io_service_pool_.get_next_index();
+        std::shared_ptr<asio_session> session = new_session(io_index);
+        acceptor_.async_accept(session->socket(), boost::bind(&async_asio_echo_serv_ex::handle_accept,
+                               this, boost::asio::placeholders::error, session, io_index));
     }
 
     void do_accept_lambda()
     {
-        session_.reset(new asio_session(io_service_pool_.get_io_service(), buffer_size_, packet_size_, g_need_echo));
+        std::size_t io_index = io_service_pool_.get_next_index();
+        session_ = new_session(io_index);
         acceptor_.async_accept(session_->socket(),
-            [this](const boost::system::error_code & ec)
+            [this, io_index](const boost::system::error_code & ec)
             {
                 if (!ec) {
-                    session_->start();
+                    start_session(session_, io_index);
                 }
                 else {
                     // Accept error
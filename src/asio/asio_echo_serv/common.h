@@ -14,11 +14,25 @@ extern uint32_t g_nodelay;
 extern uint32_t g_need_echo;
 extern uint32_t g_packet_size;
 
+extern uint32_t g_idle_timeout;
+extern uint32_t g_keepalive_timeout;
+extern uint32_t g_write_timeout;
+
+extern uint32_t g_http_compress;
+extern uint32_t g_response_body_size;
+extern uint32_t g_mirror_buffer;
+extern uint32_t g_http2_max_streams;
+extern uint32_t g_http_budget_requests;
+extern uint32_t g_http_budget_bytes;
+extern uint32_t g_http_body_window;
+extern uint32_t g_upstream_conns;
+
 extern std::string g_test_mode_str;
 extern std::string g_test_method_str;
 extern std::string g_test_mode_full_str;
 extern std::string g_nodelay_str;
 extern std::string g_rpc_topic;
+extern std::string g_upstream_list;
 
 extern std::string g_server_ip;
 extern std::string g_server_port;
@@ -32,11 +46,35 @@ enum session_mode_t {
     mode_need_echo = 1
 };
 
+enum session_timeout_t {
+    timeout_none,
+    timeout_idle,           // No request yet
+    timeout_keep_alive,     // Between two requests
+    timeout_write_stall     // The peer doesn't read the response
+};
+
+// The timeouts are in seconds, 0 means disabled.
+static inline uint32_t get_session_timeout_ms(uint32_t timeout_type)
+{
+    switch (timeout_type) {
+    case timeout_idle:
+        return g_idle_timeout * 1000;
+    case timeout_keep_alive:
+        return g_keepalive_timeout * 1000;
+    case timeout_write_stall:
+        return g_write_timeout * 1000;
+    default:
+        return 0;
+    }
+}
+
 enum test_mode_t {
     test_mode_unknown,
     test_mode_echo_server,
     test_mode_no_echo_server,
     test_mode_http_server,
+    test_mode_http2_server,
+    test_mode_http_proxy,
     test_mode_rpc_call,
     test_mode_sub_pub,
     test_mode_default = -1
@@ -55,9 +93,25 @@ enum test_method_t {
 extern aligned_atomic<uint64_t> g_query_count;
 extern aligned_atomic<uint32_t> g_client_count;
 
+extern aligned_atomic<uint64_t> g_accept_count;
+extern aligned_atomic<uint64_t> g_accept_errors;
+
 extern aligned_atomic<uint64_t> g_recv_bytes;
 extern aligned_atomic<uint64_t> g_send_bytes;
 
+extern aligned_atomic<uint64_t> g_compress_count;
+extern aligned_atomic<uint64_t> g_compress_saved_bytes;
+extern aligned_atomic<uint64_t> g_rollback_bytes;
+extern aligned_atomic<uint64_t> g_write_fallbacks;
+extern aligned_atomic<uint64_t> g_budget_yields;
+extern aligned_atomic<uint64_t> g_body_pauses;
+
+extern aligned_atomic<uint64_t> g_upstream_connects;
+extern aligned_atomic<uint64_t> g_upstream_errors;
+extern aligned_atomic<uint64_t> g_proxy_requests;
+extern aligned_atomic<uint64_t> g_proxy_total_ns;
+extern aligned_atomic<uint64_t> g_proxy_upstream_ns;
+
 extern const std::string g_response_html;
 
 }
@@ -0,0 +1,202 @@
+
+#pragma once
+
+#include <assert.h>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/io_service.hpp>
+
+#include "io_service_pool.hpp"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                          < Sharded connection registry >
+
+  One shard per io_service, a shard is only touched by the thread which runs its
+  io_service, so insert() and erase() need no lock and no atomic RMW at all.
+
+  Every shard keeps a vector of connections, and every connection remembers its
+  slot in the vector (connection_registry_hook), so both insert and erase are O(1),
+  erase moves the last connection into the freed slot.
+
+  Walking all the connections (for stats or shutdown) is posted to every shard,
+  and a shard only visits kVisitBatchSize connections per handler, then it posts
+  the rest, so a big shard never stalls its event loop. The walk goes from the
+  back to the front, so erasing the visited connection in the visitor is safe.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+template <typename Connection>
+class connection_shard;
+
+template <typename Connection>
+class connection_registry_hook {
+private:
+    friend class connection_shard<Connection>;
+
+    connection_shard<Connection> *  registry_shard_;
+    std::size_t                     registry_slot_;
+
+public:
+    connection_registry_hook() : registry_shard_(nullptr), registry_slot_(0) {}
+    ~connection_registry_hook() {}
+
+    bool is_registered() const { return (registry_shard_ != nullptr); }
+
+    connection_shard<Connection> * registry_shard() const { return registry_shard_; }
+};
+
+template <typename Connection>
+class connection_shard : private boost::noncopyable {
+public:
+    typedef connection_registry_hook<Connection>    hook_type;
+    typedef std::function<void (Connection &)>      visitor_type;
+    typedef std::function<void ()>                  complete_type;
+
+    enum { kVisitBatchSize = 256 };
+
+private:
+    boost::asio::io_service &   io_service_;
+    std::size_t                 index_;
+    std::vector<Connection *>   connections_;
+    // Written by the owner thread only, read by the stats thread.
+    std::atomic<std::size_t>    size_;
+
+public:
+    connection_shard(boost::asio::io_service & io_service, std::size_t index)
+        : io_service_(io_service), index_(index), size_(0) {}
+    ~connection_shard() {}
+
+    boost::asio::io_service & get_io_service() const { return io_service_; }
+
+    std::size_t index() const { return index_; }
+
+    /// Can be read from any thread.
+    std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+    /// Must be called on the thread which runs this shard's io_service.
+    void insert(Connection * connection) {
+        hook_type & hook = *connection;
+        assert(hook.registry_shard_ == nullptr);
+        hook.registry_shard_ = this;
+        hook.registry_slot_ = connections_.size();
+        connections_.push_back(connection);
+        size_.store(connections_.size(), std::memory_order_relaxed);
+    }
+
+    /// Must be called on the thread which runs this shard's io_service.
+    bool erase(Connection * connection) {
+        hook_type & hook = *connection;
+        if (hook.registry_shard_ != this)
+            return false;
+
+        std::size_t slot = hook.registry_slot_;
+        assert(slot < connections_.size() && connections_[slot] == connection);
+        Connection * last = connections_.back();
+        connections_[slot] = last;
+        static_cast<hook_type &>(*last).registry_slot_ = slot;
+        connections_.pop_back();
+
+        hook.registry_shard_ = nullptr;
+        hook.registry_slot_ = 0;
+        size_.store(connections_.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    /// Visit all the connections on the shard's thread, can be called from any thread.
+    void visit(const visitor_type & visitor, const complete_type & complete) {
+        io_service_.post([this, visitor, complete]() {
+            visit_from(connections_.size(), visitor, complete);
+        });
+    }
+
+private:
+    void visit_from(std::size_t cursor, const visitor_type & visitor, const complete_type & complete) {
+        std::size_t visited = 0;
+        while (cursor > 0 && visited < kVisitBatchSize) {
+            --cursor;
+            // The vector may be shrunk by the connections closed between two batches.
+            if (cursor < connections_.size()) {
+                visitor(*connections_[cursor]);
+                ++visited;
+            }
+        }
+
+        if (cursor > 0) {
+            // Yield to the other handlers on this io_service, then continue.
+            io_service_.post([this, cursor, visitor, complete]() {
+                visit_from(cursor, visitor, complete);
+            });
+        }
+        else if (complete) {
+            complete();
+        }
+    }
+};
+
+template <typename Connection>
+class connection_registry : private boost::noncopyable {
+public:
+    typedef connection_shard<Connection>            shard_type;
+    typedef typename shard_type::visitor_type       visitor_type;
+    typedef typename shard_type::complete_type      complete_type;
+
+private:
+    std::vector<std::unique_ptr<shard_type>> shards_;
+
+public:
+    explicit connection_registry(io_service_pool & pool) {
+        shards_.reserve(pool.size());
+        for (std::size_t i = 0; i < pool.size(); ++i) {
+            shards_.push_back(std::unique_ptr<shard_type>(new shard_type(pool.get_io_service(i), i)));
+        }
+    }
+
+    ~connection_registry() {}
+
+    std::size_t shard_count() const { return shards_.size(); }
+
+    shard_type & shard(std::size_t index) {
+        assert(index < shards_.size());
+        return *shards_[index];
+    }
+
+    const shard_type & shard(std::size_t index) const {
+        assert(index < shards_.size());
+        return *shards_[index];
+    }
+
+    /// The total number of connections, it's a relaxed sum, no shard is stalled.
+    std::size_t size() const {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < shards_.size(); ++i) {
+            total += shards_[i]->size();
+        }
+        return total;
+    }
+
+    /// Visit all the connections, every shard walks its own connections on its own
+    /// thread, complete() is called once on the thread of the shard which finishes last.
+    void visit_all(const visitor_type & visitor, const complete_type & complete = complete_type()) {
+        std::shared_ptr< std::atomic<std::size_t> > remaining =
+            std::make_shared< std::atomic<std::size_t> >(shards_.size());
+        complete_type shard_complete = [remaining, complete]() {
+            if (remaining->fetch_sub(1) == 1) {
+                if (complete)
+                    complete();
+            }
+        };
+        for (std::size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->visit(visitor, shard_complete);
+        }
+    }
+};
+
+} // namespace asio_test
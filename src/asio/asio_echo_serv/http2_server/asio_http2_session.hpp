@@ -0,0 +1,989 @@
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "../common.h"
+#include "../connection_registry.hpp"
+#include "../timing_wheel.hpp"
+#include "../http_server/asio_http_session.hpp"
+#include "http2_frame.hpp"
+#include "hpack.hpp"
+
+using namespace boost::system;
+
+// Whether use atomic update realtime?
+#define USE_ATOMIC_REALTIME_UPDATE  0
+
+#define QUERY_COUNTER_INTERVAL      99
+
+#define MAX_UPDATE_CNT              5
+#define MAX_UPDATE_BYTES            32768
+
+using namespace boost::asio;
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                        < HTTP/2 cleartext (h2c) session >
+
+  Prior knowledge only: the client starts with the connection preface, there is
+  no HTTP/1.1 Upgrade. The frames are parsed in place in the ring buffer, a frame
+  is handled only when it's complete, so it never crosses a read.
+
+  Many streams are multiplexed on one connection: the responses are built once at
+  startup (an HPACK block of the static table and the body), a stream only keeps
+  a pointer to its response and how many body bytes have been sent.
+
+  Flow control: the request bodies are dropped at once, the receive windows are
+  replenished with WINDOW_UPDATE. The bodies of the responses are sent as DATA
+  frames, round-robin over the streams (one frame per turn), limited by the
+  connection and the stream send windows; a blocked stream goes on after its
+  WINDOW_UPDATE (or a SETTINGS_INITIAL_WINDOW_SIZE change).
+
+  All the frames are batched into one output buffer and written with one async
+  write, if the peer doesn't read, the session stops reading its frames.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+struct http2_response {
+    // The HPACK header block, it only uses the static table.
+    std::string headers;
+    std::string body;
+};
+
+//
+// Convert a http/1.1 response to a http/2 response, the connection-specific
+// headers are dropped (RFC 7540, 8.1.2.2), the names are in lower case.
+//
+static inline
+void make_http2_response(const std::string & response, bool head_only, http2_response & h2_response)
+{
+    h2_response.headers.clear();
+    h2_response.body.clear();
+
+    std::size_t header_end = response.find("\r\n\r\n");
+    if (response.size() < 12 || header_end == std::string::npos)
+        return;
+
+    // "HTTP/1.1 200 OK"
+    hpack_encode_header(h2_response.headers, ":status", 7, response.c_str() + 9, 3);
+
+    std::size_t line = response.find("\r\n") + 2;
+    while (line < header_end + 2) {
+        std::size_t line_end = response.find("\r\n", line);
+        std::size_t colon = response.find(':', line);
+        if (colon != std::string::npos && colon < line_end) {
+            std::string name = response.substr(line, colon - line);
+            for (std::size_t i = 0; i < name.size(); ++i)
+                name[i] = detail::ascii_tolower(name[i]);
+            std::size_t value = colon + 1;
+            while (value < line_end && response[value] == ' ')
+                value++;
+            if (name != "connection" && name != "keep-alive" && name != "transfer-encoding") {
+                hpack_encode_header(h2_response.headers, name.c_str(), name.size(),
+                                    response.c_str() + value, line_end - value);
+            }
+        }
+        line = line_end + 2;
+    }
+
+    if (!head_only)
+        h2_response.body = response.substr(header_end + 4);
+}
+
+static inline const http2_response & get_http2_response_404()
+{
+    struct response_404 {
+        http2_response response;
+        response_404() { make_http2_response(g_response_html_404, false, response); }
+    };
+    static const response_404 s_response_404;
+    return s_response_404.response;
+}
+
+struct http2_route_handler {
+    const http2_response * response;
+
+    http2_route_handler() : response(nullptr) {}
+    http2_route_handler(const http2_response * _response) : response(_response) {}
+};
+
+typedef http_router<http2_route_handler,
+                    http_static_routes::kRouteCount,
+                    http_static_routes::routes> http2_server_router;
+
+//
+// Picks :method and :path of a request, the other fields are skipped.
+//
+class http2_request_visitor {
+private:
+    http_method_t   method_;
+    std::string &   path_;
+
+public:
+    explicit http2_request_visitor(std::string & path) : method_(http_method_unknown), path_(path) {
+        path_.clear();
+    }
+
+    http_method_t method() const { return method_; }
+    const std::string & path() const { return path_; }
+
+    void operator () (const char * name, std::size_t name_len, const char * value, std::size_t value_len) {
+        if (name_len == 7 && ::memcmp(name, ":method", 7) == 0) {
+            // parse_http_method() needs the token followed by a space.
+            char token[8] = { 0 };
+            if (value_len < sizeof(token)) {
+                ::memcpy(token, value, value_len);
+                token[value_len] = ' ';
+                method_ = parse_http_method(token, value_len);
+            }
+        }
+        else if (name_len == 5 && ::memcmp(name, ":path", 5) == 0) {
+            // The value may be in the Huffman buffer of the decoder, copy it.
+            const char * query = (const char *)::memchr(value, '?', value_len);
+            path_.assign(value, (query != nullptr) ? (std::size_t)(query - value) : value_len);
+        }
+    }
+};
+
+struct http2_stream {
+    const http2_response *  response;
+    std::size_t             body_sent;
+    int64_t                 send_window;
+    uint32_t                recv_unacked;
+    // END_STREAM has been received, the response has been started.
+    bool                    request_done;
+    bool                    queued;
+
+    http2_stream()
+        : response(nullptr), body_sent(0), send_window(kHttp2DefaultWindowSize),
+          recv_unacked(0), request_done(false), queued(false) {}
+};
+
+class http2_connection_manager;
+class asio_http2_session;
+
+typedef std::shared_ptr<asio_http2_session> http2_connection_ptr;
+
+class asio_http2_session : public std::enable_shared_from_this<asio_http2_session>,
+                           public connection_registry_hook<asio_http2_session>,
+                           public wheel_timer,
+                           private boost::noncopyable {
+private:
+    // The receive windows advertised to the peer, the DATA is dropped at once.
+    enum { kRecvWindowSize = 1024 * 1024 };
+    // Stop reading the frames and framing the bodies when so many bytes wait for the socket.
+    enum { kMaxOutputBytes = 256 * 1024 };
+    enum { kMaxHeaderBlockSize = 64 * 1024 };
+
+    typedef std::unordered_map<uint32_t, http2_stream> stream_map;
+
+    /// Socket for the connection.
+    ip::tcp::socket socket_;
+    /// The index of the io_service (and the connection shard) it runs on.
+    std::size_t io_index_;
+    /// The manager for this connection.
+    http2_connection_manager * connection_manager_;
+    /// The timing wheel of the io_service it runs on, nullptr means no timeouts.
+    timing_wheel * timing_wheel_;
+    /// The router to dispatch the requests.
+    const http2_server_router * router_;
+
+    bool        nodelay_;
+    bool        preface_received_;
+    bool        has_request_;
+    bool        write_pending_;
+    bool        read_paused_;
+    // GOAWAY has been sent, close it after the output is written.
+    bool        closing_;
+    // GOAWAY has been received, close it after the open streams are answered.
+    bool        goaway_received_;
+    uint32_t    pending_writes_;
+    uint32_t    buffer_size_;
+    uint32_t    max_streams_;
+    uint32_t    last_stream_id_;
+    uint32_t    continuation_stream_id_;
+    uint8_t     continuation_flags_;
+    uint32_t    peer_max_frame_size_;
+    int64_t     peer_initial_window_;
+    int64_t     conn_send_window_;
+    uint32_t    conn_recv_unacked_;
+
+    uint64_t    recv_counter_;
+    uint32_t    recv_bytes_;
+    uint32_t    send_bytes_;
+    uint32_t    recv_cnt_;
+    uint32_t    send_cnt_;
+
+    http_ring_buffer    buffer_;
+    hpack_decoder       decoder_;
+    // The header block split into HEADERS and CONTINUATION frames.
+    std::string         header_block_;
+    std::string         request_path_;
+    stream_map          streams_;
+    // The streams which have body bytes to send and some send window.
+    std::deque<uint32_t> send_queue_;
+    std::string         output_;
+    std::string         writing_;
+
+public:
+    asio_http2_session(boost::asio::io_service & io_service, std::size_t io_index,
+                       http2_connection_manager * manager, timing_wheel * wheel,
+                       const http2_server_router * router, uint32_t buffer_size, uint32_t max_streams)
+        : socket_(io_service), io_index_(io_index), connection_manager_(manager), timing_wheel_(wheel),
+          router_(router), nodelay_(false), preface_received_(false), has_request_(false),
+          write_pending_(false), read_paused_(false), closing_(false), goaway_received_(false), pending_writes_(0),
+          buffer_size_(buffer_size), max_streams_(max_streams), last_stream_id_(0),
+          continuation_stream_id_(0), continuation_flags_(0), peer_max_frame_size_(kHttp2DefaultFrameSize),
+          peer_initial_window_(kHttp2DefaultWindowSize), conn_send_window_(kHttp2DefaultWindowSize),
+          conn_recv_unacked_(0), recv_counter_(0), recv_bytes_(0), send_bytes_(0), recv_cnt_(0), send_cnt_(0),
+          buffer_(buffer_size, g_mirror_buffer != 0)
+    {
+        nodelay_ = (g_nodelay != 0);
+        if (buffer_size_ > MAX_PACKET_SIZE)
+            buffer_size_ = MAX_PACKET_SIZE;
+        if (max_streams_ == 0)
+            max_streams_ = 1;
+    }
+
+    ~asio_http2_session()
+    {
+        // stop() must have unregistered the session, see asio_http_session.
+        assert(!is_registered());
+    }
+
+    void start()
+    {
+        set_socket_send_bufsize(MAX_PACKET_SIZE);
+        set_socket_recv_bufsize(MAX_PACKET_SIZE);
+
+        socket_.set_option(ip::tcp::no_delay(nodelay_));
+
+        linger sLinger;
+        sLinger.l_onoff = 1;    // Enable linger
+        sLinger.l_linger = 5;   // After shutdown(), socket send/recv 5 second data yet.
+        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_LINGER, (const char *)&sLinger, sizeof(sLinger));
+
+        g_client_count++;
+
+        if (g_first_time) {
+            g_first_time = false;
+            g_start_time = steady_clock::now();
+        }
+
+        start_connection();
+
+        // The server connection preface, it needn't wait for the client's.
+        const uint32_t settings[][2] = {
+            { http2_settings_max_concurrent_streams, max_streams_ },
+            { http2_settings_initial_window_size,    kRecvWindowSize }
+        };
+        http2_append_settings(output_, settings, sizeof(settings) / sizeof(settings[0]));
+        http2_append_window_update(output_, 0, kRecvWindowSize - kHttp2DefaultWindowSize);
+        do_flush();
+
+        do_read_some();
+    }
+
+    void stop()
+    {
+        cancel_timer();
+
+        if (socket_.is_open()) {
+            init_shutdown();
+            socket_.close();
+
+            if (g_client_count.load() != 0)
+                g_client_count--;
+        }
+
+        // Runs on the thread of its own io_service, so it's safe to unregister here.
+        if (is_registered())
+            registry_shard()->erase(this);
+    }
+
+    void start_connection();
+    void stop_connection(const boost::system::error_code & ec);
+
+    void init_shutdown()
+    {
+        // Initiate graceful connection closure.
+        boost::system::error_code ignored_ec;
+        socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+    }
+
+    ip::tcp::socket & socket()
+    {
+        return socket_;
+    }
+
+    std::size_t io_index() const
+    {
+        return io_index_;
+    }
+
+    static http2_connection_ptr create_new(
+        boost::asio::io_service & io_service, std::size_t io_index, http2_connection_manager * conn_manager,
+        timing_wheel * wheel, const http2_server_router * router, uint32_t buffer_size, uint32_t max_streams) {
+        return std::make_shared<asio_http2_session>(io_service, io_index, conn_manager, wheel, router,
+                                                    buffer_size, max_streams);
+    }
+
+private:
+    void arm_timeout(uint32_t timeout_type)
+    {
+        if (timing_wheel_ != nullptr) {
+            uint32_t timeout_ms = get_session_timeout_ms(timeout_type);
+            if (timeout_ms != 0)
+                timing_wheel_->schedule(this, timeout_ms);
+            else
+                cancel_timer();
+        }
+    }
+
+    void arm_read_timeout()
+    {
+        if (pending_writes_ != 0)
+            arm_timeout(timeout_write_stall);
+        else if (has_request_)
+            arm_timeout(timeout_keep_alive);
+        else
+            arm_timeout(timeout_idle);
+    }
+
+    void on_write_started()
+    {
+        pending_writes_++;
+        arm_timeout(timeout_write_stall);
+    }
+
+    void on_write_completed()
+    {
+        if (pending_writes_ != 0)
+            pending_writes_--;
+        if (pending_writes_ == 0)
+            arm_timeout(timeout_keep_alive);
+    }
+
+    void on_timeout()
+    {
+        // Closing the socket aborts the pending operations, they release the session.
+        stop();
+    }
+
+    void set_socket_send_bufsize(int buffer_size)
+    {
+        boost::asio::socket_base::receive_buffer_size send_bufsize_option(buffer_size);
+        socket_.set_option(send_bufsize_option);
+    }
+
+    void set_socket_recv_bufsize(int buffer_size)
+    {
+        boost::asio::socket_base::receive_buffer_size recv_bufsize_option(buffer_size);
+        socket_.set_option(recv_bufsize_option);
+    }
+
+    inline void do_recieve_counter(uint32_t bytes_recieved)
+    {
+#if defined(USE_ATOMIC_REALTIME_UPDATE) && (USE_ATOMIC_REALTIME_UPDATE > 0)
+        if (bytes_recieved > 0) {
+            g_recv_bytes.fetch_add(bytes_recieved);
+        }
+#else
+        if (bytes_recieved > 0) {
+            recv_bytes_ += bytes_recieved;
+            recv_cnt_++;
+            if (recv_cnt_ >= MAX_UPDATE_CNT || recv_bytes_ >= MAX_UPDATE_BYTES) {
+                g_recv_bytes.fetch_add(recv_bytes_);
+                recv_bytes_ = 0;
+                recv_cnt_ = 0;
+            }
+        }
+#endif
+    }
+
+    inline void do_send_counter(uint32_t bytes_sent)
+    {
+#if defined(USE_ATOMIC_REALTIME_UPDATE) && (USE_ATOMIC_REALTIME_UPDATE > 0)
+        if (bytes_sent > 0) {
+            g_send_bytes.fetch_add(bytes_sent);
+        }
+#else
+        if (bytes_sent > 0) {
+            send_bytes_ += bytes_sent;
+            send_cnt_++;
+            if (send_cnt_ >= MAX_UPDATE_CNT || send_bytes_ >= MAX_UPDATE_BYTES) {
+                g_send_bytes.fetch_add(send_bytes_);
+                send_bytes_ = 0;
+                send_cnt_ = 0;
+            }
+        }
+#endif
+    }
+
+    inline void do_recv_qps_counter()
+    {
+#if defined(USE_ATOMIC_REALTIME_UPDATE) && (USE_ATOMIC_REALTIME_UPDATE > 0)
+        g_query_count.fetch_add(1);
+#else
+        recv_counter_++;
+        if (recv_counter_ >= QUERY_COUNTER_INTERVAL) {
+            g_query_count.fetch_add(QUERY_COUNTER_INTERVAL);
+            recv_counter_ = 0;
+        }
+#endif
+    }
+
+    void do_read_some()
+    {
+        if (buffer_.free_size() <= 1024) {
+            // Roll back the ring buffer
+            do_rollback_counter(buffer_.rollback());
+
+            if (buffer_.free_size() < kHttp2FrameHeaderSize + kHttp2DefaultFrameSize) {
+                std::cout << "asio_http2_session::do_read_some() - Error: the ring buffer is too small ("
+                          << buffer_.capacity() << " bytes)." << std::endl;
+                stop();
+                return;
+            }
+        }
+
+        char * read_data = buffer_.front();
+        std::size_t read_size = std::min((std::size_t)buffer_size_, buffer_.free_size());
+
+        arm_read_timeout();
+
+        auto self(shared_from_this());
+        socket_.async_read_some(boost::asio::buffer(read_data, read_size),
+            [this, self](const boost::system::error_code & ec, std::size_t recv_bytes)
+            {
+                if (!ec) {
+                    // Count the recieved bytes
+                    do_recieve_counter((uint32_t)recv_bytes);
+
+                    bool is_ok = buffer_.read(recv_bytes);
+                    if (!is_ok) {
+                        // Roll back the ring buffer
+                        do_rollback_counter(buffer_.rollback());
+
+                        do_read_some();
+                        return;
+                    }
+
+                    process_input();
+                }
+                else {
+                    // Write error log, the read canceled by stop() (e.g. after a GOAWAY) is not an error.
+                    if (ec != boost::asio::error::operation_aborted) {
+                        std::cout << "asio_http2_session::do_read_some() - Error: (recv_bytes = " << recv_bytes
+                                  << ", code = " << ec.value() << ") "
+                                  << ec.message().c_str() << std::endl;
+                    }
+                    stop_connection(ec);
+                }
+            }
+        );
+    }
+
+    inline void do_rollback_counter(std::size_t copied_bytes)
+    {
+        if (copied_bytes > 0) {
+            g_rollback_bytes.fetch_add(copied_bytes);
+        }
+    }
+
+    /// Handle the buffered frames, write the output and read again unless it has to wait.
+    void process_input()
+    {
+        bool can_read = process_frames();
+        if (!closing_)
+            flush_streams();
+        do_flush();
+        if (can_read && socket_.is_open())
+            do_read_some();
+    }
+
+    /// Returns false if the reading must wait (backpressure) or the connection is closing.
+    bool process_frames()
+    {
+        if (!preface_received_) {
+            if (buffer_.data_length() < kHttp2PrefaceSize)
+                return true;
+            if (::memcmp(buffer_.back(), kHttp2Preface, kHttp2PrefaceSize) != 0) {
+                std::cout << "asio_http2_session::process_frames() - Error: bad connection preface." << std::endl;
+                stop();
+                return false;
+            }
+            buffer_.parse_to(buffer_.back() + kHttp2PrefaceSize);
+            preface_received_ = true;
+        }
+
+        while (buffer_.data_length() >= kHttp2FrameHeaderSize) {
+            if (output_.size() >= kMaxOutputBytes) {
+                // Backpressure: the peer doesn't read, stop reading its frames.
+                read_paused_ = true;
+                return false;
+            }
+
+            http2_frame_header header;
+            http2_parse_frame_header(buffer_.back(), header);
+            // SETTINGS_MAX_FRAME_SIZE is never raised, a frame always fits in the ring buffer.
+            if (header.length > kHttp2DefaultFrameSize)
+                return connection_error(http2_frame_size_error, "frame too large");
+            if (buffer_.data_length() < kHttp2FrameHeaderSize + header.length)
+                break;
+
+            if (!handle_frame(header, buffer_.back() + kHttp2FrameHeaderSize))
+                return false;
+            buffer_.parse_to(buffer_.back() + kHttp2FrameHeaderSize + header.length);
+        }
+        return true;
+    }
+
+    bool connection_error(uint32_t error_code, const char * reason)
+    {
+        std::cout << "asio_http2_session::connection_error() - Error: (code = " << error_code << ") "
+                  << reason << std::endl;
+        http2_append_goaway(output_, last_stream_id_, error_code);
+        closing_ = true;
+        return false;
+    }
+
+    bool handle_frame(const http2_frame_header & header, const char * payload)
+    {
+        if (continuation_stream_id_ != 0 && (header.type != http2_frame_continuation ||
+                                             header.stream_id != continuation_stream_id_))
+            return connection_error(http2_protocol_error, "CONTINUATION expected");
+
+        switch (header.type) {
+        case http2_frame_data:
+            return handle_data(header, payload);
+
+        case http2_frame_headers:
+            return handle_headers(header, payload);
+
+        case http2_frame_continuation:
+            if (continuation_stream_id_ == 0)
+                return connection_error(http2_protocol_error, "unexpected CONTINUATION");
+            header_block_.append(payload, header.length);
+            if (header_block_.size() > kMaxHeaderBlockSize)
+                return connection_error(http2_enhance_your_calm, "header block too large");
+            if (header.flags & http2_flag_end_headers) {
+                uint32_t stream_id = continuation_stream_id_;
+                continuation_stream_id_ = 0;
+                return handle_header_block(stream_id, continuation_flags_,
+                                           header_block_.c_str(), header_block_.size());
+            }
+            return true;
+
+        case http2_frame_priority:
+            // The streams are served round-robin, the priorities are ignored.
+            if (header.length != 5)
+                return connection_error(http2_frame_size_error, "bad PRIORITY");
+            return true;
+
+        case http2_frame_rst_stream:
+            if (header.length != 4)
+                return connection_error(http2_frame_size_error, "bad RST_STREAM");
+            if (header.stream_id == 0)
+                return connection_error(http2_protocol_error, "RST_STREAM on stream 0");
+            // The send queue skips the stream which is gone.
+            streams_.erase(header.stream_id);
+            return true;
+
+        case http2_frame_settings:
+            return handle_settings(header, payload);
+
+        case http2_frame_push_promise:
+            return connection_error(http2_protocol_error, "PUSH_PROMISE from the client");
+
+        case http2_frame_ping:
+            if (header.length != 8)
+                return connection_error(http2_frame_size_error, "bad PING");
+            if (header.stream_id != 0)
+                return connection_error(http2_protocol_error, "PING on a stream");
+            if ((header.flags & http2_flag_ack) == 0)
+                http2_append_ping_ack(output_, payload);
+            return true;
+
+        case http2_frame_goaway:
+            // Keep reading (the WINDOW_UPDATEs), the streams accepted so far are still answered.
+            goaway_received_ = true;
+            return true;
+
+        case http2_frame_window_update:
+            return handle_window_update(header, payload);
+
+        default:
+            // The unknown frame types must be ignored.
+            return true;
+        }
+    }
+
+    bool handle_data(const http2_frame_header & header, const char * payload)
+    {
+        if (header.stream_id == 0)
+            return connection_error(http2_protocol_error, "DATA on stream 0");
+        if (header.flags & http2_flag_padded) {
+            if (header.length == 0 || (uint8_t)payload[0] >= header.length)
+                return connection_error(http2_protocol_error, "bad DATA padding");
+        }
+
+        // The whole payload (with the padding) counts against the windows.
+        conn_recv_unacked_ += header.length;
+        if (conn_recv_unacked_ > kRecvWindowSize)
+            return connection_error(http2_flow_control_error, "connection window exceeded");
+        if (conn_recv_unacked_ >= kRecvWindowSize / 2) {
+            http2_append_window_update(output_, 0, conn_recv_unacked_);
+            conn_recv_unacked_ = 0;
+        }
+
+        stream_map::iterator it = streams_.find(header.stream_id);
+        if (it == streams_.end() || it->second.request_done) {
+            if (header.stream_id > last_stream_id_)
+                return connection_error(http2_protocol_error, "DATA on an idle stream");
+            http2_append_rst_stream(output_, header.stream_id, http2_stream_closed);
+            return true;
+        }
+
+        // The body is dropped, it only gives the window back.
+        http2_stream & stream = it->second;
+        stream.recv_unacked += header.length;
+        if (stream.recv_unacked > kRecvWindowSize)
+            return connection_error(http2_flow_control_error, "stream window exceeded");
+        if (header.flags & http2_flag_end_stream) {
+            stream.request_done = true;
+            start_response(it);
+        }
+        else if (stream.recv_unacked >= kRecvWindowSize / 2) {
+            http2_append_window_update(output_, header.stream_id, stream.recv_unacked);
+            stream.recv_unacked = 0;
+        }
+        return true;
+    }
+
+    bool handle_headers(const http2_frame_header & header, const char * payload)
+    {
+        if (header.stream_id == 0 || (header.stream_id & 1) == 0)
+            return connection_error(http2_protocol_error, "HEADERS on a bad stream id");
+
+        std::size_t offset = 0, padding = 0;
+        if (header.flags & http2_flag_padded) {
+            if (header.length < 1)
+                return connection_error(http2_frame_size_error, "bad HEADERS");
+            padding = (uint8_t)payload[0];
+            offset = 1;
+        }
+        if (header.flags & http2_flag_priority)
+            offset += 5;
+        if (offset + padding > header.length)
+            return connection_error(http2_protocol_error, "bad HEADERS padding");
+
+        const char * fragment = payload + offset;
+        std::size_t fragment_len = header.length - offset - padding;
+        if (header.flags & http2_flag_end_headers) {
+            // The usual case: decode it in place.
+            return handle_header_block(header.stream_id, header.flags, fragment, fragment_len);
+        }
+
+        header_block_.assign(fragment, fragment_len);
+        continuation_stream_id_ = header.stream_id;
+        continuation_flags_ = header.flags;
+        return true;
+    }
+
+    bool handle_header_block(uint32_t stream_id, uint8_t flags, const char * block, std::size_t block_len)
+    {
+        // Every block must be decoded, to keep the dynamic table in sync.
+        http2_request_visitor visitor(request_path_);
+        if (!decoder_.decode((const uint8_t *)block, block_len, visitor))
+            return connection_error(http2_compression_error, "bad header block");
+
+        stream_map::iterator it = streams_.find(stream_id);
+        if (it != streams_.end()) {
+            // The trailers, they must end the stream.
+            if (it->second.request_done || (flags & http2_flag_end_stream) == 0)
+                return connection_error(http2_protocol_error, "bad trailers");
+            it->second.request_done = true;
+            start_response(it);
+            return true;
+        }
+
+        // A new stream id must be greater than all the used ones (RFC 7540 5.1.1).
+        if (stream_id <= last_stream_id_)
+            return connection_error(http2_protocol_error, "HEADERS on a closed stream");
+        last_stream_id_ = stream_id;
+
+        if (streams_.size() >= max_streams_) {
+            http2_append_rst_stream(output_, stream_id, http2_refused_stream);
+            return true;
+        }
+
+        has_request_ = true;
+        do_recv_qps_counter();
+
+        const http2_response * response = route_request(visitor);
+        it = streams_.insert(std::make_pair(stream_id, http2_stream())).first;
+        it->second.response = response;
+        it->second.send_window = peer_initial_window_;
+        if (flags & http2_flag_end_stream) {
+            it->second.request_done = true;
+            start_response(it);
+        }
+        return true;
+    }
+
+    const http2_response * route_request(const http2_request_visitor & request)
+    {
+        const http2_route_handler * handler = router_->dispatch(request.method(), request.path().c_str(),
+                                                                request.path().size());
+        if (handler != nullptr && handler->response != nullptr)
+            return handler->response;
+        return &get_http2_response_404();
+    }
+
+    void start_response(stream_map::iterator it)
+    {
+        const http2_response & response = *it->second.response;
+        bool no_body = response.body.empty();
+        http2_append_frame_header(output_, (uint32_t)response.headers.size(), http2_frame_headers,
+                                  http2_flag_end_headers | (no_body ? http2_flag_end_stream : 0), it->first);
+        output_.append(response.headers);
+
+        if (no_body) {
+            streams_.erase(it);
+        }
+        else if (!it->second.queued) {
+            it->second.queued = true;
+            send_queue_.push_back(it->first);
+        }
+    }
+
+    bool handle_settings(const http2_frame_header & header, const char * payload)
+    {
+        if (header.stream_id != 0)
+            return connection_error(http2_protocol_error, "SETTINGS on a stream");
+        if (header.flags & http2_flag_ack) {
+            if (header.length != 0)
+                return connection_error(http2_frame_size_error, "bad SETTINGS ack");
+            return true;
+        }
+        if ((header.length % 6) != 0)
+            return connection_error(http2_frame_size_error, "bad SETTINGS");
+
+        for (uint32_t offset = 0; offset < header.length; offset += 6) {
+            uint32_t id = ((uint32_t)(uint8_t)payload[offset] << 8) | (uint32_t)(uint8_t)payload[offset + 1];
+            uint32_t value = http2_read_u32(payload + offset + 2);
+            if (id == http2_settings_initial_window_size) {
+                if (value > kHttp2MaxWindowSize)
+                    return connection_error(http2_flow_control_error, "bad SETTINGS_INITIAL_WINDOW_SIZE");
+                // The delta applies to all the open streams (RFC 7540, 6.9.2).
+                int64_t delta = (int64_t)value - peer_initial_window_;
+                peer_initial_window_ = value;
+                for (stream_map::iterator it = streams_.begin(); it != streams_.end(); ++it) {
+                    if (it->second.send_window + delta > kHttp2MaxWindowSize)
+                        return connection_error(http2_flow_control_error, "stream window overflow");
+                    it->second.send_window += delta;
+                    queue_stream(it->first, it->second);
+                }
+            }
+            else if (id == http2_settings_max_frame_size) {
+                if (value < kHttp2DefaultFrameSize || value > kHttp2MaxFrameSize)
+                    return connection_error(http2_protocol_error, "bad SETTINGS_MAX_FRAME_SIZE");
+                peer_max_frame_size_ = value;
+            }
+            // The encoder never uses the dynamic table, SETTINGS_HEADER_TABLE_SIZE doesn't matter.
+        }
+        http2_append_settings_ack(output_);
+        return true;
+    }
+
+    bool handle_window_update(const http2_frame_header & header, const char * payload)
+    {
+        if (header.length != 4)
+            return connection_error(http2_frame_size_error, "bad WINDOW_UPDATE");
+        uint32_t increment = http2_read_u32(payload) & 0x7FFFFFFFU;
+
+        if (header.stream_id == 0) {
+            if (increment == 0)
+                return connection_error(http2_protocol_error, "zero WINDOW_UPDATE");
+            conn_send_window_ += increment;
+            if (conn_send_window_ > kHttp2MaxWindowSize)
+                return connection_error(http2_flow_control_error, "connection window overflow");
+            return true;
+        }
+
+        stream_map::iterator it = streams_.find(header.stream_id);
+        if (it == streams_.end())
+            return true;
+        if (increment == 0 || it->second.send_window + increment > kHttp2MaxWindowSize) {
+            http2_append_rst_stream(output_, header.stream_id,
+                                    (increment == 0) ? http2_protocol_error : http2_flow_control_error);
+            streams_.erase(it);
+            return true;
+        }
+        it->second.send_window += increment;
+        queue_stream(it->first, it->second);
+        return true;
+    }
+
+    void queue_stream(uint32_t stream_id, http2_stream & stream)
+    {
+        if (stream.request_done && !stream.queued && stream.send_window > 0
+            && stream.body_sent < stream.response->body.size()) {
+            stream.queued = true;
+            send_queue_.push_back(stream_id);
+        }
+    }
+
+    /// Frame the bodies, one DATA frame per stream in turn, until the windows are used up.
+    void flush_streams()
+    {
+        while (!send_queue_.empty() && conn_send_window_ > 0 && output_.size() < kMaxOutputBytes) {
+            uint32_t stream_id = send_queue_.front();
+            send_queue_.pop_front();
+
+            stream_map::iterator it = streams_.find(stream_id);
+            if (it == streams_.end())
+                continue;   // Reset by the peer.
+            http2_stream & stream = it->second;
+            if (stream.send_window <= 0) {
+                // Goes on after its WINDOW_UPDATE.
+                stream.queued = false;
+                continue;
+            }
+
+            const std::string & body = stream.response->body;
+            std::size_t remain = body.size() - stream.body_sent;
+            std::size_t chunk = std::min(remain, (std::size_t)peer_max_frame_size_);
+            chunk = std::min(chunk, (std::size_t)stream.send_window);
+            chunk = std::min(chunk, (std::size_t)conn_send_window_);
+            bool last = (chunk == remain);
+
+            http2_append_frame_header(output_, (uint32_t)chunk, http2_frame_data,
+                                      last ? http2_flag_end_stream : 0, stream_id);
+            output_.append(body, stream.body_sent, chunk);
+            stream.body_sent += chunk;
+            stream.send_window -= (int64_t)chunk;
+            conn_send_window_ -= (int64_t)chunk;
+
+            if (last)
+                streams_.erase(it);
+            else
+                send_queue_.push_back(stream_id);
+        }
+    }
+
+    void do_flush()
+    {
+        if (write_pending_)
+            return;
+        if (output_.empty()) {
+            if (closing_ || (goaway_received_ && streams_.empty()))
+                stop();
+            return;
+        }
+
+        writing_.swap(output_);
+        output_.clear();
+        write_pending_ = true;
+        on_write_started();
+
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(writing_.data(), writing_.size()),
+            [this, self](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec) {
+                    on_write_completed();
+
+                    // Count the sent bytes
+                    do_send_counter((uint32_t)send_bytes);
+
+                    writing_.clear();
+                    write_pending_ = false;
+
+                    if (read_paused_ && !closing_) {
+                        read_paused_ = false;
+                        process_input();
+                    }
+                    else {
+                        if (!closing_)
+                            flush_streams();
+                        do_flush();
+                    }
+                }
+                else {
+                    // Write error log
+                    std::cout << "asio_http2_session::do_flush() - Error: (send_bytes = " << send_bytes
+                              << ", code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+
+                    stop_connection(ec);
+                }
+            }
+        );
+    }
+};
+
+/// Manages the open h2c connections, see connection_manager of the http server.
+class http2_connection_manager : public connection_registry<asio_http2_session>
+{
+public:
+    explicit http2_connection_manager(io_service_pool & pool)
+        : connection_registry<asio_http2_session>(pool) {}
+
+    /// Add the specified connection to the manager,
+    /// must be called on the thread of the connection's io_service.
+    void start(http2_connection_ptr connection)
+    {
+        shard(connection->io_index()).insert(connection.get());
+    }
+
+    /// Stop the specified connection, it will be removed from the manager.
+    void stop(http2_connection_ptr connection)
+    {
+        connection->stop();
+    }
+
+    /// Stop all connections, every shard stops its own connections on its own thread,
+    /// complete() is called when all the shards are done.
+    void stop_all(const complete_type & complete = complete_type())
+    {
+        visit_all([](asio_http2_session & connection) { connection.stop(); }, complete);
+    }
+};
+
+void asio_http2_session::start_connection()
+{
+    if (connection_manager_)
+        connection_manager_->start(shared_from_this());
+}
+
+void asio_http2_session::stop_connection(const boost::system::error_code & ec)
+{
+    if (ec != boost::asio::error::operation_aborted)
+    {
+        if (connection_manager_)
+            connection_manager_->stop(shared_from_this());
+        else
+            stop();
+    }
+}
+
+} // namespace asio_test
+
+#undef USE_ATOMIC_REALTIME_UPDATE
+#undef QUERY_COUNTER_INTERVAL
+
+#undef MAX_UPDATE_CNT
+#undef MAX_UPDATE_BYTES
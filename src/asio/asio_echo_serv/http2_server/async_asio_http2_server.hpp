@@ -0,0 +1,228 @@
+
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <boost/noncopyable.hpp>
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/signal_set.hpp>
+
+#include "../common.h"
+#include "../io_service_pool.hpp"
+#include "../timing_wheel.hpp"
+#include "asio_http2_session.hpp"
+
+using namespace boost::asio;
+
+namespace asio_test {
+
+//
+// The h2c server, it runs on the same io_service_pool, timing wheels and sharded
+// connection registry as async_asio_http_server, only the sessions differ.
+//
+class async_asio_http2_server : public std::enable_shared_from_this<async_asio_http2_server>,
+                                private boost::noncopyable
+{
+private:
+    // The delay (ms) before accepting again after an accept error.
+    enum { kAcceptRetryDelay = 10 };
+
+    io_service_pool                     io_service_pool_;
+    timing_wheel_pool                   timing_wheels_;
+    http2_connection_manager            connection_manager_;
+    http2_server_router                 router_;
+    http2_response                      response_html_;
+    http2_response                      response_head_;
+    boost::asio::ip::tcp::acceptor      acceptor_;
+    boost::asio::steady_timer           accept_timer_;
+    boost::asio::signal_set             signals_;
+    std::shared_ptr<std::thread>        thread_;
+    uint32_t                            buffer_size_;
+    uint32_t                            max_streams_;
+    std::atomic<bool>                   stopped_;
+
+public:
+    async_asio_http2_server(const std::string & ip_addr, const std::string & port,
+        uint32_t buffer_size = 65536 * 2,
+        uint32_t max_streams = 256,
+        uint32_t pool_size = std::thread::hardware_concurrency())
+        : io_service_pool_(pool_size), timing_wheels_(io_service_pool_), connection_manager_(io_service_pool_),
+          acceptor_(io_service_pool_.get_first_io_service()),
+          accept_timer_(io_service_pool_.get_first_io_service()),
+          signals_(io_service_pool_.get_first_io_service()),
+          buffer_size_(buffer_size), max_streams_(max_streams), stopped_(false)
+    {
+        init_router();
+#if defined(__linux__)
+        signals_.add(SIGINT);
+        signals_.add(SIGTERM);
+        signals_.async_wait([this](const boost::system::error_code & ec, int signal_no)
+                            {
+                                shutdown();
+                            });
+#endif
+        start(ip_addr, port);
+    }
+
+    ~async_asio_http2_server()
+    {
+        this->stop();
+    }
+
+    void start(const std::string & ip_addr, const std::string & port)
+    {
+        ip::tcp::resolver resolver(io_service_pool_.get_now_io_service());
+        ip::tcp::resolver::query query(ip_addr, port);
+        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+
+        boost::system::error_code ec;
+        acceptor_.open(endpoint.protocol(), ec);
+        if (ec) {
+            // Open endpoint error
+            std::cout << "async_asio_http2_server::start() - Error: (code = " << ec.value() << ") "
+                      << ec.message().c_str() << std::endl;
+            return;
+        }
+
+        boost::asio::socket_base::reuse_address option(true);
+        acceptor_.set_option(option);
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+
+        do_accept();
+    }
+
+    void stop()
+    {
+        acceptor_.cancel();
+        boost::system::error_code ignored_ec;
+        accept_timer_.cancel(ignored_ec);
+    }
+
+    /// Stop accepting, close all the connections, then stop the io_services.
+    void shutdown()
+    {
+        if (stopped_.exchange(true))
+            return;
+        io_service_pool_.get_first_io_service().post([this]() {
+            this->stop();
+            connection_manager_.stop_all([this]() {
+                io_service_pool_.stop();
+            });
+        });
+    }
+
+    bool is_stopped() const
+    {
+        return stopped_.load();
+    }
+
+    /// The number of open connections, it doesn't stall the io_services.
+    std::size_t connection_count() const
+    {
+        return connection_manager_.size();
+    }
+
+    /// The total expired timeouts of all the connections.
+    uint64_t timeout_count() const
+    {
+        return timing_wheels_.expired_count();
+    }
+
+    /// The body size of the html response.
+    std::size_t response_size() const
+    {
+        return response_html_.body.size();
+    }
+
+    void run()
+    {
+        thread_ = std::make_shared<std::thread>([this] { io_service_pool_.run(); });
+    }
+
+    void join()
+    {
+        if (thread_->joinable())
+            thread_->join();
+    }
+
+private:
+    void init_router()
+    {
+        // The h2 responses are identity only, the frames are built from the http/1.1 ones.
+        const std::string response = make_http_response_html(g_response_body_size);
+        make_http2_response(response, false, response_html_);
+        make_http2_response(response, true, response_head_);
+
+        router_.bind(route_id_root,         http2_route_handler(&response_html_));
+        router_.bind(route_id_index,        http2_route_handler(&response_html_));
+        router_.bind(route_id_cookies,      http2_route_handler(&response_html_));
+        router_.bind(route_id_head_root,    http2_route_handler(&response_head_));
+        router_.bind(route_id_head_index,   http2_route_handler(&response_head_));
+        router_.bind(route_id_head_cookies, http2_route_handler(&response_head_));
+        router_.bind(route_id_post_root,    http2_route_handler(&response_html_));
+        router_.bind(route_id_post_upload,  http2_route_handler(&response_html_));
+        router_.bind(route_id_put_upload,   http2_route_handler(&response_html_));
+    }
+
+    void start_session(http2_connection_ptr session)
+    {
+        // Start the session on the thread of its own io_service,
+        // so it registers itself into its own connection shard.
+        io_service_pool_.get_io_service(session->io_index()).post(
+            boost::bind(&asio_http2_session::start, session));
+    }
+
+    void handle_accept(const boost::system::error_code & ec, http2_connection_ptr session)
+    {
+        if (!ec) {
+            g_accept_count.fetch_add(1);
+            if (session) {
+                start_session(session);
+            }
+            do_accept();
+        }
+        else {
+            // Accept error
+            std::cout << "async_asio_http2_server::handle_accept() - Error: (code = " << ec.value() << ") "
+                      << ec.message().c_str() << std::endl;
+            if (session) {
+                session->stop();
+            }
+            // Canceled by stop(), otherwise (e.g. out of fds) keep accepting after a while.
+            if (ec != boost::asio::error::operation_aborted) {
+                g_accept_errors.fetch_add(1);
+                do_accept_later();
+            }
+        }
+    }
+
+    void do_accept_later()
+    {
+        accept_timer_.expires_from_now(std::chrono::milliseconds(kAcceptRetryDelay));
+        accept_timer_.async_wait([this](const boost::system::error_code & ec)
+            {
+                if (!ec && !stopped_.load())
+                    do_accept();
+            });
+    }
+
+    void do_accept()
+    {
+        std::size_t io_index = io_service_pool_.get_next_index();
+        http2_connection_ptr new_session = asio_http2_session::create_new(
+                                                io_service_pool_.get_io_service(io_index),
+                                                io_index, &connection_manager_,
+                                                &timing_wheels_.get_wheel(io_index), &router_,
+                                                buffer_size_, max_streams_);
+        acceptor_.async_accept(new_session->socket(), boost::bind(&async_asio_http2_server::handle_accept,
+                               this, boost::asio::placeholders::error, new_session));
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,555 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <deque>
+#include <utility>
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                                < HPACK (RFC 7541) >
+
+  Decoder: the header fields are handed to a visitor as (pointer, length) pairs,
+  nothing is copied on the fast paths:
+
+    - an indexed field of the static table points into the static table,
+    - a raw (non-Huffman) literal points into the header block itself.
+
+  Only the Huffman strings are decoded into a scratch buffer, and only the fields
+  with incremental indexing are copied into the dynamic table.
+
+  Encoder: only the static table and the literals without indexing are used,
+  so an encoded header block never depends on the connection, it can be built once
+  and sent on any connection.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+struct hpack_static_entry {
+    const char *    name;
+    std::size_t     name_len;
+    const char *    value;
+    std::size_t     value_len;
+};
+
+#define HPACK_ENTRY(name, value)    { name, sizeof(name) - 1, value, sizeof(value) - 1 }
+
+// Index 0 is unused, the static table starts from 1.
+static const hpack_static_entry kHpackStaticTable[] = {
+    HPACK_ENTRY("", ""),
+    HPACK_ENTRY(":authority", ""),
+    HPACK_ENTRY(":method", "GET"),
+    HPACK_ENTRY(":method", "POST"),
+    HPACK_ENTRY(":path", "/"),
+    HPACK_ENTRY(":path", "/index.html"),
+    HPACK_ENTRY(":scheme", "http"),
+    HPACK_ENTRY(":scheme", "https"),
+    HPACK_ENTRY(":status", "200"),
+    HPACK_ENTRY(":status", "204"),
+    HPACK_ENTRY(":status", "206"),
+    HPACK_ENTRY(":status", "304"),
+    HPACK_ENTRY(":status", "400"),
+    HPACK_ENTRY(":status", "404"),
+    HPACK_ENTRY(":status", "500"),
+    HPACK_ENTRY("accept-charset", ""),
+    HPACK_ENTRY("accept-encoding", "gzip, deflate"),
+    HPACK_ENTRY("accept-language", ""),
+    HPACK_ENTRY("accept-ranges", ""),
+    HPACK_ENTRY("accept", ""),
+    HPACK_ENTRY("access-control-allow-origin", ""),
+    HPACK_ENTRY("age", ""),
+    HPACK_ENTRY("allow", ""),
+    HPACK_ENTRY("authorization", ""),
+    HPACK_ENTRY("cache-control", ""),
+    HPACK_ENTRY("content-disposition", ""),
+    HPACK_ENTRY("content-encoding", ""),
+    HPACK_ENTRY("content-language", ""),
+    HPACK_ENTRY("content-length", ""),
+    HPACK_ENTRY("content-location", ""),
+    HPACK_ENTRY("content-range", ""),
+    HPACK_ENTRY("content-type", ""),
+    HPACK_ENTRY("cookie", ""),
+    HPACK_ENTRY("date", ""),
+    HPACK_ENTRY("etag", ""),
+    HPACK_ENTRY("expect", ""),
+    HPACK_ENTRY("expires", ""),
+    HPACK_ENTRY("from", ""),
+    HPACK_ENTRY("host", ""),
+    HPACK_ENTRY("if-match", ""),
+    HPACK_ENTRY("if-modified-since", ""),
+    HPACK_ENTRY("if-none-match", ""),
+    HPACK_ENTRY("if-range", ""),
+    HPACK_ENTRY("if-unmodified-since", ""),
+    HPACK_ENTRY("last-modified", ""),
+    HPACK_ENTRY("link", ""),
+    HPACK_ENTRY("location", ""),
+    HPACK_ENTRY("max-forwards", ""),
+    HPACK_ENTRY("proxy-authenticate", ""),
+    HPACK_ENTRY("proxy-authorization", ""),
+    HPACK_ENTRY("range", ""),
+    HPACK_ENTRY("referer", ""),
+    HPACK_ENTRY("refresh", ""),
+    HPACK_ENTRY("retry-after", ""),
+    HPACK_ENTRY("server", ""),
+    HPACK_ENTRY("set-cookie", ""),
+    HPACK_ENTRY("strict-transport-security", ""),
+    HPACK_ENTRY("transfer-encoding", ""),
+    HPACK_ENTRY("user-agent", ""),
+    HPACK_ENTRY("vary", ""),
+    HPACK_ENTRY("via", ""),
+    HPACK_ENTRY("www-authenticate", "")
+};
+
+#undef HPACK_ENTRY
+
+enum {
+    kHpackStaticTableSize = 61,
+    kHpackDefaultTableSize = 4096,
+    // The overhead of a dynamic table entry (RFC 7541, 4.1).
+    kHpackEntryOverhead = 32
+};
+
+// The static indexes used by the encoders.
+enum hpack_static_index_t {
+    hpack_index_authority       = 1,
+    hpack_index_method_get      = 2,
+    hpack_index_method_post     = 3,
+    hpack_index_path_root       = 4,
+    hpack_index_scheme_http     = 6,
+    hpack_index_status_200      = 8,
+    hpack_index_content_length  = 28,
+    hpack_index_content_type    = 31,
+    hpack_index_server          = 54
+};
+
+struct hpack_huffman_code {
+    uint32_t    code;
+    uint32_t    bits;
+};
+
+// The Huffman code (RFC 7541, Appendix B), symbol 256 is EOS.
+static const hpack_huffman_code kHpackHuffmanCodes[257] = {
+    { 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+    { 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+    { 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+    { 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+    { 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+    { 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+    { 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+    { 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+    { 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+    { 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+    { 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+    { 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+    { 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+    { 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+    { 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+    { 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+    { 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+    { 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+    { 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+    { 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+    { 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+    { 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+    { 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+    { 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+    { 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+    { 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+    { 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+    { 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+    { 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+    { 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+    { 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+    { 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+    { 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+    { 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+    { 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+    { 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+    { 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+    { 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+    { 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+    { 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+    { 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+    { 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+    { 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+    { 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+    { 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+    { 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+    { 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+    { 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+    { 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+    { 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+    { 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+    { 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+    { 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+    { 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+    { 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+    { 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+    { 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+    { 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+    { 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+    { 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+    { 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+    { 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+    { 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+    { 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+    { 0x3fffffff, 30 }
+};
+
+namespace detail {
+
+//
+// The Huffman decoding trie, built once from the code table:
+// a node is an internal node if >= 0, a leaf (~symbol) if < 0.
+//
+class hpack_huffman_trie {
+public:
+    enum { kMaxNodes = 256 };
+
+private:
+    int16_t children_[kMaxNodes][2];
+    int     node_count_;
+
+public:
+    hpack_huffman_trie() : node_count_(1) {
+        ::memset(children_, 0, sizeof(children_));
+        for (int symbol = 0; symbol < 257; ++symbol) {
+            const hpack_huffman_code & code = kHpackHuffmanCodes[symbol];
+            int node = 0;
+            for (int bit = (int)code.bits - 1; bit >= 0; --bit) {
+                int branch = (code.code >> bit) & 1;
+                if (bit == 0) {
+                    children_[node][branch] = (int16_t)~symbol;
+                }
+                else {
+                    if (children_[node][branch] == 0) {
+                        children_[node][branch] = (int16_t)node_count_++;
+                    }
+                    node = children_[node][branch];
+                }
+            }
+        }
+    }
+
+    static const hpack_huffman_trie & instance() {
+        // Thread-safe since C++ 11.
+        static const hpack_huffman_trie trie;
+        return trie;
+    }
+
+    int16_t child(int node, int branch) const { return children_[node][branch]; }
+};
+
+} // namespace detail
+
+/// Decode a Huffman string, returns false if it's malformed (COMPRESSION_ERROR).
+static inline
+bool hpack_huffman_decode(const uint8_t * data, std::size_t size, std::string & output)
+{
+    const detail::hpack_huffman_trie & trie = detail::hpack_huffman_trie::instance();
+    output.clear();
+    int node = 0;
+    uint32_t pad_bits = 0;
+    bool pad_all_ones = true;
+    for (std::size_t i = 0; i < size; ++i) {
+        uint8_t byte = data[i];
+        for (int bit = 7; bit >= 0; --bit) {
+            int branch = (byte >> bit) & 1;
+            int16_t next = trie.child(node, branch);
+            pad_bits++;
+            pad_all_ones = pad_all_ones && (branch != 0);
+            if (next < 0) {
+                int symbol = ~next;
+                if (symbol == 256)
+                    return false;   // EOS in the string is an error.
+                output.push_back((char)symbol);
+                node = 0;
+                pad_bits = 0;
+                pad_all_ones = true;
+            }
+            else {
+                node = next;
+            }
+        }
+    }
+    // The padding is the most significant bits of EOS, shorter than 8 bits.
+    return (pad_bits < 8 && pad_all_ones);
+}
+
+/// Decode an integer with an N-bit prefix, returns false if it's truncated or too large.
+static inline
+bool hpack_decode_integer(const uint8_t * & cur, const uint8_t * end, uint32_t prefix_bits, uint32_t & value)
+{
+    if (cur >= end)
+        return false;
+    uint32_t max_prefix = (1U << prefix_bits) - 1;
+    value = (*cur++) & max_prefix;
+    if (value < max_prefix)
+        return true;
+    uint32_t shift = 0;
+    while (cur < end) {
+        uint8_t byte = *cur++;
+        if (shift > 21)
+            return false;   // More than 2^28, no header is so large.
+        value += (uint32_t)(byte & 0x7F) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+static inline
+void hpack_encode_integer(std::string & output, uint8_t first_byte, uint32_t prefix_bits, uint32_t value)
+{
+    uint32_t max_prefix = (1U << prefix_bits) - 1;
+    if (value < max_prefix) {
+        output.push_back((char)(first_byte | value));
+        return;
+    }
+    output.push_back((char)(first_byte | max_prefix));
+    value -= max_prefix;
+    while (value >= 0x80) {
+        output.push_back((char)((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    output.push_back((char)value);
+}
+
+/// An indexed header field (the name and the value are in the static table).
+static inline
+void hpack_encode_indexed(std::string & output, uint32_t index)
+{
+    hpack_encode_integer(output, 0x80, 7, index);
+}
+
+/// A literal header field without indexing, the name is in the static table.
+static inline
+void hpack_encode_literal(std::string & output, uint32_t name_index,
+                          const char * value, std::size_t value_len)
+{
+    hpack_encode_integer(output, 0x00, 4, name_index);
+    hpack_encode_integer(output, 0x00, 7, (uint32_t)value_len);
+    output.append(value, value_len);
+}
+
+/// A literal header field without indexing, with a literal name (must be in lower case).
+static inline
+void hpack_encode_literal(std::string & output, const char * name, std::size_t name_len,
+                          const char * value, std::size_t value_len)
+{
+    output.push_back((char)0x00);
+    hpack_encode_integer(output, 0x00, 7, (uint32_t)name_len);
+    output.append(name, name_len);
+    hpack_encode_integer(output, 0x00, 7, (uint32_t)value_len);
+    output.append(value, value_len);
+}
+
+/// Encode a header field with the static table only: indexed if the name and the value
+/// are both in it, otherwise a literal with the static name index (or the literal name).
+static inline
+void hpack_encode_header(std::string & output, const char * name, std::size_t name_len,
+                         const char * value, std::size_t value_len)
+{
+    uint32_t name_index = 0;
+    for (uint32_t index = 1; index <= kHpackStaticTableSize; ++index) {
+        const hpack_static_entry & entry = kHpackStaticTable[index];
+        if (entry.name_len == name_len && ::memcmp(entry.name, name, name_len) == 0) {
+            if (entry.value_len == value_len && ::memcmp(entry.value, value, value_len) == 0) {
+                hpack_encode_indexed(output, index);
+                return;
+            }
+            if (name_index == 0)
+                name_index = index;
+        }
+    }
+    if (name_index != 0)
+        hpack_encode_literal(output, name_index, value, value_len);
+    else
+        hpack_encode_literal(output, name, name_len, value, value_len);
+}
+
+class hpack_dynamic_table {
+private:
+    // The newest entry is at the front (index 62).
+    std::deque<std::pair<std::string, std::string>> entries_;
+    std::size_t size_;
+    std::size_t max_size_;
+    // The limit of max_size_, from our SETTINGS_HEADER_TABLE_SIZE.
+    std::size_t capacity_;
+
+public:
+    explicit hpack_dynamic_table(std::size_t capacity = kHpackDefaultTableSize)
+        : size_(0), max_size_(capacity), capacity_(capacity) {}
+    ~hpack_dynamic_table() {}
+
+    std::size_t size() const { return size_; }
+    std::size_t max_size() const { return max_size_; }
+    std::size_t count() const { return entries_.size(); }
+
+    bool set_max_size(std::size_t max_size) {
+        if (max_size > capacity_)
+            return false;
+        max_size_ = max_size;
+        evict(0);
+        return true;
+    }
+
+    /// The index is 1-based after the static table (62 is the newest entry).
+    const std::pair<std::string, std::string> * get(uint32_t index) const {
+        std::size_t offset = index - kHpackStaticTableSize - 1;
+        return (offset < entries_.size()) ? &entries_[offset] : nullptr;
+    }
+
+    void insert(const char * name, std::size_t name_len, const char * value, std::size_t value_len) {
+        // Copy first, the name may point into an entry which is evicted below.
+        std::pair<std::string, std::string> entry(std::string(name, name_len), std::string(value, value_len));
+        std::size_t entry_size = name_len + value_len + kHpackEntryOverhead;
+        if (entry_size > max_size_) {
+            // An entry larger than the table empties the table (RFC 7541, 4.4).
+            entries_.clear();
+            size_ = 0;
+            return;
+        }
+        evict(entry_size);
+        entries_.push_front(std::move(entry));
+        size_ += entry_size;
+    }
+
+private:
+    void evict(std::size_t room) {
+        while (!entries_.empty() && (size_ + room) > max_size_) {
+            const std::pair<std::string, std::string> & last = entries_.back();
+            size_ -= last.first.size() + last.second.size() + kHpackEntryOverhead;
+            entries_.pop_back();
+        }
+    }
+};
+
+class hpack_decoder {
+private:
+    hpack_dynamic_table table_;
+    std::string         name_buf_;
+    std::string         value_buf_;
+
+public:
+    explicit hpack_decoder(std::size_t table_capacity = kHpackDefaultTableSize) : table_(table_capacity) {}
+    ~hpack_decoder() {}
+
+    const hpack_dynamic_table & table() const { return table_; }
+
+    //
+    // Decode a complete header block, the visitor is called for every field:
+    //
+    //     void visitor(const char * name, std::size_t name_len, const char * value, std::size_t value_len);
+    //
+    // Returns false on a COMPRESSION_ERROR, the connection must be closed.
+    //
+    template <typename Visitor>
+    bool decode(const uint8_t * data, std::size_t size, Visitor & visitor) {
+        const uint8_t * cur = data;
+        const uint8_t * end = data + size;
+        bool field_seen = false;
+        while (cur < end) {
+            uint8_t first = *cur;
+            if (first & 0x80) {
+                // Indexed header field.
+                uint32_t index;
+                if (!hpack_decode_integer(cur, end, 7, index) || index == 0)
+                    return false;
+                if (index <= kHpackStaticTableSize) {
+                    // The fast path, no lookup in the dynamic table.
+                    const hpack_static_entry & entry = kHpackStaticTable[index];
+                    visitor(entry.name, entry.name_len, entry.value, entry.value_len);
+                }
+                else {
+                    const std::pair<std::string, std::string> * entry = table_.get(index);
+                    if (entry == nullptr)
+                        return false;
+                    visitor(entry->first.c_str(), entry->first.size(), entry->second.c_str(), entry->second.size());
+                }
+                field_seen = true;
+            }
+            else if ((first & 0xE0) == 0x20) {
+                // Dynamic table size update, only allowed before the first field.
+                uint32_t max_size;
+                if (field_seen || !hpack_decode_integer(cur, end, 5, max_size) || !table_.set_max_size(max_size))
+                    return false;
+            }
+            else {
+                // Literal header field: with incremental indexing (01), without indexing (0000)
+                // or never indexed (0001).
+                bool indexing = ((first & 0xC0) == 0x40);
+                uint32_t prefix_bits = indexing ? 6 : 4;
+                uint32_t name_index;
+                if (!hpack_decode_integer(cur, end, prefix_bits, name_index))
+                    return false;
+
+                const char * name;
+                std::size_t name_len;
+                if (name_index != 0) {
+                    if (name_index <= kHpackStaticTableSize) {
+                        name = kHpackStaticTable[name_index].name;
+                        name_len = kHpackStaticTable[name_index].name_len;
+                    }
+                    else {
+                        const std::pair<std::string, std::string> * entry = table_.get(name_index);
+                        if (entry == nullptr)
+                            return false;
+                        // Copy it, the insert below may evict the entry.
+                        name_buf_ = entry->first;
+                        name = name_buf_.c_str();
+                        name_len = name_buf_.size();
+                    }
+                }
+                else if (!decode_string(cur, end, name_buf_, name, name_len)) {
+                    return false;
+                }
+
+                const char * value;
+                std::size_t value_len;
+                if (!decode_string(cur, end, value_buf_, value, value_len))
+                    return false;
+
+                visitor(name, name_len, value, value_len);
+                if (indexing)
+                    table_.insert(name, name_len, value, value_len);
+                field_seen = true;
+            }
+        }
+        return true;
+    }
+
+private:
+    // A raw string points into the header block, a Huffman string is decoded into buffer.
+    bool decode_string(const uint8_t * & cur, const uint8_t * end, std::string & buffer,
+                       const char * & str, std::size_t & str_len) {
+        if (cur >= end)
+            return false;
+        bool huffman = ((*cur & 0x80) != 0);
+        uint32_t length;
+        if (!hpack_decode_integer(cur, end, 7, length))
+            return false;
+        if ((std::size_t)(end - cur) < length)
+            return false;
+        if (huffman) {
+            if (!hpack_huffman_decode(cur, length, buffer))
+                return false;
+            str = buffer.c_str();
+            str_len = buffer.size();
+        }
+        else {
+            str = (const char *)cur;
+            str_len = length;
+        }
+        cur += length;
+        return true;
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,170 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                            < HTTP/2 frames (RFC 7540) >
+
+    +-----------------------------------------------+
+    |                 Length (24)                   |
+    +---------------+---------------+---------------+
+    |   Type (8)    |   Flags (8)   |
+    +-+-------------+---------------+-------------------------------+
+    |R|                 Stream Identifier (31)                      |
+    +=+=============================================================+
+    |                   Frame Payload (0...)                      ...
+    +---------------------------------------------------------------+
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+// The client connection preface (prior knowledge, RFC 7540, 3.5).
+static const char kHttp2Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const std::size_t kHttp2PrefaceSize = sizeof(kHttp2Preface) - 1;
+
+enum {
+    kHttp2FrameHeaderSize = 9,
+    kHttp2DefaultFrameSize = 16384,
+    kHttp2MaxFrameSize = 16777215,
+    kHttp2DefaultWindowSize = 65535,
+    kHttp2MaxWindowSize = 0x7FFFFFFF
+};
+
+enum http2_frame_type_t {
+    http2_frame_data            = 0x0,
+    http2_frame_headers         = 0x1,
+    http2_frame_priority        = 0x2,
+    http2_frame_rst_stream      = 0x3,
+    http2_frame_settings        = 0x4,
+    http2_frame_push_promise    = 0x5,
+    http2_frame_ping            = 0x6,
+    http2_frame_goaway          = 0x7,
+    http2_frame_window_update   = 0x8,
+    http2_frame_continuation    = 0x9
+};
+
+enum http2_frame_flag_t {
+    http2_flag_end_stream   = 0x1,
+    http2_flag_ack          = 0x1,
+    http2_flag_end_headers  = 0x4,
+    http2_flag_padded       = 0x8,
+    http2_flag_priority     = 0x20
+};
+
+enum http2_settings_id_t {
+    http2_settings_header_table_size        = 0x1,
+    http2_settings_enable_push              = 0x2,
+    http2_settings_max_concurrent_streams   = 0x3,
+    http2_settings_initial_window_size      = 0x4,
+    http2_settings_max_frame_size           = 0x5,
+    http2_settings_max_header_list_size     = 0x6
+};
+
+enum http2_error_code_t {
+    http2_no_error              = 0x0,
+    http2_protocol_error        = 0x1,
+    http2_internal_error        = 0x2,
+    http2_flow_control_error    = 0x3,
+    http2_settings_timeout      = 0x4,
+    http2_stream_closed         = 0x5,
+    http2_frame_size_error      = 0x6,
+    http2_refused_stream        = 0x7,
+    http2_cancel                = 0x8,
+    http2_compression_error     = 0x9,
+    http2_connect_error         = 0xa,
+    http2_enhance_your_calm     = 0xb,
+    http2_inadequate_security   = 0xc,
+    http2_http_1_1_required     = 0xd
+};
+
+struct http2_frame_header {
+    uint32_t    length;
+    uint8_t     type;
+    uint8_t     flags;
+    uint32_t    stream_id;
+};
+
+static inline uint32_t http2_read_u32(const char * data)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16)
+         | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+static inline void http2_append_u32(std::string & output, uint32_t value)
+{
+    char bytes[4] = {
+        (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value
+    };
+    output.append(bytes, sizeof(bytes));
+}
+
+/// The data must have kHttp2FrameHeaderSize bytes at least.
+static inline void http2_parse_frame_header(const char * data, http2_frame_header & header)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    header.length = ((uint32_t)bytes[0] << 16) | ((uint32_t)bytes[1] << 8) | (uint32_t)bytes[2];
+    header.type = bytes[3];
+    header.flags = bytes[4];
+    header.stream_id = http2_read_u32(data + 5) & 0x7FFFFFFFU;
+}
+
+static inline void http2_append_frame_header(std::string & output, uint32_t length,
+                                             uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+    char bytes[kHttp2FrameHeaderSize] = {
+        (char)(length >> 16), (char)(length >> 8), (char)length,
+        (char)type, (char)flags,
+        (char)((stream_id >> 24) & 0x7F), (char)(stream_id >> 16), (char)(stream_id >> 8), (char)stream_id
+    };
+    output.append(bytes, sizeof(bytes));
+}
+
+static inline void http2_append_settings(std::string & output, const uint32_t (*settings)[2], std::size_t count)
+{
+    http2_append_frame_header(output, (uint32_t)(count * 6), http2_frame_settings, 0, 0);
+    for (std::size_t i = 0; i < count; ++i) {
+        output.push_back((char)(settings[i][0] >> 8));
+        output.push_back((char)settings[i][0]);
+        http2_append_u32(output, settings[i][1]);
+    }
+}
+
+static inline void http2_append_settings_ack(std::string & output)
+{
+    http2_append_frame_header(output, 0, http2_frame_settings, http2_flag_ack, 0);
+}
+
+static inline void http2_append_window_update(std::string & output, uint32_t stream_id, uint32_t increment)
+{
+    http2_append_frame_header(output, 4, http2_frame_window_update, 0, stream_id);
+    http2_append_u32(output, increment & 0x7FFFFFFFU);
+}
+
+static inline void http2_append_rst_stream(std::string & output, uint32_t stream_id, uint32_t error_code)
+{
+    http2_append_frame_header(output, 4, http2_frame_rst_stream, 0, stream_id);
+    http2_append_u32(output, error_code);
+}
+
+static inline void http2_append_goaway(std::string & output, uint32_t last_stream_id, uint32_t error_code)
+{
+    http2_append_frame_header(output, 8, http2_frame_goaway, 0, 0);
+    http2_append_u32(output, last_stream_id & 0x7FFFFFFFU);
+    http2_append_u32(output, error_code);
+}
+
+static inline void http2_append_ping_ack(std::string & output, const char * opaque_data)
+{
+    http2_append_frame_header(output, 8, http2_frame_ping, http2_flag_ack, 0);
+    output.append(opaque_data, 8);
+}
+
+} // namespace asio_test
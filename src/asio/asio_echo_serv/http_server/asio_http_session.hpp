@@ -3,15 +3,25 @@
 
 #include <iostream>
 #include <memory>
+#include <vector>
 #include <utility>
 #include <atomic>
-#include <set>
 #include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/smart_ptr.hpp>
 
 #include "../common.h"
+#include "../connection_registry.hpp"
+#include "../timing_wheel.hpp"
+#include "http_request.hpp"
+#include "http_router.hpp"
+#include "http_body_decoder.hpp"
+#include "http_compress_cache.hpp"
+#include "http_ring_buffer.hpp"
+#include "websocket.hpp"
+#include "http_response_builder.hpp"
+#include "http_upstream_pool.hpp"
 
 using namespace boost::system;
 
@@ -52,178 +62,213 @@ const std::string g_response_html =
         "Connection: Keep-Alive\r\n\r\n"
         "Hello World!";
 
-////////////////////////////////////////////////////////////////////////////////////
-/*
-
-                            < Http Ring Buffer >
-
- Bottom        Back         Parsed              Front                          Top
-    |-----------|--------------|------------------|-----------------------------|
-                ^              ^                  ^
-*/
-////////////////////////////////////////////////////////////////////////////////////
+const std::string g_response_html_head =
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Fri, 31 Aug 2016 16:25:26 GMT\r\n"
+        "Server: boost-asio\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 12\r\n"
+        "Connection: Keep-Alive\r\n\r\n";
 
-class http_ring_buffer {
-private:
-    std::unique_ptr<char> buffer_;
-    std::size_t buffer_size_;
-    char * top_;
-    char * back_;
-    char * parsed_;
-    char * front_;
+const std::string g_response_html_404 =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Date: Fri, 31 Aug 2016 16:25:26 GMT\r\n"
+        "Server: boost-asio\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 9\r\n"
+        "Connection: Keep-Alive\r\n\r\n"
+        "Not Found";
 
-public:
-    http_ring_buffer(std::size_t buffer_size)
-        : buffer_size_(buffer_size), top_(nullptr), back_(nullptr),
-          parsed_(nullptr), front_(nullptr) {
-        init_ring_buffer(buffer_size);
-    }
-    ~http_ring_buffer() {}
+const std::string g_response_html_404_head =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Date: Fri, 31 Aug 2016 16:25:26 GMT\r\n"
+        "Server: boost-asio\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 9\r\n"
+        "Connection: Keep-Alive\r\n\r\n";
 
-private:
-    void init_ring_buffer(std::size_t buffer_size) {
-        char * newBuffer = new (std::nothrow) char [buffer_size * 2];
-        if (newBuffer) {
-            ::memset(newBuffer, 0, buffer_size * 2 * sizeof(char));
-        }
-        buffer_.reset(newBuffer);
+const std::string g_response_html_502 =
+        "HTTP/1.1 502 Bad Gateway\r\n"
+        "Date: Fri, 31 Aug 2016 16:25:26 GMT\r\n"
+        "Server: boost-asio\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: 11\r\n"
+        "Connection: Keep-Alive\r\n\r\n"
+        "Bad Gateway";
 
-        char * _bottom = buffer_.get();
-        top_ = _bottom + buffer_size * 2;
-        back_ = _bottom;
-        parsed_ = _bottom;
-        front_ = _bottom;
+//
+// The body of the template html page, about body_size bytes, 0 means "Hello World!".
+//
+static inline std::string make_http_body_html(uint32_t body_size)
+{
+    if (body_size == 0)
+        return "Hello World!";
+
+    static const char kHtmlBegin[] = "<html><head><title>boost-asio</title></head><body><table>\n";
+    static const char kHtmlEnd[] = "</table></body></html>\n";
+    std::string body = kHtmlBegin;
+    uint32_t row = 0;
+    while (body.size() + (sizeof(kHtmlEnd) - 1) < body_size) {
+        body += "<tr><td>" + std::to_string(row++) + "</td><td>Hello World!</td><td>name=wookie</td></tr>\n";
     }
+    body += kHtmlEnd;
+    return body;
+}
 
-public:
-    std::size_t buffer_size() const { return buffer_size_; }
-    std::size_t total_sizes() const { return buffer_size_ * 2; }
-    std::size_t offset() const { return static_cast<std::size_t>(back_ - buffer_.get()); }
-    std::size_t empty_size() const { return offset(); }
-    std::size_t free_size() const { return static_cast<std::size_t>(top_ - front_); }
-    std::size_t data_length() const { return static_cast<std::size_t>(front_ - back_); }
+//
+// A template html page of about body_size bytes, 0 means the "Hello World!" response.
+//
+static inline std::string make_http_response_html(uint32_t body_size)
+{
+    if (body_size == 0)
+        return g_response_html;
 
-    std::size_t parse_pos() const { return static_cast<std::size_t>(parsed_ - back_); }
+    std::string body = make_http_body_html(body_size);
+    return
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Fri, 31 Aug 2016 16:25:26 GMT\r\n"
+        "Server: boost-asio\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: Keep-Alive\r\n\r\n" + body;
+}
 
-    char * data() const { return buffer_.get(); }
+//
+// GET /dynamic: the header is built per request into the arena of the connection
+// (X-Request-Id is the sequence number of the request), the page is only referenced.
+//
+class http_dynamic_page : public http_dynamic_response
+{
+private:
+    std::string body_;
 
-    char * bottom() const { return buffer_.get(); }
-    char * top() const { return top_; }
-    char * back() const { return back_; }
-    char * parsed() const { return parsed_; }
-    char * front() const { return front_; }
+public:
+    explicit http_dynamic_page(uint32_t body_size) : body_(make_http_body_html(body_size)) {}
 
-    void reset(std::size_t data_bytes, std::size_t parsed_pos) {
-        char * _bottom = buffer_.get();
-        back_ = _bottom;
-        parsed_ = _bottom + parsed_pos;
-        front_ = _bottom + data_bytes;
+    void build(http_response_builder & builder, const http_request_line & request,
+               uint64_t request_seq) const
+    {
+        builder.status(200)
+               .header(http_fragments::kDate)
+               .header(http_fragments::kServer)
+               .header(http_fragments::kContentTypeHtml)
+               .content_length(body_.size())
+               .header(http_fragments::kConnectionKeepAlive)
+               .header_uint(http_fragments::kRequestId, request_seq)
+               .end_headers();
+        if (request.method != http_method_head)
+            builder.body(body_.data(), body_.size());
     }
+};
 
-    void rollback() {
-        std::size_t offset = this->offset();
-        std::size_t free_bytes = free_size();
-        std::size_t data_bytes = data_length();
-        std::size_t parsed_offset = parse_pos();
-
-        if (offset >= 16) {
-            ::memcpy((void *)bottom(), (void *)back(), data_bytes * sizeof(char));
-        }
-        else {
-            ::memmove((void *)bottom(), (void *)back(), data_bytes * sizeof(char));
-        }
-        reset(data_bytes, parsed_offset);
-    }
+enum http_route_id_t {
+    route_id_root,
+    route_id_index,
+    route_id_cookies,
+    route_id_head_root,
+    route_id_head_index,
+    route_id_head_cookies,
+    route_id_post_root,
+    route_id_post_upload,
+    route_id_put_upload,
+    route_id_dynamic,
+    route_id_head_dynamic,
+    route_id_last
+};
 
-    bool read(std::size_t recv_size) {
-        if (front_ + recv_size <= top_) {
-            front_ += recv_size;
-            return true;
-        }
-        else {
-            return false;
-        }
-    }
+//
+// The static route set of the http server, it's fixed at compile time.
+// (A class template, so the constexpr array can have external linkage in a header.)
+//
+template <typename Dummy = void>
+struct basic_http_static_routes {
+    static constexpr route_def routes[] = {
+        { http_method_get,  "/",            route_id_root           },
+        { http_method_get,  "/index.html",  route_id_index          },
+        { http_method_get,  "/cookies",     route_id_cookies        },
+        { http_method_head, "/",            route_id_head_root      },
+        { http_method_head, "/index.html",  route_id_head_index     },
+        { http_method_head, "/cookies",     route_id_head_cookies   },
+        { http_method_post, "/",            route_id_post_root      },
+        { http_method_post, "/upload",      route_id_post_upload    },
+        { http_method_put,  "/upload",      route_id_put_upload     },
+        { http_method_get,  "/dynamic",     route_id_dynamic        },
+        { http_method_head, "/dynamic",     route_id_head_dynamic   }
+    };
+    static const std::size_t kRouteCount = sizeof(routes) / sizeof(routes[0]);
+};
 
-    void parse_to(char * parsed) {
-        back_ = parsed;
-        parsed_ = parsed;
-    }
+template <typename Dummy>
+constexpr route_def basic_http_static_routes<Dummy>::routes[];
 
-    bool parse_add(std::size_t parse_size) {
-        if (parsed_ + parse_size < top_) {
-            parsed_ += parse_size;
-            back_ = parsed_;
-            return true;
-        }
-        else {
-            parsed_ = top_;
-            back_ = top_;
-            return false;
-        }
-    }
+typedef basic_http_static_routes<> http_static_routes;
 
-    bool parse(char * &parsed) {
-        // Forward-tracking find method
-        char * cur = parsed_;
-        while (cur <= (front_ - 4)) {
-            if (cur[0] == '\r' && cur[2] == '\r'
-                && cur[1] == '\n' && cur[3] == '\n') {
-                parsed = (cur + 4);
-                return true;
-            }
-            cur++;
-            assert(cur < top_);
-        }
-        parsed = cur;
-        return false;
-    }
+struct http_route_handler {
+    const std::string *             response;
+    // The pre-compressed variants of the response, nullptr means identity only.
+    const http_cached_response *    cached;
+    // Built per request by the response builder, nullptr means a static response.
+    const http_dynamic_response *   dynamic;
 
-    bool back_parse(char * &parsed) {
-        // Back-tracking find method
-        char * cur = front_ - 4;
-        while (cur >= parsed_) {
-            if (cur[0] == '\r') {
-                if (cur[2] == '\r') {
-                    if (cur[1] == '\n' && cur[3] == '\n') {
-                        parsed = (cur + 4);
-                        return true;
-                    }
-                    // TODO: If HTTP header request format is standard, this way is Ok.
-                    cur -= 4;
-                }
-                else if (cur[1] == '\n') {
-                    cur -= 2;
-                }
-                else {
-                    cur -= 4;
-                }
-            }
-            else if (cur[0] == '\n') {
-                cur--;
-            }
-            else {
-                cur -= 4;
-            }
-        }
-        parsed = front_;
-        return false;
-    }
+    http_route_handler() : response(nullptr), cached(nullptr), dynamic(nullptr) {}
+    http_route_handler(const std::string * _response) : response(_response), cached(nullptr), dynamic(nullptr) {}
+    http_route_handler(const http_cached_response * _cached)
+        : response(&_cached->get(content_coding_identity)), cached(_cached), dynamic(nullptr) {}
+    http_route_handler(const http_dynamic_response * _dynamic)
+        : response(nullptr), cached(nullptr), dynamic(_dynamic) {}
 };
 
+typedef http_router<http_route_handler,
+                    http_static_routes::kRouteCount,
+                    http_static_routes::routes> http_server_router;
+
 class connection_manager;
+class asio_http_session;
+
+typedef std::shared_ptr<asio_http_session> connection_ptr;
 
 class asio_http_session : public std::enable_shared_from_this<asio_http_session>,
+                          public connection_registry_hook<asio_http_session>,
+                          public wheel_timer,
                           private boost::noncopyable {
 private:
     enum { PACKET_SIZE = MAX_PACKET_SIZE };
 
+    // Stop reading the requests when so many responses wait for the socket (nodelay mode).
+    enum { kMaxQueuedWrites = 256 };
+    // Stop reading the WebSocket frames when so many echo bytes wait for the socket.
+    enum { kMaxWebSocketOutput = 256 * 1024 };
+
+    enum proxy_state_t {
+        proxy_none,
+        proxy_connecting,       // Waiting for a new upstream connection
+        proxy_writing,          // The request header (or a piece of the body) is written to the upstream
+        proxy_request_body,     // Waiting for more of the request body from the client
+        proxy_response          // The response is relayed to the client
+    };
+
+    /// The io_service the session runs on, the budget continuations are posted to it.
+    boost::asio::io_service & io_service_;
     /// Socket for the connection.
     ip::tcp::socket socket_;
+    /// The index of the io_service (and the connection shard) it runs on.
+    std::size_t io_index_;
     /// The manager for this connection.
     connection_manager * connection_manager_;
+    /// The timing wheel of the io_service it runs on, nullptr means no timeouts.
+    timing_wheel * timing_wheel_;
+    /// The router to dispatch the requests.
+    const http_server_router * router_;
+    /// The upstream pool of the io_service it runs on, nullptr means it's not a proxy.
+    http_upstream_pool * upstream_pool_;
 
     bool        nodelay_;
+    bool        has_request_;
+    bool        async_write_pending_;
+    bool        write_paused_;
+    // The budget of a wakeup is used up, the rest of the requests wait for the posted continuation.
+    bool        yield_pending_;
+    uint32_t    pending_writes_;
     uint32_t    need_echo_;
     uint32_t    buffer_size_;
     uint32_t    packet_size_;
@@ -240,15 +285,81 @@ private:
     uint32_t    recv_bytes_remain_;
     uint32_t    send_bytes_remain_;
 
+    uint32_t    compress_count_;
+    uint32_t    compress_saved_bytes_;
+
     http_ring_buffer buffer_;
 
+    http_body_decoder       body_decoder_;
+    http_bounded_body_sink  body_sink_;
+    const std::string *     pending_response_;
+
+    // The responses waiting for the async write in flight, and the ones in flight (nodelay mode).
+    std::vector<boost::asio::const_buffer> write_queue_;
+    std::vector<boost::asio::const_buffer> writing_queue_;
+
+    // The dynamic responses are built into the arena, they're queued (or wait for
+    // the request body in pending_output_) as gather buffers, never copied again.
+    http_output_arena   arena_;
+    std::vector<boost::asio::const_buffer> pending_output_;
+    uint64_t            request_seq_;
+
+    // WebSocket mode (after the Upgrade handshake): every frame is echoed back.
+    bool        ws_mode_;
+    bool        ws_closing_;
+    bool        ws_in_frame_;
+    bool        ws_echo_payload_;
+    bool        ws_message_end_;
+    bool        ws_write_pending_;
+    uint8_t     ws_opcode_;
+    uint8_t     ws_mask_[4];
+    uint32_t    ws_mask_offset_;
+    uint64_t    ws_remain_;
+    std::string ws_output_;
+    std::string ws_writing_;
+
+    // Reverse proxy mode: every request is relayed to a pooled upstream connection,
+    // the request from the ring buffer, the response from the buffer of the upstream.
+    upstream_connection_ptr proxy_upstream_;
+    uint32_t    proxy_state_;
+    bool        proxy_head_request_;
+    bool        proxy_header_sent_;
+    bool        proxy_in_body_;
+    bool        proxy_relayed_;
+    std::size_t proxy_header_size_;
+    std::size_t proxy_upstream_size_;
+    std::size_t proxy_scanned_;
+    http_body_info          proxy_body_info_;
+    http_response_head      proxy_response_;
+    http_body_decoder       proxy_response_decoder_;
+    http_counting_body_sink proxy_request_sink_;
+    http_counting_body_sink proxy_response_sink_;
+    time_point<steady_clock> proxy_start_time_;
+    time_point<steady_clock> proxy_sent_time_;
+    uint64_t    proxy_upstream_time_ns_;
+
+    uint32_t    proxy_count_;
+    uint64_t    proxy_total_ns_;
+    uint64_t    proxy_upstream_ns_;
+
 public:
-    asio_http_session(boost::asio::io_service & io_service, connection_manager * manager, uint32_t buffer_size,
-                      uint32_t packet_size, uint32_t need_echo = mode_need_echo)
-        : socket_(io_service), connection_manager_(manager), nodelay_(false), need_echo_(need_echo),
+    asio_http_session(boost::asio::io_service & io_service, std::size_t io_index,
+                      connection_manager * manager, timing_wheel * wheel, const http_server_router * router,
+                      http_upstream_pool * upstream_pool, uint32_t buffer_size, uint32_t packet_size,
+                      uint32_t need_echo = mode_need_echo)
+        : io_service_(io_service), socket_(io_service), io_index_(io_index), connection_manager_(manager), timing_wheel_(wheel),
+          router_(router), upstream_pool_(upstream_pool), nodelay_(false), has_request_(false), async_write_pending_(false), write_paused_(false),
+          yield_pending_(false), pending_writes_(0), need_echo_(need_echo),
           buffer_size_(buffer_size), packet_size_(packet_size),
           recv_counter_(0), send_counter_(0), recv_bytes_(0), send_bytes_(0), recv_cnt_(0), send_cnt_(0),
-          delta_recv_count_(0), delta_send_count_(0), recv_bytes_remain_(0), send_bytes_remain_(0), buffer_(buffer_size)
+          delta_recv_count_(0), delta_send_count_(0), recv_bytes_remain_(0), send_bytes_remain_(0),
+          compress_count_(0), compress_saved_bytes_(0), buffer_(buffer_size, g_mirror_buffer != 0),
+          body_sink_(g_http_body_window), pending_response_(nullptr),
+          request_seq_(0), ws_mode_(false), ws_closing_(false), ws_in_frame_(false), ws_echo_payload_(false), ws_message_end_(false),
+          ws_write_pending_(false), ws_opcode_(0), ws_mask_offset_(0), ws_remain_(0),
+          proxy_state_(proxy_none), proxy_head_request_(false), proxy_header_sent_(false), proxy_in_body_(false),
+          proxy_relayed_(false), proxy_header_size_(0), proxy_upstream_size_(0), proxy_scanned_(0),
+          proxy_upstream_time_ns_(0), proxy_count_(0), proxy_total_ns_(0), proxy_upstream_ns_(0)
     {
         nodelay_ = (g_nodelay != 0);
         if (buffer_size_ > MAX_PACKET_SIZE)
@@ -259,6 +370,9 @@ public:
 
     ~asio_http_session()
     {
+        // The registry holds a raw pointer, so stop() must have unregistered the session,
+        // and the connection_manager may be gone already, so don't erase it here.
+        assert(!is_registered());
     }
 
     void start()
@@ -266,12 +380,14 @@ public:
         set_socket_send_bufsize(MAX_PACKET_SIZE);
         set_socket_recv_bufsize(MAX_PACKET_SIZE);
 
-        static const int kNetSendTimeout = 45 * 1000;    // Send timeout is 45 seconds.
-        static const int kNetRecvTimeout = 45 * 1000;    // Recieve timeout is 45 seconds.
-        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_SNDTIMEO, (const char *)&kNetSendTimeout, sizeof(kNetSendTimeout));
-        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_RCVTIMEO, (const char *)&kNetRecvTimeout, sizeof(kNetRecvTimeout));
+        // SO_SNDTIMEO and SO_RCVTIMEO don't work for the async operations, the idle,
+        // keep-alive and write-stall timeouts are handled by the timing wheel.
 
         socket_.set_option(ip::tcp::no_delay(nodelay_));
+        if (nodelay_) {
+            // For the speculative writes, the async operations are not affected.
+            socket_.non_blocking(true);
+        }
 
         linger sLinger;
         sLinger.l_onoff = 1;    // Enable linger
@@ -282,7 +398,7 @@ public:
 
         if (g_first_time) {
             g_first_time = false;
-            g_start_time = high_resolution_clock::now();
+            g_start_time = steady_clock::now();
         }
 
         start_connection();
@@ -292,6 +408,8 @@ public:
 
     void stop()
     {
+        cancel_timer();
+
         if (socket_.is_open()) {
             init_shutdown();
 
@@ -303,11 +421,31 @@ public:
             if (g_client_count.load() != 0)
                 g_client_count--;
         }
+
+        // The upstream is in the middle of an exchange, it can't be reused.
+        if (proxy_upstream_) {
+            proxy_upstream_->close();
+            proxy_upstream_.reset();
+        }
+
+        // Runs on the thread of its own io_service, so it's safe to unregister here.
+        if (is_registered())
+            registry_shard()->erase(this);
     }
 
     void start_connection();
     void stop_connection(const boost::system::error_code & ec);
 
+    /// Called by the body sink when it can take data again (after it has paused
+    /// the body), must be called on the thread of the session's io_service.
+    void resume_body()
+    {
+        if (socket_.is_open() && body_decoder_.is_paused()) {
+            if (process_requests())
+                do_read_some();
+        }
+    }
+
     void init_shutdown()
     {
         // Initiate graceful connection closure.
@@ -320,12 +458,61 @@ public:
         return socket_;
     }
 
-    static boost::shared_ptr<asio_http_session> create_new(
-        boost::asio::io_service & io_service, connection_manager * conn_manager, uint32_t buffer_size, uint32_t packet_size) {
-        return boost::shared_ptr<asio_http_session>(new asio_http_session(io_service, conn_manager, buffer_size, packet_size, g_test_mode));
+    std::size_t io_index() const
+    {
+        return io_index_;
+    }
+
+    static connection_ptr create_new(
+        boost::asio::io_service & io_service, std::size_t io_index, connection_manager * conn_manager,
+        timing_wheel * wheel, const http_server_router * router, http_upstream_pool * upstream_pool,
+        uint32_t buffer_size, uint32_t packet_size) {
+        return std::make_shared<asio_http_session>(io_service, io_index, conn_manager, wheel, router,
+                                                   upstream_pool, buffer_size, packet_size, g_test_mode);
     }
 
 private:
+    void arm_timeout(uint32_t timeout_type)
+    {
+        if (timing_wheel_ != nullptr) {
+            uint32_t timeout_ms = get_session_timeout_ms(timeout_type);
+            if (timeout_ms != 0)
+                timing_wheel_->schedule(this, timeout_ms);
+            else
+                cancel_timer();
+        }
+    }
+
+    void arm_read_timeout()
+    {
+        if (pending_writes_ != 0)
+            arm_timeout(timeout_write_stall);
+        else if (has_request_ && !ws_mode_)
+            arm_timeout(timeout_keep_alive);
+        else
+            arm_timeout(timeout_idle);
+    }
+
+    void on_write_started()
+    {
+        pending_writes_++;
+        arm_timeout(timeout_write_stall);
+    }
+
+    void on_write_completed()
+    {
+        if (pending_writes_ != 0)
+            pending_writes_--;
+        if (pending_writes_ == 0)
+            arm_timeout(ws_mode_ ? timeout_idle : timeout_keep_alive);
+    }
+
+    void on_timeout()
+    {
+        // Closing the socket aborts the pending operations, they release the session.
+        stop();
+    }
+
     int get_socket_send_bufsize() const
     {
         boost::asio::socket_base::send_buffer_size send_bufsize_option;
@@ -461,10 +648,57 @@ private:
 #endif
     }
 
+    inline void do_rollback_counter(std::size_t copied_bytes)
+    {
+        // A rollback is rare compared to the reads, it's counted directly.
+        if (copied_bytes > 0) {
+            g_rollback_bytes.fetch_add(copied_bytes);
+        }
+    }
+
+    inline void do_compress_counter(uint32_t saved_bytes)
+    {
+#if defined(USE_ATOMIC_REALTIME_UPDATE) && (USE_ATOMIC_REALTIME_UPDATE > 0)
+        g_compress_count.fetch_add(1);
+        g_compress_saved_bytes.fetch_add(saved_bytes);
+#else
+        compress_count_++;
+        compress_saved_bytes_ += saved_bytes;
+        if (compress_count_ >= QUERY_COUNTER_INTERVAL || compress_saved_bytes_ >= MAX_UPDATE_BYTES) {
+            g_compress_count.fetch_add(compress_count_);
+            g_compress_saved_bytes.fetch_add(compress_saved_bytes_);
+            compress_count_ = 0;
+            compress_saved_bytes_ = 0;
+        }
+#endif
+    }
+
+    inline void do_proxy_counter(uint64_t total_ns, uint64_t upstream_ns)
+    {
+#if defined(USE_ATOMIC_REALTIME_UPDATE) && (USE_ATOMIC_REALTIME_UPDATE > 0)
+        g_proxy_requests.fetch_add(1);
+        g_proxy_total_ns.fetch_add(total_ns);
+        g_proxy_upstream_ns.fetch_add(upstream_ns);
+#else
+        proxy_count_++;
+        proxy_total_ns_ += total_ns;
+        proxy_upstream_ns_ += upstream_ns;
+        if (proxy_count_ >= QUERY_COUNTER_INTERVAL) {
+            g_proxy_requests.fetch_add(proxy_count_);
+            g_proxy_total_ns.fetch_add(proxy_total_ns_);
+            g_proxy_upstream_ns.fetch_add(proxy_upstream_ns_);
+            proxy_count_ = 0;
+            proxy_total_ns_ = 0;
+            proxy_upstream_ns_ = 0;
+        }
+#endif
+    }
+
     void do_read()
     {
+        auto self(shared_from_this());
         boost::asio::async_read(socket_, boost::asio::buffer(buffer_.data(), packet_size_),
-            [this](const boost::system::error_code & ec, std::size_t recv_bytes)
+            [this, self](const boost::system::error_code & ec, std::size_t recv_bytes)
             {
                 if ((uint32_t)recv_bytes != packet_size_) {
                     std::cout << "asio_http_session::do_read(): async_read(), recv_bytes = "
@@ -490,8 +724,9 @@ private:
 
     void do_write()
     {
+        auto self(shared_from_this());
         boost::asio::async_write(socket_, boost::asio::buffer(buffer_.data(), packet_size_),
-            [this](const boost::system::error_code & ec, std::size_t send_bytes)
+            [this, self](const boost::system::error_code & ec, std::size_t send_bytes)
             {
                 if (!ec) {
                     // Count the sent bytes
@@ -525,15 +760,27 @@ private:
 
         if (buffer_.free_size() <= 1024) {
             // Roll back the ring buffer
-            buffer_.rollback();
+            do_rollback_counter(buffer_.rollback());
+
+            if (buffer_.free_size() == 0) {
+                // The http header doesn't fit in the ring buffer.
+                std::cout << "asio_http_session::do_read_some() - Error: the http header is too large ("
+                          << buffer_.data_length() << " bytes)." << std::endl;
+                stop();
+                return;
+            }
         }
 
         char * read_data = buffer_.front();
         std::size_t read_size = std::min(buffer_size_, (uint32_t)buffer_.free_size());
         assert(read_size > 0);
 
+        arm_read_timeout();
+
+        auto self(shared_from_this());
+
         socket_.async_read_some(boost::asio::buffer(read_data, read_size),
-            [this](const boost::system::error_code & ec, std::size_t recv_bytes)
+            [this, self](const boost::system::error_code & ec, std::size_t recv_bytes)
             {
                 if (!ec) {
                     if (is_first_read) {
@@ -557,85 +804,808 @@ private:
                     bool is_ok = buffer_.read(recv_bytes);
                     if (!is_ok) {
                         // Roll back the ring buffer
-                        buffer_.rollback();
+                        do_rollback_counter(buffer_.rollback());
 
                         do_read_some();
                         return;
                     }
                     
-                    char * scanned;
-                    bool http_header_ok;
-                    do {
-                        http_header_ok = buffer_.parse(scanned);
-                        if (http_header_ok) {
-                            buffer_.parse_to(scanned);
-
-                            do_recv_qps_counter();
-
-                            // A successful http request, can be used to statistic qps.
-                            if (!nodelay_) {
-                                // nodelay = false;
-#if 1
-                                do_async_write_http_response();
-#else
-                                do_async_write_http_response_some();
-#endif
-                            }
-                            else {
-                                // nodelay = true;
-                                do_sync_write_http_response();
-                            }
-                        }
-                        else {
-                            break;
-                        }
-                    } while (1);
+                    if (process_requests())
+                        do_read_some();
+                }
+                else {
+                    // Write error log, a close by the client is not an error (short-lived connections).
+                    if (ec != boost::asio::error::eof) {
+                        std::cout << "asio_http_session::do_read_some() - Error: (recv_bytes = " << recv_bytes
+                                  << ", code = " << ec.value() << ") "
+                                  << ec.message().c_str() << std::endl;
+                    }
+                    stop_connection(ec);
+                }
+            }
+        );
+    }
+
+    /// Parse the http requests in the ring buffer, the bodies are streamed to the body sink.
+    /// Returns false if the reading must wait (backpressure) or the session is stopped.
+    bool process_requests()
+    {
+        if (yield_pending_)
+            return false;
+
+        // The budget of this wakeup, so a client which pipelines thousands of requests
+        // doesn't monopolize the thread, the other sessions on it get a turn in between.
+        uint32_t request_count = 0;
+        const std::size_t start_length = buffer_.data_length();
+
+        do {
+            // A speculative write of the last response may have failed and stopped the session.
+            if (!socket_.is_open())
+                return false;
+
+            if (write_queue_.size() >= kMaxQueuedWrites) {
+                // Backpressure: the peer doesn't read the responses, stop reading its requests.
+                write_paused_ = true;
+                return false;
+            }
+
+            if (is_budget_exhausted(request_count, start_length - buffer_.data_length())) {
+                yield_processing();
+                return false;
+            }
+
+            if (ws_mode_)
+                return process_websocket_frames();
+
+            if (proxy_state_ != proxy_none) {
+                // One exchange at a time, the next request waits in the ring buffer.
+                if (proxy_state_ == proxy_request_body)
+                    return relay_request_body();
+                return false;
+            }
+
+            if (body_decoder_.is_active()) {
+                std::size_t consumed = body_decoder_.decode(buffer_.back(), buffer_.data_length(), body_sink_);
+                // Drop the consumed body bytes, the ring buffer never holds the whole body.
+                buffer_.parse_to(buffer_.back() + consumed);
+
+                if (body_decoder_.has_error()) {
+                    std::cout << "asio_http_session::process_requests() - Error: bad chunked body." << std::endl;
+                    stop();
+                    return false;
+                }
+                if (!body_decoder_.is_done()) {
+                    if (body_decoder_.is_paused()) {
+                        drain_body_later();
+                        return false;
+                    }
+                    return true;
+                }
+
+                body_decoder_.reset();
+                if (pending_response_ != nullptr) {
+                    write_http_response(*pending_response_);
+                    pending_response_ = nullptr;
+                }
+                else {
+                    write_queue_.insert(write_queue_.end(), pending_output_.begin(), pending_output_.end());
+                    pending_output_.clear();
+                    write_http_queue();
+                }
+                continue;
+            }
+
+            char * scanned;
+            if (!buffer_.parse(scanned))
+                break;
+
+            http_body_info body_info;
+            if (!parse_http_body_info(buffer_.back(), scanned, body_info)) {
+                std::cout << "asio_http_session::process_requests() - Error: bad Content-Length "
+                             "or Transfer-Encoding." << std::endl;
+                stop();
+                return false;
+            }
+
+            if (upstream_pool_ != nullptr) {
+                if (async_write_pending_) {
+                    // The relay writes the socket too, wait for the response in flight (e.g. a 502).
+                    write_paused_ = true;
+                    return false;
+                }
+                start_proxy(scanned, body_info);
+                return false;
+            }
+
+            if (body_info.has_upgrade) {
+                std::string accept_key;
+                if (parse_websocket_upgrade(buffer_.back(), scanned, accept_key)) {
+                    buffer_.parse_to(scanned);
+                    has_request_ = true;
+                    do_recv_qps_counter();
+                    start_websocket(accept_key);
+                    continue;
+                }
+            }
+
+            http_request_line request;
+            const http_dynamic_response * dynamic = nullptr;
+            const std::string & response = route_request(buffer_.back(), scanned, request, dynamic);
+            request_seq_++;
+            request_count++;
+
+            if (dynamic != nullptr) {
+                // Build it while the request line is still in the ring buffer.
+                build_http_response(*dynamic, request,
+                                    (body_info.type != http_body_none) ? pending_output_ : write_queue_);
+            }
+
+            buffer_.parse_to(scanned);
+            has_request_ = true;
+
+            do_recv_qps_counter();
+
+            if (body_info.type != http_body_none) {
+                // Respond after the whole body has been consumed.
+                body_decoder_.start(body_info);
+                pending_response_ = (dynamic == nullptr) ? &response : nullptr;
+                continue;
+            }
+
+            if (dynamic != nullptr)
+                write_http_queue();
+            else
+                write_http_response(response);
+        } while (1);
+
+        return true;
+    }
+
+    bool is_budget_exhausted(uint32_t request_count, std::size_t consumed_bytes) const
+    {
+        if (buffer_.data_length() == 0)
+            return false;
+        return ((g_http_budget_requests != 0 && request_count >= g_http_budget_requests)
+             || (g_http_budget_bytes != 0 && consumed_bytes >= g_http_budget_bytes));
+    }
+
+    /// Continue the requests left in the ring buffer after the handlers queued on this io_service.
+    void yield_processing()
+    {
+        yield_pending_ = true;
+        g_budget_yields.fetch_add(1);
+
+        auto self(shared_from_this());
+        io_service_.post([this, self]()
+            {
+                yield_pending_ = false;
+                if (socket_.is_open()) {
+                    if (process_requests())
+                        do_read_some();
+                }
+            });
+    }
+
+    /// The consumer of the body sink drains its window after the handlers queued on
+    /// this io_service, then the paused body goes on.
+    void drain_body_later()
+    {
+        g_body_pauses.fetch_add(1);
+
+        auto self(shared_from_this());
+        io_service_.post([this, self]()
+            {
+                body_sink_.drain();
+                resume_body();
+            });
+    }
+
+    /// Relay the request [back, header_end) (and its body) to an upstream, then its response to the client.
+    void start_proxy(const char * header_end, const http_body_info & body_info)
+    {
+        http_request_line request;
+        proxy_head_request_ = (parse_http_request_line(buffer_.back(), header_end, request)
+                               && request.method == http_method_head);
+        proxy_header_size_ = (std::size_t)(header_end - buffer_.back());
+        proxy_header_sent_ = false;
+        proxy_relayed_ = false;
+        proxy_body_info_ = body_info;
+        proxy_start_time_ = steady_clock::now();
+        request_seq_++;
+        has_request_ = true;
+
+        do_recv_qps_counter();
+
+        // The client waits for the upstream, it's bounded by the write-stall timeout.
+        arm_timeout(timeout_write_stall);
+
+        proxy_upstream_ = upstream_pool_->acquire();
+        if (proxy_upstream_) {
+            proxy_send_header();
+            return;
+        }
+
+        proxy_state_ = proxy_connecting;
+        auto self(shared_from_this());
+        upstream_pool_->connect([this, self](const boost::system::error_code & ec, upstream_connection_ptr upstream)
+            {
+                if (!socket_.is_open()) {
+                    if (upstream)
+                        upstream->close();
+                    return;
+                }
+                if (ec) {
+                    proxy_fail();
+                    return;
+                }
+                proxy_upstream_ = upstream;
+                proxy_send_header();
+            });
+    }
 
+    void proxy_send_header()
+    {
+        // The header is written straight from the ring buffer, the client isn't read meanwhile.
+        proxy_state_ = proxy_writing;
+        auto self(shared_from_this());
+        boost::asio::async_write(proxy_upstream_->socket(), boost::asio::buffer(buffer_.back(), proxy_header_size_),
+            [this, self](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!socket_.is_open())
+                    return;
+                if (ec) {
+                    std::cout << "asio_http_session::proxy_send_header() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    proxy_fail();
+                    return;
+                }
+                buffer_.parse_to(buffer_.back() + proxy_header_size_);
+                proxy_header_sent_ = true;
+
+                if (proxy_body_info_.type != http_body_none) {
+                    body_decoder_.start(proxy_body_info_);
+                    proxy_state_ = proxy_request_body;
+                    if (relay_request_body())
+                        do_read_some();
+                }
+                else {
+                    proxy_read_response();
+                }
+            });
+    }
+
+    /// Write the body bytes in the ring buffer to the upstream as they are (with the chunk framing),
+    /// the decoder only finds the end of the body. Returns true if it needs more bytes from the client.
+    bool relay_request_body()
+    {
+        // The upstream write is the backpressure of the relay, the sink never pauses.
+        std::size_t consumed = body_decoder_.decode(buffer_.back(), buffer_.data_length(), proxy_request_sink_);
+        if (body_decoder_.has_error()) {
+            std::cout << "asio_http_session::relay_request_body() - Error: bad chunked body." << std::endl;
+            stop();
+            return false;
+        }
+        if (consumed == 0)
+            return true;
+
+        // The bytes stay in the ring buffer until the write completes.
+        proxy_state_ = proxy_writing;
+        auto self(shared_from_this());
+        boost::asio::async_write(proxy_upstream_->socket(), boost::asio::buffer(buffer_.back(), consumed),
+            [this, self, consumed](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!socket_.is_open())
+                    return;
+                if (ec) {
+                    std::cout << "asio_http_session::relay_request_body() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    proxy_fail();
+                    return;
+                }
+                buffer_.parse_to(buffer_.back() + consumed);
+
+                if (body_decoder_.is_done()) {
+                    body_decoder_.reset();
+                    proxy_read_response();
+                    return;
+                }
+                proxy_state_ = proxy_request_body;
+                if (relay_request_body())
                     do_read_some();
+            });
+        return false;
+    }
+
+    void proxy_read_response()
+    {
+        proxy_state_ = proxy_response;
+        proxy_sent_time_ = steady_clock::now();
+        proxy_in_body_ = false;
+        proxy_upstream_size_ = 0;
+        proxy_scanned_ = 0;
+        proxy_read_upstream();
+    }
+
+    void proxy_read_upstream()
+    {
+        arm_timeout(timeout_write_stall);
+
+        http_upstream_connection & upstream = *proxy_upstream_;
+        auto self(shared_from_this());
+        upstream.socket().async_read_some(boost::asio::buffer(upstream.buffer() + proxy_upstream_size_,
+                                                              upstream.buffer_size() - proxy_upstream_size_),
+            [this, self](const boost::system::error_code & ec, std::size_t recv_bytes)
+            {
+                if (!socket_.is_open())
+                    return;
+                if (ec) {
+                    if (ec == boost::asio::error::eof && proxy_in_body_
+                        && proxy_response_.framing == http_framing_close) {
+                        // The end of a body without length.
+                        finish_proxy(0);
+                        return;
+                    }
+                    std::cout << "asio_http_session::proxy_read_upstream() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+                    proxy_fail();
+                    return;
+                }
+                proxy_upstream_size_ += recv_bytes;
+                on_upstream_data();
+            });
+    }
+
+    void on_upstream_data()
+    {
+        const char * data = proxy_upstream_->buffer();
+        std::size_t relay_size;
+        if (!proxy_in_body_) {
+            std::size_t header_size = find_http_header_end(data, proxy_upstream_size_, proxy_scanned_);
+            if (header_size == 0) {
+                if (proxy_upstream_size_ == proxy_upstream_->buffer_size()) {
+                    std::cout << "asio_http_session::on_upstream_data() - Error: the response header is too large."
+                              << std::endl;
+                    proxy_fail();
+                    return;
+                }
+                proxy_scanned_ = proxy_upstream_size_;
+                proxy_read_upstream();
+                return;
+            }
+
+            // A WebSocket (or any other) upgrade isn't relayed.
+            if (!parse_http_response_head(data, data + header_size, proxy_head_request_, proxy_response_)
+                || proxy_response_.status_code == 101) {
+                std::cout << "asio_http_session::on_upstream_data() - Error: bad response header." << std::endl;
+                proxy_fail();
+                return;
+            }
+            if (proxy_response_.status_code >= 100 && proxy_response_.status_code < 200) {
+                // An interim response (e.g. 100 Continue), the final one follows.
+                proxy_write_downstream(header_size, false);
+                return;
+            }
+
+            proxy_upstream_time_ns_ = (uint64_t)duration_cast<nanoseconds>(steady_clock::now()
+                                                                           - proxy_sent_time_).count();
+            proxy_in_body_ = true;
+            if (proxy_response_.framing == http_framing_none) {
+                proxy_write_downstream(header_size, true);
+                return;
+            }
+            if (proxy_response_.framing != http_framing_close) {
+                http_body_info info;
+                info.type = (proxy_response_.framing == http_framing_length) ? http_body_length : http_body_chunked;
+                info.content_length = proxy_response_.content_length;
+                proxy_response_decoder_.start(info);
+            }
+            relay_size = header_size;
+        }
+        else {
+            relay_size = 0;
+        }
+
+        if (proxy_response_.framing == http_framing_close) {
+            proxy_write_downstream(proxy_upstream_size_, false);
+            return;
+        }
+        relay_size += proxy_response_decoder_.decode(data + relay_size, proxy_upstream_size_ - relay_size,
+                                                     proxy_response_sink_);
+        if (proxy_response_decoder_.has_error()) {
+            std::cout << "asio_http_session::on_upstream_data() - Error: bad chunked response body." << std::endl;
+            proxy_fail();
+            return;
+        }
+        proxy_write_downstream(relay_size, proxy_response_decoder_.is_done());
+    }
+
+    /// Write the first relay_size bytes of the upstream buffer to the client, zero-copy.
+    void proxy_write_downstream(std::size_t relay_size, bool is_done)
+    {
+        proxy_relayed_ = true;
+        async_write_pending_ = true;
+        on_write_started();
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(proxy_upstream_->buffer(), relay_size),
+            [this, self, relay_size, is_done](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec) {
+                    on_write_completed();
+                    async_write_pending_ = false;
+
+                    // Count the sent bytes
+                    do_send_counter((uint32_t)send_bytes);
+
+                    std::size_t remain = proxy_upstream_size_ - relay_size;
+                    if (is_done) {
+                        finish_proxy(remain);
+                        return;
+                    }
+                    // Only the final response after an interim one can be left.
+                    if (remain != 0) {
+                        char * data = proxy_upstream_->buffer();
+                        ::memmove(data, data + relay_size, remain);
+                    }
+                    proxy_upstream_size_ = remain;
+                    proxy_scanned_ = 0;
+                    if (remain != 0)
+                        on_upstream_data();
+                    else
+                        proxy_read_upstream();
                 }
                 else {
                     // Write error log
-#if 1
-                    std::cout << "asio_http_session::do_read_some() - Error: (recv_bytes = " << recv_bytes
+                    std::cout << "asio_http_session::proxy_write_downstream() - Error: (send_bytes = " << send_bytes
                               << ", code = " << ec.value() << ") "
                               << ec.message().c_str() << std::endl;
-#endif
+
+                    stop_connection(ec);
+                }
+            });
+    }
+
+    /// The response has been relayed, extra_bytes were sent by the upstream after it.
+    void finish_proxy(std::size_t extra_bytes)
+    {
+        proxy_response_decoder_.reset();
+        bool keep_alive = proxy_response_.keep_alive && (proxy_response_.framing != http_framing_close);
+        // The upstream goes back to the pool only on an exact response boundary.
+        upstream_pool_->release(proxy_upstream_, keep_alive && extra_bytes == 0);
+        proxy_upstream_.reset();
+        proxy_state_ = proxy_none;
+
+        uint64_t total_ns = (uint64_t)duration_cast<nanoseconds>(steady_clock::now() - proxy_start_time_).count();
+        do_proxy_counter(total_ns, proxy_upstream_time_ns_);
+        do_send_counter_sync_write();
+
+        // The response is forwarded as it is, so is its end of the connection.
+        if (!keep_alive) {
+            stop();
+            return;
+        }
+        if (process_requests())
+            do_read_some();
+    }
+
+    /// The upstream failed: answer 502 if the client has got nothing of the response yet.
+    void proxy_fail()
+    {
+        g_upstream_errors.fetch_add(1);
+        if (proxy_upstream_) {
+            upstream_pool_->release(proxy_upstream_, false);
+            proxy_upstream_.reset();
+        }
+        proxy_state_ = proxy_none;
+        proxy_response_decoder_.reset();
+
+        // A half relayed request body or response can't be resynced, close the client.
+        if (proxy_relayed_ || body_decoder_.is_active()
+            || (!proxy_header_sent_ && proxy_body_info_.type != http_body_none)) {
+            stop();
+            return;
+        }
+        if (!proxy_header_sent_)
+            buffer_.parse_to(buffer_.back() + proxy_header_size_);
+
+        write_http_response(g_response_html_502);
+        if (process_requests())
+            do_read_some();
+    }
+
+    void start_websocket(const std::string & accept_key)
+    {
+        ws_mode_ = true;
+        ws_output_ = "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: " + accept_key + "\r\n\r\n";
+    }
+
+    void close_websocket(uint16_t status_code)
+    {
+        websocket_append_frame_header(ws_output_, true, ws_opcode_close, 2);
+        ws_output_.push_back((char)(status_code >> 8));
+        ws_output_.push_back((char)status_code);
+        ws_closing_ = true;
+    }
+
+    /// Echo the frames in the ring buffer, the payload is unmasked in place and
+    /// streamed out, so a frame of any size only needs the memory of the ring buffer.
+    /// Returns false if the reading must wait (backpressure) or the connection is closing.
+    bool process_websocket_frames()
+    {
+        bool can_read = true;
+        while (!ws_closing_) {
+            if (ws_output_.size() >= kMaxWebSocketOutput) {
+                write_paused_ = true;
+                can_read = false;
+                break;
+            }
+
+            if (!ws_in_frame_) {
+                websocket_frame_header header;
+                int header_size = websocket_parse_frame_header(buffer_.back(), buffer_.data_length(), header);
+                if (header_size == 0)
+                    break;
+
+                bool is_control = ((header.opcode & 0x08) != 0);
+                bool is_valid_opcode = (header.opcode <= ws_opcode_binary)
+                                    || (header.opcode >= ws_opcode_close && header.opcode <= ws_opcode_pong);
+                // The client frames must be masked, and no extension is negotiated.
+                if (header_size < 0 || !header.masked || header.rsv != 0 || !is_valid_opcode
+                    || (is_control && (!header.fin || header.payload_len > kWebSocketMaxControlPayload))) {
+                    std::cout << "asio_http_session::process_websocket_frames() - Error: bad frame." << std::endl;
+                    close_websocket(1002);
+                    break;
+                }
+                buffer_.parse_to(buffer_.back() + header_size);
+
+                ws_in_frame_ = true;
+                ws_opcode_ = header.opcode;
+                ws_remain_ = header.payload_len;
+                ws_mask_offset_ = 0;
+                ::memcpy(ws_mask_, header.mask, sizeof(ws_mask_));
+                ws_message_end_ = (header.fin && !is_control);
+                // A ping gets a pong with the same payload, a pong is dropped.
+                ws_echo_payload_ = (header.opcode != ws_opcode_pong);
+                if (ws_echo_payload_) {
+                    uint8_t opcode = (header.opcode == ws_opcode_ping) ? (uint8_t)ws_opcode_pong : header.opcode;
+                    websocket_append_frame_header(ws_output_, header.fin, opcode, header.payload_len);
+                }
+            }
+
+            std::size_t size = buffer_.data_length();
+            if (ws_remain_ < (uint64_t)size)
+                size = (std::size_t)ws_remain_;
+            if (size > 0) {
+                char * payload = buffer_.back();
+                ws_mask_offset_ = websocket_unmask(payload, size, ws_mask_, ws_mask_offset_);
+                if (ws_echo_payload_)
+                    ws_output_.append(payload, size);
+                buffer_.parse_to(payload + size);
+                ws_remain_ -= size;
+            }
+            if (ws_remain_ != 0)
+                break;
+
+            ws_in_frame_ = false;
+            if (ws_message_end_)
+                do_recv_qps_counter();
+            if (ws_opcode_ == ws_opcode_close) {
+                // The close frame has been echoed, close it after the output is written.
+                ws_closing_ = true;
+            }
+        }
+
+        do_websocket_flush();
+        return (can_read && !ws_closing_);
+    }
+
+    void do_websocket_flush()
+    {
+        // Keep the order after the http responses in flight (nodelay mode).
+        if (ws_write_pending_ || async_write_pending_)
+            return;
+        if (ws_output_.empty()) {
+            if (ws_closing_)
+                stop();
+            return;
+        }
+
+        ws_writing_.swap(ws_output_);
+        ws_output_.clear();
+        ws_write_pending_ = true;
+        on_write_started();
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(ws_writing_.data(), ws_writing_.size()),
+            [this, self](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec) {
+                    on_write_completed();
+
+                    // Count the sent bytes
+                    do_send_counter((uint32_t)send_bytes);
+
+                    ws_writing_.clear();
+                    ws_write_pending_ = false;
+
+                    if (write_paused_ && !ws_closing_) {
+                        write_paused_ = false;
+                        if (process_requests())
+                            do_read_some();
+                    }
+                    else {
+                        do_websocket_flush();
+                    }
+                }
+                else {
+                    // Write error log
+                    std::cout << "asio_http_session::do_websocket_flush() - Error: (send_bytes = " << send_bytes
+                              << ", code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+
                     stop_connection(ec);
                 }
             }
         );
     }
 
-    void do_sync_write_http_response()
+    void write_http_response(const std::string & response)
     {
-        static bool is_first_read = true;
-        boost::system::error_code ec;
-        std::size_t send_bytes = boost::asio::write(socket_,
-            boost::asio::buffer(g_response_html.c_str(), g_response_html.size()),
-            ec);
-        if (!ec) {
-#if 0
-            if (is_first_read) {
-                std::cout << "g_response_html.size() = " << g_response_html.size() << std::endl;
-                is_first_read = false;
+        // A successful http request, can be used to statistic qps.
+        if (!nodelay_) {
+            if (async_write_pending_) {
+                // One write at a time, queue it after the write in flight (in order).
+                write_queue_.push_back(boost::asio::buffer(response.c_str(), response.size()));
+                return;
             }
+            // nodelay = false;
+#if 1
+            do_async_write_http_response(response);
+#else
+            do_async_write_http_response_some(response);
 #endif
+        }
+        else {
+            // nodelay = true;
+            do_speculative_write_http_response(response);
+        }
+    }
+
+    /// Returns the static response, or sets dynamic if the response is built per request.
+    const std::string & route_request(const char * header_begin, const char * header_end,
+                                      http_request_line & request, const http_dynamic_response *& dynamic)
+    {
+        if (router_ != nullptr) {
+            if (parse_http_request_line(header_begin, header_end, request)) {
+                const http_route_handler * handler = router_->dispatch(request);
+                if (handler != nullptr && handler->dynamic != nullptr) {
+                    dynamic = handler->dynamic;
+                    return g_response_html;
+                }
+                if (handler != nullptr && handler->cached != nullptr) {
+                    // Only pick a variant, it has been compressed at startup.
+                    uint32_t coding = select_content_coding(header_begin, header_end,
+                                                            handler->cached->available_mask());
+                    if (coding != content_coding_identity)
+                        do_compress_counter(handler->cached->saved_bytes(coding));
+                    return handler->cached->get(coding);
+                }
+                if (handler != nullptr && handler->response != nullptr)
+                    return *handler->response;
+                if (request.method == http_method_head)
+                    return g_response_html_404_head;
+            }
+            return g_response_html_404;
+        }
+        return g_response_html;
+    }
+
+    void build_http_response(const http_dynamic_response & dynamic, const http_request_line & request,
+                             std::vector<boost::asio::const_buffer> & output)
+    {
+        http_response_builder builder(arena_, output);
+        dynamic.build(builder, request, request_seq_);
+        if (!builder.is_ok()) {
+            std::cout << "asio_http_session::build_http_response() - Error: a header doesn't fit in the arena ("
+                      << arena_.block_size() << " bytes)." << std::endl;
+            builder.rollback();
+            builder.status(500)
+                   .header(http_fragments::kServer)
+                   .content_length(0)
+                   .header(http_fragments::kConnectionKeepAlive)
+                   .end_headers();
+        }
+        builder.finish();
+    }
+
+    /// The arena is rewound only when nothing written into it is queued or in flight.
+    void release_arena()
+    {
+        if (!async_write_pending_ && write_queue_.empty() && pending_output_.empty())
+            arena_.reset();
+    }
+
+    /// Write the responses in the write queue (the dynamic ones point into the arena) with one gather write.
+    void write_http_queue()
+    {
+        if (async_write_pending_ || write_queue_.empty())
+            return;
+
+        if (nodelay_) {
+            boost::system::error_code ec;
+            std::size_t send_bytes = socket_.write_some(write_queue_, ec);
+            if (ec == boost::asio::error::would_block || ec == boost::asio::error::try_again) {
+                ec.clear();
+                send_bytes = 0;
+            }
+            if (ec) {
+                // Write error log
+                std::cout << "asio_http_session::write_http_queue() - Error: (send_bytes = " << send_bytes
+                          << ", code = " << ec.value() << ") "
+                          << ec.message().c_str() << std::endl;
+
+                stop_connection(ec);
+                return;
+            }
+
             // Count the sent bytes
             do_send_counter((uint32_t)send_bytes);
 
-            // If get a circle of ping-pong, we count the query one time.
-            do_send_counter_sync_write();
+            // Drop the sent buffers, only the unsent remainder goes to the async write.
+            std::size_t sent = 0;
+            while (sent < write_queue_.size() && send_bytes >= write_queue_[sent].size()) {
+                send_bytes -= write_queue_[sent].size();
+                do_send_counter_sync_write();
+                sent++;
+            }
+            write_queue_.erase(write_queue_.begin(), write_queue_.begin() + sent);
+            if (write_queue_.empty()) {
+                release_arena();
+                return;
+            }
+            write_queue_[0] = write_queue_[0] + send_bytes;
+            g_write_fallbacks.fetch_add(1);
+        }
+
+        do_async_write_queue();
+    }
+
+    void do_speculative_write_http_response(const std::string & response)
+    {
+        if (async_write_pending_) {
+            // Keep the order of the responses, queue it after the remainder in flight.
+            write_queue_.push_back(boost::asio::buffer(response.c_str(), response.size()));
+            return;
+        }
 
-            if ((uint32_t)send_bytes != g_response_html.size() && send_bytes != 0) {
-                std::cout << "asio_http_session::do_sync_write_http_response(): async_write(), send_bytes = "
-                            << send_bytes << " bytes." << std::endl;
+        // The socket is non-blocking: try to finish it inline with one syscall,
+        // a slow client never blocks the other sessions on this thread.
+        boost::system::error_code ec;
+        std::size_t send_bytes = socket_.write_some(boost::asio::buffer(response.c_str(), response.size()), ec);
+        if (ec == boost::asio::error::would_block || ec == boost::asio::error::try_again) {
+            ec.clear();
+            send_bytes = 0;
+        }
+        if (!ec) {
+            // Count the sent bytes
+            do_send_counter((uint32_t)send_bytes);
+
+            if (send_bytes == response.size()) {
+                // If get a circle of ping-pong, we count the query one time.
+                do_send_counter_sync_write();
+                return;
             }
 
-            //do_read_some();
+            // Only the unsent remainder goes to the async write.
+            g_write_fallbacks.fetch_add(1);
+            write_queue_.push_back(boost::asio::buffer(response.c_str() + send_bytes,
+                                                       response.size() - send_bytes));
+            do_async_write_queue();
         }
         else {
             // Write error log
-            std::cout << "asio_http_session::do_sync_write_http_response() - Error: (send_bytes = " << send_bytes
+            std::cout << "asio_http_session::do_speculative_write_http_response() - Error: (send_bytes = " << send_bytes
                         << ", code = " << ec.value() << ") "
                         << ec.message().c_str() << std::endl;
 
@@ -643,13 +1613,71 @@ private:
         }
     }
 
-    void do_async_write_http_response()
+    /// The write in flight has completed: start the queued responses, and resume
+    /// the requests paused by the backpressure.
+    void on_async_write_done()
+    {
+        async_write_pending_ = false;
+
+        if (!write_queue_.empty())
+            do_async_write_queue();
+        else if (ws_mode_)
+            do_websocket_flush();
+        else
+            release_arena();
+
+        if (write_paused_) {
+            write_paused_ = false;
+            if (process_requests())
+                do_read_some();
+        }
+    }
+
+    void do_async_write_queue()
+    {
+        // The responses are static strings or in the arena, the buffers stay valid until the write completes.
+        async_write_pending_ = true;
+        writing_queue_.swap(write_queue_);
+        on_write_started();
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, writing_queue_,
+            [this, self](const boost::system::error_code & ec, std::size_t send_bytes)
+            {
+                if (!ec) {
+                    on_write_completed();
+
+                    // Count the sent bytes
+                    do_send_counter((uint32_t)send_bytes);
+
+                    for (std::size_t i = 0; i < writing_queue_.size(); ++i) {
+                        do_send_counter_sync_write();
+                    }
+                    writing_queue_.clear();
+                    on_async_write_done();
+                }
+                else {
+                    // Write error log
+                    std::cout << "asio_http_session::do_async_write_queue() - Error: (send_bytes = " << send_bytes
+                              << ", code = " << ec.value() << ") "
+                              << ec.message().c_str() << std::endl;
+
+                    stop_connection(ec);
+                }
+            }
+        );
+    }
+
+    void do_async_write_http_response(const std::string & response)
     {
         static bool is_first_read = true;
-        boost::asio::async_write(socket_, boost::asio::buffer(g_response_html.c_str(), g_response_html.size()),
-            [this](const boost::system::error_code & ec, std::size_t send_bytes)
+        async_write_pending_ = true;
+        on_write_started();
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(response.c_str(), response.size()),
+            [this, self, &response](const boost::system::error_code & ec, std::size_t send_bytes)
             {
                 if (!ec) {
+                    on_write_completed();
 #if 0
                     if (is_first_read) {
                         std::cout << "g_response_html.size() = " << g_response_html.size() << std::endl;
@@ -662,12 +1690,12 @@ private:
                     // If get a circle of ping-pong, we count the query one time.
                     do_send_counter_sync_write();
 
-                    if ((uint32_t)send_bytes != g_response_html.size() && send_bytes != 0) {
+                    if ((uint32_t)send_bytes != response.size() && send_bytes != 0) {
                         std::cout << "asio_http_session::do_async_write_http_response(): async_write(), send_bytes = "
                                   << send_bytes << " bytes." << std::endl;
                     }
 
-                    //do_read_some();
+                    on_async_write_done();
                 }
                 else {
                     // Write error log
@@ -681,13 +1709,17 @@ private:
         );
     }
 
-    void do_async_write_http_response_some()
+    void do_async_write_http_response_some(const std::string & response)
     {
         static bool is_first_read = true;
-        socket_.async_write_some(boost::asio::buffer(g_response_html.c_str(), g_response_html.size()),
-            [this](const boost::system::error_code & ec, std::size_t send_bytes)
+        async_write_pending_ = true;
+        on_write_started();
+        auto self(shared_from_this());
+        socket_.async_write_some(boost::asio::buffer(response.c_str(), response.size()),
+            [this, self, &response](const boost::system::error_code & ec, std::size_t send_bytes)
             {
                 if (!ec) {
+                    on_write_completed();
 #if 0
                     if (is_first_read) {
                         std::cout << "g_response_html.size() = " << g_response_html.size() << std::endl;
@@ -700,12 +1732,12 @@ private:
                     // If get a circle of ping-pong, we count the query one time.
                     do_send_counter_sync_write();
 
-                    if ((uint32_t)send_bytes != g_response_html.size() && send_bytes != 0) {
+                    if ((uint32_t)send_bytes != response.size() && send_bytes != 0) {
                         std::cout << "asio_http_session::do_async_write_http_response_some(): async_write(), send_bytes = "
                                   << send_bytes << " bytes." << std::endl;
                     }
 
-                    //do_read_some();
+                    on_async_write_done();
                 }
                 else {
                     // Write error log
@@ -729,8 +1761,9 @@ private:
                 buffer_size = PACKET_SIZE;
 #if 1
             // async write one time <= PACKET_SIZE
+            auto self(shared_from_this());
             boost::asio::async_write(socket_, boost::asio::buffer(buffer_.data(), buffer_size),
-                [this, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
+                [this, self, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
                 {
                     if (!ec) {
                         // Count the sent bytes
@@ -758,8 +1791,9 @@ private:
             );
 #else
             // async write some one time <= PACKET_SIZE
+            auto self(shared_from_this());
             socket_.async_write_some(boost::asio::buffer(buffer_.data(), buffer_size),
-                [this, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
+                [this, self, buffer_size](const boost::system::error_code & ec, std::size_t send_bytes)
                 {
                     if (!ec) {
                         // Count the sent bytes
@@ -790,56 +1824,54 @@ private:
     }
 };
 
-typedef std::shared_ptr<asio_http_session> connection_ptr;
-
 //
 // See: https://www.boost.org/doc/libs/1_48_0/doc/html/boost_asio/example/http/server/connection.hpp
 //
 
 /// Manages open connections so that they may be cleanly stopped when the server
-/// needs to shut down.
-class connection_manager : private boost::noncopyable
+/// needs to shut down. It's sharded by io_service, a connection is registered and
+/// unregistered on the thread of its own io_service, so it needs no lock.
+class connection_manager : public connection_registry<asio_http_session>
 {
-private:
-    /// The managed connections.
-    std::set<connection_ptr> connections_;
-
 public:
-    /// Add the specified connection to the manager and start it.
-    void connection_manager::start(connection_ptr connection)
+    explicit connection_manager(io_service_pool & pool)
+        : connection_registry<asio_http_session>(pool) {}
+
+    /// Add the specified connection to the manager,
+    /// must be called on the thread of the connection's io_service.
+    void start(connection_ptr connection)
     {
-        connections_.insert(connection);
-        //connection->start();
+        shard(connection->io_index()).insert(connection.get());
     }
 
-    /// Stop the specified connection.
-    void connection_manager::stop(connection_ptr connection)
+    /// Stop the specified connection, it will be removed from the manager.
+    void stop(connection_ptr connection)
     {
-        connections_.erase(connection);
         connection->stop();
     }
 
-    /// Stop all connections.
-    void connection_manager::stop_all()
+    /// Stop all connections, every shard stops its own connections on its own thread,
+    /// complete() is called when all the shards are done.
+    void stop_all(const complete_type & complete = complete_type())
     {
-        std::for_each(connections_.begin(), connections_.end(), std::bind(&asio_http_session::stop, std::placeholders::_1));
-        connections_.clear();
+        visit_all([](asio_http_session & connection) { connection.stop(); }, complete);
     }
 };
 
 void asio_http_session::start_connection()
 {
-    //if (connection_manager_)
-    //    connection_manager_->start(asio_http_session::shared_from_this());
+    if (connection_manager_)
+        connection_manager_->start(shared_from_this());
 }
 
 void asio_http_session::stop_connection(const boost::system::error_code & ec)
 {
     if (ec != boost::asio::error::operation_aborted)
     {
-        //if (connection_manager_)
-        //    connection_manager_->stop(asio_http_session::shared_from_this());
-        stop();
+        if (connection_manager_)
+            connection_manager_->stop(shared_from_this());
+        else
+            stop();
     }
 }
 
@@ -2,7 +2,11 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
+#include <vector>
+#include <stdexcept>
 #include <thread>
+#include <chrono>
 #include <functional>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
@@ -14,7 +18,10 @@
 
 #include "../common.h"
 #include "../io_service_pool.hpp"
+#include "../timing_wheel.hpp"
 #include "asio_http_session.hpp"
+#include "http_compress_cache.hpp"
+#include "http_upstream_pool.hpp"
 
 using namespace boost::asio;
 
@@ -27,22 +34,41 @@ class async_asio_http_server : public std::enable_shared_from_this<async_asio_ht
                                private boost::noncopyable
 {
 private:
+    // The delay (ms) before accepting again after an accept error.
+    enum { kAcceptRetryDelay = 10 };
+
     io_service_pool					    io_service_pool_;
+    timing_wheel_pool                   timing_wheels_;
     connection_manager                  connection_manager_;
+    http_server_router                  router_;
+    http_compress_cache                 compress_cache_;
+    const http_cached_response *        response_html_;
+    http_dynamic_page                   dynamic_page_;
+    // The upstream pools of the reverse proxy mode, one per io_service (nullptr means no proxy).
+    std::unique_ptr<http_upstream_pools> upstreams_;
     boost::asio::ip::tcp::acceptor	    acceptor_;
+    boost::asio::steady_timer           accept_timer_;
+    boost::asio::signal_set             signals_;
     std::shared_ptr<asio_http_session>	session_;
     std::shared_ptr<std::thread>	    thread_;
     uint32_t                            buffer_size_;
     uint32_t					        packet_size_;
+    std::atomic<bool>                   stopped_;
 
 public:
     async_asio_http_server(const std::string & ip_addr, const std::string & port,
         uint32_t buffer_size = 65536 * 2,
         uint32_t packet_size = 64,
         uint32_t pool_size = std::thread::hardware_concurrency())
-        : io_service_pool_(pool_size), acceptor_(io_service_pool_.get_first_io_service()),
-          buffer_size_(buffer_size), packet_size_(packet_size)
+        : io_service_pool_(pool_size), timing_wheels_(io_service_pool_), connection_manager_(io_service_pool_),
+          compress_cache_(g_http_compress != 0), response_html_(nullptr), dynamic_page_(g_response_body_size),
+          acceptor_(io_service_pool_.get_first_io_service()),
+          accept_timer_(io_service_pool_.get_first_io_service()),
+          signals_(io_service_pool_.get_first_io_service()),
+          buffer_size_(buffer_size), packet_size_(packet_size), stopped_(false)
     {
+        init_router();
+        init_upstreams();
 #if defined(__linux__)
         //
         // See: https://codeday.me/bug/20181108/361396.html
@@ -53,10 +79,11 @@ public:
         // also want to register for other signals, such as SIGHUP to trigger a
         // re-read of a configuration file.
         //
-        boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
-        signals.async_wait([this](const boost::system::error_code & ec, int signal_no)
+        signals_.add(SIGINT);
+        signals_.add(SIGTERM);
+        signals_.async_wait([this](const boost::system::error_code & ec, int signal_no)
                             {
-                                io_service_pool_.stop();
+                                shutdown();
                             });
 #endif
         start(ip_addr, port);
@@ -65,16 +92,20 @@ public:
     async_asio_http_server(short port, uint32_t buffer_size = 65536,
         uint32_t packet_size = 64,
         uint32_t pool_size = std::thread::hardware_concurrency())
-        : io_service_pool_(pool_size),
+        : io_service_pool_(pool_size), timing_wheels_(io_service_pool_), connection_manager_(io_service_pool_),
+          compress_cache_(g_http_compress != 0), response_html_(nullptr), dynamic_page_(g_response_body_size),
           acceptor_(io_service_pool_.get_first_io_service(), ip::tcp::endpoint(ip::tcp::v4(), port)),
-          buffer_size_(buffer_size), packet_size_(packet_size)
+          accept_timer_(io_service_pool_.get_first_io_service()),
+          signals_(io_service_pool_.get_first_io_service()),
+          buffer_size_(buffer_size), packet_size_(packet_size), stopped_(false)
     {
+        init_router();
+        init_upstreams();
         do_accept();
     }
 
     ~async_asio_http_server()
     {
-        connection_manager_.stop_all();
         this->stop();
     }
 
@@ -105,6 +136,56 @@ public:
     void stop()
     {
         acceptor_.cancel();
+        boost::system::error_code ignored_ec;
+        accept_timer_.cancel(ignored_ec);
+    }
+
+    /// Stop accepting, close all the connections, then stop the io_services.
+    void shutdown()
+    {
+        if (stopped_.exchange(true))
+            return;
+        io_service_pool_.get_first_io_service().post([this]() {
+            this->stop();
+            connection_manager_.stop_all([this]() {
+                io_service_pool_.stop();
+            });
+        });
+    }
+
+    bool is_stopped() const
+    {
+        return stopped_.load();
+    }
+
+    /// The number of open connections, it doesn't stall the io_services.
+    std::size_t connection_count() const
+    {
+        return connection_manager_.size();
+    }
+
+    /// The total expired timeouts of all the connections.
+    uint64_t timeout_count() const
+    {
+        return timing_wheels_.expired_count();
+    }
+
+    /// The size of the identity html response.
+    std::size_t response_size() const
+    {
+        return response_html_->get(content_coding_identity).size();
+    }
+
+    /// Whether it's a reverse proxy.
+    bool is_proxy() const
+    {
+        return (upstreams_.get() != nullptr);
+    }
+
+    /// The one-time CPU cost of the pre-compressed variants, in nanoseconds.
+    uint64_t compress_ns() const
+    {
+        return compress_cache_.compress_ns();
     }
 
     void run()
@@ -119,11 +200,77 @@ public:
     }
 
 private:
-    void handle_accept(const boost::system::error_code & ec, asio_http_session * session)
+    void init_router()
+    {
+        // Compress the responses once, the sessions only pick a variant.
+        response_html_ = compress_cache_.add(make_http_response_html(g_response_body_size));
+        const http_cached_response * response_head = compress_cache_.add_head(response_html_);
+        compress_cache_.print_summary("html", response_html_);
+
+        router_.bind(route_id_root,         http_route_handler(response_html_));
+        router_.bind(route_id_index,        http_route_handler(response_html_));
+        router_.bind(route_id_cookies,      http_route_handler(response_html_));
+        router_.bind(route_id_head_root,    http_route_handler(response_head));
+        router_.bind(route_id_head_index,   http_route_handler(response_head));
+        router_.bind(route_id_head_cookies, http_route_handler(response_head));
+        router_.bind(route_id_post_root,    http_route_handler(response_html_));
+        router_.bind(route_id_post_upload,  http_route_handler(response_html_));
+        router_.bind(route_id_put_upload,   http_route_handler(response_html_));
+        router_.bind(route_id_dynamic,      http_route_handler(&dynamic_page_));
+        router_.bind(route_id_head_dynamic, http_route_handler(&dynamic_page_));
+    }
+
+    void init_upstreams()
+    {
+        if (g_upstream_list.empty())
+            return;
+
+        std::vector<std::pair<std::string, std::string>> upstreams;
+        if (!parse_upstream_list(g_upstream_list, upstreams))
+            throw std::runtime_error("bad upstream list: " + g_upstream_list);
+
+        std::vector<ip::tcp::endpoint> endpoints;
+        ip::tcp::resolver resolver(io_service_pool_.get_first_io_service());
+        for (std::size_t i = 0; i < upstreams.size(); ++i) {
+            boost::system::error_code ec;
+            ip::tcp::resolver::iterator iter =
+                resolver.resolve(ip::tcp::resolver::query(upstreams[i].first, upstreams[i].second), ec);
+            if (ec || iter == ip::tcp::resolver::iterator()) {
+                std::cout << "async_asio_http_server::init_upstreams() - Error: (code = " << ec.value() << ") "
+                          << ec.message().c_str() << ", upstream = "
+                          << upstreams[i].first << ":" << upstreams[i].second << std::endl;
+                continue;
+            }
+            endpoints.push_back(*iter);
+            std::cout << "upstream: " << iter->endpoint() << std::endl;
+        }
+        if (endpoints.empty())
+            throw std::runtime_error("no upstream can be resolved");
+
+        upstreams_.reset(new http_upstream_pools(io_service_pool_, endpoints, g_upstream_conns));
+        // Connect them before the first request, on the threads of their own io_services.
+        upstreams_->prewarm(io_service_pool_);
+    }
+
+    http_upstream_pool * get_upstream_pool(std::size_t io_index)
+    {
+        return upstreams_ ? &upstreams_->get_pool(io_index) : nullptr;
+    }
+
+    void start_session(connection_ptr session)
+    {
+        // Start the session on the thread of its own io_service,
+        // so it registers itself into its own connection shard.
+        io_service_pool_.get_io_service(session->io_index()).post(
+            boost::bind(&asio_http_session::start, session));
+    }
+
+    void handle_accept(const boost::system::error_code & ec, connection_ptr session)
     {
         if (!ec) {
+            g_accept_count.fetch_add(1);
             if (session) {
-                session->start();
+                start_session(session);
             }
             do_accept();
         }
@@ -133,28 +280,50 @@ private:
                       << ec.message().c_str() << std::endl;
             if (session) {
                 session->stop();
-                delete session;
             }
-        }        
+            // Canceled by stop(), otherwise (e.g. out of fds) keep accepting after a while.
+            if (ec != boost::asio::error::operation_aborted) {
+                g_accept_errors.fetch_add(1);
+                do_accept_later();
+            }
+        }
+    }
+
+    void do_accept_later()
+    {
+        accept_timer_.expires_from_now(std::chrono::milliseconds(kAcceptRetryDelay));
+        accept_timer_.async_wait([this](const boost::system::error_code & ec)
+            {
+                if (!ec && !stopped_.load())
+                    do_accept();
+            });
     }
 
     void do_accept()
     {
-        asio_http_session * new_session = new asio_http_session(io_service_pool_.get_io_service(),
-                                                                &connection_manager_, buffer_size_, packet_size_, g_test_mode);
+        std::size_t io_index = io_service_pool_.get_next_index();
+        connection_ptr new_session = asio_http_session::create_new(io_service_pool_.get_io_service(io_index),
+                                                                   io_index, &connection_manager_,
+                                                                   &timing_wheels_.get_wheel(io_index), &router_,
+                                                                   get_upstream_pool(io_index),
+                                                                   buffer_size_, packet_size_);
         acceptor_.async_accept(new_session->socket(), boost::bind(&async_asio_http_server::handle_accept,
                                this, boost::asio::placeholders::error, new_session));
     }
 
     void do_accept_lambda()
     {
-        session_.reset(new asio_http_session(io_service_pool_.get_io_service(), &connection_manager_,
-                                             buffer_size_, packet_size_, g_test_mode));
+        std::size_t io_index = io_service_pool_.get_next_index();
+        session_ = asio_http_session::create_new(io_service_pool_.get_io_service(io_index),
+                                                 io_index, &connection_manager_,
+                                                 &timing_wheels_.get_wheel(io_index), &router_,
+                                                 get_upstream_pool(io_index),
+                                                 buffer_size_, packet_size_);
         acceptor_.async_accept(session_->socket(),
             [this](const boost::system::error_code & ec)
             {
                 if (!ec) {
-                    session_->start();
+                    start_session(session_);
                 }
                 else {
                     // Accept error
@@ -0,0 +1,432 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                          < Streaming http body decoder >
+
+  The body is never staged: the decoder walks the bytes in the ring buffer and
+  hands every piece of the payload to a http_body_sink, then the session drops
+  the consumed bytes from the ring buffer, so an upload of any size only needs
+  the memory of the ring buffer.
+
+  Backpressure: the sink returns how many bytes it has taken, if it takes less
+  than it is offered, the decoder pauses, the session stops reading the socket
+  (the TCP window closes) until the sink calls asio_http_session::resume_body().
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+enum http_body_type_t {
+    http_body_none,
+    http_body_length,
+    http_body_chunked
+};
+
+struct http_body_info {
+    http_body_type_t    type;
+    uint64_t            content_length;
+    // There is an "Upgrade" header (e.g. a WebSocket handshake).
+    bool                has_upgrade;
+
+    http_body_info() : type(http_body_none), content_length(0), has_upgrade(false) {}
+};
+
+namespace detail {
+
+static inline char ascii_tolower(char ch)
+{
+    return ((ch >= 'A') && (ch <= 'Z')) ? (char)(ch + ('a' - 'A')) : ch;
+}
+
+// The name must be in lower case.
+static inline bool header_name_equals(const char * name, std::size_t name_len,
+                                      const char * lower_name, std::size_t lower_len)
+{
+    if (name_len != lower_len)
+        return false;
+    for (std::size_t i = 0; i < name_len; ++i) {
+        if (ascii_tolower(name[i]) != lower_name[i])
+            return false;
+    }
+    return true;
+}
+
+// Whether the comma separated list contains the token (case-insensitive), the token must be in lower case.
+static inline bool header_value_has_token(const char * value, const char * value_end,
+                                          const char * token, std::size_t token_len)
+{
+    while (value < value_end) {
+        while (value < value_end && (*value == ' ' || *value == '\t' || *value == ','))
+            value++;
+        const char * item = value;
+        while (value < value_end && *value != ',')
+            value++;
+        const char * item_end = value;
+        while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t'))
+            item_end--;
+        if (header_name_equals(item, item_end - item, token, token_len))
+            return true;
+    }
+    return false;
+}
+
+static inline bool parse_decimal_u64(const char * value, const char * value_end, uint64_t & number)
+{
+    while (value < value_end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+        value_end--;
+    if (value >= value_end || (value_end - value) > 19)
+        return false;
+    uint64_t result = 0;
+    for (; value < value_end; ++value) {
+        if (*value < '0' || *value > '9')
+            return false;
+        result = result * 10 + (uint64_t)(*value - '0');
+    }
+    number = result;
+    return true;
+}
+
+} // namespace detail
+
+//
+// Find "Content-Length", "Transfer-Encoding" and "Upgrade" in the http header [begin, end),
+// returns false if the header is malformed (the connection must be closed).
+//
+static inline
+bool parse_http_body_info(const char * begin, const char * end, http_body_info & info)
+{
+    static const char kContentLength[] = "content-length";
+    static const char kTransferEncoding[] = "transfer-encoding";
+    static const char kUpgrade[] = "upgrade";
+
+    info.type = http_body_none;
+    info.content_length = 0;
+    info.has_upgrade = false;
+    bool has_length = false, is_chunked = false;
+
+    // Skip the request line.
+    const char * line = (const char *)::memchr(begin, '\n', end - begin);
+    while (line != nullptr && ++line < end) {
+        const char * line_end = (const char *)::memchr(line, '\n', end - line);
+        if (line_end == nullptr)
+            line_end = end;
+        const char * value_end = (line_end > line && line_end[-1] == '\r') ? (line_end - 1) : line_end;
+
+        // Only check the lines start with 'C', 'T' or 'U', the others are skipped fast.
+        char first = detail::ascii_tolower(*line);
+        if (first == 'c' || first == 't' || first == 'u') {
+            const char * colon = (const char *)::memchr(line, ':', value_end - line);
+            if (colon != nullptr) {
+                std::size_t name_len = colon - line;
+                if (detail::header_name_equals(line, name_len, kContentLength, sizeof(kContentLength) - 1)) {
+                    uint64_t length;
+                    if (!detail::parse_decimal_u64(colon + 1, value_end, length))
+                        return false;
+                    // Different Content-Length values are an attack (request smuggling).
+                    if (has_length && length != info.content_length)
+                        return false;
+                    info.content_length = length;
+                    has_length = true;
+                }
+                else if (detail::header_name_equals(line, name_len, kTransferEncoding, sizeof(kTransferEncoding) - 1)) {
+                    if (detail::header_value_has_token(colon + 1, value_end, "chunked", 7))
+                        is_chunked = true;
+                    else
+                        return false;   // Only the chunked coding is supported.
+                }
+                else if (detail::header_name_equals(line, name_len, kUpgrade, sizeof(kUpgrade) - 1)) {
+                    info.has_upgrade = true;
+                }
+            }
+        }
+        line = (line_end < end) ? line_end : nullptr;
+    }
+
+    // Transfer-Encoding overrides Content-Length (RFC 7230, 3.3.3).
+    if (is_chunked) {
+        info.type = http_body_chunked;
+        info.content_length = 0;
+    }
+    else if (has_length && info.content_length != 0) {
+        info.type = http_body_length;
+    }
+    return true;
+}
+
+class http_body_sink {
+public:
+    virtual ~http_body_sink() {}
+
+    /// Returns the bytes it has taken, less than size means pause (backpressure),
+    /// the rest will be offered again after resume.
+    virtual std::size_t on_body_data(const char * data, std::size_t size) = 0;
+
+    virtual void on_body_complete(uint64_t body_size) = 0;
+};
+
+//
+// The default sink of the server: counts the body bytes and drops them.
+//
+class http_counting_body_sink : public http_body_sink {
+private:
+    uint64_t total_bytes_;
+    uint64_t total_bodies_;
+
+public:
+    http_counting_body_sink() : total_bytes_(0), total_bodies_(0) {}
+    virtual ~http_counting_body_sink() {}
+
+    uint64_t total_bytes() const { return total_bytes_; }
+    uint64_t total_bodies() const { return total_bodies_; }
+
+    virtual std::size_t on_body_data(const char * data, std::size_t size) {
+        (void)data;
+        total_bytes_ += size;
+        return size;
+    }
+
+    virtual void on_body_complete(uint64_t body_size) {
+        (void)body_size;
+        total_bodies_++;
+    }
+};
+
+//
+// A sink with a window: it takes at most window bytes, then pauses the body until
+// the consumer drains it (e.g. a slow disk or upstream), so a connection never
+// has more than window bytes of the body in flight. 0 means no limit.
+//
+class http_bounded_body_sink : public http_counting_body_sink {
+private:
+    std::size_t window_;
+    std::size_t pending_;
+
+public:
+    explicit http_bounded_body_sink(std::size_t window = 0) : window_(window), pending_(0) {}
+    virtual ~http_bounded_body_sink() {}
+
+    std::size_t window() const { return window_; }
+    std::size_t pending() const { return pending_; }
+
+    void set_window(std::size_t window) { window_ = window; }
+
+    /// The consumer has taken the pending bytes, the window is open again.
+    void drain() { pending_ = 0; }
+
+    virtual std::size_t on_body_data(const char * data, std::size_t size) {
+        if (window_ != 0) {
+            std::size_t room = (pending_ < window_) ? (window_ - pending_) : 0;
+            if (size > room)
+                size = room;
+            pending_ += size;
+        }
+        return http_counting_body_sink::on_body_data(data, size);
+    }
+};
+
+class http_body_decoder {
+private:
+    enum state_t {
+        state_idle,
+        state_length_data,
+        state_chunk_size,
+        state_chunk_ext,
+        state_chunk_size_lf,
+        state_chunk_data,
+        state_chunk_data_cr,
+        state_chunk_data_lf,
+        state_trailer_line_start,
+        state_trailer_line,
+        state_trailer_end_lf,
+        state_done,
+        state_error
+    };
+
+    enum { kMaxChunkSizeDigits = 16 };
+
+    state_t     state_;
+    bool        paused_;
+    uint32_t    size_digits_;
+    uint64_t    remain_;
+    uint64_t    body_size_;
+
+public:
+    http_body_decoder()
+        : state_(state_idle), paused_(false), size_digits_(0), remain_(0), body_size_(0) {}
+    ~http_body_decoder() {}
+
+    void start(const http_body_info & info) {
+        paused_ = false;
+        size_digits_ = 0;
+        body_size_ = 0;
+        if (info.type == http_body_length) {
+            state_ = state_length_data;
+            remain_ = info.content_length;
+        }
+        else if (info.type == http_body_chunked) {
+            state_ = state_chunk_size;
+            remain_ = 0;
+        }
+        else {
+            state_ = state_done;
+            remain_ = 0;
+        }
+    }
+
+    void reset() {
+        state_ = state_idle;
+        paused_ = false;
+        remain_ = 0;
+    }
+
+    bool is_active() const { return (state_ != state_idle); }
+    bool is_done() const { return (state_ == state_done); }
+    bool is_paused() const { return paused_; }
+    bool has_error() const { return (state_ == state_error); }
+
+    uint64_t body_size() const { return body_size_; }
+
+    /// Decode the bytes in [data, data + size), returns the bytes consumed (payload and framing).
+    std::size_t decode(const char * data, std::size_t size, http_body_sink & sink) {
+        const char * cur = data;
+        const char * end = data + size;
+        paused_ = false;
+
+        while (cur < end) {
+            switch (state_) {
+            case state_length_data:
+            case state_chunk_data:
+            {
+                std::size_t avail = (std::size_t)(end - cur);
+                std::size_t offer = (remain_ < (uint64_t)avail) ? (std::size_t)remain_ : avail;
+                std::size_t taken = sink.on_body_data(cur, offer);
+                if (taken > offer)
+                    taken = offer;
+                cur += taken;
+                remain_ -= taken;
+                body_size_ += taken;
+                if (remain_ == 0) {
+                    if (state_ == state_length_data) {
+                        state_ = state_done;
+                        sink.on_body_complete(body_size_);
+                        return (std::size_t)(cur - data);
+                    }
+                    state_ = state_chunk_data_cr;
+                }
+                else if (taken < offer) {
+                    paused_ = true;
+                    return (std::size_t)(cur - data);
+                }
+                break;
+            }
+
+            case state_chunk_size:
+            {
+                int digit = hex_digit(*cur);
+                if (digit >= 0) {
+                    if (++size_digits_ > kMaxChunkSizeDigits) {
+                        state_ = state_error;
+                        return (std::size_t)(cur - data);
+                    }
+                    remain_ = (remain_ << 4) | (uint64_t)digit;
+                }
+                else if (size_digits_ != 0 && (*cur == ';' || *cur == ' ' || *cur == '\t')) {
+                    state_ = state_chunk_ext;
+                }
+                else if (size_digits_ != 0 && *cur == '\r') {
+                    state_ = state_chunk_size_lf;
+                }
+                else {
+                    state_ = state_error;
+                    return (std::size_t)(cur - data);
+                }
+                cur++;
+                break;
+            }
+
+            case state_chunk_ext:
+                if (*cur == '\r')
+                    state_ = state_chunk_size_lf;
+                cur++;
+                break;
+
+            case state_chunk_size_lf:
+                if (*cur != '\n') {
+                    state_ = state_error;
+                    return (std::size_t)(cur - data);
+                }
+                cur++;
+                size_digits_ = 0;
+                state_ = (remain_ != 0) ? state_chunk_data : state_trailer_line_start;
+                break;
+
+            case state_chunk_data_cr:
+                if (*cur != '\r') {
+                    state_ = state_error;
+                    return (std::size_t)(cur - data);
+                }
+                cur++;
+                state_ = state_chunk_data_lf;
+                break;
+
+            case state_chunk_data_lf:
+                if (*cur != '\n') {
+                    state_ = state_error;
+                    return (std::size_t)(cur - data);
+                }
+                cur++;
+                state_ = state_chunk_size;
+                break;
+
+            case state_trailer_line_start:
+                state_ = (*cur == '\r') ? state_trailer_end_lf : state_trailer_line;
+                cur++;
+                break;
+
+            case state_trailer_line:
+                if (*cur == '\n')
+                    state_ = state_trailer_line_start;
+                cur++;
+                break;
+
+            case state_trailer_end_lf:
+                if (*cur != '\n') {
+                    state_ = state_error;
+                    return (std::size_t)(cur - data);
+                }
+                cur++;
+                state_ = state_done;
+                sink.on_body_complete(body_size_);
+                return (std::size_t)(cur - data);
+
+            default:
+                // idle, done or error: nothing to decode.
+                return (std::size_t)(cur - data);
+            }
+        }
+        return (std::size_t)(cur - data);
+    }
+
+private:
+    static int hex_digit(char ch) {
+        if (ch >= '0' && ch <= '9')
+            return (ch - '0');
+        else if (ch >= 'a' && ch <= 'f')
+            return (ch - 'a' + 10);
+        else if (ch >= 'A' && ch <= 'F')
+            return (ch - 'A' + 10);
+        else
+            return -1;
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,407 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <boost/noncopyable.hpp>
+
+#if defined(USE_ZLIB) && (USE_ZLIB > 0)
+#include <zlib.h>
+#endif
+
+#include "http_body_decoder.hpp"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                       < Pre-compressed response cache >
+
+  Every static (or template) response is compressed once at startup, one variant
+  per content coding, the header of the variant is rewritten:
+
+      Content-Length: <compressed size>
+      Content-Encoding: gzip | deflate
+      Vary: Accept-Encoding
+
+  At route time the session only parses "Accept-Encoding" and picks a variant,
+  no byte is compressed per request. A variant which isn't smaller than the
+  identity response is dropped.
+
+  Without zlib (USE_ZLIB is not defined) only the identity variant exists.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+enum http_content_coding_t {
+    content_coding_identity,
+    content_coding_gzip,
+    content_coding_deflate,
+    content_coding_last
+};
+
+static inline const char * get_content_coding_name(uint32_t coding)
+{
+    switch (coding) {
+    case content_coding_gzip:
+        return "gzip";
+    case content_coding_deflate:
+        return "deflate";
+    default:
+        return "identity";
+    }
+}
+
+namespace detail {
+
+static const uint32_t kQValueMax = 1000;
+
+// Parse the parameters of an Accept-Encoding item (";q=0.5"), returns the q-value in 1/1000.
+static inline uint32_t parse_qvalue(const char * param, const char * param_end)
+{
+    while (param < param_end) {
+        while (param < param_end && (*param == ';' || *param == ' ' || *param == '\t'))
+            param++;
+        if ((param_end - param) >= 2 && ascii_tolower(param[0]) == 'q' && param[1] == '=') {
+            param += 2;
+            if (param >= param_end || (*param != '0' && *param != '1'))
+                return kQValueMax;
+            uint32_t qvalue = (uint32_t)(*param++ - '0') * 1000;
+            if (param < param_end && *param == '.') {
+                param++;
+                uint32_t scale = 100;
+                while (param < param_end && *param >= '0' && *param <= '9' && scale != 0) {
+                    qvalue += (uint32_t)(*param++ - '0') * scale;
+                    scale /= 10;
+                }
+            }
+            return (qvalue <= kQValueMax) ? qvalue : kQValueMax;
+        }
+        while (param < param_end && *param != ';')
+            param++;
+    }
+    return kQValueMax;
+}
+
+} // namespace detail
+
+//
+// Pick a content coding from "Accept-Encoding" in the http header [begin, end),
+// only the codings in available_mask (1 << coding) are considered.
+// The highest q-value wins, a tie prefers gzip, then deflate, then identity.
+//
+static inline
+uint32_t select_content_coding(const char * begin, const char * end, uint32_t available_mask)
+{
+    static const char kAcceptEncoding[] = "accept-encoding";
+
+    if ((available_mask & ~(1U << content_coding_identity)) == 0)
+        return content_coding_identity;
+
+    // Skip the request line.
+    const char * line = (const char *)::memchr(begin, '\n', end - begin);
+    while (line != nullptr && ++line < end) {
+        const char * line_end = (const char *)::memchr(line, '\n', end - line);
+        if (line_end == nullptr)
+            line_end = end;
+        const char * value_end = (line_end > line && line_end[-1] == '\r') ? (line_end - 1) : line_end;
+
+        if (detail::ascii_tolower(*line) == 'a') {
+            const char * colon = (const char *)::memchr(line, ':', value_end - line);
+            if (colon != nullptr && detail::header_name_equals(line, colon - line,
+                                                               kAcceptEncoding, sizeof(kAcceptEncoding) - 1)) {
+                // -1 means the coding is not listed.
+                int32_t qvalues[content_coding_last] = { -1, -1, -1 };
+                int32_t any_qvalue = -1;
+
+                const char * value = colon + 1;
+                while (value < value_end) {
+                    while (value < value_end && (*value == ' ' || *value == '\t' || *value == ','))
+                        value++;
+                    const char * item = value;
+                    while (value < value_end && *value != ',')
+                        value++;
+                    const char * item_end = value;
+                    const char * token_end = item;
+                    while (token_end < item_end && *token_end != ';' && *token_end != ' ' && *token_end != '\t')
+                        token_end++;
+                    std::size_t token_len = token_end - item;
+                    if (token_len == 0)
+                        continue;
+
+                    int32_t qvalue = (int32_t)detail::parse_qvalue(token_end, item_end);
+                    if (detail::header_name_equals(item, token_len, "gzip", 4)
+                        || detail::header_name_equals(item, token_len, "x-gzip", 6))
+                        qvalues[content_coding_gzip] = qvalue;
+                    else if (detail::header_name_equals(item, token_len, "deflate", 7))
+                        qvalues[content_coding_deflate] = qvalue;
+                    else if (detail::header_name_equals(item, token_len, "identity", 8))
+                        qvalues[content_coding_identity] = qvalue;
+                    else if (token_len == 1 && *item == '*')
+                        any_qvalue = qvalue;
+                }
+
+                // The unlisted codings take the q-value of "*", identity is always acceptable
+                // unless it's refused explicitly (RFC 7231, 5.3.4).
+                for (uint32_t coding = content_coding_identity; coding < content_coding_last; ++coding) {
+                    if (qvalues[coding] < 0) {
+                        if (any_qvalue >= 0)
+                            qvalues[coding] = any_qvalue;
+                        else
+                            qvalues[coding] = (coding == content_coding_identity) ? 1 : 0;
+                    }
+                }
+
+                uint32_t best = content_coding_identity;
+                int32_t best_qvalue = qvalues[content_coding_identity];
+                static const uint32_t kPreferred[] = { content_coding_gzip, content_coding_deflate };
+                for (std::size_t i = 0; i < sizeof(kPreferred) / sizeof(kPreferred[0]); ++i) {
+                    uint32_t coding = kPreferred[i];
+                    if ((available_mask & (1U << coding)) != 0 && qvalues[coding] > 0
+                        && qvalues[coding] >= best_qvalue) {
+                        if (qvalues[coding] > best_qvalue || best == content_coding_identity) {
+                            best = coding;
+                            best_qvalue = qvalues[coding];
+                        }
+                    }
+                }
+                return best;
+            }
+        }
+        line = (line_end < end) ? line_end : nullptr;
+    }
+    return content_coding_identity;
+}
+
+//
+// All the encoded variants of one response, read-only after it's built.
+//
+class http_cached_response : private boost::noncopyable {
+private:
+    friend class http_compress_cache;
+
+    std::string     variants_[content_coding_last];
+    uint32_t        body_sizes_[content_coding_last];
+    uint64_t        compress_ns_[content_coding_last];
+    uint32_t        available_mask_;
+
+public:
+    http_cached_response() : available_mask_(1U << content_coding_identity) {
+        for (uint32_t coding = content_coding_identity; coding < content_coding_last; ++coding) {
+            body_sizes_[coding] = 0;
+            compress_ns_[coding] = 0;
+        }
+    }
+    ~http_cached_response() {}
+
+    uint32_t available_mask() const { return available_mask_; }
+
+    bool has_variant(uint32_t coding) const {
+        return (coding < content_coding_last) && ((available_mask_ & (1U << coding)) != 0);
+    }
+
+    const std::string & get(uint32_t coding) const {
+        return has_variant(coding) ? variants_[coding] : variants_[content_coding_identity];
+    }
+
+    /// The bytes saved on the wire when the variant is sent instead of the identity response.
+    uint32_t saved_bytes(uint32_t coding) const {
+        return has_variant(coding)
+            ? (uint32_t)(variants_[content_coding_identity].size() - variants_[coding].size()) : 0;
+    }
+
+    uint32_t body_size(uint32_t coding) const { return body_sizes_[coding]; }
+
+    /// The one-time CPU cost to compress the variant, in nanoseconds.
+    uint64_t compress_ns(uint32_t coding) const { return compress_ns_[coding]; }
+};
+
+//
+// Owns the cached responses, it's built on the main thread before the server runs.
+//
+class http_compress_cache : private boost::noncopyable {
+private:
+    std::vector<std::unique_ptr<http_cached_response>> responses_;
+    bool        enabled_;
+    int         level_;
+    uint64_t    compress_ns_;
+
+public:
+#if defined(USE_ZLIB) && (USE_ZLIB > 0)
+    http_compress_cache(bool enabled = true, int level = Z_BEST_COMPRESSION)
+#else
+    http_compress_cache(bool enabled = true, int level = 9)
+#endif
+        : enabled_(enabled), level_(level), compress_ns_(0) {}
+    ~http_compress_cache() {}
+
+    static bool is_supported() {
+#if defined(USE_ZLIB) && (USE_ZLIB > 0)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool is_enabled() const { return (enabled_ && is_supported()); }
+
+    std::size_t size() const { return responses_.size(); }
+
+    /// The total one-time CPU cost of all the variants, in nanoseconds.
+    uint64_t compress_ns() const { return compress_ns_; }
+
+    /// Build the variants of a full response (header + body).
+    const http_cached_response * add(const std::string & response) {
+        std::unique_ptr<http_cached_response> cached(new http_cached_response);
+        std::size_t header_size = get_header_size(response);
+        if (is_enabled() && header_size != 0 && header_size < response.size()) {
+            std::string header = response.substr(0, header_size);
+            std::string body = response.substr(header_size);
+            for (uint32_t coding = content_coding_gzip; coding < content_coding_last; ++coding) {
+                std::string compressed;
+                auto start_time = std::chrono::steady_clock::now();
+                bool succeed = compress(coding, body, compressed);
+                auto elapsed = std::chrono::steady_clock::now() - start_time;
+                if (succeed && compressed.size() < body.size()) {
+                    cached->variants_[coding] = rewrite_header(header, coding, compressed.size()) + compressed;
+                    cached->body_sizes_[coding] = (uint32_t)compressed.size();
+                    cached->compress_ns_[coding] = (uint64_t)std::chrono::duration_cast<
+                                                        std::chrono::nanoseconds>(elapsed).count();
+                    cached->available_mask_ |= (1U << coding);
+                    compress_ns_ += cached->compress_ns_[coding];
+                }
+            }
+            if (cached->available_mask_ != (1U << content_coding_identity)) {
+                // The identity response must carry "Vary" too, for the caches on the way.
+                cached->variants_[content_coding_identity] =
+                    rewrite_header(header, content_coding_identity, body.size()) + body;
+                cached->body_sizes_[content_coding_identity] = (uint32_t)body.size();
+            }
+        }
+        if (cached->available_mask_ == (1U << content_coding_identity)) {
+            cached->variants_[content_coding_identity] = response;
+            cached->body_sizes_[content_coding_identity] =
+                (header_size != 0) ? (uint32_t)(response.size() - header_size) : 0;
+        }
+        responses_.push_back(std::move(cached));
+        return responses_.back().get();
+    }
+
+    /// The HEAD response of a cached GET response: the same headers without the bodies.
+    const http_cached_response * add_head(const http_cached_response * get_response) {
+        std::unique_ptr<http_cached_response> cached(new http_cached_response);
+        for (uint32_t coding = content_coding_identity; coding < content_coding_last; ++coding) {
+            if (get_response->has_variant(coding)) {
+                const std::string & response = get_response->get(coding);
+                std::size_t header_size = get_header_size(response);
+                cached->variants_[coding] = (header_size != 0) ? response.substr(0, header_size) : response;
+                cached->body_sizes_[coding] = 0;
+            }
+        }
+        cached->available_mask_ = get_response->available_mask();
+        responses_.push_back(std::move(cached));
+        return responses_.back().get();
+    }
+
+    void print_summary(const std::string & name, const http_cached_response * cached) const {
+        std::cout << "http compress cache: " << name.c_str() << " - identity: "
+                  << cached->get(content_coding_identity).size() << " bytes";
+        for (uint32_t coding = content_coding_gzip; coding < content_coding_last; ++coding) {
+            if (cached->has_variant(coding)) {
+                std::cout << ", " << get_content_coding_name(coding) << ": "
+                          << cached->get(coding).size() << " bytes (saved "
+                          << cached->saved_bytes(coding) << " bytes/resp, "
+                          << std::setiosflags(std::ios::fixed) << std::setprecision(1)
+                          << (cached->compress_ns(coding) / 1000.0) << " us once)";
+            }
+        }
+        if (!is_enabled())
+            std::cout << (is_supported() ? " [compression is off]" : " [built without zlib]");
+        std::cout << std::endl;
+    }
+
+private:
+    // Returns the size of the header (including the empty line), 0 if it's not found.
+    static std::size_t get_header_size(const std::string & response) {
+        std::size_t pos = response.find("\r\n\r\n");
+        return (pos != std::string::npos) ? (pos + 4) : 0;
+    }
+
+    // Replace "Content-Length" and append "Content-Encoding" and "Vary" to the header.
+    static std::string rewrite_header(const std::string & header, uint32_t coding, std::size_t body_size) {
+        static const char kContentLength[] = "content-length";
+        std::string result;
+        result.reserve(header.size() + 64);
+        std::size_t pos = 0;
+        // The last line is the empty line.
+        while (pos + 2 < header.size()) {
+            std::size_t line_end = header.find("\r\n", pos);
+            if (line_end == std::string::npos)
+                break;
+            const char * line = header.c_str() + pos;
+            const char * colon = (const char *)::memchr(line, ':', line_end - pos);
+            if (colon != nullptr && detail::header_name_equals(line, colon - line,
+                                                               kContentLength, sizeof(kContentLength) - 1)) {
+                result += "Content-Length: ";
+                result += std::to_string(body_size);
+                result += "\r\n";
+            }
+            else {
+                result.append(header, pos, line_end + 2 - pos);
+            }
+            pos = line_end + 2;
+        }
+        if (coding != content_coding_identity) {
+            result += "Content-Encoding: ";
+            result += get_content_coding_name(coding);
+            result += "\r\n";
+        }
+        result += "Vary: Accept-Encoding\r\n\r\n";
+        return result;
+    }
+
+    bool compress(uint32_t coding, const std::string & input, std::string & output) const {
+#if defined(USE_ZLIB) && (USE_ZLIB > 0)
+        // gzip is the deflate stream in a gzip wrapper (windowBits + 16),
+        // the http "deflate" coding is the zlib format (RFC 7230, 4.2.2).
+        int window_bits = (coding == content_coding_gzip) ? (MAX_WBITS + 16) : MAX_WBITS;
+        z_stream stream;
+        ::memset(&stream, 0, sizeof(stream));
+        int ret = ::deflateInit2(&stream, level_, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            std::cout << "http_compress_cache::compress() - Error: (code = " << ret << ") deflateInit2() failed."
+                      << std::endl;
+            return false;
+        }
+        output.resize(::deflateBound(&stream, (uLong)input.size()) + 32);
+        stream.next_in = (Bytef *)input.data();
+        stream.avail_in = (uInt)input.size();
+        stream.next_out = (Bytef *)&output[0];
+        stream.avail_out = (uInt)output.size();
+        ret = ::deflate(&stream, Z_FINISH);
+        std::size_t output_size = stream.total_out;
+        ::deflateEnd(&stream);
+        if (ret != Z_STREAM_END) {
+            std::cout << "http_compress_cache::compress() - Error: (code = " << ret << ") deflate() failed."
+                      << std::endl;
+            return false;
+        }
+        output.resize(output_size);
+        return true;
+#else
+        (void)coding;
+        (void)input;
+        (void)output;
+        return false;
+#endif
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,148 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+namespace asio_test {
+
+enum http_method_t {
+    http_method_unknown,
+    http_method_get,
+    http_method_head,
+    http_method_post,
+    http_method_put,
+    http_method_delete,
+    http_method_options,
+    http_method_patch,
+    http_method_connect,
+    http_method_trace,
+    http_method_last
+};
+
+struct http_request_line {
+    http_method_t   method;
+    const char *    path;
+    std::size_t     path_len;
+    const char *    query;
+    std::size_t     query_len;
+    uint32_t        version;        // 10 = HTTP/1.0, 11 = HTTP/1.1
+
+    http_request_line()
+        : method(http_method_unknown), path(nullptr), path_len(0),
+          query(nullptr), query_len(0), version(11) {}
+};
+
+namespace detail {
+
+static inline uint32_t load_u32(const char * data)
+{
+    uint32_t value;
+    ::memcpy(&value, data, sizeof(uint32_t));
+    return value;
+}
+
+#define HTTP_METHOD_TAG(a, b, c, d) \
+    ((uint32_t)(uint8_t)(a) | ((uint32_t)(uint8_t)(b) << 8) | \
+    ((uint32_t)(uint8_t)(c) << 16) | ((uint32_t)(uint8_t)(d) << 24))
+
+} // namespace detail
+
+//
+// Decode the method token with one 32-bit load and an integer switch,
+// the token must be followed by a space (at least 4 readable bytes).
+//
+static inline
+http_method_t parse_http_method(const char * token, std::size_t token_len)
+{
+    if (token_len < 3 || token_len > 7)
+        return http_method_unknown;
+
+    // "GET " and "PUT " include the separator, the others are 4-byte prefixes.
+    uint32_t tag = detail::load_u32(token);
+    switch (tag) {
+    case HTTP_METHOD_TAG('G', 'E', 'T', ' '):
+        return http_method_get;
+    case HTTP_METHOD_TAG('P', 'U', 'T', ' '):
+        return http_method_put;
+    case HTTP_METHOD_TAG('H', 'E', 'A', 'D'):
+        return (token_len == 4) ? http_method_head : http_method_unknown;
+    case HTTP_METHOD_TAG('P', 'O', 'S', 'T'):
+        return (token_len == 4) ? http_method_post : http_method_unknown;
+    case HTTP_METHOD_TAG('D', 'E', 'L', 'E'):
+        return (token_len == 6) ? http_method_delete : http_method_unknown;
+    case HTTP_METHOD_TAG('O', 'P', 'T', 'I'):
+        return (token_len == 7) ? http_method_options : http_method_unknown;
+    case HTTP_METHOD_TAG('P', 'A', 'T', 'C'):
+        return (token_len == 5) ? http_method_patch : http_method_unknown;
+    case HTTP_METHOD_TAG('C', 'O', 'N', 'N'):
+        return (token_len == 7) ? http_method_connect : http_method_unknown;
+    case HTTP_METHOD_TAG('T', 'R', 'A', 'C'):
+        return (token_len == 5) ? http_method_trace : http_method_unknown;
+    default:
+        return http_method_unknown;
+    }
+}
+
+static inline
+const char * get_http_method_name(http_method_t method)
+{
+    static const char * const kMethodNames[http_method_last] = {
+        "UNKNOWN", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "CONNECT", "TRACE"
+    };
+    return ((unsigned)method < (unsigned)http_method_last) ? kMethodNames[method] : kMethodNames[0];
+}
+
+//
+// Parse "METHOD /path?query HTTP/1.x\r\n" in the range [begin, end),
+// end normally points to the end of the http header ("\r\n\r\n"), the parse
+// stops at the end of the request line.
+//
+static inline
+bool parse_http_request_line(const char * begin, const char * end, http_request_line & line)
+{
+    const char * line_end = (const char *)::memchr(begin, '\n', end - begin);
+    if (line_end != nullptr) {
+        if (line_end > begin && line_end[-1] == '\r')
+            line_end--;
+        end = line_end;
+    }
+    if ((end - begin) < 4)
+        return false;
+    const char * method_end = (const char *)::memchr(begin, ' ', end - begin);
+    if (method_end == nullptr)
+        return false;
+    line.method = parse_http_method(begin, method_end - begin);
+
+    const char * target = method_end + 1;
+    const char * target_end = (const char *)::memchr(target, ' ', end - target);
+    if (target_end == nullptr)
+        return false;
+
+    const char * query = (const char *)::memchr(target, '?', target_end - target);
+    if (query != nullptr) {
+        line.path = target;
+        line.path_len = query - target;
+        line.query = query + 1;
+        line.query_len = target_end - (query + 1);
+    }
+    else {
+        line.path = target;
+        line.path_len = target_end - target;
+        line.query = nullptr;
+        line.query_len = 0;
+    }
+
+    // "HTTP/1.0" or "HTTP/1.1"
+    const char * version = target_end + 1;
+    if ((end - version) >= 8 && version[5] == '1' && version[7] == '0')
+        line.version = 10;
+    else
+        line.version = 11;
+    return true;
+}
+
+} // namespace asio_test
+
+#undef HTTP_METHOD_TAG
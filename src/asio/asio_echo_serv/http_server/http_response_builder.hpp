@@ -0,0 +1,397 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/buffer.hpp>
+
+#include "http_request.hpp"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                  < Allocation-free http response builder >
+
+  A dynamic response is written straight into the output arena of the connection:
+
+      [ status line | header fragments | integer values | \r\n | small body ]
+
+  The fixed parts are constexpr fragments (pointer + length, no strlen), the
+  integers go through a two-digit table. The builder appends the written
+  ranges to the gather list of the session (the write queue), a large static
+  body is only referenced, so no byte is copied again before the gather write.
+
+  The arena is a list of fixed blocks, the memory never moves while a write is
+  in flight, and reset() only rewinds it, so after the first few requests of a
+  connection there is no allocation at all.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+//
+// A piece of the response known at compile time, e.g. "Content-Type: text/html\r\n".
+//
+struct http_fragment {
+    const char *    data;
+    std::size_t     size;
+
+    template <std::size_t N>
+    constexpr http_fragment(const char (&str)[N]) : data(str), size(N - 1) {}
+};
+
+namespace http_fragments {
+
+static constexpr http_fragment kStatus200           = "HTTP/1.1 200 OK\r\n";
+static constexpr http_fragment kStatus204           = "HTTP/1.1 204 No Content\r\n";
+static constexpr http_fragment kStatus400           = "HTTP/1.1 400 Bad Request\r\n";
+static constexpr http_fragment kStatus404           = "HTTP/1.1 404 Not Found\r\n";
+static constexpr http_fragment kStatus500           = "HTTP/1.1 500 Internal Server Error\r\n";
+
+static constexpr http_fragment kDate                = "Date: Fri, 31 Aug 2016 16:25:26 GMT\r\n";
+static constexpr http_fragment kServer              = "Server: boost-asio\r\n";
+static constexpr http_fragment kContentTypeHtml     = "Content-Type: text/html\r\n";
+static constexpr http_fragment kContentTypeText     = "Content-Type: text/plain\r\n";
+static constexpr http_fragment kConnectionKeepAlive = "Connection: Keep-Alive\r\n";
+static constexpr http_fragment kConnectionClose     = "Connection: close\r\n";
+
+// The header names, the value follows.
+static constexpr http_fragment kContentLength       = "Content-Length: ";
+static constexpr http_fragment kRequestId           = "X-Request-Id: ";
+
+static constexpr http_fragment kCRLF                = "\r\n";
+
+} // namespace http_fragments
+
+namespace detail {
+
+static const char kDigitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static inline uint32_t count_digits(uint64_t value)
+{
+    uint32_t digits = 1;
+    while (value >= 10000) {
+        value /= 10000;
+        digits += 4;
+    }
+    if (value >= 1000) return digits + 3;
+    if (value >= 100) return digits + 2;
+    if (value >= 10) return digits + 1;
+    return digits;
+}
+
+// Write the decimal value backward from the end, two digits a round, returns the length.
+static inline std::size_t u64toa(char * output, uint64_t value)
+{
+    std::size_t length = count_digits(value);
+    char * cursor = output + length;
+    while (value >= 100) {
+        uint32_t index = (uint32_t)(value % 100) * 2;
+        value /= 100;
+        cursor -= 2;
+        cursor[0] = kDigitPairs[index];
+        cursor[1] = kDigitPairs[index + 1];
+    }
+    if (value >= 10) {
+        uint32_t index = (uint32_t)value * 2;
+        cursor -= 2;
+        cursor[0] = kDigitPairs[index];
+        cursor[1] = kDigitPairs[index + 1];
+    }
+    else {
+        *--cursor = (char)('0' + value);
+    }
+    return length;
+}
+
+} // namespace detail
+
+//
+// The per-connection output arena, a bump allocator over fixed blocks.
+//
+class http_output_arena : private boost::noncopyable
+{
+public:
+    enum { kDefaultBlockSize = 16 * 1024 };
+    // The blocks kept by reset(), the ones beyond it are freed.
+    enum { kMaxRetainedBlocks = 8 };
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    std::size_t block_size_;
+    std::size_t block_index_;
+    std::size_t block_used_;
+
+public:
+    explicit http_output_arena(std::size_t block_size = kDefaultBlockSize)
+        : block_size_(block_size), block_index_(0), block_used_(0)
+    {
+    }
+
+    ~http_output_arena()
+    {
+    }
+
+    std::size_t block_size() const { return block_size_; }
+    std::size_t block_count() const { return blocks_.size(); }
+
+    bool empty() const
+    {
+        return (block_index_ == 0 && block_used_ == 0);
+    }
+
+    /// The free space of the current block (or the next one), at least min_size bytes.
+    /// Returns nullptr if min_size is larger than a block.
+    char * reserve(std::size_t min_size, char *& limit)
+    {
+        if (min_size > block_size_)
+            return nullptr;
+        if (blocks_.empty() || (block_size_ - block_used_) < min_size) {
+            if (!blocks_.empty())
+                block_index_++;
+            if (block_index_ >= blocks_.size())
+                blocks_.emplace_back(new char[block_size_]);
+            block_used_ = 0;
+        }
+        char * block = blocks_[block_index_].get();
+        limit = block + block_size_;
+        return block + block_used_;
+    }
+
+    /// Mark the space before cursor (returned by reserve()) as used.
+    void commit(const char * cursor)
+    {
+        block_used_ = (std::size_t)(cursor - blocks_[block_index_].get());
+    }
+
+    /// Rewind the arena, nothing written into it may be in flight.
+    void reset()
+    {
+        block_index_ = 0;
+        block_used_ = 0;
+        if (blocks_.size() > kMaxRetainedBlocks)
+            blocks_.resize(kMaxRetainedBlocks);
+    }
+};
+
+//
+// Builds one response into the arena, the written ranges are appended to a gather list.
+//
+class http_response_builder : private boost::noncopyable
+{
+public:
+    typedef std::vector<boost::asio::const_buffer> gather_list;
+
+    // A body not larger than it is copied behind the header, the larger ones are referenced.
+    enum { kMaxCopiedBody = 512 };
+    // The longest value written by header_uint().
+    enum { kMaxIntegerSize = 20 };
+
+private:
+    http_output_arena & arena_;
+    gather_list &       output_;
+    char *              begin_;
+    char *              cursor_;
+    char *              limit_;
+    std::size_t         total_size_;
+    bool                failed_;
+    // The gather list before this response, for rollback().
+    std::size_t         mark_count_;
+    std::size_t         mark_back_size_;
+
+public:
+    http_response_builder(http_output_arena & arena, gather_list & output)
+        : arena_(arena), output_(output), begin_(nullptr), cursor_(nullptr), limit_(nullptr),
+          total_size_(0), failed_(false), mark_count_(output.size()),
+          mark_back_size_(output.empty() ? 0 : output.back().size())
+    {
+    }
+
+    ~http_response_builder()
+    {
+        finish();
+    }
+
+    /// False if a piece didn't fit in an arena block, the response is incomplete.
+    bool is_ok() const { return !failed_; }
+
+    /// The bytes of the response written so far (including the referenced body).
+    std::size_t size() const { return total_size_ + (std::size_t)(cursor_ - begin_); }
+
+    http_response_builder & status(uint32_t status_code)
+    {
+        switch (status_code) {
+        case 200: return append(http_fragments::kStatus200);
+        case 204: return append(http_fragments::kStatus204);
+        case 400: return append(http_fragments::kStatus400);
+        case 404: return append(http_fragments::kStatus404);
+        default:  return append(http_fragments::kStatus500);
+        }
+    }
+
+    /// A whole header line, "Name: value\r\n".
+    http_response_builder & header(const http_fragment & line)
+    {
+        return append(line);
+    }
+
+    /// The name fragment includes ": ".
+    http_response_builder & header(const http_fragment & name, const char * value, std::size_t value_len)
+    {
+        char * output = ensure(name.size + value_len + http_fragments::kCRLF.size);
+        if (output != nullptr) {
+            ::memcpy(output, name.data, name.size);
+            output += name.size;
+            ::memcpy(output, value, value_len);
+            output += value_len;
+            output[0] = '\r';
+            output[1] = '\n';
+            cursor_ = output + 2;
+        }
+        return *this;
+    }
+
+    http_response_builder & header_uint(const http_fragment & name, uint64_t value)
+    {
+        char * output = ensure(name.size + kMaxIntegerSize + http_fragments::kCRLF.size);
+        if (output != nullptr) {
+            ::memcpy(output, name.data, name.size);
+            output += name.size;
+            output += detail::u64toa(output, value);
+            output[0] = '\r';
+            output[1] = '\n';
+            cursor_ = output + 2;
+        }
+        return *this;
+    }
+
+    http_response_builder & content_length(uint64_t length)
+    {
+        return header_uint(http_fragments::kContentLength, length);
+    }
+
+    http_response_builder & end_headers()
+    {
+        return append(http_fragments::kCRLF);
+    }
+
+    /// A small body is copied, a large one must stay valid until the write completes.
+    http_response_builder & body(const char * data, std::size_t size)
+    {
+        if (size <= kMaxCopiedBody) {
+            char * output = ensure(size);
+            if (output != nullptr) {
+                ::memcpy(output, data, size);
+                cursor_ = output + size;
+            }
+        }
+        else {
+            seal();
+            output_.push_back(boost::asio::const_buffer(data, size));
+            total_size_ += size;
+        }
+        return *this;
+    }
+
+    /// Commit the written bytes to the arena and append the last range, returns the response size.
+    std::size_t finish()
+    {
+        seal();
+        return total_size_;
+    }
+
+    /// Drop the ranges of this response from the gather list (the arena space is kept until reset),
+    /// the builder can write another response (e.g. a 500) after it.
+    void rollback()
+    {
+        seal();
+        output_.resize(mark_count_);
+        if (mark_count_ != 0) {
+            boost::asio::const_buffer & last = output_.back();
+            last = boost::asio::const_buffer(last.data(), mark_back_size_);
+        }
+        total_size_ = 0;
+        failed_ = false;
+        begin_ = nullptr;
+        cursor_ = nullptr;
+        limit_ = nullptr;
+    }
+
+private:
+    http_response_builder & append(const http_fragment & fragment)
+    {
+        char * output = ensure(fragment.size);
+        if (output != nullptr) {
+            ::memcpy(output, fragment.data, fragment.size);
+            cursor_ = output + fragment.size;
+        }
+        return *this;
+    }
+
+    // The output position with at least size bytes free, it may start a new range.
+    char * ensure(std::size_t size)
+    {
+        if (failed_)
+            return nullptr;
+        if ((std::size_t)(limit_ - cursor_) >= size)
+            return cursor_;
+
+        seal();
+        cursor_ = arena_.reserve(size, limit_);
+        begin_ = cursor_;
+        if (cursor_ == nullptr) {
+            limit_ = nullptr;
+            failed_ = true;
+        }
+        return cursor_;
+    }
+
+    // Append the written range to the gather list, merged with the previous one if adjacent.
+    void seal()
+    {
+        if (cursor_ == begin_)
+            return;
+        std::size_t size = (std::size_t)(cursor_ - begin_);
+        arena_.commit(cursor_);
+        if (!output_.empty()) {
+            boost::asio::const_buffer & last = output_.back();
+            if ((const char *)last.data() + last.size() == begin_) {
+                last = boost::asio::const_buffer(last.data(), last.size() + size);
+                size = 0;
+            }
+        }
+        if (size != 0)
+            output_.push_back(boost::asio::const_buffer(begin_, size));
+        total_size_ += (std::size_t)(cursor_ - begin_);
+        begin_ = cursor_;
+    }
+};
+
+//
+// A response which is built per request, bound to a route instead of a static string.
+//
+class http_dynamic_response
+{
+public:
+    virtual ~http_dynamic_response() {}
+
+    /// request_seq is the sequence number of the request on its connection (from 1).
+    virtual void build(http_response_builder & builder, const http_request_line & request,
+                       uint64_t request_seq) const = 0;
+};
+
+} // namespace asio_test
@@ -0,0 +1,304 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <boost/noncopyable.hpp>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+#define HTTP_RING_BUFFER_HAS_MIRROR 1
+#else
+#define HTTP_RING_BUFFER_HAS_MIRROR 0
+#endif
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                            < Http Ring Buffer >
+
+ Bottom        Back         Parsed              Front                          Top
+    |-----------|--------------|------------------|-----------------------------|
+                ^              ^                  ^
+
+  Copy mode (the fallback): 2 x buffer_size bytes, when the free space runs out,
+  rollback() copies the unparsed bytes [Back, Front) down to Bottom.
+
+  Mirror mode: the same physical pages (a memfd) are mapped twice, back to back,
+  so [Bottom, Bottom + capacity) and [Bottom + capacity, Top) are the same bytes:
+
+ Bottom                   Bottom + capacity                                    Top
+    |----------|==============|==========|------------------------------------|
+               ^ Back         :          ^ Front   (the same pages again)
+                              : wraps without a copy
+
+  Any span [Back, Back + capacity) is contiguous in the virtual memory, a read or a
+  parse never wraps. When Back crosses Bottom + capacity, all the pointers are
+  moved down by capacity (no byte is copied), rollback() never copies.
+  It only needs capacity bytes, half of the copy mode.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+class http_ring_buffer : private boost::noncopyable {
+private:
+    char * memory_;
+    std::size_t buffer_size_;
+    std::size_t capacity_;
+    bool mirrored_;
+    char * top_;
+    char * back_;
+    char * parsed_;
+    char * front_;
+
+public:
+    http_ring_buffer(std::size_t buffer_size, bool use_mirror = true)
+        : memory_(nullptr), buffer_size_(buffer_size), capacity_(0), mirrored_(false),
+          top_(nullptr), back_(nullptr), parsed_(nullptr), front_(nullptr) {
+        if (!use_mirror || !init_mirror_buffer(buffer_size))
+            init_ring_buffer(buffer_size);
+    }
+
+    ~http_ring_buffer() {
+        free_buffer();
+    }
+
+    static bool is_mirror_supported() {
+        return (HTTP_RING_BUFFER_HAS_MIRROR != 0);
+    }
+
+private:
+    void init_ring_buffer(std::size_t buffer_size) {
+        char * newBuffer = new (std::nothrow) char [buffer_size * 2];
+        if (newBuffer) {
+            ::memset(newBuffer, 0, buffer_size * 2 * sizeof(char));
+        }
+        memory_ = newBuffer;
+        capacity_ = buffer_size * 2;
+        mirrored_ = false;
+
+        char * _bottom = memory_;
+        top_ = _bottom + buffer_size * 2;
+        back_ = _bottom;
+        parsed_ = _bottom;
+        front_ = _bottom;
+    }
+
+    bool init_mirror_buffer(std::size_t buffer_size) {
+#if HTTP_RING_BUFFER_HAS_MIRROR
+        // The two mappings must start on a page boundary.
+        std::size_t page_size = (std::size_t)::sysconf(_SC_PAGESIZE);
+        std::size_t capacity = (buffer_size + page_size - 1) / page_size * page_size;
+        if (capacity == 0)
+            return false;
+
+        int fd = (int)::syscall(SYS_memfd_create, "http_ring_buffer", 1U /* MFD_CLOEXEC */);
+        if (fd < 0)
+            return false;
+        if (::ftruncate(fd, (off_t)capacity) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        // Reserve the address space first, then map the memfd twice over it.
+        void * reserved = ::mmap(nullptr, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reserved == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        char * base = (char *)reserved;
+        void * first = ::mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+        void * second = (first != MAP_FAILED)
+                      ? ::mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+                      : MAP_FAILED;
+        // The mappings keep the pages alive.
+        ::close(fd);
+        if (first == MAP_FAILED || second == MAP_FAILED) {
+            // e.g. vm.max_map_count is reached, use the copy mode.
+            ::munmap(base, capacity * 2);
+            return false;
+        }
+
+        memory_ = base;
+        capacity_ = capacity;
+        mirrored_ = true;
+
+        top_ = base + capacity * 2;
+        back_ = base;
+        parsed_ = base;
+        front_ = base;
+        return true;
+#else
+        (void)buffer_size;
+        return false;
+#endif
+    }
+
+    void free_buffer() {
+        if (memory_ != nullptr) {
+#if HTTP_RING_BUFFER_HAS_MIRROR
+            if (mirrored_)
+                ::munmap(memory_, capacity_ * 2);
+            else
+                delete[] memory_;
+#else
+            delete[] memory_;
+#endif
+            memory_ = nullptr;
+        }
+    }
+
+    // Mirror mode: move the window down by capacity, the bytes are the same pages.
+    void rebase() {
+        if (back_ >= memory_ + capacity_) {
+            back_ -= capacity_;
+            parsed_ -= capacity_;
+            front_ -= capacity_;
+        }
+    }
+
+public:
+    bool is_mirrored() const { return mirrored_; }
+
+    std::size_t buffer_size() const { return buffer_size_; }
+    /// The bytes of the memory allocated (physical pages in mirror mode).
+    std::size_t total_sizes() const { return capacity_; }
+    /// The max bytes of data it can hold.
+    std::size_t capacity() const { return capacity_; }
+    std::size_t offset() const { return static_cast<std::size_t>(back_ - memory_); }
+    std::size_t empty_size() const { return offset(); }
+    std::size_t free_size() const {
+        return mirrored_ ? (capacity_ - data_length()) : static_cast<std::size_t>(top_ - front_);
+    }
+    std::size_t data_length() const { return static_cast<std::size_t>(front_ - back_); }
+
+    std::size_t parse_pos() const { return static_cast<std::size_t>(parsed_ - back_); }
+
+    char * data() const { return memory_; }
+
+    char * bottom() const { return memory_; }
+    char * top() const { return top_; }
+    char * back() const { return back_; }
+    char * parsed() const { return parsed_; }
+    char * front() const { return front_; }
+
+    void reset(std::size_t data_bytes, std::size_t parsed_pos) {
+        char * _bottom = memory_;
+        back_ = _bottom;
+        parsed_ = _bottom + parsed_pos;
+        front_ = _bottom + data_bytes;
+    }
+
+    /// Returns the bytes copied, it's always 0 in mirror mode.
+    std::size_t rollback() {
+        if (mirrored_) {
+            rebase();
+            return 0;
+        }
+
+        std::size_t offset = this->offset();
+        std::size_t data_bytes = data_length();
+        std::size_t parsed_offset = parse_pos();
+
+        if (offset >= data_bytes) {
+            ::memcpy((void *)bottom(), (void *)back(), data_bytes * sizeof(char));
+        }
+        else {
+            ::memmove((void *)bottom(), (void *)back(), data_bytes * sizeof(char));
+        }
+        reset(data_bytes, parsed_offset);
+        return data_bytes;
+    }
+
+    bool read(std::size_t recv_size) {
+        if (recv_size <= free_size()) {
+            front_ += recv_size;
+            return true;
+        }
+        else {
+            return false;
+        }
+    }
+
+    void parse_to(char * parsed) {
+        back_ = parsed;
+        parsed_ = parsed;
+        if (mirrored_)
+            rebase();
+    }
+
+    bool parse_add(std::size_t parse_size) {
+        if (parsed_ + parse_size < top_) {
+            parsed_ += parse_size;
+            back_ = parsed_;
+            if (mirrored_)
+                rebase();
+            return true;
+        }
+        else {
+            parsed_ = top_;
+            back_ = top_;
+            return false;
+        }
+    }
+
+    bool parse(char * &parsed) {
+        // Forward-tracking find method
+        char * cur = parsed_;
+        while (cur <= (front_ - 4)) {
+            if (cur[0] == '\r' && cur[2] == '\r'
+                && cur[1] == '\n' && cur[3] == '\n') {
+                parsed = (cur + 4);
+                return true;
+            }
+            cur++;
+            assert(cur < top_);
+        }
+        parsed = cur;
+        return false;
+    }
+
+    bool back_parse(char * &parsed) {
+        // Back-tracking find method
+        char * cur = front_ - 4;
+        while (cur >= parsed_) {
+            if (cur[0] == '\r') {
+                if (cur[2] == '\r') {
+                    if (cur[1] == '\n' && cur[3] == '\n') {
+                        parsed = (cur + 4);
+                        return true;
+                    }
+                    // TODO: If HTTP header request format is standard, this way is Ok.
+                    cur -= 4;
+                }
+                else if (cur[1] == '\n') {
+                    cur -= 2;
+                }
+                else {
+                    cur -= 4;
+                }
+            }
+            else if (cur[0] == '\n') {
+                cur--;
+            }
+            else {
+                cur -= 4;
+            }
+        }
+        parsed = front_;
+        return false;
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,377 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include "http_request.hpp"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                        < Compile-time http route table >
+
+  The static route set is a constexpr array of route_def, all (method, path) keys
+  are hashed at compile time, then a multiplicative seed is searched
+  (also at compile time) so that every key lands in a distinct slot:
+
+      slot = (key * seed) >> (64 - kTableBits)
+
+  A lookup is one pass over the path (8 bytes a round), one multiply and one 64-bit compare
+  against the key stored in the slot. A 64-bit hash is not a proof, so a hit is confirmed
+  by one memcmp against the path stored in the slot (a miss never compares a string).
+
+  Routes which are only known at runtime are registered into a fallback map,
+  it is only probed when the static table misses.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+struct route_def {
+    http_method_t   method;
+    const char *    path;
+    uint32_t        id;
+};
+
+static const uint32_t kInvalidRouteId = uint32_t(-1);
+
+namespace detail {
+
+static const uint64_t kHashOffsetBasis = 14695981039346656037ULL;
+static const uint64_t kHashPrime = 1099511628211ULL;
+static const uint64_t kHashMultiplier = 0xC6A4A7935BD1E995ULL;
+
+// The golden ratio of 2^64, all the seed candidates are odd.
+static const uint64_t kSeedBase = 0x9E3779B97F4A7C15ULL;
+static const uint64_t kSeedStep = 0x632BE59BD9B4E019ULL;
+
+static const std::size_t kMaxSeedAttempts = 256;
+static const uint32_t kMaxExtraTableBits = 3;
+
+//
+// The key hash eats 8 bytes per round (little-endian), the constexpr version
+// and the runtime version must always give the same value.
+//
+constexpr uint64_t hash_shift_mix(uint64_t x)
+{
+    return x ^ (x >> 29);
+}
+
+constexpr uint64_t hash_round(uint64_t hash, uint64_t word)
+{
+    return hash_shift_mix((hash ^ word) * kHashMultiplier);
+}
+
+constexpr uint64_t hash_seed(http_method_t method, std::size_t len)
+{
+    return ((kHashOffsetBasis ^ (uint64_t)method) * kHashPrime) ^ ((uint64_t)len << 48);
+}
+
+constexpr std::size_t const_strlen(const char * str, std::size_t len = 0)
+{
+    return (str[len] == '\0') ? len : const_strlen(str, len + 1);
+}
+
+constexpr uint64_t const_load_bytes(const char * str, std::size_t len, std::size_t i = 0)
+{
+    return (i >= len) ? 0
+         : (((uint64_t)(uint8_t)str[i] << (i * 8)) | const_load_bytes(str, len, i + 1));
+}
+
+constexpr uint64_t const_hash_bytes(const char * str, std::size_t len, uint64_t hash)
+{
+    return (len >= 8) ? const_hash_bytes(str + 8, len - 8, hash_round(hash, const_load_bytes(str, 8)))
+         : ((len == 0) ? hash : hash_round(hash, const_load_bytes(str, len)));
+}
+
+constexpr uint64_t route_key(http_method_t method, const char * path)
+{
+    return const_hash_bytes(path, const_strlen(path), hash_seed(method, const_strlen(path)));
+}
+
+constexpr uint64_t route_key(const route_def & route)
+{
+    return route_key(route.method, route.path);
+}
+
+static inline
+uint64_t load_u64_le(const char * data)
+{
+    uint64_t word;
+    ::memcpy(&word, data, sizeof(uint64_t));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline
+uint64_t route_key(http_method_t method, const char * path, std::size_t path_len)
+{
+    uint64_t hash = hash_seed(method, path_len);
+    while (path_len >= 8) {
+        hash = hash_round(hash, load_u64_le(path));
+        path += 8;
+        path_len -= 8;
+    }
+    if (path_len > 0) {
+        uint64_t tail = 0;
+        for (std::size_t i = 0; i < path_len; ++i) {
+            tail |= (uint64_t)(uint8_t)path[i] << (i * 8);
+        }
+        hash = hash_round(hash, tail);
+    }
+    return hash;
+}
+
+constexpr std::size_t route_slot(uint64_t key, uint64_t seed, uint32_t bits)
+{
+    return (std::size_t)((key * seed) >> (64 - bits));
+}
+
+constexpr uint64_t seed_candidate(std::size_t attempt)
+{
+    return kSeedBase + (uint64_t)attempt * kSeedStep * 2;
+}
+
+constexpr uint32_t ceil_log2(std::size_t n, uint32_t bits = 0)
+{
+    return ((std::size_t(1) << bits) >= n) ? bits : ceil_log2(n, bits + 1);
+}
+
+template <std::size_t N>
+constexpr bool collides_with(const route_def (&routes)[N], uint64_t seed, uint32_t bits,
+                             std::size_t i, std::size_t j)
+{
+    return (j >= N) ? false
+         : ((route_slot(route_key(routes[i]), seed, bits) == route_slot(route_key(routes[j]), seed, bits))
+            || collides_with(routes, seed, bits, i, j + 1));
+}
+
+template <std::size_t N>
+constexpr bool has_collision(const route_def (&routes)[N], uint64_t seed, uint32_t bits, std::size_t i = 0)
+{
+    return (i >= N) ? false
+         : (collides_with(routes, seed, bits, i, i + 1) || has_collision(routes, seed, bits, i + 1));
+}
+
+// Returns 0 if no perfect seed can be found (e.g. duplicate routes).
+template <std::size_t N>
+constexpr uint64_t find_seed(const route_def (&routes)[N], uint32_t bits, std::size_t attempt = 0)
+{
+    return (attempt >= kMaxSeedAttempts) ? 0
+         : (!has_collision(routes, seed_candidate(attempt), bits) ? seed_candidate(attempt)
+            : find_seed(routes, bits, attempt + 1));
+}
+
+// Start with a load factor of at most 1/2, grow the table if no seed is found.
+template <std::size_t N>
+constexpr uint32_t find_table_bits(const route_def (&routes)[N], uint32_t bits, uint32_t max_bits)
+{
+    return (bits >= max_bits || find_seed(routes, bits) != 0) ? bits
+         : find_table_bits(routes, bits + 1, max_bits);
+}
+
+template <std::size_t N>
+constexpr uint64_t key_for_slot(const route_def (&routes)[N], uint64_t seed, uint32_t bits,
+                                std::size_t slot, std::size_t i = 0)
+{
+    return (i >= N) ? 0
+         : ((route_slot(route_key(routes[i]), seed, bits) == slot) ? route_key(routes[i])
+            : key_for_slot(routes, seed, bits, slot, i + 1));
+}
+
+template <std::size_t N>
+constexpr http_method_t method_for_slot(const route_def (&routes)[N], uint64_t seed, uint32_t bits,
+                                        std::size_t slot, std::size_t i = 0)
+{
+    return (i >= N) ? http_method_unknown
+         : ((route_slot(route_key(routes[i]), seed, bits) == slot) ? routes[i].method
+            : method_for_slot(routes, seed, bits, slot, i + 1));
+}
+
+template <std::size_t N>
+constexpr const char * path_for_slot(const route_def (&routes)[N], uint64_t seed, uint32_t bits,
+                                     std::size_t slot, std::size_t i = 0)
+{
+    return (i >= N) ? ""
+         : ((route_slot(route_key(routes[i]), seed, bits) == slot) ? routes[i].path
+            : path_for_slot(routes, seed, bits, slot, i + 1));
+}
+
+template <std::size_t N>
+constexpr uint32_t id_for_slot(const route_def (&routes)[N], uint64_t seed, uint32_t bits,
+                               std::size_t slot, std::size_t i = 0)
+{
+    return (i >= N) ? kInvalidRouteId
+         : ((route_slot(route_key(routes[i]), seed, bits) == slot) ? routes[i].id
+            : id_for_slot(routes, seed, bits, slot, i + 1));
+}
+
+// C++ 11 doesn't have std::index_sequence.
+template <std::size_t... Is>
+struct index_seq {};
+
+template <std::size_t N, std::size_t... Is>
+struct make_index_seq : make_index_seq<N - 1, N - 1, Is...> {};
+
+template <std::size_t... Is>
+struct make_index_seq<0, Is...> {
+    typedef index_seq<Is...> type;
+};
+
+template <std::size_t TableSize>
+struct slot_table {
+    uint64_t        keys[TableSize];
+    uint32_t        ids[TableSize];
+    // The route of the slot, to confirm a hit of the key.
+    http_method_t   methods[TableSize];
+    uint32_t        lengths[TableSize];
+    const char *    paths[TableSize];
+};
+
+template <std::size_t TableSize, std::size_t N, std::size_t... Is>
+constexpr slot_table<TableSize> make_slot_table(const route_def (&routes)[N], uint64_t seed,
+                                                uint32_t bits, index_seq<Is...>)
+{
+    return slot_table<TableSize> {
+        { key_for_slot(routes, seed, bits, Is)... },
+        { id_for_slot(routes, seed, bits, Is)... },
+        { method_for_slot(routes, seed, bits, Is)... },
+        { (uint32_t)const_strlen(path_for_slot(routes, seed, bits, Is))... },
+        { path_for_slot(routes, seed, bits, Is)... }
+    };
+}
+
+} // namespace detail
+
+//
+// The static part of the router: maps (method, path) to a route id.
+//
+template <std::size_t N, const route_def (&Routes)[N]>
+class static_route_table {
+public:
+    static const uint32_t kTableBits = detail::find_table_bits(Routes,
+                                            detail::ceil_log2(N) + 1,
+                                            detail::ceil_log2(N) + 1 + detail::kMaxExtraTableBits);
+    static const std::size_t kTableSize = std::size_t(1) << kTableBits;
+    static const uint64_t kSeed = detail::find_seed(Routes, kTableBits);
+
+    static_assert(N > 0, "static_route_table: the route set is empty.");
+    static_assert(kSeed != 0, "static_route_table: can not find a perfect hash seed, "
+                              "maybe there are duplicate routes.");
+
+    typedef detail::slot_table<kTableSize> slot_table;
+
+private:
+    // Constant-initialized, the lookup never checks an initialization guard.
+    static constexpr slot_table kTable = detail::make_slot_table<kTableSize>(
+            Routes, kSeed, kTableBits, typename detail::make_index_seq<kTableSize>::type());
+
+public:
+    static std::size_t size() { return N; }
+
+    /// The key is detail::route_key(method, path, path_len).
+    static uint32_t lookup(uint64_t key, http_method_t method, const char * path, std::size_t path_len) {
+        std::size_t slot = detail::route_slot(key, kSeed, kTableBits);
+        if (kTable.keys[slot] != key)
+            return kInvalidRouteId;
+        // Confirm the hit, a request path may collide with a route on the 64-bit hash.
+        return (kTable.methods[slot] == method && kTable.lengths[slot] == path_len
+                && ::memcmp(kTable.paths[slot], path, path_len) == 0) ? kTable.ids[slot] : kInvalidRouteId;
+    }
+
+    static uint32_t lookup(http_method_t method, const char * path, std::size_t path_len) {
+        return lookup(detail::route_key(method, path, path_len), method, path, path_len);
+    }
+};
+
+template <std::size_t N, const route_def (&Routes)[N]>
+constexpr typename static_route_table<N, Routes>::slot_table static_route_table<N, Routes>::kTable;
+
+//
+// The http router: a compile-time route table, a handler per static route id,
+// and a runtime-registered fallback for the dynamic routes.
+//
+template <typename Handler, std::size_t N, const route_def (&Routes)[N]>
+class http_router {
+public:
+    typedef Handler                             handler_type;
+    typedef static_route_table<N, Routes>       table_type;
+
+private:
+    struct dynamic_route {
+        http_method_t   method;
+        std::string     path;
+        handler_type    handler;
+    };
+
+    handler_type handlers_[N];
+    std::unordered_map<uint64_t, dynamic_route> dynamic_routes_;
+
+public:
+    http_router() : handlers_() {}
+    ~http_router() {}
+
+    /// Bind a handler to a static route id (the id in the route_def).
+    bool bind(uint32_t id, const handler_type & handler) {
+        if (id < N) {
+            handlers_[id] = handler;
+            return true;
+        }
+        return false;
+    }
+
+    /// Register a route at runtime, only be probed when the static table misses.
+    bool add_route(http_method_t method, const std::string & path, const handler_type & handler) {
+        uint64_t key = detail::route_key(method, path.c_str(), path.size());
+        if (table_type::lookup(key, method, path.c_str(), path.size()) != kInvalidRouteId)
+            return false;
+        dynamic_route route;
+        route.method = method;
+        route.path = path;
+        route.handler = handler;
+        return dynamic_routes_.insert(std::make_pair(key, route)).second;
+    }
+
+    std::size_t static_routes() const { return N; }
+    std::size_t dynamic_routes() const { return dynamic_routes_.size(); }
+
+    /// Returns nullptr if the route is not found.
+    const handler_type * dispatch(http_method_t method, const char * path, std::size_t path_len) const {
+        uint64_t key = detail::route_key(method, path, path_len);
+        uint32_t id = table_type::lookup(key, method, path, path_len);
+        if (id < N) {
+            return &handlers_[id];
+        }
+        if (!dynamic_routes_.empty()) {
+            return dispatch_dynamic(key, method, path, path_len);
+        }
+        return nullptr;
+    }
+
+    const handler_type * dispatch(const http_request_line & request) const {
+        return dispatch(request.method, request.path, request.path_len);
+    }
+
+private:
+    const handler_type * dispatch_dynamic(uint64_t key, http_method_t method,
+                                          const char * path, std::size_t path_len) const {
+        typename std::unordered_map<uint64_t, dynamic_route>::const_iterator iter = dynamic_routes_.find(key);
+        if (iter != dynamic_routes_.end()) {
+            // Confirm the match, the fallback routes are not collision-free.
+            const dynamic_route & route = iter->second;
+            if (route.method == method && route.path.size() == path_len
+                && ::memcmp(route.path.c_str(), path, path_len) == 0) {
+                return &route.handler;
+            }
+        }
+        return nullptr;
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,413 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+
+#include "../common.h"
+#include "../io_service_pool.hpp"
+#include "http_body_decoder.hpp"
+
+using namespace boost::asio;
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                  < Upstream connection pools of the reverse proxy >
+
+  Every io_service has its own pool, a session only takes the connections from
+  the pool of its own io_service, so an upstream connection never crosses
+  threads and the pool needs no lock.
+
+  The pools are pre-warmed at startup (upstream_conns connections to every
+  upstream). An idle connection keeps a read pending, so a connection closed by
+  the upstream (e.g. its keep-alive timeout) leaves the pool at once instead of
+  failing the next request. The upstreams are picked round-robin.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+//
+// Parse "host:port[,host:port...]", returns false if an item is malformed.
+//
+static inline
+bool parse_upstream_list(const std::string & list, std::vector<std::pair<std::string, std::string>> & upstreams)
+{
+    upstreams.clear();
+    std::size_t begin = 0;
+    while (begin < list.size()) {
+        std::size_t end = list.find(',', begin);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string item = list.substr(begin, end - begin);
+        std::size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 >= item.size())
+            return false;
+        upstreams.push_back(std::make_pair(item.substr(0, colon), item.substr(colon + 1)));
+        begin = end + 1;
+    }
+    return !upstreams.empty();
+}
+
+enum http_response_framing_t {
+    http_framing_none,              // 1xx, 204, 304 or a response to HEAD
+    http_framing_length,
+    http_framing_chunked,
+    http_framing_close              // The body ends when the upstream closes
+};
+
+struct http_response_head {
+    uint32_t        status_code;
+    uint32_t        framing;
+    uint64_t        content_length;
+    bool            keep_alive;
+
+    http_response_head()
+        : status_code(0), framing(http_framing_none), content_length(0), keep_alive(true) {}
+};
+
+//
+// Parse the status line and the framing headers of a response [begin, end),
+// returns false if it's malformed.
+//
+static inline
+bool parse_http_response_head(const char * begin, const char * end, bool head_request,
+                              http_response_head & head)
+{
+    static const char kContentLength[] = "content-length";
+    static const char kTransferEncoding[] = "transfer-encoding";
+    static const char kConnection[] = "connection";
+
+    // "HTTP/1.x 200 OK"
+    if ((end - begin) < 12 || ::memcmp(begin, "HTTP/1.", 7) != 0 || begin[8] != ' ')
+        return false;
+    uint32_t status_code = 0;
+    for (int i = 9; i < 12; ++i) {
+        if (begin[i] < '0' || begin[i] > '9')
+            return false;
+        status_code = status_code * 10 + (uint32_t)(begin[i] - '0');
+    }
+    head.status_code = status_code;
+    // HTTP/1.0 closes after the response unless it says "keep-alive".
+    head.keep_alive = (begin[7] != '0');
+    head.content_length = 0;
+
+    bool has_length = false, is_chunked = false;
+    const char * line = (const char *)::memchr(begin, '\n', end - begin);
+    while (line != nullptr && ++line < end) {
+        const char * line_end = (const char *)::memchr(line, '\n', end - line);
+        if (line_end == nullptr)
+            line_end = end;
+        const char * value_end = (line_end > line && line_end[-1] == '\r') ? (line_end - 1) : line_end;
+
+        char first = detail::ascii_tolower(*line);
+        if (first == 'c' || first == 't') {
+            const char * colon = (const char *)::memchr(line, ':', value_end - line);
+            if (colon != nullptr) {
+                std::size_t name_len = colon - line;
+                if (detail::header_name_equals(line, name_len, kContentLength, sizeof(kContentLength) - 1)) {
+                    uint64_t length;
+                    if (!detail::parse_decimal_u64(colon + 1, value_end, length))
+                        return false;
+                    if (has_length && length != head.content_length)
+                        return false;
+                    head.content_length = length;
+                    has_length = true;
+                }
+                else if (detail::header_name_equals(line, name_len, kTransferEncoding, sizeof(kTransferEncoding) - 1)) {
+                    if (!detail::header_value_has_token(colon + 1, value_end, "chunked", 7))
+                        return false;
+                    is_chunked = true;
+                }
+                else if (detail::header_name_equals(line, name_len, kConnection, sizeof(kConnection) - 1)) {
+                    if (detail::header_value_has_token(colon + 1, value_end, "close", 5))
+                        head.keep_alive = false;
+                    else if (detail::header_value_has_token(colon + 1, value_end, "keep-alive", 10))
+                        head.keep_alive = true;
+                }
+            }
+        }
+        line = (line_end < end) ? line_end : nullptr;
+    }
+
+    if (head_request || (status_code >= 100 && status_code < 200) || status_code == 204 || status_code == 304)
+        head.framing = http_framing_none;
+    else if (is_chunked)
+        head.framing = http_framing_chunked;
+    else if (has_length)
+        head.framing = (head.content_length != 0) ? http_framing_length : http_framing_none;
+    else
+        head.framing = http_framing_close;
+    return true;
+}
+
+//
+// The size of the header (including the empty line) in [data, data + size), 0 if it's incomplete.
+// The bytes before from have been searched already.
+//
+static inline
+std::size_t find_http_header_end(const char * data, std::size_t size, std::size_t from)
+{
+    std::size_t pos = (from >= 3) ? (from - 3) : 0;
+    while (pos + 4 <= size) {
+        const char * lf = (const char *)::memchr(data + pos + 3, '\n', size - pos - 3);
+        if (lf == nullptr)
+            break;
+        pos = (std::size_t)(lf - data) - 3;
+        if (::memcmp(data + pos, "\r\n\r\n", 4) == 0)
+            return pos + 4;
+        pos++;
+    }
+    return 0;
+}
+
+class http_upstream_connection : public std::enable_shared_from_this<http_upstream_connection>,
+                                 private boost::noncopyable
+{
+public:
+    enum { kBufferSize = 64 * 1024 };
+
+private:
+    ip::tcp::socket     socket_;
+    std::size_t         upstream_index_;
+    bool                idle_;
+    // Bumped every time it goes idle, so a stale idle read is ignored.
+    uint32_t            idle_generation_;
+    std::vector<char>   buffer_;
+
+public:
+    http_upstream_connection(boost::asio::io_service & io_service, std::size_t upstream_index)
+        : socket_(io_service), upstream_index_(upstream_index), idle_(false), idle_generation_(0),
+          buffer_(kBufferSize)
+    {
+    }
+
+    ~http_upstream_connection()
+    {
+    }
+
+    ip::tcp::socket & socket() { return socket_; }
+    std::size_t upstream_index() const { return upstream_index_; }
+
+    char * buffer() { return &buffer_[0]; }
+    std::size_t buffer_size() const { return buffer_.size(); }
+
+    bool is_idle() const { return idle_; }
+    uint32_t idle_generation() const { return idle_generation_; }
+
+    void set_idle(bool idle)
+    {
+        idle_ = idle;
+        if (idle)
+            idle_generation_++;
+    }
+
+    bool is_open() const { return socket_.is_open(); }
+
+    void close()
+    {
+        idle_ = false;
+        if (socket_.is_open()) {
+            boost::system::error_code ignored_ec;
+            socket_.close(ignored_ec);
+        }
+    }
+};
+
+typedef std::shared_ptr<http_upstream_connection> upstream_connection_ptr;
+
+//
+// The upstream connections of one io_service, only be touched on its thread.
+//
+class http_upstream_pool : private boost::noncopyable
+{
+public:
+    typedef std::function<void (const boost::system::error_code &, upstream_connection_ptr)> connect_handler;
+
+private:
+    boost::asio::io_service &               io_service_;
+    const std::vector<ip::tcp::endpoint> &  endpoints_;
+    std::vector<std::vector<upstream_connection_ptr>> idle_;
+    std::size_t                             max_idle_;
+    std::size_t                             next_upstream_;
+
+public:
+    http_upstream_pool(boost::asio::io_service & io_service,
+                       const std::vector<ip::tcp::endpoint> & endpoints, std::size_t max_idle)
+        : io_service_(io_service), endpoints_(endpoints), idle_(endpoints.size()),
+          max_idle_(max_idle), next_upstream_(0)
+    {
+    }
+
+    ~http_upstream_pool()
+    {
+        close_all();
+    }
+
+    std::size_t idle_count() const
+    {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < idle_.size(); ++i)
+            total += idle_[i].size();
+        return total;
+    }
+
+    /// Open max_idle connections to every upstream, must be called on the thread of its io_service.
+    void prewarm()
+    {
+        for (std::size_t i = 0; i < endpoints_.size(); ++i) {
+            for (std::size_t n = 0; n < max_idle_; ++n) {
+                connect_to(i, [this](const boost::system::error_code & ec, upstream_connection_ptr conn) {
+                    if (!ec)
+                        release(conn, true);
+                });
+            }
+        }
+    }
+
+    /// An idle connection (round-robin over the upstreams), nullptr if there is none.
+    upstream_connection_ptr acquire()
+    {
+        std::size_t count = idle_.size();
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t index = (next_upstream_ + i) % count;
+            if (!idle_[index].empty()) {
+                upstream_connection_ptr conn = idle_[index].back();
+                idle_[index].pop_back();
+                conn->set_idle(false);
+                // Abort the idle read, its handler sees the connection isn't idle.
+                boost::system::error_code ignored_ec;
+                conn->socket().cancel(ignored_ec);
+                next_upstream_ = index + 1;
+                return conn;
+            }
+        }
+        return upstream_connection_ptr();
+    }
+
+    /// Open a new connection to the next upstream.
+    void connect(const connect_handler & handler)
+    {
+        std::size_t index = next_upstream_ % endpoints_.size();
+        next_upstream_ = index + 1;
+        connect_to(index, handler);
+    }
+
+    /// Give a connection back after a complete exchange, or close it if it can't be reused.
+    void release(upstream_connection_ptr conn, bool reusable)
+    {
+        std::vector<upstream_connection_ptr> & idle = idle_[conn->upstream_index()];
+        if (!reusable || !conn->is_open() || idle.size() >= max_idle_) {
+            conn->close();
+            return;
+        }
+        conn->set_idle(true);
+        idle.push_back(conn);
+        watch_idle(conn);
+    }
+
+    void close_all()
+    {
+        for (std::size_t i = 0; i < idle_.size(); ++i) {
+            for (std::size_t n = 0; n < idle_[i].size(); ++n)
+                idle_[i][n]->close();
+            idle_[i].clear();
+        }
+    }
+
+private:
+    void connect_to(std::size_t index, const connect_handler & handler)
+    {
+        upstream_connection_ptr conn = std::make_shared<http_upstream_connection>(io_service_, index);
+        conn->socket().async_connect(endpoints_[index],
+            [this, conn, handler](const boost::system::error_code & ec)
+            {
+                if (!ec) {
+                    boost::system::error_code ignored_ec;
+                    conn->socket().set_option(ip::tcp::no_delay(true), ignored_ec);
+                    g_upstream_connects.fetch_add(1);
+                    handler(ec, conn);
+                }
+                else {
+                    std::cout << "http_upstream_pool::connect_to() - Error: (code = " << ec.value() << ") "
+                              << ec.message().c_str() << ", upstream = " << endpoints_[conn->upstream_index()]
+                              << std::endl;
+                    conn->close();
+                    handler(ec, upstream_connection_ptr());
+                }
+            });
+    }
+
+    void watch_idle(upstream_connection_ptr conn)
+    {
+        uint32_t generation = conn->idle_generation();
+        conn->socket().async_read_some(boost::asio::buffer(conn->buffer(), conn->buffer_size()),
+            [this, conn, generation](const boost::system::error_code & ec, std::size_t recv_bytes)
+            {
+                // Taken by a session (the read is aborted), or idle again since then.
+                if (!conn->is_idle() || conn->idle_generation() != generation)
+                    return;
+                // Closed by the upstream, or an unexpected response: it can't be reused.
+                std::vector<upstream_connection_ptr> & idle = idle_[conn->upstream_index()];
+                std::vector<upstream_connection_ptr>::iterator iter = std::find(idle.begin(), idle.end(), conn);
+                if (iter != idle.end())
+                    idle.erase(iter);
+                conn->close();
+            });
+    }
+};
+
+//
+// One upstream pool per io_service.
+//
+class http_upstream_pools : private boost::noncopyable
+{
+private:
+    std::vector<ip::tcp::endpoint>                      endpoints_;
+    std::vector<std::unique_ptr<http_upstream_pool>>    pools_;
+
+public:
+    http_upstream_pools(io_service_pool & pool, const std::vector<ip::tcp::endpoint> & endpoints,
+                        std::size_t conns_per_upstream)
+        : endpoints_(endpoints)
+    {
+        pools_.reserve(pool.size());
+        for (std::size_t i = 0; i < pool.size(); ++i) {
+            pools_.push_back(std::unique_ptr<http_upstream_pool>(
+                new http_upstream_pool(pool.get_io_service(i), endpoints_, conns_per_upstream)));
+        }
+    }
+
+    ~http_upstream_pools() {}
+
+    std::size_t size() const { return pools_.size(); }
+    const std::vector<ip::tcp::endpoint> & endpoints() const { return endpoints_; }
+
+    http_upstream_pool & get_pool(std::size_t index)
+    {
+        assert(index < pools_.size());
+        return *pools_[index];
+    }
+
+    /// Pre-warm every pool on the thread of its own io_service.
+    void prewarm(io_service_pool & pool)
+    {
+        for (std::size_t i = 0; i < pools_.size(); ++i) {
+            http_upstream_pool * upstream_pool = pools_[i].get();
+            pool.get_io_service(i).post([upstream_pool]() { upstream_pool->prewarm(); });
+        }
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,366 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define WEBSOCKET_UNMASK_SSE2   1
+#else
+#define WEBSOCKET_UNMASK_SSE2   0
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WEBSOCKET_UNMASK_AVX2   1
+#else
+#define WEBSOCKET_UNMASK_AVX2   0
+#endif
+
+#include "http_body_decoder.hpp"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                            < WebSocket (RFC 6455) >
+
+     0                   1                   2                   3
+     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+    +-+-+-+-+-------+-+-------------+-------------------------------+
+    |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+    |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+    |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+    | |1|2|3|       |K|             |                               |
+    +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+    |     Extended payload length continued, if payload len == 127  |
+    + - - - - - - - - - - - - - - - +-------------------------------+
+    |                               |Masking-key, if MASK set to 1  |
+    +-------------------------------+-------------------------------+
+    | Masking-key (continued)       |          Payload Data         |
+    +-------------------------------- - - - - - - - - - - - - - - - +
+
+  Unmasking is a XOR with the 4-byte key repeated, it's done 32 (AVX2) or
+  16 (SSE2) bytes at a time, then 8 bytes, then byte by byte. The key offset
+  is carried over, so a payload can be unmasked piece by piece as it arrives.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+enum websocket_opcode_t {
+    ws_opcode_continuation  = 0x0,
+    ws_opcode_text          = 0x1,
+    ws_opcode_binary        = 0x2,
+    ws_opcode_close         = 0x8,
+    ws_opcode_ping          = 0x9,
+    ws_opcode_pong          = 0xA
+};
+
+enum {
+    kWebSocketMaxHeaderSize = 14,
+    kWebSocketMaxControlPayload = 125
+};
+
+struct websocket_frame_header {
+    bool        fin;
+    uint8_t     rsv;
+    uint8_t     opcode;
+    bool        masked;
+    uint8_t     mask[4];
+    uint64_t    payload_len;
+    std::size_t header_size;
+};
+
+/// Returns 0 if it needs more bytes, -1 if the header is malformed, or the header size.
+static inline
+int websocket_parse_frame_header(const char * data, std::size_t size, websocket_frame_header & header)
+{
+    if (size < 2)
+        return 0;
+    const uint8_t * bytes = (const uint8_t *)data;
+    header.fin = ((bytes[0] & 0x80) != 0);
+    header.rsv = (uint8_t)((bytes[0] >> 4) & 0x07);
+    header.opcode = (uint8_t)(bytes[0] & 0x0F);
+    header.masked = ((bytes[1] & 0x80) != 0);
+
+    std::size_t header_size = 2;
+    uint64_t payload_len = bytes[1] & 0x7F;
+    if (payload_len == 126) {
+        header_size += 2;
+        if (size < header_size)
+            return 0;
+        payload_len = ((uint64_t)bytes[2] << 8) | (uint64_t)bytes[3];
+    }
+    else if (payload_len == 127) {
+        header_size += 8;
+        if (size < header_size)
+            return 0;
+        payload_len = 0;
+        for (std::size_t i = 2; i < 10; ++i)
+            payload_len = (payload_len << 8) | (uint64_t)bytes[i];
+        if (payload_len & 0x8000000000000000ULL)
+            return -1;
+    }
+    if (header.masked) {
+        if (size < header_size + 4)
+            return 0;
+        ::memcpy(header.mask, bytes + header_size, 4);
+        header_size += 4;
+    }
+    header.payload_len = payload_len;
+    header.header_size = header_size;
+    return (int)header_size;
+}
+
+/// Append a frame header, the mask is optional (only the clients mask).
+static inline
+void websocket_append_frame_header(std::string & output, bool fin, uint8_t opcode,
+                                   uint64_t payload_len, const uint8_t * mask = nullptr)
+{
+    char bytes[kWebSocketMaxHeaderSize];
+    std::size_t size = 2;
+    bytes[0] = (char)((fin ? 0x80 : 0x00) | (opcode & 0x0F));
+    uint8_t mask_bit = (mask != nullptr) ? 0x80 : 0x00;
+    if (payload_len < 126) {
+        bytes[1] = (char)(mask_bit | (uint8_t)payload_len);
+    }
+    else if (payload_len <= 0xFFFF) {
+        bytes[1] = (char)(mask_bit | 126);
+        bytes[2] = (char)(payload_len >> 8);
+        bytes[3] = (char)payload_len;
+        size = 4;
+    }
+    else {
+        bytes[1] = (char)(mask_bit | 127);
+        for (std::size_t i = 0; i < 8; ++i)
+            bytes[2 + i] = (char)(payload_len >> (56 - i * 8));
+        size = 10;
+    }
+    if (mask != nullptr) {
+        ::memcpy(bytes + size, mask, 4);
+        size += 4;
+    }
+    output.append(bytes, size);
+}
+
+//
+// XOR the data with the mask in place, offset is the position of data[0] in the payload
+// (mod 4), returns the offset of the next byte.
+//
+static inline
+uint32_t websocket_unmask(char * data, std::size_t size, const uint8_t * mask, uint32_t offset)
+{
+    // The mask rotated to the offset, byte i of the word is for data[i].
+    uint8_t rotated[8];
+    for (uint32_t i = 0; i < 8; ++i)
+        rotated[i] = mask[(offset + i) & 3];
+    uint32_t mask32;
+    ::memcpy(&mask32, rotated, sizeof(mask32));
+
+    std::size_t i = 0;
+#if WEBSOCKET_UNMASK_AVX2
+    __m256i mask256 = _mm256_set1_epi32((int)mask32);
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(block, mask256));
+    }
+#endif
+#if WEBSOCKET_UNMASK_SSE2
+    __m128i mask128 = _mm_set1_epi32((int)mask32);
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(block, mask128));
+    }
+#endif
+    uint64_t mask64;
+    ::memcpy(&mask64, rotated, sizeof(mask64));
+    for (; i + 8 <= size; i += 8) {
+        uint64_t block;
+        ::memcpy(&block, data + i, sizeof(block));
+        block ^= mask64;
+        ::memcpy(data + i, &block, sizeof(block));
+    }
+    for (; i < size; ++i)
+        data[i] ^= (char)rotated[i & 3];
+
+    return (uint32_t)((offset + size) & 3);
+}
+
+namespace detail {
+
+// SHA-1, only for the Sec-WebSocket-Accept of the handshake.
+static inline void sha1_block(uint32_t state[5], const uint8_t * block)
+{
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+             | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; ++i) {
+        uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+        w[i] = (x << 1) | (x >> 31);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = (b << 30) | (b >> 2);
+        b = a;
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+static inline void sha1(const char * data, std::size_t size, uint8_t digest[20])
+{
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    std::size_t offset = 0;
+    for (; offset + 64 <= size; offset += 64)
+        sha1_block(state, (const uint8_t *)data + offset);
+
+    // The padding: 0x80, zeros, then the bit length (big endian), in one or two blocks.
+    uint8_t tail[128];
+    std::size_t remain = size - offset;
+    ::memcpy(tail, data + offset, remain);
+    tail[remain] = 0x80;
+    std::size_t tail_size = (remain < 56) ? 64 : 128;
+    ::memset(tail + remain + 1, 0, tail_size - remain - 1);
+    uint64_t bits = (uint64_t)size * 8;
+    for (int i = 0; i < 8; ++i)
+        tail[tail_size - 1 - i] = (uint8_t)(bits >> (i * 8));
+    sha1_block(state, tail);
+    if (tail_size == 128)
+        sha1_block(state, tail + 64);
+
+    for (int i = 0; i < 5; ++i) {
+        digest[i * 4]     = (uint8_t)(state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+static inline std::string base64_encode(const uint8_t * data, std::size_t size)
+{
+    static const char kBase64Chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string output;
+    output.reserve((size + 2) / 3 * 4);
+    std::size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        uint32_t n = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | (uint32_t)data[i + 2];
+        output.push_back(kBase64Chars[(n >> 18) & 0x3F]);
+        output.push_back(kBase64Chars[(n >> 12) & 0x3F]);
+        output.push_back(kBase64Chars[(n >> 6) & 0x3F]);
+        output.push_back(kBase64Chars[n & 0x3F]);
+    }
+    if (i < size) {
+        uint32_t n = (uint32_t)data[i] << 16;
+        if (i + 1 < size)
+            n |= (uint32_t)data[i + 1] << 8;
+        output.push_back(kBase64Chars[(n >> 18) & 0x3F]);
+        output.push_back(kBase64Chars[(n >> 12) & 0x3F]);
+        output.push_back((i + 1 < size) ? kBase64Chars[(n >> 6) & 0x3F] : '=');
+        output.push_back('=');
+    }
+    return output;
+}
+
+} // namespace detail
+
+/// Sec-WebSocket-Accept = base64(SHA-1(key + GUID)).
+static inline
+std::string websocket_accept_key(const char * key, std::size_t key_len)
+{
+    static const char kWebSocketGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    std::string input(key, key_len);
+    input.append(kWebSocketGuid, sizeof(kWebSocketGuid) - 1);
+    uint8_t digest[20];
+    detail::sha1(input.c_str(), input.size(), digest);
+    return detail::base64_encode(digest, sizeof(digest));
+}
+
+//
+// Check the upgrade request in the http header [begin, end): "Upgrade: websocket",
+// "Connection: Upgrade", "Sec-WebSocket-Version: 13" and a Sec-WebSocket-Key,
+// returns false if it's not a valid WebSocket handshake.
+//
+static inline
+bool parse_websocket_upgrade(const char * begin, const char * end, std::string & accept_key)
+{
+    static const char kUpgrade[] = "upgrade";
+    static const char kConnection[] = "connection";
+    static const char kKey[] = "sec-websocket-key";
+    static const char kVersion[] = "sec-websocket-version";
+
+    bool has_upgrade = false, has_connection = false, has_version = false;
+    const char * key = nullptr;
+    std::size_t key_len = 0;
+
+    // Skip the request line.
+    const char * line = (const char *)::memchr(begin, '\n', end - begin);
+    while (line != nullptr && ++line < end) {
+        const char * line_end = (const char *)::memchr(line, '\n', end - line);
+        if (line_end == nullptr)
+            line_end = end;
+        const char * value_end = (line_end > line && line_end[-1] == '\r') ? (line_end - 1) : line_end;
+
+        const char * colon = (const char *)::memchr(line, ':', value_end - line);
+        if (colon != nullptr) {
+            std::size_t name_len = colon - line;
+            const char * value = colon + 1;
+            if (detail::header_name_equals(line, name_len, kUpgrade, sizeof(kUpgrade) - 1)) {
+                has_upgrade = detail::header_value_has_token(value, value_end, "websocket", 9);
+            }
+            else if (detail::header_name_equals(line, name_len, kConnection, sizeof(kConnection) - 1)) {
+                has_connection = detail::header_value_has_token(value, value_end, kUpgrade, sizeof(kUpgrade) - 1);
+            }
+            else if (detail::header_name_equals(line, name_len, kVersion, sizeof(kVersion) - 1)) {
+                has_version = detail::header_value_has_token(value, value_end, "13", 2);
+            }
+            else if (detail::header_name_equals(line, name_len, kKey, sizeof(kKey) - 1)) {
+                while (value < value_end && (*value == ' ' || *value == '\t'))
+                    value++;
+                const char * trimmed_end = value_end;
+                while (trimmed_end > value && (trimmed_end[-1] == ' ' || trimmed_end[-1] == '\t'))
+                    trimmed_end--;
+                key = value;
+                key_len = trimmed_end - value;
+            }
+        }
+        line = (line_end < end) ? line_end : nullptr;
+    }
+
+    if (!has_upgrade || !has_connection || !has_version || key == nullptr || key_len == 0)
+        return false;
+    accept_key = websocket_accept_key(key, key_len);
+    return true;
+}
+
+} // namespace asio_test
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <assert.h>
 #include <atomic>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
@@ -26,8 +27,9 @@ private:
     std::atomic<std::size_t> next_io_service_;
 
 public:
-    /// Construct the io_service pool.
-    explicit io_service_pool(std::size_t pool_size) : next_io_service_(0)
+    /// Construct the io_service pool. Without keep_alive, run() returns when all
+    /// the io_services are out of work (e.g. all the client connections are closed).
+    explicit io_service_pool(std::size_t pool_size, bool keep_alive = true) : next_io_service_(0)
     {
         if (pool_size == 0) {
             throw std::runtime_error("io_service_pool size is 0.");
@@ -37,9 +39,11 @@ public:
         // exit until they are explicitly stopped.
         for (std::size_t i = 0; i < pool_size; ++i) {
             io_service_ptr io_service(new boost::asio::io_service);
-            io_work_ptr work(new boost::asio::io_service::work(*io_service));
             io_services_.push_back(io_service);
-            workes_.push_back(work);
+            if (keep_alive) {
+                io_work_ptr work(new boost::asio::io_service::work(*io_service));
+                workes_.push_back(work);
+            }
         }
     }
 
@@ -75,14 +79,31 @@ public:
             io_services_[i]->stop();
     }
 
+    /// The number of io_services in the pool.
+    std::size_t size() const
+    {
+        return io_services_.size();
+    }
+
+    /// Get the io_service by index.
+    boost::asio::io_service & get_io_service(std::size_t index)
+    {
+        assert(index < io_services_.size());
+        return *io_services_[index];
+    }
+
+    /// Get the index of the next io_service to use, round-robin.
+    std::size_t get_next_index()
+    {
+        std::size_t index = next_io_service_.fetch_add(1, std::memory_order_relaxed);
+        return (index % io_services_.size());
+    }
+
     /// Get an io_service to use.
     boost::asio::io_service & get_io_service()
     {
         // Use a round-robin scheme to choose the next io_service to use.
-        boost::asio::io_service & io_service = *io_services_[next_io_service_];
-        next_io_service_++;
-        if (next_io_service_ >= io_services_.size())
-            next_io_service_ = 0;
+        boost::asio::io_service & io_service = *io_services_[get_next_index()];
         return io_service;
     }
 
@@ -90,9 +111,8 @@ public:
     boost::asio::io_service & get_now_io_service()
     {
         // Use a round-robin scheme to choose the next io_service to use.
-        if (next_io_service_ >= io_services_.size())
-            next_io_service_ = 0;
-        boost::asio::io_service & io_service = *io_services_[next_io_service_];
+        std::size_t index = next_io_service_.load(std::memory_order_relaxed) % io_services_.size();
+        boost::asio::io_service & io_service = *io_services_[index];
         return io_service;
     }
 
@@ -0,0 +1,302 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <boost/noncopyable.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "io_service_pool.hpp"
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                            < Hashed timing wheel >
+
+  One wheel per io_service, driven by one steady_timer, all the connection
+  timeouts of the io_service are the nodes in the wheel (intrusive, no allocation).
+
+      slot = deadline_tick & kSlotMask
+
+  A node whose deadline is more than one revolution away just stays in its slot,
+  it's re-checked every revolution (the "rounds" of a hashed wheel).
+
+  Rearm is O(1): if the new deadline is later than the old one (the common case,
+  "the connection has traffic again"), only the deadline is updated and the node
+  is moved lazily when its old slot comes round. Otherwise it's relinked.
+
+  A wheel and its nodes are only touched by the thread which runs its io_service.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+class timing_wheel;
+
+class wheel_timer {
+private:
+    friend class timing_wheel;
+
+    wheel_timer *   prev_;
+    wheel_timer *   next_;
+    timing_wheel *  wheel_;
+    uint64_t        deadline_;
+    uint32_t        slot_;
+
+public:
+    wheel_timer() : prev_(nullptr), next_(nullptr), wheel_(nullptr), deadline_(0), slot_(0) {}
+    virtual ~wheel_timer();
+
+    bool is_armed() const { return (wheel_ != nullptr); }
+
+    /// Cancel the timer if it's armed.
+    void cancel_timer();
+
+protected:
+    /// Called on the thread of the wheel, the timer has been disarmed already.
+    virtual void on_timeout() = 0;
+};
+
+class timing_wheel : private boost::noncopyable {
+public:
+    enum {
+        kSlotBits = 9,
+        kSlotCount = 1 << kSlotBits,
+        kSlotMask = kSlotCount - 1,
+        // The expired nodes are moved to this list before their callbacks are fired.
+        kFiringSlot = kSlotCount
+    };
+
+    enum { kDefaultTickMs = 100 };
+
+private:
+    boost::asio::io_service &               io_service_;
+    boost::asio::steady_timer               timer_;
+    std::chrono::steady_clock::time_point   start_time_;
+    uint32_t                                tick_ms_;
+    uint64_t                                current_tick_;
+    std::size_t                             armed_count_;
+    bool                                    ticking_;
+    // Written by the owner thread only, read by the stats thread.
+    std::atomic<uint64_t>                   expired_count_;
+
+    wheel_timer *                           slots_[kSlotCount + 1];
+
+public:
+    timing_wheel(boost::asio::io_service & io_service, uint32_t tick_ms = kDefaultTickMs)
+        : io_service_(io_service), timer_(io_service), start_time_(std::chrono::steady_clock::now()),
+          tick_ms_((tick_ms != 0) ? tick_ms : 1), current_tick_(0), armed_count_(0),
+          ticking_(false), expired_count_(0) {
+        for (std::size_t i = 0; i <= kSlotCount; ++i) {
+            slots_[i] = nullptr;
+        }
+    }
+
+    ~timing_wheel() {
+        // Disarm all the nodes, so they don't touch the wheel when they are destroyed.
+        for (std::size_t i = 0; i <= kSlotCount; ++i) {
+            wheel_timer * node = slots_[i];
+            while (node != nullptr) {
+                wheel_timer * next = node->next_;
+                node->prev_ = nullptr;
+                node->next_ = nullptr;
+                node->wheel_ = nullptr;
+                node = next;
+            }
+            slots_[i] = nullptr;
+        }
+    }
+
+    boost::asio::io_service & get_io_service() const { return io_service_; }
+
+    uint32_t tick_ms() const { return tick_ms_; }
+
+    std::size_t armed_count() const { return armed_count_; }
+
+    /// Can be read from any thread.
+    uint64_t expired_count() const { return expired_count_.load(std::memory_order_relaxed); }
+
+    /// Arm (or rearm) the timer, it expires after timeout_ms (rounded up to the tick).
+    void schedule(wheel_timer * node, uint32_t timeout_ms) {
+        if (!ticking_) {
+            // The wheel is idle, catch up with the clock before linking.
+            current_tick_ = now_tick();
+        }
+
+        uint64_t ticks = (timeout_ms + tick_ms_ - 1) / tick_ms_;
+        uint64_t deadline = current_tick_ + ((ticks != 0) ? ticks : 1);
+
+        if (node->wheel_ == this) {
+            if (deadline >= node->deadline_) {
+                // Lazy rearm, the node is moved when its slot comes round.
+                node->deadline_ = deadline;
+                return;
+            }
+            unlink(node);
+        }
+        else if (node->wheel_ != nullptr) {
+            node->wheel_->cancel(node);
+        }
+
+        node->deadline_ = deadline;
+        link(node, (uint32_t)(deadline & kSlotMask));
+        armed_count_++;
+
+        if (!ticking_) {
+            ticking_ = true;
+            start_tick();
+        }
+    }
+
+    void cancel(wheel_timer * node) {
+        if (node->wheel_ == this) {
+            unlink(node);
+            armed_count_--;
+        }
+    }
+
+private:
+    uint64_t now_tick() const {
+        std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                std::chrono::steady_clock::now() - start_time_);
+        return (uint64_t)elapsed.count() / tick_ms_;
+    }
+
+    void link(wheel_timer * node, uint32_t slot) {
+        node->wheel_ = this;
+        node->slot_ = slot;
+        node->prev_ = nullptr;
+        node->next_ = slots_[slot];
+        if (slots_[slot] != nullptr)
+            slots_[slot]->prev_ = node;
+        slots_[slot] = node;
+    }
+
+    void unlink(wheel_timer * node) {
+        if (node->prev_ != nullptr)
+            node->prev_->next_ = node->next_;
+        else
+            slots_[node->slot_] = node->next_;
+        if (node->next_ != nullptr)
+            node->next_->prev_ = node->prev_;
+        node->prev_ = nullptr;
+        node->next_ = nullptr;
+        node->wheel_ = nullptr;
+    }
+
+    void start_tick() {
+        // Schedule at the absolute tick time, so the wheel never drifts.
+        timer_.expires_at(start_time_ + std::chrono::milliseconds((current_tick_ + 1) * tick_ms_));
+        timer_.async_wait([this](const boost::system::error_code & ec) {
+            if (!ec) {
+                on_tick();
+            }
+            else if (ec != boost::asio::error::operation_aborted) {
+                std::cout << "timing_wheel::start_tick() - Error: (code = " << ec.value() << ") "
+                          << ec.message().c_str() << std::endl;
+            }
+        });
+    }
+
+    void on_tick() {
+        uint64_t target_tick = now_tick();
+        while (current_tick_ < target_tick) {
+            current_tick_++;
+            expire_slot((uint32_t)(current_tick_ & kSlotMask));
+        }
+
+        fire_expired();
+
+        if (armed_count_ != 0)
+            start_tick();
+        else
+            ticking_ = false;
+    }
+
+    void expire_slot(uint32_t slot) {
+        wheel_timer * node = slots_[slot];
+        while (node != nullptr) {
+            wheel_timer * next = node->next_;
+            if (node->deadline_ <= current_tick_) {
+                unlink(node);
+                link(node, kFiringSlot);
+            }
+            else if ((node->deadline_ & kSlotMask) != slot) {
+                // It was rearmed lazily, move it to the slot of its new deadline.
+                unlink(node);
+                link(node, (uint32_t)(node->deadline_ & kSlotMask));
+            }
+            node = next;
+        }
+    }
+
+    void fire_expired() {
+        // A callback may cancel or rearm any node, so take them off the list one by one.
+        uint64_t expired = 0;
+        while (slots_[kFiringSlot] != nullptr) {
+            wheel_timer * node = slots_[kFiringSlot];
+            unlink(node);
+            armed_count_--;
+            expired++;
+            node->on_timeout();
+        }
+        if (expired != 0)
+            expired_count_.store(expired_count_.load(std::memory_order_relaxed) + expired,
+                                 std::memory_order_relaxed);
+    }
+};
+
+inline wheel_timer::~wheel_timer()
+{
+    cancel_timer();
+}
+
+inline void wheel_timer::cancel_timer()
+{
+    if (wheel_ != nullptr)
+        wheel_->cancel(this);
+}
+
+//
+// One timing wheel per io_service of the io_service_pool, the index is
+// the same as the io_service's index in the pool.
+//
+class timing_wheel_pool : private boost::noncopyable {
+private:
+    std::vector<std::unique_ptr<timing_wheel>> wheels_;
+
+public:
+    explicit timing_wheel_pool(io_service_pool & pool, uint32_t tick_ms = timing_wheel::kDefaultTickMs) {
+        wheels_.reserve(pool.size());
+        for (std::size_t i = 0; i < pool.size(); ++i) {
+            wheels_.push_back(std::unique_ptr<timing_wheel>(new timing_wheel(pool.get_io_service(i), tick_ms)));
+        }
+    }
+
+    ~timing_wheel_pool() {}
+
+    std::size_t size() const { return wheels_.size(); }
+
+    timing_wheel & get_wheel(std::size_t index) {
+        assert(index < wheels_.size());
+        return *wheels_[index];
+    }
+
+    /// The total expirations of all the wheels, it's a relaxed sum.
+    uint64_t expired_count() const {
+        uint64_t total = 0;
+        for (std::size_t i = 0; i < wheels_.size(); ++i) {
+            total += wheels_[i]->expired_count();
+        }
+        return total;
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,192 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+#include <iomanip>      // For std::setw()
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <unordered_map>
+
+#include "asio/asio_echo_serv/http_server/http_request.hpp"
+#include "asio/asio_echo_serv/http_server/http_router.hpp"
+
+using namespace asio_test;
+using namespace std::chrono;
+
+//
+// A typical REST-like route set, fixed at compile time.
+//
+constexpr route_def g_bench_routes[] = {
+    { http_method_get,    "/",                          0  },
+    { http_method_get,    "/index.html",                1  },
+    { http_method_get,    "/cookies",                   2  },
+    { http_method_get,    "/favicon.ico",               3  },
+    { http_method_get,    "/api/v1/users",              4  },
+    { http_method_post,   "/api/v1/users",              5  },
+    { http_method_get,    "/api/v1/users/profile",      6  },
+    { http_method_put,    "/api/v1/users/profile",      7  },
+    { http_method_get,    "/api/v1/orders",             8  },
+    { http_method_post,   "/api/v1/orders",             9  },
+    { http_method_delete, "/api/v1/orders",             10 },
+    { http_method_get,    "/api/v1/products/list",      11 },
+    { http_method_get,    "/static/js/app.bundle.js",   12 },
+    { http_method_get,    "/static/css/main.css",       13 },
+    { http_method_get,    "/health",                    14 },
+    { http_method_get,    "/metrics",                   15 }
+};
+
+static const std::size_t kRouteCount = sizeof(g_bench_routes) / sizeof(g_bench_routes[0]);
+
+typedef uint32_t bench_handler;
+typedef http_router<bench_handler, kRouteCount, g_bench_routes> bench_router;
+
+struct bench_request {
+    http_method_t   method;
+    std::string     path;
+    std::string     map_key;        // "METHOD path", prepared for the std::unordered_map
+};
+
+static
+std::string make_map_key(http_method_t method, const char * path, std::size_t path_len)
+{
+    std::string key = get_http_method_name(method);
+    key.push_back(' ');
+    key.append(path, path_len);
+    return key;
+}
+
+static
+void make_requests(std::vector<bench_request> & requests, std::size_t count, uint32_t miss_percent)
+{
+    static const char * const kMissPaths[] = {
+        "/not/found", "/api/v2/users", "/index.htm", "/static/js/app.js", "/healthz"
+    };
+    static const std::size_t kMissCount = sizeof(kMissPaths) / sizeof(kMissPaths[0]);
+
+    std::mt19937 rand_gen(20161031);
+    std::uniform_int_distribution<uint32_t> percent(0, 99);
+    std::uniform_int_distribution<std::size_t> hit_index(0, kRouteCount - 1);
+    std::uniform_int_distribution<std::size_t> miss_index(0, kMissCount - 1);
+
+    requests.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        bench_request & request = requests[i];
+        if (percent(rand_gen) < miss_percent) {
+            request.method = http_method_get;
+            request.path = kMissPaths[miss_index(rand_gen)];
+        }
+        else {
+            const route_def & route = g_bench_routes[hit_index(rand_gen)];
+            request.method = route.method;
+            request.path = route.path;
+        }
+        request.map_key = make_map_key(request.method, request.path.c_str(), request.path.size());
+    }
+}
+
+static
+void print_result(const char * name, std::size_t lookups, double elapsed_time, uint64_t checksum)
+{
+    double ns_per_lookup = (elapsed_time * 1000.0 * 1000.0 * 1000.0) / (double)lookups;
+    double mops = (double)lookups / elapsed_time / (1000.0 * 1000.0);
+    std::cout << std::left << std::setw(40) << name << " : "
+              << std::right << std::setw(8)
+              << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+              << ns_per_lookup << " ns/lookup, "
+              << std::setw(9) << mops << " M lookups/s, "
+              << "checksum = " << checksum << std::endl;
+}
+
+void run_static_router_bench(const bench_router & router, const std::vector<bench_request> & requests,
+                             std::size_t iterations)
+{
+    uint64_t checksum = 0;
+    time_point<steady_clock> start_time = steady_clock::now();
+    for (std::size_t n = 0; n < iterations; ++n) {
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            const bench_request & request = requests[i];
+            const bench_handler * handler = router.dispatch(request.method, request.path.c_str(), request.path.size());
+            checksum += (handler != nullptr) ? *handler : 1000;
+        }
+    }
+    duration<double> elapsed_time = duration_cast< duration<double> >(steady_clock::now() - start_time);
+    print_result("static_route_table (perfect hash)", requests.size() * iterations, elapsed_time.count(), checksum);
+}
+
+void run_unordered_map_bench(const std::unordered_map<std::string, bench_handler> & routes,
+                             const std::vector<bench_request> & requests, std::size_t iterations)
+{
+    uint64_t checksum = 0;
+    time_point<steady_clock> start_time = steady_clock::now();
+    for (std::size_t n = 0; n < iterations; ++n) {
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            const bench_request & request = requests[i];
+            std::unordered_map<std::string, bench_handler>::const_iterator iter = routes.find(request.map_key);
+            checksum += (iter != routes.end()) ? iter->second : 1000;
+        }
+    }
+    duration<double> elapsed_time = duration_cast< duration<double> >(steady_clock::now() - start_time);
+    print_result("unordered_map (prepared key)", requests.size() * iterations, elapsed_time.count(), checksum);
+}
+
+void run_unordered_map_build_key_bench(const std::unordered_map<std::string, bench_handler> & routes,
+                                       const std::vector<bench_request> & requests, std::size_t iterations)
+{
+    uint64_t checksum = 0;
+    time_point<steady_clock> start_time = steady_clock::now();
+    for (std::size_t n = 0; n < iterations; ++n) {
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            const bench_request & request = requests[i];
+            // The key must be built from the request line in the recieve buffer.
+            std::string key = make_map_key(request.method, request.path.c_str(), request.path.size());
+            std::unordered_map<std::string, bench_handler>::const_iterator iter = routes.find(key);
+            checksum += (iter != routes.end()) ? iter->second : 1000;
+        }
+    }
+    duration<double> elapsed_time = duration_cast< duration<double> >(steady_clock::now() - start_time);
+    print_result("unordered_map (key built per request)", requests.size() * iterations, elapsed_time.count(), checksum);
+}
+
+int main(int argc, char * argv[])
+{
+    std::size_t request_count = 4096;
+    std::size_t iterations = 2000;
+    uint32_t miss_percent = 10;
+
+    if (argc > 1)
+        iterations = (std::size_t)::atol(argv[1]);
+    if (argc > 2)
+        miss_percent = (uint32_t)::atoi(argv[2]);
+    if (iterations == 0)
+        iterations = 1;
+    if (miss_percent > 100)
+        miss_percent = 100;
+
+    bench_router router;
+    std::unordered_map<std::string, bench_handler> map_routes;
+    for (std::size_t i = 0; i < kRouteCount; ++i) {
+        const route_def & route = g_bench_routes[i];
+        router.bind(route.id, route.id);
+        map_routes.insert(std::make_pair(make_map_key(route.method, route.path, ::strlen(route.path)), route.id));
+    }
+
+    std::vector<bench_request> requests;
+    make_requests(requests, request_count, miss_percent);
+
+    std::cout << std::endl;
+    std::cout << "http_router_bench: routes = " << kRouteCount
+              << ", table size = " << bench_router::table_type::kTableSize
+              << ", requests = " << request_count << " x " << iterations
+              << ", miss = " << miss_percent << "%" << std::endl;
+    std::cout << std::endl;
+
+    run_static_router_bench(router, requests, iterations);
+    run_unordered_map_bench(map_routes, requests, iterations);
+    run_unordered_map_build_key_bench(map_routes, requests, iterations);
+
+    std::cout << std::endl;
+    return 0;
+}
@@ -0,0 +1,138 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_HAS_SSE42_PATH   1
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HAS_SSE42_PATH   1
+#endif
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                          < CRC32C (Castagnoli) >
+
+  The crc32 instruction of SSE 4.2 does 8 bytes per instruction, it's picked at
+  runtime (cpuid), so the build needs no -msse4.2. Other CPUs use slicing-by-8
+  tables. crc32c_extend(0, "123456789", 9) = 0xE3069283.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+struct crc32c_tables
+{
+    uint32_t table[8][256];
+
+    crc32c_tables()
+    {
+        static const uint32_t kPolynomial = 0x82F63B78U;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ ((crc & 1) ? kPolynomial : 0);
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k)
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+        }
+    }
+
+    static const crc32c_tables & get()
+    {
+        static const crc32c_tables tables;
+        return tables;
+    }
+};
+
+static inline
+uint32_t crc32c_extend_portable(uint32_t crc, const unsigned char * data, std::size_t size)
+{
+    const uint32_t (*t)[256] = crc32c_tables::get().table;
+    while (size >= 8) {
+        uint32_t low, high;
+        std::memcpy(&low, data, sizeof(low));
+        std::memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- != 0)
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(CRC32C_HAS_SSE42_PATH)
+
+#if !defined(_MSC_VER)
+__attribute__((target("sse4.2")))
+#endif
+static inline
+uint32_t crc32c_extend_sse42(uint32_t crc, const unsigned char * data, std::size_t size)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        crc64 = _mm_crc32_u64(crc64, value);
+        data += 8;
+        size -= 8;
+    }
+    uint32_t crc32 = (uint32_t)crc64;
+    while (size-- != 0)
+        crc32 = _mm_crc32_u8(crc32, *data++);
+    return crc32;
+}
+
+static inline bool crc32c_has_sse42()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return ((info[2] & (1 << 20)) != 0);
+#else
+    return (__builtin_cpu_supports("sse4.2") != 0);
+#endif
+}
+
+#endif // CRC32C_HAS_SSE42_PATH
+
+} // namespace detail
+
+/// The crc of data appended to the data of crc (0 for a new crc).
+static inline
+uint32_t crc32c_extend(uint32_t crc, const void * data, std::size_t size)
+{
+    const unsigned char * bytes = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+#if defined(CRC32C_HAS_SSE42_PATH)
+    static const bool has_sse42 = detail::crc32c_has_sse42();
+    if (has_sse42)
+        crc = detail::crc32c_extend_sse42(crc, bytes, size);
+    else
+#endif
+        crc = detail::crc32c_extend_portable(crc, bytes, size);
+    return ~crc;
+}
+
+static inline
+uint32_t crc32c(const void * data, std::size_t size)
+{
+    return crc32c_extend(0, data, size);
+}
+
+} // namespace asio_test
+
+#undef CRC32C_HAS_SSE42_PATH
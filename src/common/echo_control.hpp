@@ -0,0 +1,91 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                    < The in-band control messages of the echo test >
+
+  A control message is sent alone on an idle connection (no packet in flight),
+  so it begins at a packet boundary, it may still arrive in pieces:
+
+      [ magic "ASIOCTL\1" : 8 ][ command : 4 ][ value : 4 ]    (little endian)
+
+  The server applies it and answers with an ack of the same layout, the magic
+  "ASIOACK\1" and the value it applied, then the client goes on. A server which
+  doesn't know the message echoes it, the client tells that from an ack.
+
+  cmd_packet_size: the packets of the connection are value bytes from now on.
+  The client sends it as the first message of the connection (the size is
+  declared at connect), so the server counts the packet boundaries in the
+  packets of the client, whatever its own --packet-size is.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+struct echo_control
+{
+    enum { kMessageSize = 16 };
+
+    enum command_t {
+        cmd_none,
+        cmd_packet_size
+    };
+
+    static const char * magic() { return "ASIOCTL\1"; }
+    static const char * ack_magic() { return "ASIOACK\1"; }
+
+    static void make(char * message, uint32_t command, uint32_t value)
+    {
+        make_with(message, magic(), command, value);
+    }
+
+    static void make_ack(char * message, uint32_t command, uint32_t value)
+    {
+        make_with(message, ack_magic(), command, value);
+    }
+
+    /// Returns true if data is a whole control message.
+    static bool parse(const char * data, std::size_t size, uint32_t & command, uint32_t & value)
+    {
+        return parse_with(data, size, magic(), command, value);
+    }
+
+    /// Returns true if data is a whole ack.
+    static bool parse_ack(const char * data, std::size_t size, uint32_t & command, uint32_t & value)
+    {
+        return parse_with(data, size, ack_magic(), command, value);
+    }
+
+    /// Returns true if data (shorter than a message) may be the first piece of a control message.
+    static bool is_partial(const char * data, std::size_t size)
+    {
+        return (size < kMessageSize && std::memcmp(data, magic(), std::min(size, (std::size_t)8)) == 0);
+    }
+
+private:
+    static void make_with(char * message, const char * magic, uint32_t command, uint32_t value)
+    {
+        std::memcpy(message, magic, 8);
+        std::memcpy(message + 8, &command, sizeof(command));
+        std::memcpy(message + 12, &value, sizeof(value));
+    }
+
+    static bool parse_with(const char * data, std::size_t size, const char * magic,
+                           uint32_t & command, uint32_t & value)
+    {
+        if (size != kMessageSize || std::memcmp(data, magic, 8) != 0)
+            return false;
+        std::memcpy(&command, data + 8, sizeof(command));
+        std::memcpy(&value, data + 12, sizeof(value));
+        return true;
+    }
+};
+
+} // namespace asio_test
@@ -0,0 +1,185 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+namespace asio_test {
+
+////////////////////////////////////////////////////////////////////////////////////
+/*
+
+                    < Machine-readable stats records >
+
+  --output=json writes one JSON object per line, --output=csv writes a header
+  line and one row per record. Every record is
+
+      ts (unix ms), the run configuration, then the fields of the record
+
+  and all the records of a run have the same fields in the same order (the
+  interval records and the final one only differ by "type"), so a CSV has one
+  header. --output=text keeps the formatted lines.
+*/
+////////////////////////////////////////////////////////////////////////////////////
+
+enum stats_output_format_t {
+    stats_output_text,
+    stats_output_json,
+    stats_output_csv
+};
+
+static inline
+bool parse_stats_output_format(const std::string & name, uint32_t & format)
+{
+    if (name == "text")
+        format = stats_output_text;
+    else if (name == "json")
+        format = stats_output_json;
+    else if (name == "csv")
+        format = stats_output_csv;
+    else
+        return false;
+    return true;
+}
+
+//
+// The fields of a record, the values are rendered at once (strings are kept quoted).
+//
+class stats_record
+{
+public:
+    typedef std::pair<std::string, std::string> field_t;
+
+private:
+    std::vector<field_t> fields_;
+
+    static std::string quote(const std::string & value)
+    {
+        std::string quoted = "\"";
+        for (std::size_t i = 0; i < value.size(); ++i) {
+            char ch = value[i];
+            if (ch == '"' || ch == '\\')
+                quoted += '\\';
+            if ((unsigned char)ch >= 0x20)
+                quoted += ch;
+        }
+        quoted += '"';
+        return quoted;
+    }
+
+public:
+    stats_record() {}
+    ~stats_record() {}
+
+    const std::vector<field_t> & fields() const { return fields_; }
+
+    stats_record & add(const char * key, uint64_t value)
+    {
+        fields_.push_back(field_t(key, std::to_string(value)));
+        return *this;
+    }
+
+    stats_record & add(const char * key, uint32_t value)
+    {
+        return add(key, (uint64_t)value);
+    }
+
+    stats_record & add(const char * key, double value)
+    {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%.3f", value);
+        fields_.push_back(field_t(key, buf));
+        return *this;
+    }
+
+    stats_record & add(const char * key, const std::string & value)
+    {
+        fields_.push_back(field_t(key, quote(value)));
+        return *this;
+    }
+
+    stats_record & add(const char * key, const char * value)
+    {
+        return add(key, std::string(value));
+    }
+};
+
+class stats_writer
+{
+private:
+    uint32_t      format_;
+    std::unique_ptr<std::ofstream> file_;
+    std::ostream * os_;
+    stats_record  config_;
+    bool          header_written_;
+
+public:
+    /// An empty path writes to std::cout.
+    stats_writer(uint32_t format, const std::string & path)
+        : format_(format), os_(&std::cout), header_written_(false)
+    {
+        if (format_ != stats_output_text && !path.empty()) {
+            file_.reset(new std::ofstream(path.c_str(), std::ios::out | std::ios::trunc));
+            if (!file_->is_open())
+                throw std::runtime_error("stats_writer: can not open the output file: " + path);
+            os_ = file_.get();
+        }
+    }
+
+    ~stats_writer() {}
+
+    bool is_text() const { return (format_ == stats_output_text); }
+
+    /// The formatted text lines are still wanted (the records don't go to std::cout).
+    bool print_text() const { return (is_text() || file_); }
+
+    /// The fields written after the timestamp of every record.
+    void set_config(const stats_record & config)
+    {
+        config_ = config;
+    }
+
+    void write(const stats_record & record)
+    {
+        if (is_text())
+            return;
+
+        uint64_t ts = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::system_clock::now().time_since_epoch()).count();
+        stats_record full;
+        full.add("ts", ts);
+        std::vector<stats_record::field_t> fields = full.fields();
+        fields.insert(fields.end(), config_.fields().begin(), config_.fields().end());
+        fields.insert(fields.end(), record.fields().begin(), record.fields().end());
+
+        std::ostream & os = *os_;
+        if (format_ == stats_output_json) {
+            os << "{";
+            for (std::size_t i = 0; i < fields.size(); ++i) {
+                os << ((i != 0) ? "," : "") << "\"" << fields[i].first << "\":" << fields[i].second;
+            }
+            os << "}" << std::endl;
+        }
+        else {
+            if (!header_written_) {
+                for (std::size_t i = 0; i < fields.size(); ++i)
+                    os << ((i != 0) ? "," : "") << fields[i].first;
+                os << std::endl;
+                header_written_ = true;
+            }
+            for (std::size_t i = 0; i < fields.size(); ++i)
+                os << ((i != 0) ? "," : "") << fields[i].second;
+            os << std::endl;
+        }
+    }
+};
+
+} // namespace asio_test
@@ -3,16 +3,17 @@
 test_method=$1
 client_num=$2
 packet_size=$3
+thread_num=$4
 
 test_method=${test_method:-pingpong}
 client_num=${client_num:-10}
 packet_size=${packet_size:-64}
+thread_num=${thread_num:-0}
 
 # echo "test_method = $test_method"
 # echo "client_num = $client_num"
 # echo "packet_size = $packet_size"
+# echo "thread_num = $thread_num"
 
-for ((i=0; i<$client_num; i++));
-do
-    ./asio_echo_client --host=127.0.0.1 --port=8090 --mode=echo --test=$test_method --packet-size=$packet_size &
-done
+# All the connections run in one process, spread over thread_num threads (0 = all the cores).
+./asio_echo_client --host=127.0.0.1 --port=8090 --mode=echo --test=$test_method --packet-size=$packet_size --thread-num=$thread_num --connections=$client_num